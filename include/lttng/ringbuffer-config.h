@@ -99,6 +99,18 @@ struct lttng_ust_lib_ring_buffer_client_cb {
 				size_t *offset, size_t *length);
 	void (*packet_size_field) (const struct lttng_ust_lib_ring_buffer_config *config,
 				size_t *offset, size_t *length);
+	/*
+	 * Offset of the begin and end timestamp fields in client, and
+	 * their size.
+	 */
+	void (*timestamp_fields) (const struct lttng_ust_lib_ring_buffer_config *config,
+				size_t *begin_offset, size_t *end_offset,
+				size_t *length);
+	/*
+	 * Called by the channel switch and read timers, before they
+	 * process the channel buffers.
+	 */
+	void (*channel_timer) (struct channel *chan);
 };
 
 /*
@@ -126,6 +138,15 @@ struct lttng_ust_lib_ring_buffer_client_cb {
  * RING_BUFFER_ALLOC_GLOBAL and RING_BUFFER_SYNC_GLOBAL :
  *   Global shared buffer with global synchronization.
  *
+ * RING_BUFFER_ALLOC_PER_THREAD and RING_BUFFER_SYNC_GLOBAL :
+ *   Each thread takes a stream index no other live thread owns on its first
+ *   reserve, and writes to that stream until it exits, regardless of
+ *   migration. Stream memory is allocated on the first write. Threads
+ *   beyond the number of streams share the stream of their processor ID.
+ *   Global synchronization is still required for those, and because timers
+ *   and consumers switch sub-buffers remotely. A stream written by its
+ *   owner only is uncontended: the fast path cmpxchg does not fail.
+ *
  * wakeup:
  *
  * RING_BUFFER_WAKEUP_BY_TIMER uses per-cpu deferrable timers to poll the
@@ -140,11 +161,12 @@ struct lttng_ust_lib_ring_buffer_client_cb {
  * RING_BUFFER_WAKEUP_NONE does not perform any wakeup whatsoever. The client
  * has the responsibility to perform wakeups.
  */
-#define LTTNG_UST_RING_BUFFER_CONFIG_PADDING	20
+#define LTTNG_UST_RING_BUFFER_CONFIG_PADDING	(20 - 2 * sizeof(void *))
 
 enum lttng_ust_lib_ring_buffer_alloc_types {
 	RING_BUFFER_ALLOC_PER_CPU,
 	RING_BUFFER_ALLOC_GLOBAL,
+	RING_BUFFER_ALLOC_PER_THREAD,
 };
 
 enum lttng_ust_lib_ring_buffer_sync_types {
@@ -307,12 +329,20 @@ void lib_ring_buffer_ctx_init(struct lttng_ust_lib_ring_buffer_ctx *ctx,
  * needed in the record header. If this flag is not set, the record header needs
  * only to contain "tsc_bits" bit of time value.
  *
+ * RING_BUFFER_RFLAG_BATCH_NEXT
+ *
+ * This flag is passed to record_header_size() for the records following the
+ * first one of a batch reservation. These records share the time value of the
+ * first record, so record_header_size() can reuse the time-related decisions
+ * it made for the first record, without reading the buffer state again.
+ *
  * Reservation flags can be added by the client, starting from
  * "(RING_BUFFER_FLAGS_END << 0)". It can be used to pass information from
  * record_header_size() to lib_ring_buffer_write_record_header().
  */
 #define	RING_BUFFER_RFLAG_FULL_TSC		(1U << 0)
-#define RING_BUFFER_RFLAG_END			(1U << 1)
+#define RING_BUFFER_RFLAG_BATCH_NEXT		(1U << 1)
+#define RING_BUFFER_RFLAG_END			(1U << 2)
 
 /*
  * We need to define RING_BUFFER_ALIGN_ATTR so it is known early at
@@ -386,6 +416,9 @@ int lib_ring_buffer_check_config(const struct lttng_ust_lib_ring_buffer_config *
 	    && config->sync == RING_BUFFER_SYNC_PER_CPU
 	    && switch_timer_interval)
 		return -EINVAL;
+	if (config->alloc == RING_BUFFER_ALLOC_PER_THREAD
+	    && config->sync == RING_BUFFER_SYNC_PER_CPU)
+		return -EINVAL;
 	return 0;
 }
 
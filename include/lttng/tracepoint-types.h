@@ -23,6 +23,8 @@
  * SOFTWARE.
  */
 
+#include <stdint.h>
+
 struct lttng_ust_tracepoint_probe {
 	void (*func)(void);
 	void *data;
@@ -35,7 +37,26 @@ struct lttng_ust_tracepoint {
 	struct lttng_ust_tracepoint_probe *probes;
 	int *tracepoint_provider_ref;
 	const char *signature;
-	char padding[LTTNG_UST_TRACEPOINT_PADDING];
+	union {
+		struct {
+			/* Set when exactly one probe is connected. */
+			struct lttng_ust_tracepoint_probe *sole_probe;
+			/* Precomputed name hash, see ust-name-hash.h. */
+			uint32_t name_hash;
+			uint32_t name_len;	/* 0: hash not precomputed */
+		} ext;
+		char padding[LTTNG_UST_TRACEPOINT_PADDING];
+	} u;
+};
+
+/*
+ * Emitted in the __tracepoints_jump_entries section by each call site
+ * built with TRACEPOINT_JUMP_LABEL.
+ */
+struct lttng_ust_tracepoint_jump_entry {
+	unsigned long code;	/* Patchable jump instruction */
+	unsigned long target;	/* Tracepoint state check */
+	struct lttng_ust_tracepoint *tracepoint;
 };
 
 #endif /* _LTTNG_TRACEPOINT_TYPES_H */
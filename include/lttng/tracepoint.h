@@ -33,6 +33,7 @@
 #include <string.h>	/* for memset */
 #include <lttng/ust-config.h>	/* for sdt */
 #include <lttng/ust-compiler.h>
+#include <lttng/ust-name-hash.h>
 
 #ifdef LTTNG_UST_HAVE_SDT_INTEGRATION
 #define SDT_USE_VARIADIC
@@ -46,9 +47,57 @@
 extern "C" {
 #endif
 
+/*
+ * Jump labels are supported on little-endian aarch64 by compilers with
+ * asm goto. Call sites compiled with TRACEPOINT_JUMP_LABEL defined start
+ * with a jump to the tracepoint state check, which the tracepoint
+ * library patches into a nop while the tracepoint is disabled. A call
+ * site which cannot be patched keeps checking the state. Other
+ * architectures, where an instruction cannot be replaced while other
+ * threads may execute it without a trap handler, always check the state.
+ */
+#if defined(__AARCH64EL__) \
+	&& (defined(__clang__) ? (__clang_major__ >= 9) : \
+		(defined(__GNUC__) && (__GNUC__ * 100 + __GNUC_MINOR__ >= 405)))
+#define LTTNG_UST_HAVE_JUMP_LABEL
+#endif
+
+#if defined(TRACEPOINT_JUMP_LABEL) && defined(LTTNG_UST_HAVE_JUMP_LABEL)
+
+#define _TP_JUMP_LABEL_INSN(_label)					\
+	"1:\n\t"							\
+	"b " _label "\n\t"
+
+#define tracepoint_enabled(provider, name) \
+	__tracepoint_jump_label_##provider##___##name()
+
+#define _DECLARE_TRACEPOINT_JUMP_LABEL(_provider, _name)			\
+static inline __attribute__((always_inline, unused)) lttng_ust_notrace		\
+int __tracepoint_jump_label_##_provider##___##_name(void);			\
+static inline									\
+int __tracepoint_jump_label_##_provider##___##_name(void)			\
+{										\
+	__asm__ goto(_TP_JUMP_LABEL_INSN("%l[__tp_check]")			\
+		".pushsection __tracepoints_jump_entries, \"aw\"\n\t"		\
+		".balign 8\n\t"							\
+		".quad 1b, %l[__tp_check], "					\
+			"__tracepoint_" #_provider "___" #_name "\n\t"	\
+		".popsection\n\t"						\
+		: : : : __tp_check);						\
+	return 0;								\
+__tp_check:									\
+	return caa_unlikely(CMM_LOAD_SHARED(__tracepoint_##_provider##___##_name.state)); \
+}
+
+#else	/* TRACEPOINT_JUMP_LABEL && LTTNG_UST_HAVE_JUMP_LABEL */
+
 #define tracepoint_enabled(provider, name) \
 	caa_unlikely(CMM_LOAD_SHARED(__tracepoint_##provider##___##name.state))
 
+#define _DECLARE_TRACEPOINT_JUMP_LABEL(_provider, _name)
+
+#endif	/* TRACEPOINT_JUMP_LABEL && LTTNG_UST_HAVE_JUMP_LABEL */
+
 #define do_tracepoint(provider, name, ...) \
 	__tracepoint_cb_##provider##___##name(__VA_ARGS__)
 
@@ -157,6 +206,10 @@ extern "C" {
  * The tracepoint cb is marked always inline so we can distinguish
  * between caller's ip addresses within the probe using the return
  * address.
+ *
+ * The sole probe is called without walking the probes array. It is
+ * only set by tracepoint libraries which know about it: the array is
+ * walked otherwise.
  */
 #define _DECLARE_TRACEPOINT(_provider, _name, ...)			 		\
 extern struct lttng_ust_tracepoint __tracepoint_##_provider##___##_name;		\
@@ -170,6 +223,15 @@ void __tracepoint_cb_##_provider##___##_name(_TP_ARGS_PROTO(__VA_ARGS__))		\
 	if (caa_unlikely(!TP_RCU_LINK_TEST()))						\
 		return;									\
 	tp_rcu_read_lock_bp();								\
+	__tp_probe = tp_rcu_dereference_bp(__tracepoint_##_provider##___##_name.u.ext.sole_probe); \
+	if (caa_likely(__tp_probe)) {							\
+		void *__tp_data = __tp_probe->data;					\
+											\
+		URCU_FORCE_CAST(void (*)(_TP_ARGS_DATA_PROTO(__VA_ARGS__)),		\
+				__tp_probe->func)					\
+				(_TP_ARGS_DATA_VAR(__VA_ARGS__));			\
+		goto end;								\
+	}										\
 	__tp_probe = tp_rcu_dereference_bp(__tracepoint_##_provider##___##_name.probes); \
 	if (caa_unlikely(!__tp_probe))							\
 		goto end;								\
@@ -201,7 +263,8 @@ void __tracepoint_unregister_##_provider##___##_name(char *name,			\
 		void (*func)(void), void *data)						\
 {											\
 	__tracepoint_probe_unregister(name, func, data);				\
-}
+}											\
+_DECLARE_TRACEPOINT_JUMP_LABEL(_provider, _name)
 
 extern int __tracepoint_probe_register(const char *name, void (*func)(void),
 		void *data, const char *signature);
@@ -359,6 +422,50 @@ extern struct lttng_ust_tracepoint * const __start___tracepoints_ptrs[]
 extern struct lttng_ust_tracepoint * const __stop___tracepoints_ptrs[]
 	__attribute__((weak, visibility("hidden")));
 
+#ifdef LTTNG_UST_HAVE_JUMP_LABEL
+extern struct lttng_ust_tracepoint_jump_entry __start___tracepoints_jump_entries[]
+	__attribute__((weak, visibility("hidden")));
+extern struct lttng_ust_tracepoint_jump_entry __stop___tracepoints_jump_entries[]
+	__attribute__((weak, visibility("hidden")));
+
+/*
+ * Hand the jump labels of the module over to the tracepoint library,
+ * which patches them from then on. Older tracepoint libraries do not
+ * provide tracepoint_register_jump_entries: the call sites then keep
+ * checking the tracepoint state.
+ */
+static inline void lttng_ust_notrace
+__tracepoints__jump_entries_init(void);
+static inline void
+__tracepoints__jump_entries_init(void)
+{
+	int (*register_jump_entries)(struct lttng_ust_tracepoint * const *,
+		struct lttng_ust_tracepoint_jump_entry *,
+		struct lttng_ust_tracepoint_jump_entry *);
+
+	if (&__start___tracepoints_jump_entries[0]
+			== &__stop___tracepoints_jump_entries[0])
+		return;
+	register_jump_entries =
+		URCU_FORCE_CAST(int (*)(struct lttng_ust_tracepoint * const *,
+				struct lttng_ust_tracepoint_jump_entry *,
+				struct lttng_ust_tracepoint_jump_entry *),
+			dlsym(tracepoint_dlopen_ptr->liblttngust_handle,
+				"tracepoint_register_jump_entries"));
+	if (register_jump_entries)
+		register_jump_entries(__start___tracepoints_ptrs,
+			__start___tracepoints_jump_entries,
+			__stop___tracepoints_jump_entries);
+}
+#else
+static inline void lttng_ust_notrace
+__tracepoints__jump_entries_init(void);
+static inline void
+__tracepoints__jump_entries_init(void)
+{
+}
+#endif
+
 /*
  * When TRACEPOINT_PROBE_DYNAMIC_LINKAGE is defined, we do not emit a
  * unresolved symbol that requires the provider to be linked in. When
@@ -394,7 +501,11 @@ extern struct lttng_ust_tracepoint * const __stop___tracepoints_ptrs[]
 			NULL,							\
 			_TRACEPOINT_UNDEFINED_REF(_provider), 			\
 			_TP_EXTRACT_STRING(_args),				\
-			{ },							\
+			{ {							\
+				NULL,						\
+				LTTNG_UST_NAME_HASH_SUM(#_provider ":" #_name),	\
+				LTTNG_UST_NAME_HASH_LEN(#_provider ":" #_name),	\
+			} },							\
 		};								\
 	static struct lttng_ust_tracepoint *					\
 		__tracepoint_ptr_##_provider##___##_name			\
@@ -428,6 +539,7 @@ __tracepoints__ptrs_init(void)
 		tracepoint_dlopen_ptr->tracepoint_register_lib(__start___tracepoints_ptrs,
 				__stop___tracepoints_ptrs -
 				__start___tracepoints_ptrs);
+		__tracepoints__jump_entries_init();
 	}
 }
 
@@ -42,8 +42,8 @@
 #define LTTNG_UST_COMM_MAGIC			0xC57C57C5
 
 /* Version for ABI between liblttng-ust, sessiond, consumerd */
-#define LTTNG_UST_ABI_MAJOR_VERSION		7
-#define LTTNG_UST_ABI_MINOR_VERSION		1
+#define LTTNG_UST_ABI_MAJOR_VERSION		8
+#define LTTNG_UST_ABI_MINOR_VERSION		0
 
 enum lttng_ust_instrumentation {
 	LTTNG_UST_TRACEPOINT		= 0,
@@ -61,9 +61,30 @@ enum lttng_ust_output {
 	LTTNG_UST_MMAP		= 0,
 };
 
+/*
+ * LTTNG_UST_CHAN_PER_THREAD channels have as many streams as the
+ * consumer creates, see ustctl_get_nr_stream_per_thread_channel(). On
+ * its first event, each thread takes a stream that no other live thread
+ * owns, and gives it back when it exits. Stream memory is allocated on
+ * the first write. Threads which outnumber the streams share the stream
+ * of their CPU. Streams are not tied to CPUs: their packet context has no
+ * cpu_id field, and the stream_instance_id packet header field
+ * identifies the stream.
+ */
 enum lttng_ust_chan_type {
 	LTTNG_UST_CHAN_PER_CPU = 0,
 	LTTNG_UST_CHAN_METADATA = 1,
+	LTTNG_UST_CHAN_PER_THREAD = 2,
+};
+
+/* Channel creation flags (bitmask). */
+enum lttng_ust_chan_flags {
+	LTTNG_UST_CHAN_FLAG_HUGEPAGES = (1U << 0),	/* Back streams with huge pages */
+	LTTNG_UST_CHAN_FLAG_NUMA = (1U << 1),		/* Per-cpu streams on local node */
+	LTTNG_UST_CHAN_FLAG_FUTEX_WAKEUP = (1U << 2),	/* Wake up readers by futex */
+	LTTNG_UST_CHAN_FLAG_LAZY_ALLOC = (1U << 3),	/* Per-cpu streams allocated on first write */
+	LTTNG_UST_CHAN_FLAG_SUBBUF_POOL = (1U << 4),	/* Per-cpu sub-buffers from a channel pool */
+	LTTNG_UST_CHAN_FLAG_PACKET_INDEX = (1U << 5),	/* Sparse record index per packet */
 };
 
 struct lttng_ust_tracer_version {
@@ -250,6 +271,18 @@ struct lttng_ust_event_exclusion {
 	char names[LTTNG_UST_SYM_NAME_LEN][0];
 } LTTNG_PACKED;
 
+/*
+ * Event rate limit, enforced with a token bucket on each CPU: up to
+ * "burst" events are recorded back-to-back, refilled at "rate" events
+ * per second. A rate of 0 removes the limit.
+ */
+#define LTTNG_UST_RATE_LIMIT_PADDING	32
+struct lttng_ust_rate_limit {
+	uint64_t rate;		/* events per second, per CPU */
+	uint64_t burst;		/* bucket depth, in events */
+	char padding[LTTNG_UST_RATE_LIMIT_PADDING];
+} LTTNG_PACKED;
+
 #define _UST_CMD(minor)				(minor)
 #define _UST_CMDR(minor, type)			(minor)
 #define _UST_CMDW(minor, type)			(minor)
@@ -297,6 +330,8 @@ struct lttng_ust_event_exclusion {
 /* Event FD commands */
 #define LTTNG_UST_FILTER			_UST_CMD(0xA0)
 #define LTTNG_UST_EXCLUSION			_UST_CMD(0xA1)
+#define LTTNG_UST_RATE_LIMIT			\
+	_UST_CMDW(0xA2, struct lttng_ust_rate_limit)
 
 #define LTTNG_UST_ROOT_HANDLE	0
 
@@ -43,6 +43,7 @@
 struct lttng_ust_shm_handle;
 struct lttng_ust_lib_ring_buffer;
 
+#define USTCTL_CONSUMER_CHANNEL_ATTR_PADDING	120
 struct ustctl_consumer_channel_attr {
 	enum lttng_ust_chan_type type;
 	uint64_t subbuf_size;			/* bytes */
@@ -53,6 +54,9 @@ struct ustctl_consumer_channel_attr {
 	enum lttng_ust_output output;		/* splice, mmap */
 	uint32_t chan_id;			/* channel ID */
 	unsigned char uuid[LTTNG_UST_UUID_LEN]; /* Trace session unique ID */
+	uint32_t flags;				/* enum lttng_ust_chan_flags */
+	uint32_t pool_num_subbuf;		/* sub-buffers in pool (SUBBUF_POOL) */
+	char padding[USTCTL_CONSUMER_CHANNEL_ATTR_PADDING];
 } LTTNG_PACKED;
 
 /*
@@ -87,6 +91,8 @@ int ustctl_set_filter(int sock, struct lttng_ust_filter_bytecode *bytecode,
 		struct lttng_ust_object_data *obj_data);
 int ustctl_set_exclusion(int sock, struct lttng_ust_event_exclusion *exclusion,
 		struct lttng_ust_object_data *obj_data);
+int ustctl_set_rate_limit(int sock, struct lttng_ust_rate_limit *rate_limit,
+		struct lttng_ust_object_data *obj_data);
 
 int ustctl_enable(int sock, struct lttng_ust_object_data *object);
 int ustctl_disable(int sock, struct lttng_ust_object_data *object);
@@ -160,6 +166,13 @@ struct ustctl_consumer_stream;
 struct ustctl_consumer_channel_attr;
 
 int ustctl_get_nr_stream_per_channel(void);
+/*
+ * Default number of streams of LTTNG_UST_CHAN_PER_THREAD channels. Any
+ * number from 1 to 4096 may be passed to ustctl_create_channel() for
+ * those: each stream costs two file descriptors in the application, and
+ * memory only once a thread writes to it.
+ */
+int ustctl_get_nr_stream_per_thread_channel(void);
 
 struct ustctl_consumer_channel *
 	ustctl_create_channel(struct ustctl_consumer_channel_attr *attr,
@@ -177,6 +190,15 @@ int ustctl_channel_close_wakeup_fd(struct ustctl_consumer_channel *consumer_chan
 int ustctl_channel_get_wait_fd(struct ustctl_consumer_channel *consumer_chan);
 int ustctl_channel_get_wakeup_fd(struct ustctl_consumer_channel *consumer_chan);
 
+/*
+ * Number of channel streams whose shared memory is backed by huge pages:
+ * hugetlbfs, or transparent huge pages actually mapped once the stream
+ * is populated. Only meaningful for channels created with
+ * LTTNG_UST_CHAN_FLAG_HUGEPAGES.
+ */
+int ustctl_channel_get_nr_hugepage_streams(struct ustctl_consumer_channel *consumer_chan,
+		unsigned int *nr_streams);
+
 int ustctl_write_metadata_to_channel(
 		struct ustctl_consumer_channel *channel,
 		const char *metadata_str,	/* NOT null-terminated */
@@ -197,6 +219,16 @@ int ustctl_stream_close_wakeup_fd(struct ustctl_consumer_stream *stream);
 int ustctl_stream_get_wait_fd(struct ustctl_consumer_stream *stream);
 int ustctl_stream_get_wakeup_fd(struct ustctl_consumer_stream *stream);
 
+/*
+ * For channels created with LTTNG_UST_CHAN_FLAG_LAZY_ALLOC, the shared
+ * memory of a per-cpu stream is only allocated when the application
+ * first writes to it from that cpu, which wakes up the stream reader
+ * (wait fd or futex). Returns 1 if the stream is allocated (always the
+ * case without lazy allocation), 0 if it was never written to, or
+ * -ENOSPC if its allocation failed.
+ */
+int ustctl_stream_is_materialized(struct ustctl_consumer_stream *stream);
+
 /* Create/destroy stream buffers for read */
 struct ustctl_consumer_stream *
 	ustctl_create_stream(struct ustctl_consumer_channel *channel,
@@ -223,9 +255,41 @@ int ustctl_get_padded_subbuf_size(struct ustctl_consumer_stream *stream,
 int ustctl_get_next_subbuf(struct ustctl_consumer_stream *stream);
 int ustctl_put_next_subbuf(struct ustctl_consumer_stream *stream);
 
+/*
+ * Move the current packet (between get/put or get_next/put_next),
+ * padding included, to out_fd without copying it through user space:
+ * the data is spliced from the stream shm fd. Returns the number of
+ * bytes moved, or a negative error value. For sockets, pages may
+ * still be referenced by the network stack after return: the
+ * sub-buffer should not be put back before the data is sent.
+ */
+ssize_t ustctl_splice_subbuf(struct ustctl_consumer_stream *stream,
+		int out_fd);
+
+/*
+ * For channels created with LTTNG_UST_CHAN_FLAG_FUTEX_WAKEUP, replaces
+ * polling the stream wait fd. Returns 0 when a sub-buffer was delivered
+ * since the previous call, -ETIMEDOUT after timeout_ms (-1: no timeout).
+ * Consume all available sub-buffers before waiting again. Application
+ * exit is not notified: use a timeout to check for hang up.
+ */
+int ustctl_stream_wait_wakeup(struct ustctl_consumer_stream *stream,
+		int timeout_ms);
+
 /* snapshot */
 
 int ustctl_snapshot(struct ustctl_consumer_stream *stream);
+/*
+ * Like ustctl_snapshot(), but the snapshot range starts where the
+ * previous incremental snapshot of the stream ended: only sub-buffers
+ * completed since then are part of it. nr_lost is set to the number of
+ * sub-buffers overwritten before they could be part of a snapshot.
+ * Returns -EAGAIN if no new sub-buffer is available.
+ */
+int ustctl_snapshot_incremental(struct ustctl_consumer_stream *stream,
+		unsigned long *nr_lost);
+/* Next incremental snapshot covers the whole buffer again. */
+int ustctl_snapshot_incremental_reset(struct ustctl_consumer_stream *stream);
 int ustctl_snapshot_get_consumed(struct ustctl_consumer_stream *stream,
 		unsigned long *pos);
 int ustctl_snapshot_get_produced(struct ustctl_consumer_stream *stream,
@@ -257,6 +321,53 @@ int ustctl_get_sequence_number(struct ustctl_consumer_stream *stream,
 int ustctl_get_instance_id(struct ustctl_consumer_stream *stream,
 		uint64_t *id);
 
+#define USTCTL_STREAM_STATS_PADDING	56
+/*
+ * Producer-side statistics of a stream, cumulative since the stream
+ * was created or last reset. Record counts only cover sub-buffers
+ * delivered so far.
+ */
+struct ustctl_stream_stats {
+	uint64_t reserve_slow;		/* Reservations through slow path */
+	uint64_t reserve_retry;		/* Reservation and switch retries */
+	uint64_t switch_timer;		/* Switches forced by switch timer */
+	uint64_t switch_flush;		/* Switches forced by flush */
+	uint64_t records_lost_full;	/* Discarded, buffer full */
+	uint64_t records_lost_wrap;	/* Discarded, nested wrap-around */
+	uint64_t records_lost_big;	/* Discarded, too big */
+	uint64_t records_count;		/* Records in delivered sub-buffers */
+	uint64_t records_overrun;	/* Records overwritten */
+	uint64_t records_truncated;	/* Strings cut or padded to fit */
+	char padding[USTCTL_STREAM_STATS_PADDING];
+} LTTNG_PACKED;
+
+int ustctl_get_stats(struct ustctl_consumer_stream *stream,
+		struct ustctl_stream_stats *stats);
+
+#define USTCTL_PACKET_INDEX_MAX_ENTRIES	64
+/*
+ * Sparse index of the records of a packet, for channels created with
+ * LTTNG_UST_CHAN_FLAG_PACKET_INDEX. The packet is split in
+ * USTCTL_PACKET_INDEX_MAX_ENTRIES intervals of equal size, and each
+ * entry describes the record covering the first byte of an interval.
+ * Decoding an event header from the entry offset, after aligning it on
+ * the event header alignment, yields that record.
+ */
+struct ustctl_packet_index_entry {
+	uint64_t offset;		/* Offset in packet, in bytes */
+	uint64_t timestamp;		/* Record timestamp */
+} LTTNG_PACKED;
+
+/*
+ * Copy the index entries of the sub-buffer held by the consumer, in
+ * offset order. On input, *count is the size of the entries array. On
+ * output, it is the number of entries of the packet, which may be
+ * larger than the number copied. Returns -ENOENT if the channel has no
+ * packet index.
+ */
+int ustctl_get_packet_index(struct ustctl_consumer_stream *stream,
+		struct ustctl_packet_index_entry *entries, size_t *count);
+
 /* returns whether UST has perf counters support. */
 int ustctl_has_perf_counters(void);
 
@@ -280,6 +391,7 @@ enum ustctl_channel_header {
 	USTCTL_CHANNEL_HEADER_UNKNOWN = 0,
 	USTCTL_CHANNEL_HEADER_COMPACT = 1,
 	USTCTL_CHANNEL_HEADER_LARGE = 2,
+	USTCTL_CHANNEL_HEADER_VARINT = 3,
 };
 
 /* event type structures */
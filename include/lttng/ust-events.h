@@ -75,6 +75,8 @@ enum lttng_client_types {
 	LTTNG_CLIENT_OVERWRITE = 2,
 	LTTNG_CLIENT_DISCARD_RT = 3,
 	LTTNG_CLIENT_OVERWRITE_RT = 4,
+	LTTNG_CLIENT_DISCARD_PT = 5,
+	LTTNG_CLIENT_OVERWRITE_PT = 6,
 	LTTNG_NR_CLIENT_TYPES,
 };
 
@@ -321,6 +323,9 @@ struct lttng_event_desc {
 	union {
 		struct {
 			const char **model_emf_uri;
+			/* Precomputed name hash, see ust-name-hash.h. */
+			uint32_t name_hash;
+			uint32_t name_len;	/* 0: hash not precomputed */
 		} ext;
 		char padding[LTTNG_UST_EVENT_DESC_PADDING];
 	} u;
@@ -363,6 +368,7 @@ struct lttng_enabler {
 	struct lttng_channel *chan;
 	struct lttng_ctx *ctx;
 	unsigned int enabled:1;
+	struct lttng_ust_rate_limit rate_limit;	/* rate 0: no limit */
 };
 
 struct tp_list_entry {
@@ -387,6 +393,7 @@ struct lttng_ust_field_list {
 
 struct ust_pending_probe;
 struct lttng_event;
+struct lttng_rate_limit;
 
 struct lttng_ust_filter_bytecode_node {
 	struct cds_list_head node;
@@ -463,6 +470,13 @@ struct lttng_event {
 	struct cds_list_head enablers_ref_head;
 	struct cds_hlist_node hlist;	/* session ht of events */
 	int registered;			/* has reg'd tracepoint probe */
+
+	/* LTTng-UST 2.10 starts here */
+	/*
+	 * Token buckets, NULL if the event rate is not limited. Only
+	 * valid if the channel ops have u.s.has_rate_limit set.
+	 */
+	struct lttng_rate_limit *rate_limit;
 };
 
 struct lttng_enum {
@@ -489,11 +503,19 @@ struct lttng_channel_ops {
 			unsigned int read_timer_interval,
 			unsigned char *uuid,
 			uint32_t chan_id,
-			const int *stream_fds, int nr_stream_fds);
+			const int *stream_fds, int nr_stream_fds,
+			uint32_t flags, size_t pool_num_subbuf);
 	void (*channel_destroy)(struct lttng_channel *chan);
 	union {
 		void *_deprecated1;
 		unsigned long has_strcpy:1;		/* ABI has strcpy */
+		struct {
+			unsigned long _has_strcpy:1;	/* Same bit as has_strcpy */
+			unsigned long has_batch:1;	/* ABI has batch reserve/commit */
+			unsigned long has_strtrim:1;	/* ABI has string trim */
+			unsigned long has_rate_limit:1;	/* ABI has rate limit */
+			unsigned long has_strlen:1;	/* ABI has string length */
+		} s;
 	} u;
 	void *_deprecated2;
 	int (*event_reserve)(struct lttng_ust_lib_ring_buffer_ctx *ctx,
@@ -515,6 +537,50 @@ struct lttng_channel_ops {
 	int (*flush_buffer)(struct channel *chan, struct lttng_ust_shm_handle *handle);
 	void (*event_strcpy)(struct lttng_ust_lib_ring_buffer_ctx *ctx,
 			const char *src, size_t len);
+	/*
+	 * Batched reservation of nr_records records of the same event,
+	 * each with a payload of ctx->data_size bytes, using a single
+	 * buffer space reservation and commit. event_reserve_batch()
+	 * writes the header of the first record, event_batch_next()
+	 * writes the header of each following record. Only available
+	 * if u.s.has_batch is set.
+	 */
+	int (*event_reserve_batch)(struct lttng_ust_lib_ring_buffer_ctx *ctx,
+			uint32_t event_id, unsigned int nr_records);
+	void (*event_batch_next)(struct lttng_ust_lib_ring_buffer_ctx *ctx,
+			uint32_t event_id);
+	void (*event_commit_batch)(struct lttng_ust_lib_ring_buffer_ctx *ctx,
+			unsigned int nr_records);
+	/*
+	 * Single-pass capture of trailing string fields. Only available
+	 * if u.s.has_strtrim is set. event_reserve_bounded() reserves a
+	 * payload of ctx->data_size bytes, lowered to no less than
+	 * min_data_size when needed to fit in the current packet.
+	 * event_strcpy_bounded() writes at most len - 1 characters
+	 * followed by '\0', and returns the number of characters written.
+	 * event_strtrim() writes the string padding field which ends
+	 * the record, and releases the reserved space left after it. If
+	 * that space cannot be released, the padding field covers it
+	 * instead. It must be called before event_commit(). Truncated and padded records are counted
+	 * in the stream records_truncated statistic.
+	 */
+	int (*event_reserve_bounded)(struct lttng_ust_lib_ring_buffer_ctx *ctx,
+			uint32_t event_id, size_t min_data_size);
+	size_t (*event_strcpy_bounded)(struct lttng_ust_lib_ring_buffer_ctx *ctx,
+			const char *src, size_t len);
+	void (*event_strtrim)(struct lttng_ust_lib_ring_buffer_ctx *ctx);
+	/*
+	 * Returns 1 if the event can be recorded, 0 if its rate limit
+	 * suppresses it. Only available if u.s.has_rate_limit is set.
+	 * Called only when the event has a rate limit.
+	 */
+	int (*event_rate_limit)(struct lttng_event *event);
+	/*
+	 * Returns the length of the string field src, excluding the
+	 * terminating NULL character, using the fastest string kernel
+	 * for the running CPU. Only available if u.s.has_strlen is set.
+	 */
+	size_t (*event_strlen)(const char *src);
 };
 
 /*
@@ -539,7 +605,10 @@ struct lttng_channel {
 	unsigned int _deprecated2;
 	struct cds_list_head node;	/* Channel list in session */
 	const struct lttng_channel_ops *ops;
-	int header_type;		/* 0: unset, 1: compact, 2: large */
+	int header_type;		/*
+					 * 0: unset, 1: compact, 2: large,
+					 * 3: varint
+					 */
 	struct lttng_ust_shm_handle *handle;	/* shared-memory handle */
 	unsigned int _deprecated3:1;
 
@@ -642,6 +711,8 @@ int lttng_enabler_attach_context(struct lttng_enabler *enabler,
 		struct lttng_ust_context *ctx);
 int lttng_enabler_attach_exclusion(struct lttng_enabler *enabler,
 		struct lttng_ust_excluder_node *excluder);
+int lttng_enabler_attach_rate_limit(struct lttng_enabler *enabler,
+		struct lttng_ust_rate_limit *rate_limit);
 
 int lttng_attach_context(struct lttng_ust_context *context_param,
 		union ust_args *uargs,
@@ -723,6 +794,14 @@ void lttng_enabler_event_link_bytecode(struct lttng_event *event,
 void lttng_free_event_filter_runtime(struct lttng_event *event);
 void lttng_filter_sync_state(struct lttng_bytecode_runtime *runtime);
 
+int lttng_event_rate_limit(struct lttng_event *event);
+void lttng_event_sync_rate_limit(struct lttng_event *event,
+		const struct lttng_ust_rate_limit *limit);
+void lttng_event_free_rate_limit(struct lttng_event *event);
+unsigned long lttng_event_flush_rate_limit(struct lttng_event *event);
+void lttng_rate_limit_flush_all(void);
+void lttng_rate_limit_prune_release_queue(void);
+
 struct cds_list_head *lttng_get_probe_list_head(void);
 int lttng_session_active(void);
 
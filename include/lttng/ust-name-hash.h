@@ -0,0 +1,151 @@
+#ifndef _LTTNG_UST_NAME_HASH_H
+#define _LTTNG_UST_NAME_HASH_H
+
+/*
+ * Hash of tracepoint and event names, computed at compile time for the
+ * names emitted by the tracepoint macros, and at run time otherwise.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The hash sums each character multiplied by a pseudo-random key of
+ * its position, which only needs a constant expression per character
+ * when the name is a string literal: the compiler folds it in C and C++
+ * alike. The sum is mixed with the name length at run time, when it is
+ * used as a hash table key.
+ *
+ * Names longer than LTTNG_UST_NAME_HASH_MAX_LEN are emitted with a zero
+ * length, and hashed at run time.
+ */
+#define LTTNG_UST_NAME_HASH_MAX_LEN	64
+
+#define _LTTNG_UST_NAME_HASH_K(_i)					\
+	((((uint32_t) (_i) + 1) * 0x9e3779b1U				\
+		^ ((((uint32_t) (_i) + 1) * 0x9e3779b1U) >> 15))		\
+	 * 0x85ebca77U)
+
+/* Characters past the end of the literal read its null terminator. */
+#define _LTTNG_UST_NAME_HASH_C(_s, _i)					\
+	((uint32_t) (unsigned char)					\
+		(_s)[(_i) < sizeof(_s) ? (_i) : sizeof(_s) - 1]		\
+	 * _LTTNG_UST_NAME_HASH_K(_i))
+
+#define _LTTNG_UST_NAME_HASH_SUM(_s)					\
+	(_LTTNG_UST_NAME_HASH_C(_s, 0) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 1) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 2) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 3) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 4) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 5) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 6) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 7) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 8) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 9) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 10) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 11) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 12) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 13) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 14) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 15) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 16) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 17) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 18) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 19) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 20) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 21) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 22) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 23) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 24) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 25) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 26) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 27) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 28) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 29) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 30) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 31) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 32) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 33) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 34) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 35) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 36) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 37) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 38) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 39) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 40) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 41) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 42) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 43) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 44) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 45) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 46) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 47) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 48) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 49) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 50) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 51) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 52) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 53) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 54) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 55) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 56) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 57) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 58) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 59) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 60) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 61) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 62) \
+	+ _LTTNG_UST_NAME_HASH_C(_s, 63))
+
+#define LTTNG_UST_NAME_HASH_LEN(_s)					\
+	(sizeof(_s) - 1 <= LTTNG_UST_NAME_HASH_MAX_LEN ? sizeof(_s) - 1 : 0)
+
+#define LTTNG_UST_NAME_HASH_SUM(_s)					\
+	(sizeof(_s) - 1 <= LTTNG_UST_NAME_HASH_MAX_LEN ?		\
+		_LTTNG_UST_NAME_HASH_SUM(_s) : 0)
+
+static inline
+uint32_t lttng_ust_name_hash_final(uint32_t sum, uint32_t len)
+{
+	uint32_t h = sum ^ len;
+
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	return h;
+}
+
+static inline
+uint32_t lttng_ust_name_hash(const char *name, size_t len)
+{
+	uint32_t sum = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		sum += (uint32_t) (unsigned char) name[i]
+			* _LTTNG_UST_NAME_HASH_K(i);
+	return lttng_ust_name_hash_final(sum, len);
+}
+
+#endif /* _LTTNG_UST_NAME_HASH_H */
@@ -68,6 +68,38 @@
 		__max1 > __max2 ? __max1: __max2;	\
 	})
 
+/*
+ * Define TP_STRING_SINGLE_PASS to a size in bytes before including the
+ * tracepoint provider to capture trailing string fields in a single
+ * pass. Events whose only variable-size fields are strings located at
+ * the end of the payload then reserve room for TP_STRING_SINGLE_PASS
+ * bytes of string data (lowered to fit in the current packet, but
+ * never below half of it), copy the strings without computing their
+ * length beforehand, and release the unused space before commit.
+ * Strings which do not fit in the reserved room are truncated, which
+ * is reported by the records_truncated stream statistic.
+ *
+ * All the events of such a provider end with a "_string_pad" sequence
+ * of zero bytes. It stays empty, except in single-pass records whose
+ * unused space cannot be released (another record was reserved after
+ * them): the padding then covers that space.
+ */
+#undef _TP_STRING_SINGLE_PASS
+#undef _TP_STRING_PAD_FIELD
+#undef _TP_STRING_PAD_ROOM
+#ifdef TP_STRING_SINGLE_PASS
+#define _TP_STRING_SINGLE_PASS	((size_t) (TP_STRING_SINGLE_PASS))
+#define _TP_STRING_PAD_FIELD	\
+	ctf_sequence(uint8_t, _string_pad, "", uint32_t, 0)
+/* Worst-case room taken by the padding length. */
+#define _TP_STRING_PAD_ROOM	\
+	(sizeof(uint32_t) + lttng_alignof(uint32_t) - 1)
+#else /* TP_STRING_SINGLE_PASS */
+#define _TP_STRING_SINGLE_PASS	((size_t) 0)
+#define _TP_STRING_PAD_FIELD
+#define _TP_STRING_PAD_ROOM	((size_t) 0)
+#endif /* TP_STRING_SINGLE_PASS */
+
 /*
  * Stage 0 of tracepoint event generation.
  *
@@ -311,6 +343,7 @@ static const char							\
 #define TRACEPOINT_EVENT_CLASS(_provider, _name, _args, _fields)		   	     \
 	static const struct lttng_event_field __event_fields___##_provider##___##_name[] = { \
 		_fields									     \
+		_TP_STRING_PAD_FIELD							     \
 		ctf_integer(int, dummy, 0)	/* Dummy, C99 forbids 0-len array. */	     \
 	};
 
@@ -381,7 +414,9 @@ static void __event_probe__##_provider##___##_name(_TP_ARGS_DATA_PROTO(_args));
 #undef _ctf_string
 #define _ctf_string(_item, _src, _nowrite)				       \
 	__event_len += __dynamic_len[__dynamic_len_idx++] =		       \
-		strlen((_src) ? (_src) : __LTTNG_UST_NULL_STRING) + 1;
+		(__chan->ops->u.s.has_strlen ?				       \
+			__chan->ops->event_strlen((_src) ? (_src) : __LTTNG_UST_NULL_STRING) : \
+			strlen((_src) ? (_src) : __LTTNG_UST_NULL_STRING)) + 1;
 
 #undef _ctf_enum
 #define _ctf_enum(_provider, _name, _type, _item, _src, _nowrite)		\
@@ -396,9 +431,11 @@ static void __event_probe__##_provider##___##_name(_TP_ARGS_DATA_PROTO(_args));
 #undef TRACEPOINT_EVENT_CLASS
 #define TRACEPOINT_EVENT_CLASS(_provider, _name, _args, _fields)	      \
 static inline lttng_ust_notrace						      \
-size_t __event_get_size__##_provider##___##_name(size_t *__dynamic_len, _TP_ARGS_DATA_PROTO(_args)); \
+size_t __event_get_size__##_provider##___##_name(struct lttng_channel *__chan, \
+		size_t *__dynamic_len, _TP_ARGS_DATA_PROTO(_args));	      \
 static inline								      \
-size_t __event_get_size__##_provider##___##_name(size_t *__dynamic_len, _TP_ARGS_DATA_PROTO(_args)) \
+size_t __event_get_size__##_provider##___##_name(struct lttng_channel *__chan, \
+		size_t *__dynamic_len, _TP_ARGS_DATA_PROTO(_args))	      \
 {									      \
 	size_t __event_len = 0;						      \
 	unsigned int __dynamic_len_idx = 0;				      \
@@ -406,11 +443,85 @@ size_t __event_get_size__##_provider##___##_name(size_t *__dynamic_len, _TP_ARGS
 	if (0)								      \
 		(void) __dynamic_len_idx;	/* don't warn if unused */    \
 	_fields								      \
+	_TP_STRING_PAD_FIELD						      \
 	return __event_len;						      \
 }
 
 #include TRACEPOINT_INCLUDE
 
+/*
+ * Stage 3.0.1 of tracepoint event generation.
+ *
+ * Create static inline function that tells whether the event can be
+ * written in a single pass, i.e. its only variable-size fields are
+ * strings located at the end of the payload. It computes the size of
+ * the payload with empty strings and the string padding length, and
+ * the number of strings.
+ */
+
+/* Reset all macros within TRACEPOINT_EVENT */
+#include <lttng/ust-tracepoint-event-reset.h>
+#include <lttng/ust-tracepoint-event-write.h>
+
+#undef _ctf_integer_ext
+#define _ctf_integer_ext(_type, _item, _src, _byte_order, _base, _nowrite)       \
+	if (*__nr_strings)						       \
+		__single_pass = 0;					       \
+	*__fixed_len += lib_ring_buffer_align(*__fixed_len, lttng_alignof(_type)); \
+	*__fixed_len += sizeof(_type);
+
+#undef _ctf_float
+#define _ctf_float(_type, _item, _src, _nowrite)				 \
+	_ctf_integer_ext(_type, _item, _src, BYTE_ORDER, 10, _nowrite)
+
+#undef _ctf_array_encoded
+#define _ctf_array_encoded(_type, _item, _src, _byte_order, _length, _encoding,	 \
+			_nowrite, _elem_type_base)				 \
+	if (*__nr_strings)						       \
+		__single_pass = 0;					       \
+	*__fixed_len += lib_ring_buffer_align(*__fixed_len, lttng_alignof(_type)); \
+	*__fixed_len += sizeof(_type) * (_length);
+
+#undef _ctf_sequence_encoded
+#define _ctf_sequence_encoded(_type, _item, _src, _byte_order, _length_type,	 \
+			_src_length, _encoding, _nowrite, _elem_type_base)	 \
+	__single_pass = 0;
+
+#undef _ctf_string
+#define _ctf_string(_item, _src, _nowrite)				       \
+	(*__nr_strings)++;						       \
+	*__fixed_len += 1;
+
+#undef _ctf_enum
+#define _ctf_enum(_provider, _name, _type, _item, _src, _nowrite)		\
+	_ctf_integer_ext(_type, _item, _src, BYTE_ORDER, 10, _nowrite)
+
+#undef TP_ARGS
+#define TP_ARGS(...) __VA_ARGS__
+
+#undef TP_FIELDS
+#define TP_FIELDS(...) __VA_ARGS__
+
+#undef TRACEPOINT_EVENT_CLASS
+#define TRACEPOINT_EVENT_CLASS(_provider, _name, _args, _fields)	      \
+static inline lttng_ust_notrace						      \
+int __event_single_pass__##_provider##___##_name(size_t *__fixed_len,	      \
+		unsigned int *__nr_strings);				      \
+static inline								      \
+int __event_single_pass__##_provider##___##_name(size_t *__fixed_len,	      \
+		unsigned int *__nr_strings)				      \
+{									      \
+	int __single_pass = 1;						      \
+									      \
+	*__fixed_len = 0;						      \
+	*__nr_strings = 0;						      \
+	_fields								      \
+	*__fixed_len += _TP_STRING_PAD_ROOM;				      \
+	return __single_pass && *__nr_strings;				      \
+}
+
+#include TRACEPOINT_INCLUDE
+
 /*
  * Stage 3.1 of tracepoint event generation.
  *
@@ -560,6 +671,7 @@ void __event_prepare_filter_stack__##_provider##___##_name(char *__stack_data,\
 						 _TP_ARGS_DATA_PROTO(_args))  \
 {									      \
 	_fields								      \
+	_TP_STRING_PAD_FIELD						      \
 }
 
 #include TRACEPOINT_INCLUDE
@@ -615,6 +727,7 @@ size_t __event_get_align__##_provider##___##_name(_TP_ARGS_PROTO(_args))      \
 {									      \
 	size_t __event_align = 1;					      \
 	_fields								      \
+	_TP_STRING_PAD_FIELD						      \
 	return __event_align;						      \
 }
 
@@ -682,7 +795,14 @@ size_t __event_get_align__##_provider##___##_name(_TP_ARGS_PROTO(_args))      \
 			((_src) ? (_src) : __LTTNG_UST_NULL_STRING);		\
 		lib_ring_buffer_align_ctx(&__ctx,				\
 			lttng_alignof(*__ctf_tmp_string));			\
-		if (__chan->ops->u.has_strcpy)					\
+		if (__single_pass)						\
+			/* Leave room for the next strings and padding. */ \
+			__chan->ops->event_strcpy_bounded(&__ctx,		\
+				__ctf_tmp_string,				\
+				__single_pass_end - __ctx.buf_offset		\
+					- --__single_pass_strings		\
+					- _TP_STRING_PAD_ROOM);		\
+		else if (__chan->ops->u.has_strcpy)				\
 			__chan->ops->event_strcpy(&__ctx, __ctf_tmp_string,	\
 				__get_dynamic_len(dest));			\
 		else								\
@@ -756,14 +876,19 @@ void __event_probe__##_provider##___##_name(_TP_ARGS_DATA_PROTO(_args))	      \
 	struct lttng_stack_ctx __lttng_ctx;				      \
 	size_t __event_len, __event_align;				      \
 	size_t __dynamic_len_idx = 0;					      \
+	size_t __single_pass_len = 0, __single_pass_end = 0;		      \
+	unsigned int __single_pass_strings = 0;				      \
+	int __single_pass = 0;						      \
 	union {								      \
 		size_t __dynamic_len[_TP_ARRAY_SIZE(__event_fields___##_provider##___##_name) - 1]; \
 		char __filter_stack_data[2 * sizeof(unsigned long) * (_TP_ARRAY_SIZE(__event_fields___##_provider##___##_name) - 1)]; \
 	} __stackvar;							      \
 	int __ret;							      \
 									      \
-	if (0)								      \
+	if (0) {							      \
 		(void) __dynamic_len_idx;	/* don't warn if unused */    \
+		(void) __single_pass_end;				      \
+	}								      \
 	if (!_TP_SESSION_CHECK(session, __chan->session))		      \
 		return;							      \
 	if (caa_unlikely(!CMM_ACCESS_ONCE(__chan->session->active)))	      \
@@ -788,8 +913,18 @@ void __event_probe__##_provider##___##_name(_TP_ARGS_DATA_PROTO(_args))	      \
 		if (caa_likely(!__filter_record))			      \
 			return;						      \
 	}								      \
-	__event_len = __event_get_size__##_provider##___##_name(__stackvar.__dynamic_len, \
-		 _TP_ARGS_DATA_VAR(_args));				      \
+	if (__chan->ops->u.s.has_rate_limit				      \
+			&& caa_unlikely(CMM_ACCESS_ONCE(__event->rate_limit)) \
+			&& !__chan->ops->event_rate_limit(__event))	      \
+		return;							      \
+	if (_TP_STRING_SINGLE_PASS && __chan->ops->u.s.has_strtrim)	      \
+		__single_pass = __event_single_pass__##_provider##___##_name( \
+			&__single_pass_len, &__single_pass_strings);	      \
+	if (__single_pass)						      \
+		__event_len = __single_pass_len + _TP_STRING_SINGLE_PASS;     \
+	else								      \
+		__event_len = __event_get_size__##_provider##___##_name(__chan, \
+			__stackvar.__dynamic_len, _TP_ARGS_DATA_VAR(_args));  \
 	__event_align = __event_get_align__##_provider##___##_name(_TP_ARGS_VAR(_args)); \
 	memset(&__lttng_ctx, 0, sizeof(__lttng_ctx));			      \
 	__lttng_ctx.event = __event;					      \
@@ -798,10 +933,20 @@ void __event_probe__##_provider##___##_name(_TP_ARGS_DATA_PROTO(_args))	      \
 	lib_ring_buffer_ctx_init(&__ctx, __chan->chan, __event, __event_len,  \
 				 __event_align, -1, __chan->handle, &__lttng_ctx); \
 	__ctx.ip = _TP_IP_PARAM(TP_IP_PARAM);				      \
-	__ret = __chan->ops->event_reserve(&__ctx, __event->id);	      \
+	if (__single_pass)						      \
+		__ret = __chan->ops->event_reserve_bounded(&__ctx, __event->id, \
+			__single_pass_len + (_TP_STRING_SINGLE_PASS >> 1));   \
+	else								      \
+		__ret = __chan->ops->event_reserve(&__ctx, __event->id);      \
 	if (__ret < 0)							      \
 		return;							      \
+	__single_pass_end = __ctx.pre_offset + __ctx.slot_size;		      \
 	_fields								      \
+	if (__single_pass)						      \
+		__chan->ops->event_strtrim(&__ctx);			      \
+	else {								      \
+		_TP_STRING_PAD_FIELD					      \
+	}								      \
 	__chan->ops->event_commit(&__ctx);				      \
 }
 
@@ -897,6 +1042,8 @@ static const struct lttng_event_desc __event_desc___##_provider##_##_name = {
 	.u = {								       \
 	    .ext = {							       \
 		  .model_emf_uri = &__ref_model_emf_uri___##_provider##___##_name, \
+		  .name_hash = LTTNG_UST_NAME_HASH_SUM(#_provider ":" #_name), \
+		  .name_len = LTTNG_UST_NAME_HASH_LEN(#_provider ":" #_name), \
 		},							       \
 	},								       \
 };
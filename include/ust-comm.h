@@ -98,6 +98,7 @@ struct ustcomm_ust_msg {
 		struct {
 			uint32_t count;	/* how many names follow */
 		} LTTNG_PACKED exclusion;
+		struct lttng_ust_rate_limit rate_limit;
 		char padding[USTCOMM_MSG_PADDING2];
 	} u;
 } LTTNG_PACKED;
@@ -1473,6 +1473,7 @@ int ustcomm_register_channel(int sock,
 		switch (reply.r.header_type) {
 		case 1:
 		case 2:
+		case 3:
 			*header_type = reply.r.header_type;
 			break;
 		default:
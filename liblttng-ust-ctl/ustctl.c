@@ -24,6 +24,7 @@
 #include <lttng/ust-events.h>
 #include <sys/mman.h>
 #include <byteswap.h>
+#include <fcntl.h>
 
 #include <usterr-signal-safe.h>
 #include <ust-comm.h>
@@ -63,17 +64,25 @@ struct ustctl_consumer_stream {
 	int shm_fd, wait_fd, wakeup_fd;
 	int cpu;
 	uint64_t memory_map_size;
+	int splice_pipe[2];			/* ustctl_splice_subbuf() */
+	/* End of the previous incremental snapshot. */
+	unsigned long last_snapshot_produced;
+	int has_last_snapshot;
 };
 
 extern void lttng_ring_buffer_client_overwrite_init(void);
 extern void lttng_ring_buffer_client_overwrite_rt_init(void);
 extern void lttng_ring_buffer_client_discard_init(void);
 extern void lttng_ring_buffer_client_discard_rt_init(void);
+extern void lttng_ring_buffer_client_overwrite_pt_init(void);
+extern void lttng_ring_buffer_client_discard_pt_init(void);
 extern void lttng_ring_buffer_metadata_client_init(void);
 extern void lttng_ring_buffer_client_overwrite_exit(void);
 extern void lttng_ring_buffer_client_overwrite_rt_exit(void);
 extern void lttng_ring_buffer_client_discard_exit(void);
 extern void lttng_ring_buffer_client_discard_rt_exit(void);
+extern void lttng_ring_buffer_client_overwrite_pt_exit(void);
+extern void lttng_ring_buffer_client_discard_pt_exit(void);
 extern void lttng_ring_buffer_metadata_client_exit(void);
 
 volatile enum ust_loglevel ust_loglevel;
@@ -361,6 +370,24 @@ int ustctl_set_exclusion(int sock, struct lttng_ust_event_exclusion *exclusion,
 	return ustcomm_recv_app_reply(sock, &lur, lum.handle, lum.cmd);
 }
 
+int ustctl_set_rate_limit(int sock, struct lttng_ust_rate_limit *rate_limit,
+		struct lttng_ust_object_data *obj_data)
+{
+	struct ustcomm_ust_msg lum;
+	struct ustcomm_ust_reply lur;
+
+	if (!obj_data || !rate_limit)
+		return -EINVAL;
+
+	memset(&lum, 0, sizeof(lum));
+	lum.handle = obj_data->handle;
+	lum.cmd = LTTNG_UST_RATE_LIMIT;
+	lum.u.rate_limit.rate = rate_limit->rate;
+	lum.u.rate_limit.burst = rate_limit->burst;
+
+	return ustcomm_send_app_cmd(sock, &lum, &lur);
+}
+
 /* Enable event, channel and session ioctl */
 int ustctl_enable(int sock, struct lttng_ust_object_data *object)
 {
@@ -1001,6 +1028,13 @@ int ustctl_get_nr_stream_per_channel(void)
 	return num_possible_cpus();
 }
 
+int ustctl_get_nr_stream_per_thread_channel(void)
+{
+	/* Room for oversubscribed thread pools. */
+	return min_t(int, 4 * num_possible_cpus(),
+			RING_BUFFER_MAX_THREAD_STREAMS);
+}
+
 struct ustctl_consumer_channel *
 	ustctl_create_channel(struct ustctl_consumer_channel_attr *attr,
 		const int *stream_fds, int nr_stream_fds)
@@ -1029,6 +1063,16 @@ struct ustctl_consumer_channel *
 			return NULL;
 		}
 		break;
+	case LTTNG_UST_CHAN_PER_THREAD:
+		if (attr->output == LTTNG_UST_MMAP) {
+			if (attr->overwrite)
+				transport_name = "relay-overwrite-pt-mmap";
+			else
+				transport_name = "relay-discard-pt-mmap";
+		} else {
+			return NULL;
+		}
+		break;
 	case LTTNG_UST_CHAN_METADATA:
 		if (attr->output == LTTNG_UST_MMAP)
 			transport_name = "relay-metadata-mmap";
@@ -1056,7 +1100,8 @@ struct ustctl_consumer_channel *
 			attr->switch_timer_interval,
 			attr->read_timer_interval,
 			attr->uuid, attr->chan_id,
-			stream_fds, nr_stream_fds);
+			stream_fds, nr_stream_fds, attr->flags,
+			attr->pool_num_subbuf);
 	if (!chan->chan) {
 		goto chan_error;
 	}
@@ -1269,12 +1314,30 @@ struct ustctl_consumer_stream *
 	stream->wakeup_fd = wakeup_fd;
 	stream->memory_map_size = memory_map_size;
 	stream->cpu = cpu;
+	stream->splice_pipe[0] = -1;
+	stream->splice_pipe[1] = -1;
 	return stream;
 
 alloc_error:
 	return NULL;
 }
 
+static
+void ustctl_stream_close_splice_pipe(struct ustctl_consumer_stream *stream)
+{
+	int i, ret;
+
+	for (i = 0; i < 2; i++) {
+		if (stream->splice_pipe[i] < 0)
+			continue;
+		ret = close(stream->splice_pipe[i]);
+		if (ret) {
+			PERROR("close");
+		}
+		stream->splice_pipe[i] = -1;
+	}
+}
+
 void ustctl_destroy_stream(struct ustctl_consumer_stream *stream)
 {
 	struct lttng_ust_lib_ring_buffer *buf;
@@ -1285,6 +1348,7 @@ void ustctl_destroy_stream(struct ustctl_consumer_stream *stream)
 	consumer_chan = stream->chan;
 	(void) ustctl_stream_close_wait_fd(stream);
 	(void) ustctl_stream_close_wakeup_fd(stream);
+	ustctl_stream_close_splice_pipe(stream);
 	lib_ring_buffer_release_read(buf, consumer_chan->chan->handle);
 	free(stream);
 }
@@ -1305,6 +1369,15 @@ int ustctl_channel_get_wakeup_fd(struct ustctl_consumer_channel *chan)
 		&chan->chan->handle->chan._ref);
 }
 
+int ustctl_channel_get_nr_hugepage_streams(struct ustctl_consumer_channel *chan,
+		unsigned int *nr_streams)
+{
+	if (!chan || !nr_streams)
+		return -EINVAL;
+	*nr_streams = channel_handle_get_nr_hugepage_streams(chan->chan->handle);
+	return 0;
+}
+
 int ustctl_stream_get_wait_fd(struct ustctl_consumer_stream *stream)
 {
 	struct lttng_ust_lib_ring_buffer *buf;
@@ -1317,6 +1390,20 @@ int ustctl_stream_get_wait_fd(struct ustctl_consumer_stream *stream)
 	return shm_get_wait_fd(consumer_chan->chan->handle, &buf->self._ref);
 }
 
+int ustctl_stream_is_materialized(struct ustctl_consumer_stream *stream)
+{
+	if (!stream)
+		return -EINVAL;
+	switch (CMM_LOAD_SHARED(stream->buf->lazy_state)) {
+	case RB_LAZY_ACTIVE:
+		return 1;
+	case RB_LAZY_FAILED:
+		return -ENOSPC;
+	default:
+		return 0;
+	}
+}
+
 int ustctl_stream_get_wakeup_fd(struct ustctl_consumer_stream *stream)
 {
 	struct lttng_ust_lib_ring_buffer *buf;
@@ -1357,9 +1444,15 @@ int ustctl_get_mmap_len(struct ustctl_consumer_stream *stream,
 	chan = consumer_chan->chan->chan;
 	if (chan->backend.config.output != RING_BUFFER_MMAP)
 		return -EINVAL;
-	mmap_buf_len = chan->backend.buf_size;
-	if (chan->backend.extra_reader_sb)
-		mmap_buf_len += chan->backend.subbuf_size;
+	if (chan->pool_num_subbuf) {
+		/* All streams map the channel sub-buffer pool. */
+		mmap_buf_len = (unsigned long) chan->pool_num_subbuf
+				* chan->backend.subbuf_size;
+	} else {
+		mmap_buf_len = chan->backend.buf_size;
+		if (chan->backend.extra_reader_sb)
+			mmap_buf_len += chan->backend.subbuf_size;
+	}
 	if (mmap_buf_len > INT_MAX)
 		return -EFBIG;
 	*len = mmap_buf_len;
@@ -1386,31 +1479,44 @@ int ustctl_get_max_subbuf_size(struct ustctl_consumer_stream *stream,
  * get_next/put_next).
  */
 
-/* returns the offset of the subbuffer belonging to the mmap reader. */
-int ustctl_get_mmap_read_offset(struct ustctl_consumer_stream *stream,
-		unsigned long *off)
+/* returns the backend pages of the subbuffer belonging to the reader. */
+static
+struct lttng_ust_lib_ring_buffer_backend_pages *
+	ustctl_get_read_pages(struct ustctl_consumer_stream *stream)
 {
 	struct channel *chan;
 	unsigned long sb_bindex;
 	struct lttng_ust_lib_ring_buffer *buf;
 	struct ustctl_consumer_channel *consumer_chan;
 	struct lttng_ust_lib_ring_buffer_backend_pages_shmp *barray_idx;
-	struct lttng_ust_lib_ring_buffer_backend_pages *pages;
 
-	if (!stream)
-		return -EINVAL;
 	buf = stream->buf;
 	consumer_chan = stream->chan;
 	chan = consumer_chan->chan->chan;
-	if (chan->backend.config.output != RING_BUFFER_MMAP)
-		return -EINVAL;
 	sb_bindex = subbuffer_id_get_index(&chan->backend.config,
 					buf->backend.buf_rsb.id);
 	barray_idx = shmp_index(consumer_chan->chan->handle, buf->backend.array,
 			sb_bindex);
 	if (!barray_idx)
+		return NULL;
+	return shmp(consumer_chan->chan->handle, barray_idx->shmp);
+}
+
+/* returns the offset of the subbuffer belonging to the mmap reader. */
+int ustctl_get_mmap_read_offset(struct ustctl_consumer_stream *stream,
+		unsigned long *off)
+{
+	struct channel *chan;
+	struct ustctl_consumer_channel *consumer_chan;
+	struct lttng_ust_lib_ring_buffer_backend_pages *pages;
+
+	if (!stream)
 		return -EINVAL;
-	pages = shmp(consumer_chan->chan->handle, barray_idx->shmp);
+	consumer_chan = stream->chan;
+	chan = consumer_chan->chan->chan;
+	if (chan->backend.config.output != RING_BUFFER_MMAP)
+		return -EINVAL;
+	pages = ustctl_get_read_pages(stream);
 	if (!pages)
 		return -EINVAL;
 	*off = pages->mmap_offset;
@@ -1470,6 +1576,116 @@ int ustctl_get_next_subbuf(struct ustctl_consumer_stream *stream)
 }
 
 
+int ustctl_stream_wait_wakeup(struct ustctl_consumer_stream *stream,
+		int timeout_ms)
+{
+	struct ustctl_consumer_channel *consumer_chan;
+
+	if (!stream)
+		return -EINVAL;
+	consumer_chan = stream->chan;
+	return lib_ring_buffer_wait_wakeup(stream->buf,
+			consumer_chan->chan->handle, timeout_ms);
+}
+
+/*
+ * The splice pipe is created on first use, sized to hold a whole
+ * sub-buffer when the system allows it.
+ */
+static
+int ustctl_stream_get_splice_pipe(struct ustctl_consumer_stream *stream)
+{
+	struct channel *chan = stream->chan->chan->chan;
+	int ret;
+
+	if (stream->splice_pipe[0] >= 0)
+		return 0;
+	ret = pipe2(stream->splice_pipe, O_CLOEXEC);
+	if (ret < 0) {
+		ret = -errno;
+		PERROR("pipe2");
+		stream->splice_pipe[0] = -1;
+		stream->splice_pipe[1] = -1;
+		return ret;
+	}
+	/* Best effort: splice in smaller chunks otherwise. */
+	(void) fcntl(stream->splice_pipe[1], F_SETPIPE_SZ,
+			(int) chan->backend.subbuf_size);
+	return 0;
+}
+
+ssize_t ustctl_splice_subbuf(struct ustctl_consumer_stream *stream,
+		int out_fd)
+{
+	struct lttng_ust_lib_ring_buffer_backend_pages *pages;
+	unsigned long len;
+	size_t moved = 0;
+	loff_t shm_offset;
+	ssize_t ret;
+	int shm_fd;
+
+	if (!stream || out_fd < 0)
+		return -EINVAL;
+	pages = ustctl_get_read_pages(stream);
+	if (!pages)
+		return -EINVAL;
+	ret = ustctl_get_padded_subbuf_size(stream, &len);
+	if (ret)
+		return ret;
+	ret = ustctl_stream_get_splice_pipe(stream);
+	if (ret)
+		return ret;
+
+	/*
+	 * The sub-buffer pages follow the buffer structures in their shm
+	 * object: their offset within that object is the file offset.
+	 * With a sub-buffer pool, it may be another stream's object.
+	 */
+	shm_fd = shm_get_shm_fd(stream->chan->chan->handle, &pages->p._ref);
+	if (shm_fd < 0)
+		return -EINVAL;
+	shm_offset = pages->p._ref.offset;
+	while (moved < len) {
+		ssize_t in, out;
+
+		in = splice(shm_fd, &shm_offset,
+				stream->splice_pipe[1], NULL, len - moved,
+				SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (in < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			PERROR("splice");
+			goto error;
+		}
+		if (in == 0) {
+			/* Stream file shorter than the buffer layout. */
+			ret = -EIO;
+			goto error;
+		}
+		while (in > 0) {
+			out = splice(stream->splice_pipe[0], NULL, out_fd,
+					NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (out < 0) {
+				if (errno == EINTR)
+					continue;
+				ret = -errno;
+				PERROR("splice");
+				goto error_pipe;
+			}
+			in -= out;
+			moved += out;
+		}
+	}
+	return moved;
+
+error_pipe:
+	/* Drop the data left in the pipe with the pipe itself. */
+	ustctl_stream_close_splice_pipe(stream);
+error:
+	return ret;
+}
+
 /* Release exclusive sub-buffer access, move consumer forward. */
 int ustctl_put_next_subbuf(struct ustctl_consumer_stream *stream)
 {
@@ -1500,6 +1716,37 @@ int ustctl_snapshot(struct ustctl_consumer_stream *stream)
 			&buf->prod_snapshot, consumer_chan->chan->handle);
 }
 
+int ustctl_snapshot_incremental(struct ustctl_consumer_stream *stream,
+		unsigned long *nr_lost)
+{
+	struct lttng_ust_lib_ring_buffer *buf;
+	struct ustctl_consumer_channel *consumer_chan;
+	int ret;
+
+	if (!stream || !nr_lost)
+		return -EINVAL;
+	buf = stream->buf;
+	consumer_chan = stream->chan;
+	ret = lib_ring_buffer_snapshot_incremental(buf, &buf->cons_snapshot,
+			&buf->prod_snapshot,
+			stream->has_last_snapshot ?
+				&stream->last_snapshot_produced : NULL,
+			nr_lost, consumer_chan->chan->handle);
+	if (ret)
+		return ret;
+	stream->last_snapshot_produced = buf->prod_snapshot;
+	stream->has_last_snapshot = 1;
+	return 0;
+}
+
+int ustctl_snapshot_incremental_reset(struct ustctl_consumer_stream *stream)
+{
+	if (!stream)
+		return -EINVAL;
+	stream->has_last_snapshot = 0;
+	return 0;
+}
+
 /* Get the consumer position (iteration start) */
 int ustctl_snapshot_get_consumed(struct ustctl_consumer_stream *stream,
 		unsigned long *pos)
@@ -1564,9 +1811,11 @@ void ustctl_flush_buffer(struct ustctl_consumer_stream *stream,
 	assert(stream);
 	buf = stream->buf;
 	consumer_chan = stream->chan;
-	lib_ring_buffer_switch_slow(buf,
-		producer_active ? SWITCH_ACTIVE : SWITCH_FLUSH,
-		consumer_chan->chan->handle);
+	if (lib_ring_buffer_switch_slow(buf,
+			producer_active ? SWITCH_ACTIVE : SWITCH_FLUSH,
+			consumer_chan->chan->handle))
+		v_inc(&consumer_chan->chan->chan->backend.config,
+			&buf->stats.switch_flush);
 }
 
 static
@@ -1743,6 +1992,61 @@ int ustctl_get_instance_id(struct ustctl_consumer_stream *stream,
 	return client_cb->instance_id(buf, handle, id);
 }
 
+int ustctl_get_stats(struct ustctl_consumer_stream *stream,
+		struct ustctl_stream_stats *stats)
+{
+	const struct lttng_ust_lib_ring_buffer_config *config;
+	struct lttng_ust_lib_ring_buffer *buf;
+
+	if (!stream || !stats)
+		return -EINVAL;
+	buf = stream->buf;
+	config = &stream->chan->chan->chan->backend.config;
+	memset(stats, 0, sizeof(*stats));
+	stats->reserve_slow = lib_ring_buffer_get_reserve_slow(config, buf);
+	stats->reserve_retry = lib_ring_buffer_get_reserve_retry(config, buf);
+	stats->switch_timer = lib_ring_buffer_get_switch_timer(config, buf);
+	stats->switch_flush = lib_ring_buffer_get_switch_flush(config, buf);
+	stats->records_lost_full =
+		lib_ring_buffer_get_records_lost_full(config, buf);
+	stats->records_lost_wrap =
+		lib_ring_buffer_get_records_lost_wrap(config, buf);
+	stats->records_lost_big =
+		lib_ring_buffer_get_records_lost_big(config, buf);
+	stats->records_count = lib_ring_buffer_get_records_count(config, buf);
+	stats->records_overrun =
+		lib_ring_buffer_get_records_overrun(config, buf);
+	stats->records_truncated =
+		lib_ring_buffer_get_records_truncated(config, buf);
+	return 0;
+}
+
+int ustctl_get_packet_index(struct ustctl_consumer_stream *stream,
+		struct ustctl_packet_index_entry *entries, size_t *count)
+{
+	struct lttng_ust_lib_ring_buffer_packet_index *index;
+	struct lttng_ust_lib_ring_buffer *buf;
+	struct lttng_ust_shm_handle *handle;
+	size_t i, nr_entries;
+
+	if (!stream || !count || (*count && !entries))
+		return -EINVAL;
+	buf = stream->buf;
+	handle = stream->chan->chan->handle;
+	index = lib_ring_buffer_read_packet_index(&buf->backend, handle);
+	if (!index)
+		return -ENOENT;
+	nr_entries = CMM_LOAD_SHARED(index->nr_entries);
+	if (nr_entries > RB_PACKET_INDEX_ENTRIES)
+		return -EINVAL;
+	for (i = 0; i < nr_entries && i < *count; i++) {
+		entries[i].offset = index->entries[i].offset;
+		entries[i].timestamp = index->entries[i].timestamp;
+	}
+	*count = nr_entries;
+	return 0;
+}
+
 #ifdef LTTNG_UST_HAVE_PERF_EVENT
 
 int ustctl_has_perf_counters(void)
@@ -2172,6 +2476,9 @@ int ustctl_reply_register_channel(int sock,
 	case USTCTL_CHANNEL_HEADER_LARGE:
 		reply.r.header_type = 2;
 		break;
+	case USTCTL_CHANNEL_HEADER_VARINT:
+		reply.r.header_type = 3;
+		break;
 	default:
 		reply.r.header_type = 0;
 		break;
@@ -2211,12 +2518,15 @@ void ustctl_init(void)
 	lttng_ring_buffer_client_overwrite_rt_init();
 	lttng_ring_buffer_client_discard_init();
 	lttng_ring_buffer_client_discard_rt_init();
-	lib_ringbuffer_signal_init();
+	lttng_ring_buffer_client_overwrite_pt_init();
+	lttng_ring_buffer_client_discard_pt_init();
 }
 
 static __attribute__((destructor))
 void ustctl_exit(void)
 {
+	lttng_ring_buffer_client_discard_pt_exit();
+	lttng_ring_buffer_client_overwrite_pt_exit();
 	lttng_ring_buffer_client_discard_rt_exit();
 	lttng_ring_buffer_client_discard_exit();
 	lttng_ring_buffer_client_overwrite_rt_exit();
@@ -58,6 +58,7 @@
 #include "lttng-tracer.h"
 #include "lttng-tracer-core.h"
 #include "lttng-ust-statedump.h"
+#include "lttng-local-session.h"
 #include "wait.h"
 #include "../libringbuffer/shm.h"
 #include "jhash.h"
@@ -209,6 +210,19 @@ void unregister_event(struct lttng_event *event)
 		event->registered = 0;
 }
 
+/*
+ * Report the events suppressed by rate limits of @session which have not
+ * been summarized yet. Used before the session stops recording.
+ */
+static
+void lttng_session_flush_rate_limits(struct lttng_session *session)
+{
+	struct lttng_event *event;
+
+	cds_list_for_each_entry(event, &session->events_head, node)
+		lttng_event_flush_rate_limit(event);
+}
+
 /*
  * Only used internally at session destruction.
  */
@@ -226,6 +240,8 @@ void lttng_session_destroy(struct lttng_session *session)
 	struct lttng_enum *_enum, *tmp_enum;
 	struct lttng_enabler *enabler, *tmpenabler;
 
+	if (session->active)
+		lttng_session_flush_rate_limits(session);
 	CMM_ACCESS_ONCE(session->active) = 0;
 	cds_list_for_each_entry(event, &session->events_head, node) {
 		_lttng_event_unregister(event);
@@ -259,7 +275,8 @@ int lttng_enum_create(const struct lttng_enum_desc *desc,
 	int ret = 0;
 	size_t name_len = strlen(enum_name);
 	uint32_t hash;
-	int notify_socket;
+	int notify_socket = -1;
+	struct lttng_local_session *ls;
 
 	hash = jhash(enum_name, name_len, 0);
 	head = &session->enums_ht.table[hash & (LTTNG_UST_ENUM_HT_SIZE - 1)];
@@ -272,10 +289,13 @@ int lttng_enum_create(const struct lttng_enum_desc *desc,
 		}
 	}
 
-	notify_socket = lttng_get_notify_socket(session->owner);
-	if (notify_socket < 0) {
-		ret = notify_socket;
-		goto socket_error;
+	ls = lttng_local_session_find(session);
+	if (!ls) {
+		notify_socket = lttng_get_notify_socket(session->owner);
+		if (notify_socket < 0) {
+			ret = notify_socket;
+			goto socket_error;
+		}
 	}
 
 	_enum = zmalloc(sizeof(*_enum));
@@ -286,12 +306,15 @@ int lttng_enum_create(const struct lttng_enum_desc *desc,
 	_enum->session = session;
 	_enum->desc = desc;
 
-	ret = ustcomm_register_enum(notify_socket,
-		session->objd,
-		enum_name,
-		desc->nr_entries,
-		desc->entries,
-		&_enum->id);
+	if (ls)
+		ret = lttng_local_register_enum(ls, desc, &_enum->id);
+	else
+		ret = ustcomm_register_enum(notify_socket,
+			session->objd,
+			enum_name,
+			desc->nr_entries,
+			desc->entries,
+			&_enum->id);
 	if (ret < 0) {
 		DBG("Error (%d) registering enumeration to sessiond", ret);
 		goto sessiond_register_error;
@@ -392,6 +415,9 @@ int lttng_create_all_ctx_enums(size_t nr_fields,
  */
 int lttng_session_statedump(struct lttng_session *session)
 {
+	/* Local sessions have no listener thread to perform it. */
+	if (lttng_local_session_find(session))
+		return 0;
 	session->statedump_pending = 1;
 	lttng_ust_sockinfo_session_enabled(session->owner);
 	return 0;
@@ -401,16 +427,20 @@ int lttng_session_enable(struct lttng_session *session)
 {
 	int ret = 0;
 	struct lttng_channel *chan;
-	int notify_socket;
+	int notify_socket = -1;
+	struct lttng_local_session *ls;
 
 	if (session->active) {
 		ret = -EBUSY;
 		goto end;
 	}
 
-	notify_socket = lttng_get_notify_socket(session->owner);
-	if (notify_socket < 0)
-		return notify_socket;
+	ls = lttng_local_session_find(session);
+	if (!ls) {
+		notify_socket = lttng_get_notify_socket(session->owner);
+		if (notify_socket < 0)
+			return notify_socket;
+	}
 
 	/* Set transient enabler state to "enabled" */
 	session->tstate = 1;
@@ -439,14 +469,18 @@ int lttng_session_enable(struct lttng_session *session)
 				return ret;
 			}
 		}
-		ret = ustcomm_register_channel(notify_socket,
-			session,
-			session->objd,
-			chan->objd,
-			nr_fields,
-			fields,
-			&chan_id,
-			&chan->header_type);
+		if (ls)
+			ret = lttng_local_register_channel(ls, chan,
+				&chan_id, &chan->header_type);
+		else
+			ret = ustcomm_register_channel(notify_socket,
+				session,
+				session->objd,
+				chan->objd,
+				nr_fields,
+				fields,
+				&chan_id,
+				&chan->header_type);
 		if (ret) {
 			DBG("Error (%d) registering channel to sessiond", ret);
 			return ret;
@@ -480,6 +514,8 @@ int lttng_session_disable(struct lttng_session *session)
 		ret = -EBUSY;
 		goto end;
 	}
+	/* Report suppressed events while the session still records. */
+	lttng_session_flush_rate_limits(session);
 	/* Set atomically the state to "inactive" */
 	CMM_ACCESS_ONCE(session->active) = 0;
 
@@ -524,6 +560,19 @@ end:
 	return ret;
 }
 
+/*
+ * Events hash table key, using the name hash emitted by the event
+ * descriptor if any.
+ */
+static
+uint32_t lttng_event_desc_hash(const struct lttng_event_desc *desc)
+{
+	if (desc->u.ext.name_len)
+		return lttng_ust_name_hash_final(desc->u.ext.name_hash,
+				desc->u.ext.name_len);
+	return lttng_ust_name_hash(desc->name, strlen(desc->name));
+}
+
 /*
  * Supports event creation while tracing session is active.
  */
@@ -537,12 +586,12 @@ int lttng_event_create(const struct lttng_event_desc *desc,
 	struct cds_hlist_head *head;
 	struct cds_hlist_node *node;
 	int ret = 0;
-	size_t name_len = strlen(event_name);
 	uint32_t hash;
-	int notify_socket, loglevel;
+	int notify_socket = -1, loglevel;
 	const char *uri;
+	struct lttng_local_session *ls;
 
-	hash = jhash(event_name, name_len, 0);
+	hash = lttng_event_desc_hash(desc);
 	head = &chan->session->events_ht.table[hash & (LTTNG_UST_EVENT_HT_SIZE - 1)];
 	cds_hlist_for_each_entry(event, node, head, hlist) {
 		assert(event->desc);
@@ -554,10 +603,13 @@ int lttng_event_create(const struct lttng_event_desc *desc,
 		}
 	}
 
-	notify_socket = lttng_get_notify_socket(session->owner);
-	if (notify_socket < 0) {
-		ret = notify_socket;
-		goto socket_error;
+	ls = lttng_local_session_find(session);
+	if (!ls) {
+		notify_socket = lttng_get_notify_socket(session->owner);
+		if (notify_socket < 0) {
+			ret = notify_socket;
+			goto socket_error;
+		}
 	}
 
 	ret = lttng_create_all_event_enums(desc->nr_fields, desc->fields,
@@ -594,17 +646,20 @@ int lttng_event_create(const struct lttng_event_desc *desc,
 		uri = NULL;
 
 	/* Fetch event ID from sessiond */
-	ret = ustcomm_register_event(notify_socket,
-		session,
-		session->objd,
-		chan->objd,
-		event_name,
-		loglevel,
-		desc->signature,
-		desc->nr_fields,
-		desc->fields,
-		uri,
-		&event->id);
+	if (ls)
+		ret = lttng_local_register_event(ls, chan, desc, &event->id);
+	else
+		ret = ustcomm_register_event(notify_socket,
+			session,
+			session->objd,
+			chan->objd,
+			event_name,
+			loglevel,
+			desc->signature,
+			desc->nr_fields,
+			desc->fields,
+			uri,
+			&event->id);
 	if (ret < 0) {
 		DBG("Error (%d) registering event to sessiond", ret);
 		goto sessiond_register_error;
@@ -760,20 +815,16 @@ void lttng_create_event_if_missing(struct lttng_enabler *enabler)
 			int found = 0, ret;
 			struct cds_hlist_head *head;
 			struct cds_hlist_node *node;
-			const char *event_name;
-			size_t name_len;
 			uint32_t hash;
 
 			desc = probe_desc->event_desc[i];
 			if (!lttng_desc_match_enabler(desc, enabler))
 				continue;
-			event_name = desc->name;
-			name_len = strlen(event_name);
 
 			/*
 			 * Check if already created.
 			 */
-			hash = jhash(event_name, name_len, 0);
+			hash = lttng_event_desc_hash(desc);
 			head = &session->events_ht.table[hash & (LTTNG_UST_EVENT_HT_SIZE - 1)];
 			cds_hlist_for_each_entry(event, node, head, hlist) {
 				if (event->desc == desc
@@ -895,6 +946,7 @@ void _lttng_event_destroy(struct lttng_event *event)
 	cds_list_del(&event->node);
 	lttng_destroy_context(event->ctx);
 	lttng_free_event_filter_runtime(event);
+	lttng_event_free_rate_limit(event);
 	/* Free event enabler refs */
 	cds_list_for_each_entry_safe(enabler_ref, tmp_enabler_ref,
 			&event->enablers_ref_head, node)
@@ -974,6 +1026,16 @@ int lttng_enabler_attach_exclusion(struct lttng_enabler *enabler,
 	return 0;
 }
 
+int lttng_enabler_attach_rate_limit(struct lttng_enabler *enabler,
+		struct lttng_ust_rate_limit *rate_limit)
+{
+	if (rate_limit->rate && !rate_limit->burst)
+		return -EINVAL;
+	memcpy(&enabler->rate_limit, rate_limit, sizeof(enabler->rate_limit));
+	lttng_session_lazy_sync_enablers(enabler->chan->session);
+	return 0;
+}
+
 int lttng_attach_context(struct lttng_ust_context *context_param,
 		union ust_args *uargs,
 		struct lttng_ctx **ctx, struct lttng_session *session)
@@ -1079,7 +1141,9 @@ void lttng_session_sync_enablers(struct lttng_session *session)
 	cds_list_for_each_entry(event, &session->events_head, node) {
 		struct lttng_enabler_ref *enabler_ref;
 		struct lttng_bytecode_runtime *runtime;
+		struct lttng_ust_rate_limit limit;
 		int enabled = 0, has_enablers_without_bytecode = 0;
+		int unlimited = 0;
 
 		/* Enable events */
 		cds_list_for_each_entry(enabler_ref,
@@ -1126,7 +1190,33 @@ void lttng_session_sync_enablers(struct lttng_session *session)
 				&event->bytecode_runtime_head, node) {
 			lttng_filter_sync_state(runtime);
 		}
+
+		/*
+		 * Rate limit is the most permissive among enabled
+		 * enablers: any enabler without rate limit lifts it.
+		 */
+		memset(&limit, 0, sizeof(limit));
+		cds_list_for_each_entry(enabler_ref,
+				&event->enablers_ref_head, node) {
+			struct lttng_ust_rate_limit *rl =
+				&enabler_ref->ref->rate_limit;
+
+			if (!enabler_ref->ref->enabled)
+				continue;
+			if (!rl->rate) {
+				unlimited = 1;
+				break;
+			}
+			if (rl->rate > limit.rate)
+				limit.rate = rl->rate;
+			if (rl->burst > limit.burst)
+				limit.burst = rl->burst;
+		}
+		if (unlimited)
+			memset(&limit, 0, sizeof(limit));
+		lttng_event_sync_rate_limit(event, &limit);
 	}
+	lttng_rate_limit_prune_release_queue();
 	__tracepoint_probe_prune_release_queue();
 }
 
@@ -0,0 +1,857 @@
+/*
+ * lttng-local-session.c
+ *
+ * LTTng UST sessions created by the traced application itself, without
+ * session daemon. The CTF metadata normally produced by the session
+ * daemon from the registration messages is generated here.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#define _LGPL_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <urcu/list.h>
+#include <lttng/tracepoint.h>
+#include <lttng/ust-events.h>
+#include <lttng/ust-abi.h>
+#include <lttng/ust-version.h>
+#include <lttng/ust-dynamic-type.h>
+#include <lttng/ringbuffer-config.h>
+#include <usterr-signal-safe.h>
+#include <helper.h>
+
+#include "lttng-local-session.h"
+#include "lttng-tracer.h"
+#include "lttng-tracer-core.h"
+#include "tracepoint-internal.h"
+#include "clock.h"
+#include "compat.h"
+#include "getenv.h"
+
+#define NSEC_PER_SEC			1000000000ULL
+
+static CDS_LIST_HEAD(local_sessions);
+
+/*
+ * Metadata of one registration, accumulated in memory and written with
+ * a single write() so that a crash never leaves half a declaration in
+ * the metadata file.
+ */
+struct metadata_buf {
+	char *p;
+	size_t len;
+	size_t alloc;
+	int error;
+};
+
+static __attribute__((format(printf, 2, 3)))
+void metadata_printf(struct metadata_buf *mb, const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
+
+	if (mb->error)
+		return;
+	for (;;) {
+		size_t avail = mb->alloc - mb->len;
+		char *p;
+
+		va_start(ap, fmt);
+		ret = vsnprintf(mb->p ? mb->p + mb->len : NULL, avail, fmt, ap);
+		va_end(ap);
+		if (ret < 0) {
+			mb->error = -EINVAL;
+			return;
+		}
+		if ((size_t) ret < avail) {
+			mb->len += ret;
+			return;
+		}
+		p = realloc(mb->p, mb->len + ret + 4096);
+		if (!p) {
+			mb->error = -ENOMEM;
+			return;
+		}
+		mb->p = p;
+		mb->alloc = mb->len + ret + 4096;
+	}
+}
+
+static
+int metadata_flush(struct lttng_local_session *ls, struct metadata_buf *mb)
+{
+	size_t pos = 0;
+	int ret = mb->error;
+
+	if (ret)
+		goto end;
+	while (pos < mb->len) {
+		ssize_t len;
+
+		len = write(ls->metadata_fd, mb->p + pos, mb->len - pos);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			goto end;
+		}
+		pos += len;
+	}
+end:
+	free(mb->p);
+	mb->p = NULL;
+	mb->len = mb->alloc = 0;
+	mb->error = 0;
+	return ret;
+}
+
+static
+void print_tabs(struct metadata_buf *mb, size_t nesting)
+{
+	size_t i;
+
+	for (i = 0; i < nesting; i++)
+		metadata_printf(mb, "	");
+}
+
+/* Print a double-quoted string, escaping quotes and backslashes. */
+static
+void print_escaped(struct metadata_buf *mb, const char *str)
+{
+	metadata_printf(mb, "\"");
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			metadata_printf(mb, "\\");
+		metadata_printf(mb, "%c", *str);
+	}
+	metadata_printf(mb, "\"");
+}
+
+static
+void print_uuid(struct metadata_buf *mb, const unsigned char *uuid)
+{
+	metadata_printf(mb,
+		"%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+		uuid[0], uuid[1], uuid[2], uuid[3],
+		uuid[4], uuid[5], uuid[6], uuid[7],
+		uuid[8], uuid[9], uuid[10], uuid[11],
+		uuid[12], uuid[13], uuid[14], uuid[15]);
+}
+
+static
+const char *encoding_str(enum lttng_string_encodings encoding)
+{
+	switch (encoding) {
+	case lttng_encode_UTF8:
+		return "UTF8";
+	case lttng_encode_ASCII:
+		return "ASCII";
+	case lttng_encode_none:
+	default:
+		return "none";
+	}
+}
+
+static
+const char *byte_order_str(unsigned int reverse_byte_order)
+{
+	if (!reverse_byte_order)
+		return "";
+#if (BYTE_ORDER == BIG_ENDIAN)
+	return " byte_order = le;";
+#else
+	return " byte_order = be;";
+#endif
+}
+
+static
+void print_integer(struct metadata_buf *mb, const struct lttng_integer_type *it)
+{
+	metadata_printf(mb,
+		"integer { size = %u; align = %u; signed = %u; encoding = %s; base = %u;%s }",
+		it->size, it->alignment, it->signedness,
+		encoding_str(it->encoding), it->base,
+		byte_order_str(it->reverse_byte_order));
+}
+
+static
+void print_enum_value(struct metadata_buf *mb, const struct lttng_enum_value *value)
+{
+	if (value->signedness)
+		metadata_printf(mb, "%lld", (long long) value->value);
+	else
+		metadata_printf(mb, "%llu", value->value);
+}
+
+static
+int print_enum(struct metadata_buf *mb, const char *name,
+		const struct lttng_enum_desc *desc,
+		const struct lttng_integer_type *container,
+		size_t nesting)
+{
+	unsigned int i;
+
+	print_tabs(mb, nesting);
+	metadata_printf(mb, "enum : ");
+	print_integer(mb, container);
+	metadata_printf(mb, " {\n");
+	for (i = 0; i < desc->nr_entries; i++) {
+		const struct lttng_enum_entry *entry = &desc->entries[i];
+
+		print_tabs(mb, nesting + 1);
+		print_escaped(mb, entry->string);
+		if (entry->u.extra.options & LTTNG_ENUM_ENTRY_OPTION_IS_AUTO) {
+			metadata_printf(mb, ",\n");
+			continue;
+		}
+		metadata_printf(mb, " = ");
+		print_enum_value(mb, &entry->start);
+		if (entry->start.value != entry->end.value) {
+			metadata_printf(mb, " ... ");
+			print_enum_value(mb, &entry->end);
+		}
+		metadata_printf(mb, ",\n");
+	}
+	print_tabs(mb, nesting);
+	metadata_printf(mb, "} _%s;\n", name);
+	return 0;
+}
+
+static
+int print_field(struct metadata_buf *mb, const struct lttng_event_field *field,
+		size_t nesting);
+
+static
+int print_dynamic(struct metadata_buf *mb, const struct lttng_event_field *field,
+		size_t nesting)
+{
+	const struct lttng_event_field *tag, *choices;
+	char tag_name[LTTNG_UST_SYM_NAME_LEN];
+	size_t nr_choices, i;
+	int ret;
+
+	tag = lttng_ust_dynamic_type_tag_field();
+	if (!tag)
+		return -EINVAL;
+	ret = lttng_ust_dynamic_type_choices(&nr_choices, &choices);
+	if (ret)
+		return ret;
+	snprintf(tag_name, sizeof(tag_name), "%s_tag", field->name);
+	ret = print_enum(mb, tag_name, tag->type.u.basic.enumeration.desc,
+			&tag->type.u.basic.enumeration.container_type,
+			nesting);
+	if (ret)
+		return ret;
+	print_tabs(mb, nesting);
+	metadata_printf(mb, "variant <_%s> {\n", tag_name);
+	for (i = 0; i < nr_choices; i++) {
+		ret = print_field(mb, &choices[i], nesting + 1);
+		if (ret)
+			return ret;
+	}
+	print_tabs(mb, nesting);
+	metadata_printf(mb, "} _%s;\n", field->name);
+	return 0;
+}
+
+static
+int print_field(struct metadata_buf *mb, const struct lttng_event_field *field,
+		size_t nesting)
+{
+	const struct lttng_type *type = &field->type;
+
+	if (field->nowrite)
+		return 0;
+	switch (type->atype) {
+	case atype_integer:
+		print_tabs(mb, nesting);
+		print_integer(mb, &type->u.basic.integer);
+		metadata_printf(mb, " _%s;\n", field->name);
+		break;
+	case atype_float:
+	{
+		const struct lttng_float_type *ft = &type->u.basic._float;
+
+		print_tabs(mb, nesting);
+		metadata_printf(mb,
+			"floating_point { exp_dig = %u; mant_dig = %u; align = %u;%s } _%s;\n",
+			ft->exp_dig, ft->mant_dig, ft->alignment,
+			byte_order_str(ft->reverse_byte_order),
+			field->name);
+		break;
+	}
+	case atype_enum:
+		return print_enum(mb, field->name,
+				type->u.basic.enumeration.desc,
+				&type->u.basic.enumeration.container_type,
+				nesting);
+	case atype_array:
+		if (type->u.array.elem_type.atype != atype_integer)
+			return -EINVAL;
+		print_tabs(mb, nesting);
+		print_integer(mb, &type->u.array.elem_type.u.basic.integer);
+		metadata_printf(mb, " _%s[%u];\n", field->name,
+			type->u.array.length);
+		break;
+	case atype_sequence:
+		if (type->u.sequence.length_type.atype != atype_integer
+				|| type->u.sequence.elem_type.atype != atype_integer)
+			return -EINVAL;
+		print_tabs(mb, nesting);
+		print_integer(mb, &type->u.sequence.length_type.u.basic.integer);
+		metadata_printf(mb, " __%s_length;\n", field->name);
+		print_tabs(mb, nesting);
+		print_integer(mb, &type->u.sequence.elem_type.u.basic.integer);
+		metadata_printf(mb, " _%s[ __%s_length ];\n",
+			field->name, field->name);
+		break;
+	case atype_string:
+		print_tabs(mb, nesting);
+		if (type->u.basic.string.encoding == lttng_encode_ASCII)
+			metadata_printf(mb, "string { encoding = ASCII; }");
+		else
+			metadata_printf(mb, "string");
+		metadata_printf(mb, " _%s;\n", field->name);
+		break;
+	case atype_dynamic:
+		return print_dynamic(mb, field, nesting);
+	case atype_struct:
+		/* Only the empty structure is used, by dynamic "none". */
+		if (type->u._struct.nr_fields)
+			return -EINVAL;
+		print_tabs(mb, nesting);
+		metadata_printf(mb, "struct {} _%s;\n", field->name);
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static
+int64_t measure_clock_offset(void)
+{
+	uint64_t monotonic[2], realtime, freq;
+	struct timespec rts = { 0, 0 };
+
+	freq = trace_clock_freq();
+	monotonic[0] = trace_clock_read64();
+	if (clock_gettime(CLOCK_REALTIME, &rts) < 0)
+		return 0;
+	monotonic[1] = trace_clock_read64();
+	realtime = (uint64_t) rts.tv_sec * freq;
+	if (freq == NSEC_PER_SEC)
+		realtime += rts.tv_nsec;
+	else
+		realtime += (uint64_t) rts.tv_nsec * freq / NSEC_PER_SEC;
+	return (int64_t) realtime - (int64_t) ((monotonic[0] + monotonic[1]) >> 1);
+}
+
+/*
+ * Trace-wide declarations: type aliases, trace, environment and clock
+ * blocks, packet context and event headers. Matches the layout written
+ * by the ring buffer client (lttng-ring-buffer-client.h).
+ */
+static
+int write_trace_metadata(struct lttng_local_session *ls)
+{
+	struct metadata_buf mb = { 0 };
+	char hostname[HOST_NAME_MAX + 1] = "";
+	char procname[LTTNG_UST_PROCNAME_LEN] = "";
+	char clock_uuid[LTTNG_UST_UUID_STR_LEN];
+	const char *clock_name;
+
+	(void) gethostname(hostname, sizeof(hostname));
+	hostname[HOST_NAME_MAX] = '\0';
+	lttng_ust_getprocname(procname);
+	procname[LTTNG_UST_PROCNAME_LEN - 1] = '\0';
+	clock_name = trace_clock_name();
+
+	metadata_printf(&mb,
+		"/* CTF %u.%u */\n\n"
+		"typealias integer { size = 8; align = %u; signed = false; } := uint8_t;\n"
+		"typealias integer { size = 16; align = %u; signed = false; } := uint16_t;\n"
+		"typealias integer { size = 32; align = %u; signed = false; } := uint32_t;\n"
+		"typealias integer { size = 64; align = %u; signed = false; } := uint64_t;\n"
+		"typealias integer { size = %u; align = %u; signed = false; } := unsigned long;\n"
+		"typealias integer { size = 3; align = 1; signed = false; } := uint3_t;\n"
+		"typealias integer { size = 5; align = 1; signed = false; } := uint5_t;\n"
+		"typealias integer { size = 27; align = 1; signed = false; } := uint27_t;\n"
+		"\n"
+		"trace {\n"
+		"	major = %u;\n"
+		"	minor = %u;\n"
+		"	uuid = \"",
+		CTF_SPEC_MAJOR, CTF_SPEC_MINOR,
+		(unsigned int) lttng_alignof(uint8_t) * CHAR_BIT,
+		(unsigned int) lttng_alignof(uint16_t) * CHAR_BIT,
+		(unsigned int) lttng_alignof(uint32_t) * CHAR_BIT,
+		(unsigned int) lttng_alignof(uint64_t) * CHAR_BIT,
+		(unsigned int) sizeof(unsigned long) * CHAR_BIT,
+		(unsigned int) lttng_alignof(unsigned long) * CHAR_BIT,
+		CTF_SPEC_MAJOR, CTF_SPEC_MINOR);
+	print_uuid(&mb, ls->uuid);
+	metadata_printf(&mb,
+		"\";\n"
+		"	byte_order = %s;\n"
+		"	packet.header := struct {\n"
+		"		uint32_t magic;\n"
+		"		uint8_t  uuid[16];\n"
+		"		uint32_t stream_id;\n"
+		"		uint64_t stream_instance_id;\n"
+		"	};\n"
+		"};\n\n",
+#if (BYTE_ORDER == BIG_ENDIAN)
+		"be"
+#else
+		"le"
+#endif
+		);
+
+	metadata_printf(&mb, "env {\n	hostname = ");
+	print_escaped(&mb, hostname);
+	metadata_printf(&mb,
+		";\n"
+		"	domain = \"ust\";\n"
+		"	tracer_name = \"lttng-ust\";\n"
+		"	tracer_major = %u;\n"
+		"	tracer_minor = %u;\n"
+		"	vpid = %d;\n"
+		"	procname = ",
+		LTTNG_UST_MAJOR_VERSION, LTTNG_UST_MINOR_VERSION,
+		(int) getpid());
+	print_escaped(&mb, procname);
+	metadata_printf(&mb, ";\n};\n\n");
+
+	metadata_printf(&mb, "clock {\n	name = \"%s\";\n", clock_name);
+	if (!trace_clock_uuid(clock_uuid))
+		metadata_printf(&mb, "	uuid = \"%s\";\n", clock_uuid);
+	metadata_printf(&mb, "	description = ");
+	print_escaped(&mb, trace_clock_description());
+	metadata_printf(&mb,
+		";\n"
+		"	freq = %" PRIu64 ";\n"
+		"	offset = %" PRId64 ";\n"
+		"};\n\n",
+		trace_clock_freq(), measure_clock_offset());
+
+	metadata_printf(&mb,
+		"typealias integer {\n"
+		"	size = 27; align = 1; signed = false;\n"
+		"	map = clock.%s.value;\n"
+		"} := uint27_clock_monotonic_t;\n\n"
+		"typealias integer {\n"
+		"	size = 32; align = %u; signed = false;\n"
+		"	map = clock.%s.value;\n"
+		"} := uint32_clock_monotonic_t;\n\n"
+		"typealias integer {\n"
+		"	size = 64; align = %u; signed = false;\n"
+		"	map = clock.%s.value;\n"
+		"} := uint64_clock_monotonic_t;\n\n",
+		clock_name,
+		(unsigned int) lttng_alignof(uint32_t) * CHAR_BIT, clock_name,
+		(unsigned int) lttng_alignof(uint64_t) * CHAR_BIT, clock_name);
+
+	metadata_printf(&mb,
+		"struct packet_context {\n"
+		"	uint64_clock_monotonic_t timestamp_begin;\n"
+		"	uint64_clock_monotonic_t timestamp_end;\n"
+		"	uint64_t content_size;\n"
+		"	uint64_t packet_size;\n"
+		"	uint64_t packet_seq_num;\n"
+		"	unsigned long events_discarded;\n"
+		"	uint32_t cpu_id;\n"
+		"};\n\n"
+		"struct event_header_compact {\n"
+		"	enum : uint5_t { compact = 0 ... 30, extended = 31 } id;\n"
+		"	variant <id> {\n"
+		"		struct {\n"
+		"			uint27_clock_monotonic_t timestamp;\n"
+		"		} compact;\n"
+		"		struct {\n"
+		"			uint32_t id;\n"
+		"			uint64_clock_monotonic_t timestamp;\n"
+		"		} extended;\n"
+		"	} v;\n"
+		"} align(%u);\n\n"
+		"struct event_header_large {\n"
+		"	enum : uint16_t { compact = 0 ... 65534, extended = 65535 } id;\n"
+		"	variant <id> {\n"
+		"		struct {\n"
+		"			uint32_clock_monotonic_t timestamp;\n"
+		"		} compact;\n"
+		"		struct {\n"
+		"			uint32_t id;\n"
+		"			uint64_clock_monotonic_t timestamp;\n"
+		"		} extended;\n"
+		"	} v;\n"
+		"} align(%u);\n\n",
+		(unsigned int) lttng_alignof(uint32_t) * CHAR_BIT,
+		(unsigned int) lttng_alignof(uint16_t) * CHAR_BIT);
+
+	/* Unaligned fields, see lttng_write_event_header_varint(). */
+	metadata_printf(&mb,
+		"struct event_header_varint {\n"
+		"	enum : uint3_t { d8 = 0, d16 = 1, d24 = 2, d32 = 3, extended = 4 } len;\n"
+		"	uint5_t id;\n"
+		"	variant <len> {\n"
+		"		struct {\n"
+		"			integer { size = 8; align = 8; signed = false; map = clock.%s.value; } timestamp;\n"
+		"		} d8;\n"
+		"		struct {\n"
+		"			integer { size = 16; align = 8; signed = false; map = clock.%s.value; } timestamp;\n"
+		"		} d16;\n"
+		"		struct {\n"
+		"			integer { size = 24; align = 8; signed = false; map = clock.%s.value; } timestamp;\n"
+		"		} d24;\n"
+		"		struct {\n"
+		"			integer { size = 32; align = 8; signed = false; map = clock.%s.value; } timestamp;\n"
+		"		} d32;\n"
+		"		struct {\n"
+		"			integer { size = 32; align = 8; signed = false; } id;\n"
+		"			integer { size = 64; align = 8; signed = false; map = clock.%s.value; } timestamp;\n"
+		"		} extended;\n"
+		"	} v;\n"
+		"} align(8);\n\n",
+		clock_name, clock_name, clock_name, clock_name, clock_name);
+
+	return metadata_flush(ls, &mb);
+}
+
+static
+void generate_uuid(unsigned char *uuid)
+{
+	ssize_t len = -1;
+	int fd;
+
+	fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		len = lttng_ust_read(fd, uuid, LTTNG_UST_UUID_LEN);
+		(void) close(fd);
+	}
+	if (len != LTTNG_UST_UUID_LEN) {
+		uint64_t seed[2];
+
+		seed[0] = trace_clock_read64();
+		seed[1] = (uint64_t) getpid() << 32 | (uint32_t) time(NULL);
+		memcpy(uuid, seed, LTTNG_UST_UUID_LEN);
+	}
+	/* RFC 4122 version 4 (random) UUID. */
+	uuid[6] = (uuid[6] & 0x0F) | 0x40;
+	uuid[8] = (uuid[8] & 0x3F) | 0x80;
+}
+
+/*
+ * Create the trace directory <path>/<procname>-<pid>-<date>-<time> of
+ * a local session, so that the trace of a process is not overwritten
+ * by its successors.
+ */
+int lttng_local_session_create_dir(const char *path, char *dir, size_t len)
+{
+	char procname[LTTNG_UST_PROCNAME_LEN] = "";
+	char date[16];
+	time_t now;
+	struct tm tm;
+	int ret;
+
+	lttng_ust_getprocname(procname);
+	procname[LTTNG_UST_PROCNAME_LEN - 1] = '\0';
+	now = time(NULL);
+	if (!localtime_r(&now, &tm))
+		return -EINVAL;
+	strftime(date, sizeof(date), "%Y%m%d-%H%M%S", &tm);
+	ret = snprintf(dir, len, "%s/%s-%d-%s", path, procname,
+		(int) getpid(), date);
+	if (ret < 0 || ret >= len)
+		return -ENAMETOOLONG;
+	ret = mkdir(dir, S_IRWXU | S_IRGRP | S_IXGRP);
+	if (ret < 0 && errno != EEXIST) {
+		ret = -errno;
+		PERROR("mkdir %s", dir);
+		return ret;
+	}
+	return 0;
+}
+
+/* Create (or truncate) the file @name of the trace directory @dir. */
+int lttng_local_session_open_file(const char *dir, const char *name)
+{
+	char path[PATH_MAX];
+	int ret;
+
+	ret = snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if (ret < 0 || ret >= sizeof(path))
+		return -ENAMETOOLONG;
+	ret = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+		S_IRUSR | S_IWUSR);
+	if (ret < 0) {
+		ret = -errno;
+		PERROR("open %s", path);
+	}
+	return ret;
+}
+
+/*
+ * Positive integer read from environment variable @name, or
+ * @default_value if unset or invalid.
+ */
+size_t lttng_local_session_getenv_size(const char *name, size_t default_value)
+{
+	const char *str;
+	char *end;
+	unsigned long long value;
+
+	str = lttng_secure_getenv(name);
+	if (!str || !*str)
+		return default_value;
+	errno = 0;
+	value = strtoull(str, &end, 0);
+	if (errno || *end || !value) {
+		ERR("Invalid value \"%s\" for %s, using %zu", str, name,
+			default_value);
+		return default_value;
+	}
+	return value;
+}
+
+struct lttng_local_session *lttng_local_session_create(int metadata_fd)
+{
+	struct lttng_local_session *ls;
+
+	ls = zmalloc(sizeof(*ls));
+	if (!ls)
+		return NULL;
+	ls->metadata_fd = metadata_fd;
+	generate_uuid(ls->uuid);
+	if (write_trace_metadata(ls))
+		goto error;
+	ls->session = lttng_session_create();
+	if (!ls->session)
+		goto error;
+	ls->session->objd = -1;
+	cds_list_add(&ls->node, &local_sessions);
+	return ls;
+
+error:
+	free(ls);
+	return NULL;
+}
+
+/*
+ * Destroys the session and its channels. The metadata file descriptor
+ * and the channel stream file descriptors belong to the caller.
+ */
+void lttng_local_session_destroy(struct lttng_local_session *ls)
+{
+	cds_list_del(&ls->node);
+	lttng_session_destroy(ls->session);
+	free(ls);
+}
+
+struct lttng_channel *lttng_local_session_add_channel(
+		struct lttng_local_session *ls,
+		const char *transport_name,
+		size_t subbuf_size, size_t num_subbuf,
+		const int *stream_fds, int nr_stream_fds,
+		uint32_t flags)
+{
+	const struct lttng_transport *transport;
+	struct lttng_channel *chan;
+
+	if (ls->session->been_active)
+		return NULL;	/* Refuse to add channel to active session */
+	transport = lttng_transport_find(transport_name);
+	if (!transport) {
+		DBG("LTTng transport %s not found\n", transport_name);
+		return NULL;
+	}
+	chan = transport->ops.channel_create(transport_name, NULL,
+			subbuf_size, num_subbuf, 0, 0, ls->uuid,
+			ls->next_chan_id, stream_fds, nr_stream_fds,
+			flags, 0);
+	if (!chan)
+		return NULL;
+	ls->next_chan_id++;
+
+	/* Initialize our lttng chan, as lttng_abi_map_channel() does. */
+	chan->tstate = 1;
+	chan->enabled = 1;
+	chan->ctx = NULL;
+	chan->session = ls->session;
+	chan->objd = -1;
+	chan->ops = &transport->ops;
+	chan->header_type = 0;
+	chan->type = nr_stream_fds > 1 ?
+		LTTNG_UST_CHAN_PER_CPU : LTTNG_UST_CHAN_PER_THREAD;
+	cds_list_add(&chan->node, &ls->session->chan_head);
+	return chan;
+}
+
+static
+int enable_event(struct lttng_channel *chan, const char *pattern)
+{
+	struct lttng_ust_event param;
+	struct lttng_enabler *enabler;
+	enum lttng_enabler_type type;
+	size_t len = strlen(pattern);
+
+	if (!len || len >= LTTNG_UST_SYM_NAME_LEN)
+		return -EINVAL;
+	memset(&param, 0, sizeof(param));
+	param.instrumentation = LTTNG_UST_TRACEPOINT;
+	strcpy(param.name, pattern);
+	param.loglevel_type = LTTNG_UST_LOGLEVEL_ALL;
+	param.loglevel = -1;
+	if (pattern[len - 1] == '*')
+		type = LTTNG_ENABLER_WILDCARD;
+	else
+		type = LTTNG_ENABLER_EVENT;
+	enabler = lttng_enabler_create(type, &param, chan);
+	if (!enabler)
+		return -ENOMEM;
+	return lttng_enabler_enable(enabler);
+}
+
+/*
+ * Enable the events matching the comma-separated patterns of @list in
+ * @chan: a name ending with '*' is a wildcard, any other name matches
+ * a single event. All log levels are enabled.
+ */
+int lttng_local_session_enable_events(struct lttng_local_session *ls,
+		struct lttng_channel *chan, const char *list)
+{
+	char *patterns, *pattern, *saveptr = NULL;
+	int ret = 0;
+
+	patterns = strdup(list);
+	if (!patterns)
+		return -ENOMEM;
+	for (pattern = strtok_r(patterns, ",", &saveptr); pattern;
+			pattern = strtok_r(NULL, ",", &saveptr)) {
+		ret = enable_event(chan, pattern);
+		if (ret) {
+			ERR("Cannot enable event \"%s\"", pattern);
+			break;
+		}
+	}
+	free(patterns);
+	return ret;
+}
+
+/*
+ * Unlike sessions started by the session daemon, no state dump is
+ * performed: it is driven by the listener threads.
+ */
+int lttng_local_session_start(struct lttng_local_session *ls)
+{
+	return lttng_session_enable(ls->session);
+}
+
+struct lttng_local_session *lttng_local_session_find(
+		struct lttng_session *session)
+{
+	struct lttng_local_session *ls;
+
+	cds_list_for_each_entry(ls, &local_sessions, node) {
+		if (ls->session == session)
+			return ls;
+	}
+	return NULL;
+}
+
+/* Enumerations are declared inline within the event fields. */
+int lttng_local_register_enum(struct lttng_local_session *ls,
+		const struct lttng_enum_desc *desc, uint64_t *id)
+{
+	*id = ls->next_enum_id++;
+	return 0;
+}
+
+/* Local channels always use the varint event header. */
+int lttng_local_register_channel(struct lttng_local_session *ls,
+		struct lttng_channel *chan, uint32_t *chan_id,
+		int *header_type)
+{
+	struct metadata_buf mb = { 0 };
+	int ret;
+
+	metadata_printf(&mb,
+		"stream {\n"
+		"	id = %u;\n"
+		"	event.header := struct event_header_varint;\n"
+		"	packet.context := struct packet_context;\n"
+		"};\n\n",
+		chan->id);
+	ret = metadata_flush(ls, &mb);
+	if (ret)
+		return ret;
+	*chan_id = chan->id;
+	*header_type = 3;
+	return 0;
+}
+
+int lttng_local_register_event(struct lttng_local_session *ls,
+		struct lttng_channel *chan, const struct lttng_event_desc *desc,
+		uint32_t *id)
+{
+	struct metadata_buf mb = { 0 };
+	unsigned int i;
+	int loglevel, ret;
+
+	if (desc->loglevel)
+		loglevel = *(*desc->loglevel);
+	else
+		loglevel = TRACE_DEFAULT;
+	metadata_printf(&mb, "event {\n	name = ");
+	print_escaped(&mb, desc->name);
+	metadata_printf(&mb,
+		";\n"
+		"	id = %u;\n"
+		"	stream_id = %u;\n"
+		"	loglevel = %d;\n",
+		ls->next_event_id, chan->id, loglevel);
+	if (desc->u.ext.model_emf_uri) {
+		metadata_printf(&mb, "	model.emf.uri = ");
+		print_escaped(&mb, *desc->u.ext.model_emf_uri);
+		metadata_printf(&mb, ";\n");
+	}
+	metadata_printf(&mb, "	fields := struct {\n");
+	for (i = 0; i < desc->nr_fields; i++) {
+		ret = print_field(&mb, &desc->fields[i], 2);
+		if (ret) {
+			free(mb.p);
+			return ret;
+		}
+	}
+	metadata_printf(&mb, "	};\n};\n\n");
+	ret = metadata_flush(ls, &mb);
+	if (ret)
+		return ret;
+	*id = ls->next_event_id++;
+	return 0;
+}
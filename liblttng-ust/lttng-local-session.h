@@ -0,0 +1,76 @@
+#ifndef _LTTNG_LOCAL_SESSION_H
+#define _LTTNG_LOCAL_SESSION_H
+
+/*
+ * lttng-local-session.h
+ *
+ * LTTng UST sessions created by the traced application itself, without
+ * session daemon.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <urcu/list.h>
+#include <lttng/ust-events.h>
+
+/*
+ * A local session plays the part of the session daemon for its
+ * lttng_session: it assigns channel, event and enumeration IDs, and
+ * writes the CTF metadata describing them to metadata_fd. All functions
+ * below must be called with the ust lock held.
+ */
+struct lttng_local_session {
+	struct lttng_session *session;
+	int metadata_fd;
+	unsigned char uuid[LTTNG_UST_UUID_LEN];
+	uint32_t next_chan_id;
+	uint32_t next_event_id;
+	uint64_t next_enum_id;
+	struct cds_list_head node;	/* Local session list */
+};
+
+struct lttng_local_session *lttng_local_session_create(int metadata_fd);
+void lttng_local_session_destroy(struct lttng_local_session *ls);
+struct lttng_channel *lttng_local_session_add_channel(
+		struct lttng_local_session *ls,
+		const char *transport_name,
+		size_t subbuf_size, size_t num_subbuf,
+		const int *stream_fds, int nr_stream_fds,
+		uint32_t flags);
+int lttng_local_session_enable_events(struct lttng_local_session *ls,
+		struct lttng_channel *chan, const char *list);
+int lttng_local_session_start(struct lttng_local_session *ls);
+
+/* Helpers for the users of local sessions. */
+int lttng_local_session_create_dir(const char *path, char *dir, size_t len);
+int lttng_local_session_open_file(const char *dir, const char *name);
+size_t lttng_local_session_getenv_size(const char *name,
+		size_t default_value);
+
+/* Used by lttng-events.c in place of the session daemon notifications. */
+struct lttng_local_session *lttng_local_session_find(
+		struct lttng_session *session);
+int lttng_local_register_enum(struct lttng_local_session *ls,
+		const struct lttng_enum_desc *desc, uint64_t *id);
+int lttng_local_register_channel(struct lttng_local_session *ls,
+		struct lttng_channel *chan, uint32_t *chan_id,
+		int *header_type);
+int lttng_local_register_event(struct lttng_local_session *ls,
+		struct lttng_channel *chan, const struct lttng_event_desc *desc,
+		uint32_t *id);
+
+#endif /* _LTTNG_LOCAL_SESSION_H */
@@ -0,0 +1,303 @@
+/*
+ * lttng-rate-limit.c
+ *
+ * LTTng UST per-event rate limiting.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#define _LGPL_SOURCE
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <urcu/compiler.h>
+#include <urcu/system.h>
+#include <urcu/arch.h>
+#include <urcu/uatomic.h>
+#include <urcu/list.h>
+
+#include <lttng/ust-events.h>
+#include <helper.h>
+#include "clock.h"
+#include "../libringbuffer/smp.h"
+
+#define TRACEPOINT_CREATE_PROBES
+#define TRACEPOINT_DEFINE
+#include "lttng-ust-rate-limit-provider.h"
+
+#define NSEC_PER_SEC			1000000000ULL
+
+/* Minimum delay between two suppression summaries of a bucket. */
+#define RATE_LIMIT_SUMMARY_PERIOD	NSEC_PER_SEC
+
+/*
+ * Token bucket of one CPU. Credit is kept in nanoseconds: each allowed
+ * event consumes one interval worth of credit, and elapsed time is
+ * credited back up to the bucket capacity.
+ *
+ * The bucket is only ever updated by its owner of the "busy" flag. A
+ * thread finding the bucket busy (preempted owner, or nested signal
+ * handler on the same CPU) lets its event through rather than waiting.
+ */
+struct lttng_rate_limit_bucket {
+	int busy;
+	uint64_t last;			/* Time of last refill (ns) */
+	uint64_t credit;		/* Available credit (ns) */
+	unsigned long suppressed;	/* Suppressed since last summary */
+	uint64_t last_summary;		/* Time of last summary (ns) */
+} __attribute__((aligned(CAA_CACHE_LINE_SIZE)));
+
+struct lttng_rate_limit {
+	uint64_t rate;			/* Events per second, per CPU */
+	uint64_t burst;			/* Events */
+	uint64_t interval;		/* ns between two events */
+	uint64_t capacity;		/* Bucket capacity (ns) */
+	struct lttng_event *event;
+	struct cds_list_head node;	/* rate_limit_list or release queue */
+	int nr_cpus;
+	struct lttng_rate_limit_bucket buckets[];
+};
+
+/*
+ * Limits in use, walked by the channel timers to report trailing
+ * suppressed events. Protected by rate_limit_mutex.
+ */
+static CDS_LIST_HEAD(rate_limit_list);
+static pthread_mutex_t rate_limit_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Limits replaced by lttng_event_sync_rate_limit(), freed after a grace
+ * period by lttng_rate_limit_prune_release_queue(). Protected by the
+ * ust lock.
+ */
+static CDS_LIST_HEAD(rate_limit_release_queue);
+
+static
+struct lttng_rate_limit *rate_limit_create(struct lttng_event *event,
+		const struct lttng_ust_rate_limit *limit)
+{
+	struct lttng_rate_limit *rl;
+	uint64_t now, burst;
+	int nr_cpus, i;
+
+	nr_cpus = num_possible_cpus();
+	if (nr_cpus <= 0)
+		nr_cpus = 1;
+	rl = zmalloc(sizeof(*rl) + nr_cpus * sizeof(rl->buckets[0]));
+	if (!rl)
+		return NULL;
+	rl->event = event;
+	rl->rate = limit->rate;
+	rl->burst = limit->burst;
+	rl->interval = NSEC_PER_SEC / limit->rate;
+	if (!rl->interval)
+		rl->interval = 1;
+	/* Keep the capacity from overflowing. */
+	burst = limit->burst;
+	if (burst > UINT64_MAX / 2 / rl->interval)
+		burst = UINT64_MAX / 2 / rl->interval;
+	rl->capacity = burst * rl->interval;
+	rl->nr_cpus = nr_cpus;
+	now = trace_clock_read64_monotonic();
+	for (i = 0; i < nr_cpus; i++) {
+		rl->buckets[i].last = now;
+		rl->buckets[i].credit = rl->capacity;
+		rl->buckets[i].last_summary = now;
+	}
+	return rl;
+}
+
+/*
+ * Called from the probe, within the tracer RCU read-side critical
+ * section. Returns 1 if the event should be recorded, 0 if it is
+ * suppressed.
+ */
+int lttng_event_rate_limit(struct lttng_event *event)
+{
+	struct lttng_rate_limit *rl;
+	struct lttng_rate_limit_bucket *b;
+	unsigned long count = 0;
+	uint64_t now;
+	int cpu, allow = 1;
+
+	rl = CMM_LOAD_SHARED(event->rate_limit);
+	if (!rl)
+		return 1;
+	cmm_smp_read_barrier_depends();
+	cpu = lttng_ust_get_cpu();
+	if (caa_unlikely(cpu < 0))
+		cpu = 0;
+	b = &rl->buckets[cpu % rl->nr_cpus];
+	if (uatomic_cmpxchg(&b->busy, 0, 1) != 0)
+		return 1;
+	now = trace_clock_read64_monotonic();
+	if (now > b->last) {
+		uint64_t delta = now - b->last;
+
+		if (delta >= rl->capacity - b->credit)
+			b->credit = rl->capacity;
+		else
+			b->credit += delta;
+		b->last = now;
+	}
+	if (b->credit >= rl->interval) {
+		b->credit -= rl->interval;
+	} else {
+		uatomic_inc(&b->suppressed);
+		allow = 0;
+	}
+	if (caa_unlikely(CMM_LOAD_SHARED(b->suppressed))
+			&& now - b->last_summary >= RATE_LIMIT_SUMMARY_PERIOD) {
+		b->last_summary = now;
+		count = uatomic_xchg(&b->suppressed, 0);
+	}
+	uatomic_set(&b->busy, 0);
+	if (count)
+		tracepoint(lttng_ust_rate_limit, suppressed,
+			event->desc->name, (uint64_t) count);
+	return allow;
+}
+
+/*
+ * Report the events suppressed since the last summary of each bucket.
+ * Unless @force is set, buckets summarized by their writer within the
+ * summary period are left to it. Returns the number of events
+ * reported.
+ */
+static
+unsigned long rate_limit_flush(struct lttng_rate_limit *rl, int force)
+{
+	unsigned long total = 0;
+	uint64_t now;
+	int i;
+
+	now = trace_clock_read64_monotonic();
+	for (i = 0; i < rl->nr_cpus; i++) {
+		struct lttng_rate_limit_bucket *b = &rl->buckets[i];
+		unsigned long count;
+
+		if (!CMM_LOAD_SHARED(b->suppressed))
+			continue;
+		if (!force && now - CMM_LOAD_SHARED(b->last_summary)
+				< RATE_LIMIT_SUMMARY_PERIOD)
+			continue;
+		count = uatomic_xchg(&b->suppressed, 0);
+		if (!count)
+			continue;
+		tracepoint(lttng_ust_rate_limit, suppressed,
+			rl->event->desc->name, (uint64_t) count);
+		total += count;
+	}
+	return total;
+}
+
+/*
+ * Report the events suppressed by the rate limit of @event which have
+ * not been summarized yet. Called with the ust lock held. Returns the
+ * number of events reported.
+ */
+unsigned long lttng_event_flush_rate_limit(struct lttng_event *event)
+{
+	if (!event->rate_limit)
+		return 0;
+	return rate_limit_flush(event->rate_limit, 1);
+}
+
+/*
+ * Called periodically by the channel timers, so that events suppressed
+ * right before a burst ends are reported even if no event follows.
+ */
+void lttng_rate_limit_flush_all(void)
+{
+	struct lttng_rate_limit *rl;
+
+	pthread_mutex_lock(&rate_limit_mutex);
+	cds_list_for_each_entry(rl, &rate_limit_list, node)
+		rate_limit_flush(rl, 0);
+	pthread_mutex_unlock(&rate_limit_mutex);
+}
+
+/*
+ * Apply @limit to @event. Called with the ust lock held. A limit whose
+ * rate is 0 removes the event rate limit. The bucket state is kept when
+ * the parameters are unchanged. A replaced limit is queued for release:
+ * lttng_rate_limit_prune_release_queue() must be called once all
+ * events are synchronized.
+ */
+void lttng_event_sync_rate_limit(struct lttng_event *event,
+		const struct lttng_ust_rate_limit *limit)
+{
+	struct lttng_rate_limit *old, *new = NULL;
+
+	old = event->rate_limit;
+	if (!old && !limit->rate)
+		return;
+	if (old && old->rate == limit->rate && old->burst == limit->burst)
+		return;
+	if (limit->rate) {
+		new = rate_limit_create(event, limit);
+		if (!new)
+			return;	/* Keep previous limit. */
+	}
+	cmm_smp_wmb();
+	CMM_STORE_SHARED(event->rate_limit, new);
+	pthread_mutex_lock(&rate_limit_mutex);
+	if (new)
+		cds_list_add(&new->node, &rate_limit_list);
+	if (old)
+		cds_list_del(&old->node);
+	pthread_mutex_unlock(&rate_limit_mutex);
+	if (old)
+		cds_list_add(&old->node, &rate_limit_release_queue);
+}
+
+/*
+ * Free the limits replaced by lttng_event_sync_rate_limit(), after
+ * reporting what they suppressed. A single grace period covers all of
+ * them. Called with the ust lock held.
+ */
+void lttng_rate_limit_prune_release_queue(void)
+{
+	struct lttng_rate_limit *rl, *tmp;
+
+	if (cds_list_empty(&rate_limit_release_queue))
+		return;
+	synchronize_trace();
+	cds_list_for_each_entry_safe(rl, tmp, &rate_limit_release_queue,
+			node) {
+		cds_list_del(&rl->node);
+		rate_limit_flush(rl, 1);
+		free(rl);
+	}
+}
+
+/*
+ * Called on event teardown, after the event has been unregistered and
+ * a grace period has elapsed.
+ */
+void lttng_event_free_rate_limit(struct lttng_event *event)
+{
+	struct lttng_rate_limit *rl = event->rate_limit;
+
+	if (!rl)
+		return;
+	pthread_mutex_lock(&rate_limit_mutex);
+	cds_list_del(&rl->node);
+	pthread_mutex_unlock(&rate_limit_mutex);
+	rate_limit_flush(rl, 1);
+	free(rl);
+	event->rate_limit = NULL;
+}
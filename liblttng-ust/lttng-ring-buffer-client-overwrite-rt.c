@@ -33,4 +33,6 @@
 #define LTTNG_CLIENT_TYPE			LTTNG_CLIENT_OVERWRITE_RT
 #define LTTNG_CLIENT_CALLBACKS			lttng_client_callbacks_overwrite_rt
 #define LTTNG_CLIENT_WAKEUP			RING_BUFFER_WAKEUP_BY_TIMER
+#define LTTNG_CLIENT_ALLOC			RING_BUFFER_ALLOC_PER_CPU
+#define LTTNG_CLIENT_PACKET_CPU_ID		1
 #include "lttng-ring-buffer-client.h"
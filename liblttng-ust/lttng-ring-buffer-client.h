@@ -29,6 +29,10 @@
 
 #define LTTNG_COMPACT_EVENT_BITS       5
 #define LTTNG_COMPACT_TSC_BITS         27
+#define LTTNG_VARINT_LEN_BITS          3
+#define LTTNG_VARINT_EVENT_BITS        5
+#define LTTNG_VARINT_LEN_EXTENDED      4
+#define LTTNG_VARINT_TSC_MAX_LEN       4
 
 enum app_ctx_mode {
 	APP_CTX_DISABLED,
@@ -64,7 +68,9 @@ struct packet_header {
 						 * the beginning of the trace.
 						 * (may overflow)
 						 */
+#if LTTNG_CLIENT_PACKET_CPU_ID
 		uint32_t cpu_id;		/* CPU id associated with stream */
+#endif
 		uint8_t header_end;		/* End of header */
 	} ctx;
 };
@@ -143,6 +149,38 @@ void ctx_record(struct lttng_ust_lib_ring_buffer_ctx *bufctx,
 	}
 }
 
+/*
+ * Number of bytes needed by the varint event header to encode the
+ * timestamp delta from the previous record of the buffer, or 0 if the
+ * full timestamp must be written. Computed once per reservation: the
+ * following records of a batch share the same timestamp, and reuse the
+ * length of the first one. A racing writer can only make last_tsc
+ * older than the previous record, which overestimates the delta. On
+ * 32-bit architectures, last_tsc only holds the timestamp bits above
+ * tsc_bits, so the delta is known to fit in tsc_bits when
+ * RING_BUFFER_RFLAG_FULL_TSC is not set.
+ */
+static inline
+unsigned int varint_tsc_len(const struct lttng_ust_lib_ring_buffer_config *config,
+			    struct lttng_ust_lib_ring_buffer_ctx *ctx)
+{
+#if (CAA_BITS_PER_LONG == 64)
+	uint64_t delta = ctx->tsc - v_read(config, &ctx->buf->last_tsc);
+
+	if (caa_likely(delta < (1ULL << 16)))
+		return delta < (1ULL << 8) ? 1 : 2;
+	if (delta < (1ULL << 24))
+		return 3;
+	if (delta < (1ULL << 32))
+		return 4;
+	return 0;
+#else
+	if (ctx->rflags & RING_BUFFER_RFLAG_FULL_TSC)
+		return 0;
+	return LTTNG_VARINT_TSC_MAX_LEN;
+#endif
+}
+
 /*
  * record_header_size - Calculate the header size and padding necessary.
  * @config: ring buffer instance configuration
@@ -199,6 +237,32 @@ size_t record_header_size(const struct lttng_ust_lib_ring_buffer_config *config,
 			offset += sizeof(uint64_t);	/* timestamp */
 		}
 		break;
+	case 3:	/* varint */
+	{
+		unsigned int tsc_len;
+
+		padding = 0;		/* Byte-aligned */
+		if (!(ctx->rflags & RING_BUFFER_RFLAG_BATCH_NEXT)) {
+			tsc_len = varint_tsc_len(config, ctx);
+			if (!tsc_len) {
+				ctx->rflags |= LTTNG_RFLAG_EXTENDED;
+			} else {
+				ctx->rflags &= ~LTTNG_RFLAG_TSC_LEN_MASK;
+				ctx->rflags |= (tsc_len - 1)
+					* LTTNG_RFLAG_TSC_LEN_UNIT;
+			}
+		}
+		offset += sizeof(uint8_t);	/* length and id */
+		if (!(ctx->rflags & LTTNG_RFLAG_EXTENDED)) {
+			tsc_len = (ctx->rflags & LTTNG_RFLAG_TSC_LEN_MASK)
+					/ LTTNG_RFLAG_TSC_LEN_UNIT + 1;
+			offset += tsc_len;		/* timestamp */
+		} else {
+			offset += sizeof(uint32_t);	/* id */
+			offset += sizeof(uint64_t);	/* timestamp */
+		}
+		break;
+	}
 	default:
 		padding = 0;
 		WARN_ON_ONCE(1);
@@ -224,6 +288,54 @@ void lttng_write_event_header_slow(const struct lttng_ust_lib_ring_buffer_config
 				 struct lttng_ust_lib_ring_buffer_ctx *ctx,
 				 uint32_t event_id);
 
+/*
+ * The varint event header starts with a byte holding the length of the
+ * timestamp that follows (LTTNG_VARINT_LEN_BITS, 1 to 4 bytes encoded as
+ * 0 to 3) and the event ID (LTTNG_VARINT_EVENT_BITS). The timestamp
+ * holds the low-order bits of the clock, enough for the reader to
+ * recover the full value from the previous record. Larger event IDs and
+ * timestamp deltas use the LTTNG_VARINT_LEN_EXTENDED length, followed by
+ * the 32-bit event ID and the 64-bit timestamp. None of the fields are
+ * aligned.
+ */
+static __inline__
+void lttng_write_event_header_varint(const struct lttng_ust_lib_ring_buffer_config *config,
+				 struct lttng_ust_lib_ring_buffer_ctx *ctx,
+				 uint32_t event_id)
+{
+	if (caa_likely(!(ctx->rflags & LTTNG_RFLAG_EXTENDED))) {
+		uint8_t header[1 + LTTNG_VARINT_TSC_MAX_LEN] = { 0 };
+		unsigned int tsc_len;
+
+		tsc_len = (ctx->rflags & LTTNG_RFLAG_TSC_LEN_MASK)
+				/ LTTNG_RFLAG_TSC_LEN_UNIT + 1;
+		bt_bitfield_write(header, uint8_t,
+				0,
+				LTTNG_VARINT_LEN_BITS,
+				tsc_len - 1);
+		bt_bitfield_write(header, uint8_t,
+				LTTNG_VARINT_LEN_BITS,
+				LTTNG_VARINT_EVENT_BITS,
+				event_id);
+		bt_bitfield_write(header, uint8_t,
+				CHAR_BIT,
+				tsc_len * CHAR_BIT,
+				ctx->tsc);
+		lib_ring_buffer_write(config, ctx, header, 1 + tsc_len);
+	} else {
+		uint8_t len_id = 0;
+		uint64_t timestamp = ctx->tsc;
+
+		bt_bitfield_write(&len_id, uint8_t,
+				0,
+				LTTNG_VARINT_LEN_BITS,
+				LTTNG_VARINT_LEN_EXTENDED);
+		lib_ring_buffer_write(config, ctx, &len_id, sizeof(len_id));
+		lib_ring_buffer_write(config, ctx, &event_id, sizeof(event_id));
+		lib_ring_buffer_write(config, ctx, &timestamp, sizeof(timestamp));
+	}
+}
+
 /*
  * lttng_write_event_header
  *
@@ -242,7 +354,7 @@ void lttng_write_event_header(const struct lttng_ust_lib_ring_buffer_config *con
 	struct lttng_event *event = ctx->priv;
 	struct lttng_stack_ctx *lttng_ctx = ctx->priv2;
 
-	if (caa_unlikely(ctx->rflags))
+	if (caa_unlikely(ctx->rflags & ~LTTNG_RFLAG_TSC_LEN_MASK))
 		goto slow_path;
 
 	switch (lttng_chan->header_type) {
@@ -271,6 +383,9 @@ void lttng_write_event_header(const struct lttng_ust_lib_ring_buffer_config *con
 		lib_ring_buffer_write(config, ctx, &timestamp, sizeof(timestamp));
 		break;
 	}
+	case 3:	/* varint */
+		lttng_write_event_header_varint(config, ctx, event_id);
+		break;
 	default:
 		WARN_ON_ONCE(1);
 	}
@@ -353,6 +468,9 @@ void lttng_write_event_header_slow(const struct lttng_ust_lib_ring_buffer_config
 		}
 		break;
 	}
+	case 3:	/* varint */
+		lttng_write_event_header_varint(config, ctx, event_id);
+		break;
 	default:
 		WARN_ON_ONCE(1);
 	}
@@ -423,7 +541,9 @@ static void client_buffer_begin(struct lttng_ust_lib_ring_buffer *buf, uint64_t
 	header->ctx.packet_size = ~0ULL;
 	header->ctx.packet_seq_num = chan->backend.num_subbuf * cnt + subbuf_idx;
 	header->ctx.events_discarded = 0;
+#if LTTNG_CLIENT_PACKET_CPU_ID
 	header->ctx.cpu_id = buf->backend.cpu;
+#endif
 }
 
 /*
@@ -455,6 +575,8 @@ static void client_buffer_end(struct lttng_ust_lib_ring_buffer *buf, uint64_t ts
 	records_lost += lib_ring_buffer_get_records_lost_wrap(&client_config, buf);
 	records_lost += lib_ring_buffer_get_records_lost_big(&client_config, buf);
 	header->ctx.events_discarded = records_lost;
+	lib_ring_buffer_index_finalize(&client_config, &buf->backend,
+			subbuf_idx, handle);
 }
 
 static int client_buffer_create(struct lttng_ust_lib_ring_buffer *buf, void *priv,
@@ -481,6 +603,21 @@ static void client_packet_size_field(const struct lttng_ust_lib_ring_buffer_conf
 	*length = sizeof(((struct packet_header *) NULL)->ctx.packet_size);
 }
 
+static void client_timestamp_fields(const struct lttng_ust_lib_ring_buffer_config *config,
+				      size_t *begin_offset, size_t *end_offset,
+				      size_t *length)
+{
+	*begin_offset = offsetof(struct packet_header, ctx.timestamp_begin);
+	*end_offset = offsetof(struct packet_header, ctx.timestamp_end);
+	*length = sizeof(((struct packet_header *) NULL)->ctx.timestamp_begin);
+}
+
+/* Report events suppressed by rate limits at the end of a burst. */
+static void client_channel_timer(struct channel *chan)
+{
+	lttng_rate_limit_flush_all();
+}
+
 static struct packet_header *client_packet_header(struct lttng_ust_lib_ring_buffer *buf,
 		struct lttng_ust_shm_handle *handle)
 {
@@ -611,6 +748,8 @@ struct lttng_ust_client_lib_ring_buffer_client_cb client_cb = {
 		.buffer_finalize = client_buffer_finalize,
 		.content_size_field = client_content_size_field,
 		.packet_size_field = client_packet_size_field,
+		.timestamp_fields = client_timestamp_fields,
+		.channel_timer = client_channel_timer,
 	},
 	.timestamp_begin = client_timestamp_begin,
 	.timestamp_end = client_timestamp_end,
@@ -633,9 +772,11 @@ static const struct lttng_ust_lib_ring_buffer_config client_config = {
 	.cb.buffer_finalize = client_buffer_finalize,
 	.cb.content_size_field = client_content_size_field,
 	.cb.packet_size_field = client_packet_size_field,
+	.cb.timestamp_fields = client_timestamp_fields,
+	.cb.channel_timer = client_channel_timer,
 
 	.tsc_bits = LTTNG_COMPACT_TSC_BITS,
-	.alloc = RING_BUFFER_ALLOC_PER_CPU,
+	.alloc = LTTNG_CLIENT_ALLOC,
 	.sync = RING_BUFFER_SYNC_GLOBAL,
 	.mode = RING_BUFFER_MODE_TEMPLATE,
 	.backend = RING_BUFFER_PAGE,
@@ -658,7 +799,8 @@ struct lttng_channel *_channel_create(const char *name,
 				unsigned int read_timer_interval,
 				unsigned char *uuid,
 				uint32_t chan_id,
-				const int *stream_fds, int nr_stream_fds)
+				const int *stream_fds, int nr_stream_fds,
+				uint32_t flags, size_t pool_num_subbuf)
 {
 	struct lttng_channel chan_priv_init;
 	struct lttng_ust_shm_handle *handle;
@@ -674,7 +816,7 @@ struct lttng_channel *_channel_create(const char *name,
 			&chan_priv_init,
 			buf_addr, subbuf_size, num_subbuf,
 			switch_timer_interval, read_timer_interval,
-			stream_fds, nr_stream_fds);
+			stream_fds, nr_stream_fds, flags, pool_num_subbuf);
 	if (!handle)
 		return NULL;
 	lttng_chan = priv;
@@ -690,16 +832,19 @@ void lttng_channel_destroy(struct lttng_channel *chan)
 }
 
 static
-int lttng_event_reserve(struct lttng_ust_lib_ring_buffer_ctx *ctx,
-		      uint32_t event_id)
+int _lttng_event_reserve(struct lttng_ust_lib_ring_buffer_ctx *ctx,
+		      uint32_t event_id, unsigned int nr_records,
+		      size_t min_data_size)
 {
 	struct lttng_channel *lttng_chan = channel_get_private(ctx->chan);
 	int ret, cpu;
 
+	if (caa_unlikely(!nr_records))
+		return -EINVAL;
 	cpu = lib_ring_buffer_get_cpu(&client_config);
 	if (cpu < 0)
 		return -EPERM;
-	ctx->cpu = cpu;
+	ctx->cpu = lib_ring_buffer_get_stream(&client_config, ctx->chan, cpu);
 
 	switch (lttng_chan->header_type) {
 	case 1:	/* compact */
@@ -710,11 +855,18 @@ int lttng_event_reserve(struct lttng_ust_lib_ring_buffer_ctx *ctx,
 		if (event_id > 65534)
 			ctx->rflags |= LTTNG_RFLAG_EXTENDED;
 		break;
+	case 3:	/* varint */
+		if (event_id >= (1U << LTTNG_VARINT_EVENT_BITS))
+			ctx->rflags |= LTTNG_RFLAG_EXTENDED;
+		break;
 	default:
 		WARN_ON_ONCE(1);
 	}
 
-	ret = lib_ring_buffer_reserve(&client_config, ctx);
+	if (min_data_size < ctx->data_size)
+		lib_ring_buffer_shrink_to_packet(&client_config, ctx,
+				min_data_size);
+	ret = lib_ring_buffer_reserve_batch(&client_config, ctx, nr_records);
 	if (ret)
 		goto put;
 	lttng_write_event_header(&client_config, ctx, event_id);
@@ -725,12 +877,66 @@ put:
 }
 
 static
-void lttng_event_commit(struct lttng_ust_lib_ring_buffer_ctx *ctx)
+int lttng_event_reserve_batch(struct lttng_ust_lib_ring_buffer_ctx *ctx,
+		      uint32_t event_id, unsigned int nr_records)
+{
+	return _lttng_event_reserve(ctx, event_id, nr_records, ctx->data_size);
+}
+
+static
+int lttng_event_reserve_bounded(struct lttng_ust_lib_ring_buffer_ctx *ctx,
+		      uint32_t event_id, size_t min_data_size)
+{
+	return _lttng_event_reserve(ctx, event_id, 1, min_data_size);
+}
+
+static
+int lttng_event_reserve(struct lttng_ust_lib_ring_buffer_ctx *ctx,
+		      uint32_t event_id)
+{
+	return lttng_event_reserve_batch(ctx, event_id, 1);
+}
+
+/*
+ * Write the header of the next record of a batch, after the payload of
+ * the previous record. Must match the layout computed by
+ * record_header_size() at reservation.
+ */
+static
+void lttng_event_batch_next(struct lttng_ust_lib_ring_buffer_ctx *ctx,
+		      uint32_t event_id)
 {
-	lib_ring_buffer_commit(&client_config, ctx);
+	struct lttng_channel *lttng_chan = channel_get_private(ctx->chan);
+
+	switch (lttng_chan->header_type) {
+	case 1:	/* compact */
+		lib_ring_buffer_align_ctx(ctx, lttng_alignof(uint32_t));
+		break;
+	case 2:	/* large */
+		lib_ring_buffer_align_ctx(ctx, lttng_alignof(uint16_t));
+		break;
+	case 3:	/* varint */
+		break;
+	default:
+		WARN_ON_ONCE(1);
+	}
+	lttng_write_event_header(&client_config, ctx, event_id);
+}
+
+static
+void lttng_event_commit_batch(struct lttng_ust_lib_ring_buffer_ctx *ctx,
+		      unsigned int nr_records)
+{
+	lib_ring_buffer_commit_batch(&client_config, ctx, nr_records);
 	lib_ring_buffer_put_cpu(&client_config);
 }
 
+static
+void lttng_event_commit(struct lttng_ust_lib_ring_buffer_ctx *ctx)
+{
+	lttng_event_commit_batch(ctx, 1);
+}
+
 static
 void lttng_event_write(struct lttng_ust_lib_ring_buffer_ctx *ctx, const void *src,
 		     size_t len)
@@ -745,6 +951,39 @@ void lttng_event_strcpy(struct lttng_ust_lib_ring_buffer_ctx *ctx, const char *s
 	lib_ring_buffer_strcpy(&client_config, ctx, src, len, '#');
 }
 
+static
+size_t lttng_event_strlen(const char *src)
+{
+	return lib_ring_buffer_strnlen(src, SIZE_MAX);
+}
+
+static
+size_t lttng_event_strcpy_bounded(struct lttng_ust_lib_ring_buffer_ctx *ctx,
+		     const char *src, size_t len)
+{
+	return lib_ring_buffer_strcpy_bounded(&client_config, ctx, src, len);
+}
+
+/*
+ * Write the string padding field which ends single-pass records: a
+ * 32-bit length followed by as many zero bytes. The padding is empty
+ * unless the unused end of the record cannot be released.
+ */
+static
+void lttng_event_strtrim(struct lttng_ust_lib_ring_buffer_ctx *ctx)
+{
+	unsigned long end_offset = ctx->pre_offset + ctx->slot_size;
+	uint32_t pad_len = 0;
+
+	lib_ring_buffer_align_ctx(ctx, lttng_alignof(pad_len));
+	ctx->buf_offset += sizeof(pad_len);
+	if (lib_ring_buffer_try_trim_reserve(&client_config, ctx))
+		pad_len = end_offset - ctx->buf_offset;
+	ctx->buf_offset -= sizeof(pad_len);
+	lib_ring_buffer_write(&client_config, ctx, &pad_len, sizeof(pad_len));
+	lib_ring_buffer_memset(&client_config, ctx, 0, pad_len);
+}
+
 #if 0
 static
 wait_queue_head_t *lttng_get_reader_wait_queue(struct channel *chan)
@@ -784,8 +1023,9 @@ int lttng_flush_buffer(struct channel *chan, struct lttng_ust_shm_handle *handle
 		buf = channel_get_ring_buffer(&client_config, chan,
 				cpu, handle, &shm_fd, &wait_fd,
 				&wakeup_fd, &memory_map_size);
-		lib_ring_buffer_switch(&client_config, buf,
-				SWITCH_ACTIVE, handle);
+		if (lib_ring_buffer_switch(&client_config, buf,
+				SWITCH_ACTIVE, handle))
+			v_inc(&client_config, &buf->stats.switch_flush);
 	}
 	return 0;
 }
@@ -795,7 +1035,13 @@ static struct lttng_transport lttng_relay_transport = {
 	.ops = {
 		.channel_create = _channel_create,
 		.channel_destroy = lttng_channel_destroy,
-		.u.has_strcpy = 1,
+		.u.s = {
+			._has_strcpy = 1,
+			.has_batch = 1,
+			.has_strtrim = 1,
+			.has_rate_limit = 1,
+			.has_strlen = 1,
+		},
 		.event_reserve = lttng_event_reserve,
 		.event_commit = lttng_event_commit,
 		.event_write = lttng_event_write,
@@ -806,6 +1052,14 @@ static struct lttng_transport lttng_relay_transport = {
 		.is_disabled = lttng_is_disabled,
 		.flush_buffer = lttng_flush_buffer,
 		.event_strcpy = lttng_event_strcpy,
+		.event_reserve_batch = lttng_event_reserve_batch,
+		.event_batch_next = lttng_event_batch_next,
+		.event_commit_batch = lttng_event_commit_batch,
+		.event_reserve_bounded = lttng_event_reserve_bounded,
+		.event_strcpy_bounded = lttng_event_strcpy_bounded,
+		.event_strtrim = lttng_event_strtrim,
+		.event_rate_limit = lttng_event_rate_limit,
+		.event_strlen = lttng_event_strlen,
 	},
 	.client_config = &client_config,
 };
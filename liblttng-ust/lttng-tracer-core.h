@@ -53,6 +53,11 @@ void lttng_ust_sockinfo_session_enabled(void *owner);
 
 void lttng_ust_malloc_wrapper_init(void);
 
+void lttng_ust_flight_recorder_init(void);
+void lttng_ust_flight_recorder_exit(void);
+void lttng_ust_local_consumer_init(void);
+void lttng_ust_local_consumer_exit(void);
+
 ssize_t lttng_ust_read(int fd, void *buf, size_t len);
 
 size_t lttng_ust_dummy_get_size(struct lttng_ctx_field *field, size_t offset);
@@ -44,6 +44,12 @@
 #define LTTNG_METADATA_TIMEOUT_MSEC	10000
 
 #define LTTNG_RFLAG_EXTENDED		RING_BUFFER_RFLAG_END
-#define LTTNG_RFLAG_END			(LTTNG_RFLAG_EXTENDED << 1)
+/*
+ * Length of the timestamp of a varint event header, minus one byte, set
+ * by record_header_size() for lttng_write_event_header().
+ */
+#define LTTNG_RFLAG_TSC_LEN_UNIT	(LTTNG_RFLAG_EXTENDED << 1)
+#define LTTNG_RFLAG_TSC_LEN_MASK	(3 * LTTNG_RFLAG_TSC_LEN_UNIT)
+#define LTTNG_RFLAG_END			(LTTNG_RFLAG_TSC_LEN_UNIT << 2)
 
 #endif /* _LTTNG_TRACER_H */
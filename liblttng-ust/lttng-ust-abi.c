@@ -418,6 +418,7 @@ int lttng_abi_map_channel(int session_objd,
 
 	switch (type) {
 	case LTTNG_UST_CHAN_PER_CPU:
+	case LTTNG_UST_CHAN_PER_THREAD:
 		break;
 	default:
 		ret = -EINVAL;
@@ -468,6 +469,18 @@ int lttng_abi_map_channel(int session_objd,
 		}
 		chan_name = "channel";
 		break;
+	case LTTNG_UST_CHAN_PER_THREAD:
+		if (config->output == RING_BUFFER_MMAP) {
+			if (config->mode == RING_BUFFER_OVERWRITE)
+				transport_name = "relay-overwrite-pt-mmap";
+			else
+				transport_name = "relay-discard-pt-mmap";
+		} else {
+			ret = -EINVAL;
+			goto notransport;
+		}
+		chan_name = "channel";
+		break;
 	default:
 		ret = -EINVAL;
 		goto notransport;
@@ -937,6 +950,8 @@ static const struct lttng_ust_objd_ops lttng_channel_ops = {
  *		Attach a filter to an enabler.
  *	LTTNG_UST_EXCLUSION
  *		Attach exclusions to an enabler.
+ *	LTTNG_UST_RATE_LIMIT
+ *		Limit the rate of events recorded for this enabler.
  */
 static
 long lttng_enabler_cmd(int objd, unsigned int cmd, unsigned long arg,
@@ -967,6 +982,9 @@ long lttng_enabler_cmd(int objd, unsigned int cmd, unsigned long arg,
 		return lttng_enabler_attach_exclusion(enabler,
 				(struct lttng_ust_excluder_node *) arg);
 	}
+	case LTTNG_UST_RATE_LIMIT:
+		return lttng_enabler_attach_rate_limit(enabler,
+				(struct lttng_ust_rate_limit *) arg);
 	default:
 		return -EINVAL;
 	}
@@ -321,6 +321,7 @@ static const char *cmd_name_mapping[] = {
 	/* Event FD commands */
 	[ LTTNG_UST_FILTER ] = "Create Filter",
 	[ LTTNG_UST_EXCLUSION ] = "Add exclusions to event",
+	[ LTTNG_UST_RATE_LIMIT ] = "Set event rate limit",
 };
 
 static const char *str_timeout;
@@ -330,12 +331,18 @@ extern void lttng_ring_buffer_client_overwrite_init(void);
 extern void lttng_ring_buffer_client_overwrite_rt_init(void);
 extern void lttng_ring_buffer_client_discard_init(void);
 extern void lttng_ring_buffer_client_discard_rt_init(void);
+extern void lttng_ring_buffer_client_overwrite_pt_init(void);
+extern void lttng_ring_buffer_client_discard_pt_init(void);
 extern void lttng_ring_buffer_metadata_client_init(void);
 extern void lttng_ring_buffer_client_overwrite_exit(void);
 extern void lttng_ring_buffer_client_overwrite_rt_exit(void);
 extern void lttng_ring_buffer_client_discard_exit(void);
 extern void lttng_ring_buffer_client_discard_rt_exit(void);
+extern void lttng_ring_buffer_client_overwrite_pt_exit(void);
+extern void lttng_ring_buffer_client_discard_pt_exit(void);
 extern void lttng_ring_buffer_metadata_client_exit(void);
+extern void lib_ring_buffer_thread_stream_init(void);
+extern void lib_ring_buffer_thread_stream_exit(void);
 
 ssize_t lttng_ust_read(int fd, void *buf, size_t len)
 {
@@ -1600,12 +1607,23 @@ void __attribute__((constructor)) lttng_ust_init(void)
 	lttng_ring_buffer_client_overwrite_rt_init();
 	lttng_ring_buffer_client_discard_init();
 	lttng_ring_buffer_client_discard_rt_init();
+	lttng_ring_buffer_client_overwrite_pt_init();
+	lttng_ring_buffer_client_discard_pt_init();
+	lib_ring_buffer_thread_stream_init();
 	lttng_perf_counter_init();
 	/*
 	 * Invoke ust malloc wrapper init before starting other threads.
 	 */
 	lttng_ust_malloc_wrapper_init();
 
+	/*
+	 * Start the flight recorder and local consumer before the
+	 * listener threads, so that they record from the first
+	 * registered probe on.
+	 */
+	lttng_ust_flight_recorder_init();
+	lttng_ust_local_consumer_init();
+
 	timeout_mode = get_constructor_timeout(&constructor_timeout);
 
 	ret = sem_init(&constructor_wait, 0, 0);
@@ -1724,8 +1742,13 @@ void lttng_ust_cleanup(int exiting)
 	 * point.
 	 */
 	lttng_ust_abi_exit();
+	lttng_ust_flight_recorder_exit();
+	lttng_ust_local_consumer_exit();
 	lttng_ust_events_exit();
 	lttng_perf_counter_exit();
+	lib_ring_buffer_thread_stream_exit();
+	lttng_ring_buffer_client_discard_pt_exit();
+	lttng_ring_buffer_client_overwrite_pt_exit();
 	lttng_ring_buffer_client_discard_rt_exit();
 	lttng_ring_buffer_client_discard_exit();
 	lttng_ring_buffer_client_overwrite_rt_exit();
@@ -0,0 +1,166 @@
+/*
+ * lttng-ust-flight-recorder.c
+ *
+ * LTTng UST flight recorder: overwrite-mode channel backed by files,
+ * created by the application itself when LTTNG_UST_FLIGHT_RECORDER_PATH
+ * is set. The stream files keep the last sub-buffers written before the
+ * process terminates, crash included, and are turned into a CTF trace
+ * by the lttng-ust-recover tool.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#define _LGPL_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <lttng/ust-events.h>
+#include <usterr-signal-safe.h>
+#include <helper.h>
+
+#include "lttng-local-session.h"
+#include "lttng-tracer-core.h"
+#include "getenv.h"
+#include "../libringbuffer/smp.h"
+
+#define FLIGHT_RECORDER_TRANSPORT		"relay-overwrite-mmap"
+#define FLIGHT_RECORDER_DEFAULT_SUBBUF_SIZE	131072
+#define FLIGHT_RECORDER_DEFAULT_NUM_SUBBUF	4
+#define FLIGHT_RECORDER_DEFAULT_EVENTS		"*"
+
+static struct lttng_local_session *fr_session;
+static int fr_metadata_fd = -1;
+static int *fr_stream_fds;
+static int fr_nr_stream_fds;
+static pid_t fr_pid;		/* Process which created the session. */
+
+static
+void close_files(void)
+{
+	int i;
+
+	for (i = 0; i < fr_nr_stream_fds; i++) {
+		if (fr_stream_fds[i] >= 0 && close(fr_stream_fds[i]))
+			PERROR("close");
+	}
+	free(fr_stream_fds);
+	fr_stream_fds = NULL;
+	fr_nr_stream_fds = 0;
+	if (fr_metadata_fd >= 0 && close(fr_metadata_fd))
+		PERROR("close");
+	fr_metadata_fd = -1;
+}
+
+/*
+ * Called from the library constructor, after the ring buffer clients
+ * are registered.
+ */
+void lttng_ust_flight_recorder_init(void)
+{
+	char dir[PATH_MAX], name[NAME_MAX];
+	const char *path, *events;
+	struct lttng_channel *chan;
+	size_t subbuf_size, num_subbuf;
+	int i, ret;
+
+	path = lttng_secure_getenv("LTTNG_UST_FLIGHT_RECORDER_PATH");
+	if (!path || !*path)
+		return;
+	subbuf_size = lttng_local_session_getenv_size(
+		"LTTNG_UST_FLIGHT_RECORDER_SUBBUF_SIZE",
+		FLIGHT_RECORDER_DEFAULT_SUBBUF_SIZE);
+	num_subbuf = lttng_local_session_getenv_size(
+		"LTTNG_UST_FLIGHT_RECORDER_NUM_SUBBUF",
+		FLIGHT_RECORDER_DEFAULT_NUM_SUBBUF);
+	events = lttng_secure_getenv("LTTNG_UST_FLIGHT_RECORDER_EVENTS");
+	if (!events || !*events)
+		events = FLIGHT_RECORDER_DEFAULT_EVENTS;
+
+	ust_lock_nocheck();
+	if (lttng_local_session_create_dir(path, dir, sizeof(dir)))
+		goto error;
+	fr_metadata_fd = lttng_local_session_open_file(dir, "metadata");
+	if (fr_metadata_fd < 0)
+		goto error;
+	fr_nr_stream_fds = num_possible_cpus();
+	fr_stream_fds = zmalloc(fr_nr_stream_fds * sizeof(*fr_stream_fds));
+	if (!fr_stream_fds)
+		goto error;
+	for (i = 0; i < fr_nr_stream_fds; i++)
+		fr_stream_fds[i] = -1;
+	for (i = 0; i < fr_nr_stream_fds; i++) {
+		snprintf(name, sizeof(name), "channel0_%d", i);
+		fr_stream_fds[i] = lttng_local_session_open_file(dir, name);
+		if (fr_stream_fds[i] < 0)
+			goto error;
+	}
+
+	fr_session = lttng_local_session_create(fr_metadata_fd);
+	if (!fr_session)
+		goto error;
+	chan = lttng_local_session_add_channel(fr_session,
+		FLIGHT_RECORDER_TRANSPORT, subbuf_size, num_subbuf,
+		fr_stream_fds, fr_nr_stream_fds, 0);
+	if (!chan) {
+		ERR("Cannot create flight recorder channel (subbuf size %zu, %zu subbufs)",
+			subbuf_size, num_subbuf);
+		goto error;
+	}
+	ret = lttng_local_session_enable_events(fr_session, chan, events);
+	if (ret)
+		goto error;
+	ret = lttng_local_session_start(fr_session);
+	if (ret) {
+		ERR("Cannot start flight recorder session: %d", ret);
+		goto error;
+	}
+	fr_pid = getpid();
+	ust_unlock();
+	DBG("Flight recorder output in %s", dir);
+	return;
+
+error:
+	if (fr_session) {
+		lttng_local_session_destroy(fr_session);
+		fr_session = NULL;
+	}
+	close_files();
+	ust_unlock();
+}
+
+/*
+ * Called from the library teardown, before the sessions are destroyed.
+ * Flushing the buffers closes the packets being written, so that a
+ * clean exit leaves only complete packets in the stream files. A child
+ * process shares the files of its parent, and leaves them untouched.
+ */
+void lttng_ust_flight_recorder_exit(void)
+{
+	struct lttng_channel *chan;
+
+	if (!fr_session)
+		return;
+	if (fr_pid == getpid()) {
+		cds_list_for_each_entry(chan, &fr_session->session->chan_head,
+				node)
+			chan->ops->flush_buffer(chan->chan, chan->handle);
+	}
+	lttng_local_session_destroy(fr_session);
+	fr_session = NULL;
+	close_files();
+}
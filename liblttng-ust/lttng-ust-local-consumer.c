@@ -0,0 +1,537 @@
+/*
+ * lttng-ust-local-consumer.c
+ *
+ * LTTng UST local consumer: when LTTNG_UST_LOCAL_CONSUMER_PATH is set,
+ * the application traces into its own session, and a low-priority
+ * drainer thread writes the packets and the metadata to a local trace
+ * directory, for systems without session and consumer daemons.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#define _LGPL_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <lttng/ust-events.h>
+#include <lttng/ust-tid.h>
+#include <usterr-signal-safe.h>
+#include <helper.h>
+
+#include "lttng-local-session.h"
+#include "lttng-tracer-core.h"
+#include "getenv.h"
+#include "../libringbuffer/backend.h"
+#include "../libringbuffer/frontend.h"
+#include "../libringbuffer/smp.h"
+
+#define LOCAL_CONSUMER_TRANSPORT		"relay-discard-mmap"
+#define LOCAL_CONSUMER_DEFAULT_SUBBUF_SIZE	131072
+#define LOCAL_CONSUMER_DEFAULT_NUM_SUBBUF	4
+#define LOCAL_CONSUMER_DEFAULT_EVENTS		"*"
+/* Period of the flush of partially filled packets. */
+#define LOCAL_CONSUMER_FLUSH_PERIOD_MS		1000
+/* Nice value of the drainer thread. */
+#define LOCAL_CONSUMER_NICE			19
+
+struct local_stream {
+	struct lttng_ust_lib_ring_buffer *buf;
+	int cpu;
+	int shm_fd;
+	int wait_fd;
+	int out_fd;			/* Current trace file */
+	uint64_t out_size;		/* Bytes written to current trace file */
+	uint64_t out_index;		/* Index of current trace file */
+};
+
+static struct lttng_local_session *lc_session;
+static struct lttng_channel *lc_chan;
+static int lc_metadata_fd = -1;
+static struct local_stream *lc_streams;
+static int lc_nr_streams;
+static char lc_dir[PATH_MAX];
+static size_t lc_tracefile_size, lc_tracefile_count;
+
+static pthread_t lc_drainer;
+static pid_t lc_drainer_pid;	/* Process running the drainer, or 0. */
+static int lc_quit_pipe[2] = { -1, -1 };
+
+/*
+ * Anonymous shared memory backing a stream. The name is unlinked right
+ * away: nothing outside this process needs to map it.
+ */
+static
+int create_shm_fd(int cpu)
+{
+	char name[NAME_MAX];
+	int fd, ret;
+
+	snprintf(name, sizeof(name), "/lttng-ust-local-%d-%d",
+		(int) getpid(), cpu);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		ret = -errno;
+		PERROR("shm_open %s", name);
+		return ret;
+	}
+	if (shm_unlink(name))
+		PERROR("shm_unlink %s", name);
+	return fd;
+}
+
+/*
+ * Trace file names follow lttng-consumerd: channel0_<cpu>, suffixed by
+ * _<index> when the trace file size is bounded.
+ */
+static
+void tracefile_name(const struct local_stream *s, uint64_t index,
+		char *name, size_t len)
+{
+	if (lc_tracefile_size)
+		snprintf(name, len, "channel0_%d_%" PRIu64, s->cpu, index);
+	else
+		snprintf(name, len, "channel0_%d", s->cpu);
+}
+
+static
+int stream_open_tracefile(struct local_stream *s)
+{
+	char name[NAME_MAX];
+
+	tracefile_name(s, s->out_index, name, sizeof(name));
+	s->out_fd = lttng_local_session_open_file(lc_dir, name);
+	s->out_size = 0;
+	return s->out_fd < 0 ? s->out_fd : 0;
+}
+
+/*
+ * Move on to the next trace file of the stream, and remove the oldest
+ * one if the trace file count is bounded.
+ */
+static
+int stream_rotate(struct local_stream *s)
+{
+	char name[NAME_MAX], path[PATH_MAX];
+
+	if (close(s->out_fd))
+		PERROR("close");
+	s->out_index++;
+	if (lc_tracefile_count && s->out_index >= lc_tracefile_count) {
+		tracefile_name(s, s->out_index - lc_tracefile_count,
+			name, sizeof(name));
+		snprintf(path, sizeof(path), "%s/%s", lc_dir, name);
+		if (unlink(path) && errno != ENOENT)
+			PERROR("unlink %s", path);
+	}
+	return stream_open_tracefile(s);
+}
+
+/* Packets are never split across trace files. */
+static
+int stream_write(struct local_stream *s, const char *data, size_t len)
+{
+	int ret;
+
+	if (lc_tracefile_size && s->out_size
+			&& s->out_size + len > lc_tracefile_size) {
+		ret = stream_rotate(s);
+		if (ret)
+			return ret;
+	}
+	if (s->out_fd < 0)
+		return -EBADF;
+	while (len) {
+		ssize_t written;
+
+		written = write(s->out_fd, data, len);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			PERROR("write");
+			return ret;
+		}
+		data += written;
+		len -= written;
+		s->out_size += written;
+	}
+	return 0;
+}
+
+/* Address of the sub-buffer held by the reader. */
+static
+const char *stream_read_address(struct local_stream *s)
+{
+	const struct lttng_ust_lib_ring_buffer_config *config =
+		&lc_chan->chan->backend.config;
+	struct lttng_ust_shm_handle *handle = lc_chan->handle;
+	struct lttng_ust_lib_ring_buffer_backend_pages_shmp *barray_idx;
+	struct lttng_ust_lib_ring_buffer_backend_pages *pages;
+	unsigned long sb_bindex;
+
+	sb_bindex = subbuffer_id_get_index(config, s->buf->backend.buf_rsb.id);
+	barray_idx = shmp_index(handle, s->buf->backend.array, sb_bindex);
+	if (!barray_idx)
+		return NULL;
+	pages = shmp(handle, barray_idx->shmp);
+	if (!pages)
+		return NULL;
+	return shmp(handle, pages->p);
+}
+
+/*
+ * Write out every delivered sub-buffer of the stream. Packets are
+ * written straight from the ring buffer mapping. A packet which cannot
+ * be written is dropped, so that writers are not held back.
+ */
+static
+void stream_drain(struct local_stream *s)
+{
+	const struct lttng_ust_lib_ring_buffer_config *config =
+		&lc_chan->chan->backend.config;
+	struct lttng_ust_shm_handle *handle = lc_chan->handle;
+
+	while (!lib_ring_buffer_get_next_subbuf(s->buf, handle)) {
+		const char *data;
+		unsigned long len;
+
+		len = lib_ring_buffer_get_read_data_size(config, s->buf,
+			handle);
+		len = PAGE_ALIGN(len);
+		data = stream_read_address(s);
+		if (data)
+			(void) stream_write(s, data, len);
+		lib_ring_buffer_put_next_subbuf(s->buf, handle);
+	}
+}
+
+/*
+ * Empty the wakeup pipe before looking for data, as required by
+ * lib_ring_buffer_wakeup().
+ */
+static
+void drain_fd(int fd)
+{
+	char buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+static
+uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		return 0;
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static
+void *drainer_thread(void *arg)
+{
+	struct pollfd *fds;
+	uint64_t last_flush;
+	int i, quit = 0;
+
+	/* Lowest priority: the application comes first. */
+	if (setpriority(PRIO_PROCESS, gettid(), LOCAL_CONSUMER_NICE))
+		DBG("Cannot lower local consumer priority");
+	fds = zmalloc((lc_nr_streams + 1) * sizeof(*fds));
+	if (!fds) {
+		ERR("Cannot allocate local consumer poll set");
+		return NULL;
+	}
+	fds[0].fd = lc_quit_pipe[0];
+	fds[0].events = POLLIN;
+	for (i = 0; i < lc_nr_streams; i++) {
+		fds[i + 1].fd = lc_streams[i].wait_fd;
+		fds[i + 1].events = POLLIN;
+	}
+	last_flush = now_ms();
+	while (!quit) {
+		uint64_t now;
+		int ret;
+
+		ret = poll(fds, lc_nr_streams + 1,
+			LOCAL_CONSUMER_FLUSH_PERIOD_MS);
+		if (ret < 0 && errno != EINTR) {
+			PERROR("poll");
+			break;
+		}
+		if (fds[0].revents)
+			quit = 1;
+		now = now_ms();
+		if (now - last_flush >= LOCAL_CONSUMER_FLUSH_PERIOD_MS) {
+			lc_chan->ops->flush_buffer(lc_chan->chan,
+				lc_chan->handle);
+			last_flush = now;
+		}
+		for (i = 0; i < lc_nr_streams; i++) {
+			if (fds[i + 1].revents)
+				drain_fd(fds[i + 1].fd);
+			stream_drain(&lc_streams[i]);
+		}
+	}
+	free(fds);
+	return NULL;
+}
+
+static
+int start_drainer(void)
+{
+	sigset_t sig_all_blocked, orig_mask;
+	int ret;
+
+	if (pipe2(lc_quit_pipe, O_CLOEXEC)) {
+		PERROR("pipe2");
+		return -errno;
+	}
+	/* The drainer must not receive signals meant for the application. */
+	sigfillset(&sig_all_blocked);
+	ret = pthread_sigmask(SIG_SETMASK, &sig_all_blocked, &orig_mask);
+	if (ret)
+		ERR("pthread_sigmask: %s", strerror(ret));
+	ret = pthread_create(&lc_drainer, NULL, drainer_thread, NULL);
+	if (ret)
+		ERR("pthread_create: %s", strerror(ret));
+	else
+		lc_drainer_pid = getpid();
+	if (pthread_sigmask(SIG_SETMASK, &orig_mask, NULL))
+		ERR("pthread_sigmask");
+	return -ret;
+}
+
+static
+void stop_drainer(void)
+{
+	int ret;
+
+	if (write(lc_quit_pipe[1], "", 1) < 0)
+		PERROR("write");
+	ret = pthread_join(lc_drainer, NULL);
+	if (ret)
+		ERR("pthread_join: %s", strerror(ret));
+	lc_drainer_pid = 0;
+}
+
+static
+void release_streams(void)
+{
+	int i;
+
+	for (i = 0; i < lc_nr_streams; i++) {
+		struct local_stream *s = &lc_streams[i];
+
+		if (s->buf)
+			lib_ring_buffer_release_read(s->buf, lc_chan->handle);
+	}
+}
+
+static
+void close_files(void)
+{
+	int i;
+
+	for (i = 0; i < lc_nr_streams; i++) {
+		struct local_stream *s = &lc_streams[i];
+
+		if (s->out_fd >= 0 && close(s->out_fd))
+			PERROR("close");
+		if (s->shm_fd >= 0 && close(s->shm_fd))
+			PERROR("close");
+	}
+	free(lc_streams);
+	lc_streams = NULL;
+	lc_nr_streams = 0;
+	if (lc_metadata_fd >= 0 && close(lc_metadata_fd))
+		PERROR("close");
+	lc_metadata_fd = -1;
+	for (i = 0; i < 2; i++) {
+		if (lc_quit_pipe[i] >= 0 && close(lc_quit_pipe[i]))
+			PERROR("close");
+		lc_quit_pipe[i] = -1;
+	}
+}
+
+static
+int open_streams(void)
+{
+	const struct lttng_ust_lib_ring_buffer_config *config =
+		&lc_chan->chan->backend.config;
+	int i, ret;
+
+	for (i = 0; i < lc_nr_streams; i++) {
+		struct local_stream *s = &lc_streams[i];
+		int shm_fd, wakeup_fd;
+		uint64_t memory_map_size;
+
+		s->buf = channel_get_ring_buffer(config, lc_chan->chan, i,
+			lc_chan->handle, &shm_fd, &s->wait_fd, &wakeup_fd,
+			&memory_map_size);
+		if (!s->buf)
+			return -EINVAL;
+		ret = lib_ring_buffer_open_read(s->buf, lc_chan->handle);
+		if (ret) {
+			s->buf = NULL;
+			return ret;
+		}
+		/* Let the drainer empty the wakeup pipe without blocking. */
+		if (fcntl(s->wait_fd, F_SETFL, O_NONBLOCK) < 0) {
+			ret = -errno;
+			PERROR("fcntl");
+			return ret;
+		}
+		ret = stream_open_tracefile(s);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Called from the library constructor, after the ring buffer clients
+ * are registered.
+ */
+void lttng_ust_local_consumer_init(void)
+{
+	const char *path, *events;
+	size_t subbuf_size, num_subbuf;
+	int *shm_fds = NULL;
+	int i, ret;
+
+	path = lttng_secure_getenv("LTTNG_UST_LOCAL_CONSUMER_PATH");
+	if (!path || !*path)
+		return;
+	subbuf_size = lttng_local_session_getenv_size(
+		"LTTNG_UST_LOCAL_CONSUMER_SUBBUF_SIZE",
+		LOCAL_CONSUMER_DEFAULT_SUBBUF_SIZE);
+	num_subbuf = lttng_local_session_getenv_size(
+		"LTTNG_UST_LOCAL_CONSUMER_NUM_SUBBUF",
+		LOCAL_CONSUMER_DEFAULT_NUM_SUBBUF);
+	lc_tracefile_size = lttng_local_session_getenv_size(
+		"LTTNG_UST_LOCAL_CONSUMER_TRACEFILE_SIZE", 0);
+	lc_tracefile_count = lttng_local_session_getenv_size(
+		"LTTNG_UST_LOCAL_CONSUMER_TRACEFILE_COUNT", 0);
+	events = lttng_secure_getenv("LTTNG_UST_LOCAL_CONSUMER_EVENTS");
+	if (!events || !*events)
+		events = LOCAL_CONSUMER_DEFAULT_EVENTS;
+
+	ust_lock_nocheck();
+	if (lttng_local_session_create_dir(path, lc_dir, sizeof(lc_dir)))
+		goto error;
+	lc_metadata_fd = lttng_local_session_open_file(lc_dir, "metadata");
+	if (lc_metadata_fd < 0)
+		goto error;
+	lc_nr_streams = num_possible_cpus();
+	lc_streams = zmalloc(lc_nr_streams * sizeof(*lc_streams));
+	shm_fds = zmalloc(lc_nr_streams * sizeof(*shm_fds));
+	if (!lc_streams || !shm_fds)
+		goto error;
+	for (i = 0; i < lc_nr_streams; i++) {
+		struct local_stream *s = &lc_streams[i];
+
+		s->cpu = i;
+		s->wait_fd = -1;
+		s->out_fd = -1;
+		s->shm_fd = create_shm_fd(i);
+		if (s->shm_fd < 0)
+			goto error;
+		shm_fds[i] = s->shm_fd;
+	}
+
+	lc_session = lttng_local_session_create(lc_metadata_fd);
+	if (!lc_session)
+		goto error;
+	lc_chan = lttng_local_session_add_channel(lc_session,
+		LOCAL_CONSUMER_TRANSPORT, subbuf_size, num_subbuf,
+		shm_fds, lc_nr_streams, 0);
+	if (!lc_chan) {
+		ERR("Cannot create local consumer channel (subbuf size %zu, %zu subbufs)",
+			subbuf_size, num_subbuf);
+		goto error;
+	}
+	/* A packet must fit in a trace file. */
+	if (lc_tracefile_size && lc_tracefile_size < subbuf_size)
+		lc_tracefile_size = subbuf_size;
+	ret = open_streams();
+	if (ret)
+		goto error;
+	ret = lttng_local_session_enable_events(lc_session, lc_chan, events);
+	if (ret)
+		goto error;
+	ret = lttng_local_session_start(lc_session);
+	if (ret) {
+		ERR("Cannot start local consumer session: %d", ret);
+		goto error;
+	}
+	ret = start_drainer();
+	if (ret)
+		goto error;
+	free(shm_fds);
+	ust_unlock();
+	DBG("Local consumer output in %s", lc_dir);
+	return;
+
+error:
+	if (lc_session) {
+		if (lc_chan)
+			release_streams();
+		lttng_local_session_destroy(lc_session);
+		lc_session = NULL;
+		lc_chan = NULL;
+	}
+	free(shm_fds);
+	close_files();
+	ust_unlock();
+}
+
+/*
+ * Called from the library teardown, before the sessions are destroyed.
+ * The buffers are flushed, and the drainer writes out what they hold
+ * before exiting.
+ *
+ * After a fork, the child has no drainer, and shares the buffers of
+ * its parent: it only tears down its own mappings and descriptors.
+ */
+void lttng_ust_local_consumer_exit(void)
+{
+	if (!lc_session)
+		return;
+	if (lc_drainer_pid == getpid()) {
+		lc_chan->ops->flush_buffer(lc_chan->chan, lc_chan->handle);
+		stop_drainer();
+		release_streams();
+	}
+	lc_drainer_pid = 0;
+	lttng_local_session_destroy(lc_session);
+	lc_session = NULL;
+	lc_chan = NULL;
+	close_files();
+}
@@ -0,0 +1,48 @@
+#undef TRACEPOINT_PROVIDER
+#define TRACEPOINT_PROVIDER lttng_ust_rate_limit
+
+#if !defined(_TRACEPOINT_LTTNG_UST_RATE_LIMIT_PROVIDER_H) || defined(TRACEPOINT_HEADER_MULTI_READ)
+#define _TRACEPOINT_LTTNG_UST_RATE_LIMIT_PROVIDER_H
+
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <lttng/tracepoint.h>
+
+/*
+ * Number of events of a given name suppressed by their rate limit on
+ * the current CPU since the previous summary.
+ */
+TRACEPOINT_EVENT(lttng_ust_rate_limit, suppressed,
+	TP_ARGS(const char *, name, uint64_t, count),
+	TP_FIELDS(
+		ctf_string(event, name)
+		ctf_integer(uint64_t, count, count)
+	)
+)
+
+#endif /* _TRACEPOINT_LTTNG_UST_RATE_LIMIT_PROVIDER_H */
+
+#undef TRACEPOINT_INCLUDE
+#define TRACEPOINT_INCLUDE "./lttng-ust-rate-limit-provider.h"
+
+/* This part must be outside ifdef protection */
+#include <lttng/tracepoint-event.h>
@@ -30,6 +30,9 @@ struct tracepoint_lib {
 	struct lttng_ust_tracepoint * const *tracepoints_start;
 	int tracepoints_count;
 	struct cds_list_head callsites;
+	/* Jump labels of the library call sites, sorted by tracepoint. */
+	struct lttng_ust_tracepoint_jump_entry *jump_entries_start;
+	struct lttng_ust_tracepoint_jump_entry *jump_entries_end;
 };
 
 extern int tracepoint_probe_register_noupdate(const char *name,
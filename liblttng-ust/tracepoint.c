@@ -24,10 +24,15 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
 
 #include <urcu/arch.h>
 #include <urcu-bp.h>
-#include <urcu/hlist.h>
+#include <urcu/rculfhash.h>
 #include <urcu/uatomic.h>
 #include <urcu/compiler.h>
 #include <urcu/system.h>
@@ -40,7 +45,7 @@
 
 #include "tracepoint-internal.h"
 #include "lttng-tracer-core.h"
-#include "jhash.h"
+#include "getenv.h"
 #include "error.h"
 
 /* Test compiler support for weak symbols with hidden visibility. */
@@ -74,6 +79,15 @@ static pthread_mutex_t tracepoint_mutex = PTHREAD_MUTEX_INITIALIZER;
  */
 static CDS_LIST_HEAD(libs);
 
+/*
+ * With LTTNG_UST_DEFER_TRACEPOINT_REGISTRATION=1, libraries registering
+ * until a probe is connected for the first time are queued here
+ * instead, and registered as a batch before that probe is connected.
+ * Protected by tracepoint mutex.
+ */
+static CDS_LIST_HEAD(pending_libs);
+static int defer_registration = -1;
+
 /*
  * The tracepoint mutex protects the library tracepoints, the hash table, and
  * the library list.
@@ -83,12 +97,24 @@ static CDS_LIST_HEAD(libs);
  */
 
 /*
- * Tracepoint hash table, containing the active tracepoints.
- * Protected by tracepoint mutex.
+ * Tracepoint hash table, containing the active tracepoints. Updates are
+ * protected by tracepoint mutex, lookups by RCU. The table is grown by
+ * the thread adding entries rather than by the RCU worker threads of
+ * automatic resize, which we do not want to start in the application.
+ *
+ * liburcu-cds initializes the bucket levels of 8192 buckets and more
+ * from helper threads, even for an explicit cds_lfht_resize(). Growth
+ * is capped below that, as it may happen from a library constructor
+ * with tracepoint mutex held.
  */
+#define HT_MAX_SIZE (1 << 13)
 #define TRACEPOINT_HASH_BITS 12
 #define TRACEPOINT_TABLE_SIZE (1 << TRACEPOINT_HASH_BITS)
-static struct cds_hlist_head tracepoint_table[TRACEPOINT_TABLE_SIZE];
+static struct cds_lfht *tracepoint_ht;
+static unsigned long tracepoint_ht_size, nr_tracepoint_entries;
+
+/* Tracepoint entries removed from the table, freed after a grace period. */
+static CDS_LIST_HEAD(removed_tracepoints);
 
 static CDS_LIST_HEAD(old_probes);
 static int need_update;
@@ -103,7 +129,8 @@ static int release_queue_need_update;
  * Tracepoint entries modifications are protected by the tracepoint mutex.
  */
 struct tracepoint_entry {
-	struct cds_hlist_node hlist;
+	struct cds_lfht_node node;	/* hash table node */
+	struct cds_list_head removed_node;	/* removed_tracepoints node */
 	struct lttng_ust_tracepoint_probe *probes;
 	int refcount;	/* Number of times armed. 0 if disarmed. */
 	int callsite_refcount;	/* how many libs use this tracepoint */
@@ -121,19 +148,94 @@ struct tp_probes {
 };
 
 /*
- * Callsite hash table, containing the tracepoint call sites.
- * Protected by tracepoint mutex.
+ * Callsite hash table, containing the tracepoint call sites, keyed by
+ * tracepoint name. Same locking and resize as the tracepoint table.
  */
 #define CALLSITE_HASH_BITS 12
 #define CALLSITE_TABLE_SIZE (1 << CALLSITE_HASH_BITS)
-static struct cds_hlist_head callsite_table[CALLSITE_TABLE_SIZE];
+static struct cds_lfht *callsite_ht;
+static unsigned long callsite_ht_size, nr_callsite_entries;
 
 struct callsite_entry {
-	struct cds_hlist_node hlist;	/* hash table node */
-	struct cds_list_head node;	/* lib list of callsites node */
+	struct cds_lfht_node node;	/* hash table node */
+	struct cds_list_head lib_node;	/* lib list of callsites node */
 	struct lttng_ust_tracepoint *tp;
 };
 
+/*
+ * Hash of a tracepoint name, computed once by the callers of the hash
+ * table functions below.
+ */
+static unsigned long tracepoint_name_hash(const char *name)
+{
+	size_t name_len = strlen(name);
+
+	if (name_len > LTTNG_UST_SYM_NAME_LEN - 1) {
+		WARN("Truncating tracepoint name %s which exceeds size limits of %u chars", name, LTTNG_UST_SYM_NAME_LEN - 1);
+		name_len = LTTNG_UST_SYM_NAME_LEN - 1;
+	}
+	return lttng_ust_name_hash(name, name_len);
+}
+
+/* Use the name hash emitted by the tracepoint definition if any. */
+static unsigned long tracepoint_hash(struct lttng_ust_tracepoint *tp)
+{
+	if (tp->u.ext.name_len)
+		return lttng_ust_name_hash_final(tp->u.ext.name_hash,
+				tp->u.ext.name_len);
+	return tracepoint_name_hash(tp->name);
+}
+
+static int tracepoint_entry_match(struct cds_lfht_node *node, const void *key)
+{
+	struct tracepoint_entry *e =
+		caa_container_of(node, struct tracepoint_entry, node);
+
+	return !strncmp(key, e->name, LTTNG_UST_SYM_NAME_LEN - 1);
+}
+
+static int callsite_entry_match(struct cds_lfht_node *node, const void *key)
+{
+	struct callsite_entry *e =
+		caa_container_of(node, struct callsite_entry, node);
+
+	return !strncmp(key, e->tp->name, LTTNG_UST_SYM_NAME_LEN - 1);
+}
+
+/*
+ * Grow a hash table to one bucket per entry, up to HT_MAX_SIZE buckets.
+ * Must be called with tracepoint mutex held, outside of RCU read-side
+ * critical sections.
+ */
+static void ht_grow(struct cds_lfht *ht, unsigned long *size,
+		unsigned long nr_entries)
+{
+	unsigned long new_size = *size;
+
+	while (new_size < nr_entries && new_size < HT_MAX_SIZE)
+		new_size <<= 1;
+	if (new_size == *size)
+		return;
+	DBG("Resizing tracepoint hash table from %lu to %lu buckets",
+		*size, new_size);
+	cds_lfht_resize(ht, new_size);
+	*size = new_size;
+}
+
+/*
+ * Free the tracepoint entries removed from the table. Must be called
+ * with tracepoint mutex held, after a grace period.
+ */
+static void free_removed_tracepoints(void)
+{
+	struct tracepoint_entry *e, *tmp;
+
+	cds_list_for_each_entry_safe(e, tmp, &removed_tracepoints, removed_node) {
+		cds_list_del(&e->removed_node);
+		free(e);
+	}
+}
+
 /* coverity[+alloc] */
 static void *allocate_probes(int count)
 {
@@ -151,6 +253,7 @@ static void release_probes(void *old)
 			struct tp_probes, probes[0]);
 		synchronize_rcu();
 		free(tp_probes);
+		free_removed_tracepoints();
 	}
 }
 
@@ -249,28 +352,30 @@ tracepoint_entry_remove_probe(struct tracepoint_entry *entry,
 
 /*
  * Get tracepoint if the tracepoint is present in the tracepoint hash table.
- * Must be called with tracepoint mutex held.
+ * Must be called with tracepoint mutex held, or within a RCU read-side
+ * critical section, in which case the entry is valid until its end.
  * Returns NULL if not present.
  */
-static struct tracepoint_entry *get_tracepoint(const char *name)
+static struct tracepoint_entry *get_tracepoint_hash(const char *name,
+		unsigned long hash)
 {
-	struct cds_hlist_head *head;
-	struct cds_hlist_node *node;
-	struct tracepoint_entry *e;
-	size_t name_len = strlen(name);
-	uint32_t hash;
+	struct cds_lfht_iter iter;
+	struct cds_lfht_node *node;
+
+	if (!tracepoint_ht)
+		return NULL;
+	rcu_read_lock();
+	cds_lfht_lookup(tracepoint_ht, hash, tracepoint_entry_match, name, &iter);
+	node = cds_lfht_iter_get_node(&iter);
+	rcu_read_unlock();
+	if (!node)
+		return NULL;
+	return caa_container_of(node, struct tracepoint_entry, node);
+}
 
-	if (name_len > LTTNG_UST_SYM_NAME_LEN - 1) {
-		WARN("Truncating tracepoint name %s which exceeds size limits of %u chars", name, LTTNG_UST_SYM_NAME_LEN - 1);
-		name_len = LTTNG_UST_SYM_NAME_LEN - 1;
-	}
-	hash = jhash(name, name_len, 0);
-	head = &tracepoint_table[hash & (TRACEPOINT_TABLE_SIZE - 1)];
-	cds_hlist_for_each_entry(e, node, head, hlist) {
-		if (!strncmp(name, e->name, LTTNG_UST_SYM_NAME_LEN - 1))
-			return e;
-	}
-	return NULL;
+static struct tracepoint_entry *get_tracepoint(const char *name)
+{
+	return get_tracepoint_hash(name, tracepoint_name_hash(name));
 }
 
 /*
@@ -280,23 +385,18 @@ static struct tracepoint_entry *get_tracepoint(const char *name)
 static struct tracepoint_entry *add_tracepoint(const char *name,
 		const char *signature)
 {
-	struct cds_hlist_head *head;
-	struct cds_hlist_node *node;
 	struct tracepoint_entry *e;
 	size_t name_len = strlen(name);
-	uint32_t hash;
+	unsigned long hash;
 
-	if (name_len > LTTNG_UST_SYM_NAME_LEN - 1) {
-		WARN("Truncating tracepoint name %s which exceeds size limits of %u chars", name, LTTNG_UST_SYM_NAME_LEN - 1);
+	if (!tracepoint_ht)
+		return ERR_PTR(-ENOMEM);
+	hash = tracepoint_name_hash(name);
+	if (name_len > LTTNG_UST_SYM_NAME_LEN - 1)
 		name_len = LTTNG_UST_SYM_NAME_LEN - 1;
-	}
-	hash = jhash(name, name_len, 0);
-	head = &tracepoint_table[hash & (TRACEPOINT_TABLE_SIZE - 1)];
-	cds_hlist_for_each_entry(e, node, head, hlist) {
-		if (!strncmp(name, e->name, LTTNG_UST_SYM_NAME_LEN - 1)) {
-			DBG("tracepoint %s busy", name);
-			return ERR_PTR(-EEXIST);	/* Already there */
-		}
+	if (get_tracepoint_hash(name, hash)) {
+		DBG("tracepoint %s busy", name);
+		return ERR_PTR(-EEXIST);	/* Already there */
 	}
 	/*
 	 * Using zmalloc here to allocate a variable length element. Could
@@ -311,26 +411,205 @@ static struct tracepoint_entry *add_tracepoint(const char *name,
 	e->refcount = 0;
 	e->callsite_refcount = 0;
 	e->signature = signature;
-	cds_hlist_add_head(&e->hlist, head);
+	rcu_read_lock();
+	cds_lfht_add(tracepoint_ht, hash, &e->node);
+	rcu_read_unlock();
+	ht_grow(tracepoint_ht, &tracepoint_ht_size, ++nr_tracepoint_entries);
 	return e;
 }
 
 /*
  * Remove the tracepoint from the tracepoint hash table. Must be called with
- * tracepoint mutex held.
+ * tracepoint mutex held. The entry is freed after the next grace period
+ * waited for by the probe release paths.
  */
 static void remove_tracepoint(struct tracepoint_entry *e)
 {
-	cds_hlist_del(&e->hlist);
-	free(e);
+	rcu_read_lock();
+	(void) cds_lfht_del(tracepoint_ht, &e->node);
+	rcu_read_unlock();
+	nr_tracepoint_entries--;
+	cds_list_add(&e->removed_node, &removed_tracepoints);
+}
+
+#ifdef LTTNG_UST_HAVE_JUMP_LABEL
+
+#define JUMP_LABEL_INSN_SIZE	4
+
+static void jump_label_insn(const struct lttng_ust_tracepoint_jump_entry *entry,
+		int enable, uint8_t *insn)
+{
+	uint32_t v;
+
+	if (enable)	/* b imm26 */
+		v = 0x14000000U
+			| (((entry->target - entry->code) >> 2) & 0x03ffffffU);
+	else
+		v = 0xd503201fU;	/* nop */
+	memcpy(insn, &v, sizeof(v));
+}
+
+/* B and NOP may be exchanged while other threads execute them. */
+static int jump_label_write(const struct lttng_ust_tracepoint_jump_entry *entry,
+		const uint8_t *insn)
+{
+	uint32_t v;
+
+	memcpy(&v, insn, sizeof(v));
+	CMM_STORE_SHARED(*(uint32_t *) entry->code, v);
+	return 0;
+}
+
+/*
+ * Mapping of the last call site patched, valid for one patching pass:
+ * its protection is restored after each write.
+ */
+static unsigned long jump_label_map_start, jump_label_map_end;
+static int jump_label_map_prot;
+
+/*
+ * Get the protection of the mapping holding addr from the maps of the
+ * process, so that it can be restored after patching.
+ */
+static int jump_label_get_prot(unsigned long addr, int *prot)
+{
+	char line[PATH_MAX], perms[5];
+	unsigned long start, end;
+	int ret = -ENOENT;
+	FILE *file;
+
+	if (addr >= jump_label_map_start && addr < jump_label_map_end) {
+		*prot = jump_label_map_prot;
+		return 0;
+	}
+	file = fopen("/proc/self/maps", "r");
+	if (!file)
+		return -errno;
+	while (fgets(line, sizeof(line), file)) {
+		if (sscanf(line, "%lx-%lx %4s ", &start, &end, perms) != 3)
+			continue;
+		if (addr < start || addr >= end)
+			continue;
+		*prot = (perms[0] == 'r' ? PROT_READ : 0)
+			| (perms[1] == 'w' ? PROT_WRITE : 0)
+			| (perms[2] == 'x' ? PROT_EXEC : 0);
+		jump_label_map_start = start;
+		jump_label_map_end = end;
+		jump_label_map_prot = *prot;
+		ret = 0;
+		break;
+	}
+	fclose(file);
+	return ret;
+}
+
+static void jump_label_reset_prot(void)
+{
+	jump_label_map_start = jump_label_map_end = 0;
+}
+
+/*
+ * A call site which cannot be patched, e.g. under a W^X policy, keeps
+ * checking the tracepoint state as long as it is a jump. It is then
+ * left alone by clearing its code address, the section being writable.
+ */
+static void jump_label_update_entry(struct lttng_ust_tracepoint_jump_entry *entry,
+		int enable)
+{
+	static unsigned long page_size;
+	uint8_t insn[JUMP_LABEL_INSN_SIZE];
+	void *page;
+	int prot, ret;
+
+	if (!entry->code)
+		return;
+	jump_label_insn(entry, enable, insn);
+	if (!memcmp((void *) entry->code, insn, JUMP_LABEL_INSN_SIZE))
+		return;
+	if (!page_size)
+		page_size = sysconf(_SC_PAGE_SIZE);
+	ret = jump_label_get_prot(entry->code, &prot);
+	if (ret)
+		goto error;
+	/* The aligned instruction is within a page. */
+	page = (void *) (entry->code & ~(page_size - 1));
+	if (!(prot & PROT_WRITE)
+			&& mprotect(page, page_size, prot | PROT_WRITE)) {
+		ret = -errno;
+		goto error;
+	}
+	ret = jump_label_write(entry, insn);
+	__builtin___clear_cache((char *) entry->code,
+		(char *) entry->code + JUMP_LABEL_INSN_SIZE);
+	if (!(prot & PROT_WRITE) && mprotect(page, page_size, prot))
+		PERROR("mprotect");
+	if (ret)
+		goto error;
+	return;
+
+error:
+	DBG("Cannot patch tracepoint call site at %p (error %d), keeping its tracepoint state check",
+		(void *) entry->code, ret);
+	jump_label_insn(entry, 1, insn);
+	if (!memcmp((void *) entry->code, insn, JUMP_LABEL_INSN_SIZE))
+		entry->code = 0;
 }
 
+/*
+ * Patch the call sites of a tracepoint according to its state, in all
+ * libraries. Must be called with tracepoint mutex held.
+ */
+static void tracepoint_update_jump_labels(struct lttng_ust_tracepoint *tp)
+{
+	int enable = !!CMM_LOAD_SHARED(tp->state);
+	struct tracepoint_lib *lib;
+
+	jump_label_reset_prot();
+	cds_list_for_each_entry(lib, &libs, list) {
+		struct lttng_ust_tracepoint_jump_entry *low, *high, *mid;
+
+		/* Find the first entry of the tracepoint. */
+		low = lib->jump_entries_start;
+		high = lib->jump_entries_end;
+		while (low < high) {
+			mid = low + (high - low) / 2;
+			if ((uintptr_t) mid->tracepoint < (uintptr_t) tp)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		for (; low < lib->jump_entries_end && low->tracepoint == tp; low++)
+			jump_label_update_entry(low, enable);
+	}
+}
+
+static int jump_entry_cmp(const void *a, const void *b)
+{
+	const struct lttng_ust_tracepoint_jump_entry *ea = a, *eb = b;
+
+	if ((uintptr_t) ea->tracepoint < (uintptr_t) eb->tracepoint)
+		return -1;
+	if ((uintptr_t) ea->tracepoint > (uintptr_t) eb->tracepoint)
+		return 1;
+	return 0;
+}
+
+#else	/* LTTNG_UST_HAVE_JUMP_LABEL */
+
+static void tracepoint_update_jump_labels(struct lttng_ust_tracepoint *tp)
+{
+}
+
+#endif	/* LTTNG_UST_HAVE_JUMP_LABEL */
+
 /*
  * Sets the probe callback corresponding to one tracepoint.
  */
 static void set_tracepoint(struct tracepoint_entry **entry,
 	struct lttng_ust_tracepoint *elem, int active)
 {
+	struct lttng_ust_tracepoint_probe *probes = (*entry)->probes;
+
 	WARN_ON(strncmp((*entry)->name, elem->name, LTTNG_UST_SYM_NAME_LEN - 1) != 0);
 	/*
 	 * Check that signatures match before connecting a probe to a
@@ -355,10 +634,15 @@ static void set_tracepoint(struct tracepoint_entry **entry,
 	 * probe callbacks array is consistent before setting a pointer to it.
 	 * This array is referenced by __DO_TRACE from
 	 * include/linux/tracepoints.h. A matching cmm_smp_read_barrier_depends()
-	 * is used.
+	 * is used. The sole probe points within the probes array, and
+	 * shares its lifetime.
 	 */
-	rcu_assign_pointer(elem->probes, (*entry)->probes);
+	rcu_assign_pointer(elem->probes, probes);
+	rcu_assign_pointer(elem->u.ext.sole_probe,
+		probes && probes[0].func && !probes[1].func ?
+			&probes[0] : NULL);
 	CMM_STORE_SHARED(elem->state, active);
+	tracepoint_update_jump_labels(elem);
 }
 
 /*
@@ -370,7 +654,9 @@ static void set_tracepoint(struct tracepoint_entry **entry,
 static void disable_tracepoint(struct lttng_ust_tracepoint *elem)
 {
 	CMM_STORE_SHARED(elem->state, 0);
+	rcu_assign_pointer(elem->u.ext.sole_probe, NULL);
 	rcu_assign_pointer(elem->probes, NULL);
+	tracepoint_update_jump_labels(elem);
 }
 
 /*
@@ -379,29 +665,27 @@ static void disable_tracepoint(struct lttng_ust_tracepoint *elem)
  */
 static void add_callsite(struct tracepoint_lib * lib, struct lttng_ust_tracepoint *tp)
 {
-	struct cds_hlist_head *head;
 	struct callsite_entry *e;
 	const char *name = tp->name;
-	size_t name_len = strlen(name);
-	uint32_t hash;
+	unsigned long hash;
 	struct tracepoint_entry *tp_entry;
 
-	if (name_len > LTTNG_UST_SYM_NAME_LEN - 1) {
-		WARN("Truncating tracepoint name %s which exceeds size limits of %u chars", name, LTTNG_UST_SYM_NAME_LEN - 1);
-		name_len = LTTNG_UST_SYM_NAME_LEN - 1;
-	}
-	hash = jhash(name, name_len, 0);
-	head = &callsite_table[hash & (CALLSITE_TABLE_SIZE - 1)];
+	if (!callsite_ht)
+		return;
+	hash = tracepoint_hash(tp);
 	e = zmalloc(sizeof(struct callsite_entry));
 	if (!e) {
 		PERROR("Unable to add callsite for tracepoint \"%s\"", name);
 		return;
 	}
-	cds_hlist_add_head(&e->hlist, head);
 	e->tp = tp;
-	cds_list_add(&e->node, &lib->callsites);
+	rcu_read_lock();
+	cds_lfht_add(callsite_ht, hash, &e->node);
+	rcu_read_unlock();
+	nr_callsite_entries++;
+	cds_list_add(&e->lib_node, &lib->callsites);
 
-	tp_entry = get_tracepoint(name);
+	tp_entry = get_tracepoint_hash(name, hash);
 	if (!tp_entry)
 		return;
 	tp_entry->callsite_refcount++;
@@ -409,56 +693,53 @@ static void add_callsite(struct tracepoint_lib * lib, struct lttng_ust_tracepoin
 
 /*
  * Remove the callsite from the callsite hash table and from lib
- * callsite list. Must be called with tracepoint mutex held.
+ * callsite list. Must be called with tracepoint mutex held. The caller
+ * frees the callsite after a grace period.
  */
 static void remove_callsite(struct callsite_entry *e)
 {
 	struct tracepoint_entry *tp_entry;
 
-	tp_entry = get_tracepoint(e->tp->name);
+	tp_entry = get_tracepoint_hash(e->tp->name, tracepoint_hash(e->tp));
 	if (tp_entry) {
 		tp_entry->callsite_refcount--;
 		if (tp_entry->callsite_refcount == 0)
 			disable_tracepoint(e->tp);
 	}
-	cds_hlist_del(&e->hlist);
-	cds_list_del(&e->node);
-	free(e);
+	rcu_read_lock();
+	(void) cds_lfht_del(callsite_ht, &e->node);
+	rcu_read_unlock();
+	nr_callsite_entries--;
 }
 
 /*
  * Enable/disable all callsites based on the state of a specific
- * tracepoint entry.
+ * tracepoint entry. The callsites are looked up under RCU read-side
+ * lock, the tracepoint mutex being only needed to update them.
  * Must be called with tracepoint mutex held.
  */
 static void tracepoint_sync_callsites(const char *name)
 {
-	struct cds_hlist_head *head;
-	struct cds_hlist_node *node;
+	struct cds_lfht_iter iter;
 	struct callsite_entry *e;
-	size_t name_len = strlen(name);
-	uint32_t hash;
 	struct tracepoint_entry *tp_entry;
+	unsigned long hash;
 
-	tp_entry = get_tracepoint(name);
-	if (name_len > LTTNG_UST_SYM_NAME_LEN - 1) {
-		WARN("Truncating tracepoint name %s which exceeds size limits of %u chars", name, LTTNG_UST_SYM_NAME_LEN - 1);
-		name_len = LTTNG_UST_SYM_NAME_LEN - 1;
-	}
-	hash = jhash(name, name_len, 0);
-	head = &callsite_table[hash & (CALLSITE_TABLE_SIZE - 1)];
-	cds_hlist_for_each_entry(e, node, head, hlist) {
-		struct lttng_ust_tracepoint *tp = e->tp;
-
-		if (strncmp(name, tp->name, LTTNG_UST_SYM_NAME_LEN - 1))
-			continue;
+	if (!callsite_ht)
+		return;
+	hash = tracepoint_name_hash(name);
+	tp_entry = get_tracepoint_hash(name, hash);
+	rcu_read_lock();
+	cds_lfht_for_each_entry_duplicate(callsite_ht, hash,
+			callsite_entry_match, name, &iter, e, node) {
 		if (tp_entry) {
-			set_tracepoint(&tp_entry, tp,
+			set_tracepoint(&tp_entry, e->tp,
 					!!tp_entry->refcount);
 		} else {
-			disable_tracepoint(tp);
+			disable_tracepoint(e->tp);
 		}
 	}
+	rcu_read_unlock();
 }
 
 /**
@@ -482,7 +763,8 @@ void tracepoint_update_probe_range(struct lttng_ust_tracepoint * const *begin,
 			disable_tracepoint(*iter);
 			continue;
 		}
-		mark_entry = get_tracepoint((*iter)->name);
+		mark_entry = get_tracepoint_hash((*iter)->name,
+				tracepoint_hash(*iter));
 		if (mark_entry) {
 			set_tracepoint(&mark_entry, *iter,
 					!!mark_entry->refcount);
@@ -521,8 +803,68 @@ static void lib_unregister_callsites(struct tracepoint_lib *lib)
 {
 	struct callsite_entry *callsite, *tmp;
 
-	cds_list_for_each_entry_safe(callsite, tmp, &lib->callsites, node)
+	if (cds_list_empty(&lib->callsites))
+		return;
+	cds_list_for_each_entry(callsite, &lib->callsites, lib_node)
 		remove_callsite(callsite);
+	/* Wait for the lookups of the removed callsites. */
+	synchronize_rcu();
+	cds_list_for_each_entry_safe(callsite, tmp, &lib->callsites, lib_node) {
+		cds_list_del(&callsite->lib_node);
+		free(callsite);
+	}
+}
+
+static void new_tracepoints(struct lttng_ust_tracepoint * const *start,
+			    struct lttng_ust_tracepoint * const *end)
+{
+	if (new_tracepoint_cb) {
+		struct lttng_ust_tracepoint * const *t;
+
+		for (t = start; t < end; t++) {
+			if (*t)
+				new_tracepoint_cb(*t);
+		}
+	}
+}
+
+/*
+ * Add a library to the registered libraries, with its callsites. Its
+ * tracepoints are updated by the caller. Must be called with tracepoint
+ * mutex held.
+ */
+static void lib_add(struct tracepoint_lib *pl)
+{
+	struct tracepoint_lib *iter;
+
+	/*
+	 * We sort the libs by struct lib pointer address.
+	 */
+	cds_list_for_each_entry_reverse(iter, &libs, list) {
+		BUG_ON(iter == pl);    /* Should never be in the list twice */
+		if (iter < pl) {
+			/* We belong to the location right after iter. */
+			cds_list_add(&pl->list, &iter->list);
+			goto lib_added;
+		}
+	}
+	/* We should be added at the head of the list */
+	cds_list_add(&pl->list, &libs);
+lib_added:
+	new_tracepoints(pl->tracepoints_start,
+		pl->tracepoints_start + pl->tracepoints_count);
+	lib_register_callsites(pl);
+}
+
+static int lib_registration_deferred(void)
+{
+	if (defer_registration < 0) {
+		const char *str;
+
+		str = lttng_secure_getenv("LTTNG_UST_DEFER_TRACEPOINT_REGISTRATION");
+		defer_registration = str && !strcmp(str, "1");
+	}
+	return defer_registration;
 }
 
 /*
@@ -537,6 +879,35 @@ static void tracepoint_update_probes(void)
 		lib_update_tracepoints(lib);
 }
 
+/*
+ * Register the queued libraries in one pass. Must be called with
+ * tracepoint mutex held, before connecting a probe. Libraries loaded
+ * afterwards are registered right away, even once all the probes are
+ * disconnected.
+ *
+ * The events of the probe providers are connected to the sessions by
+ * liblttng-ust, which already does it in one lttng_fix_pending_events()
+ * pass for all the providers registered while no session is active.
+ */
+static void lib_register_pending(void)
+{
+	struct tracepoint_lib *lib, *tmp;
+	int nr_libs = 0;
+
+	defer_registration = 0;
+	if (cds_list_empty(&pending_libs))
+		return;
+	cds_list_for_each_entry_safe(lib, tmp, &pending_libs, list) {
+		cds_list_del(&lib->list);
+		lib_add(lib);
+		nr_libs++;
+	}
+	if (callsite_ht)
+		ht_grow(callsite_ht, &callsite_ht_size, nr_callsite_entries);
+	tracepoint_update_probes();
+	DBG("registered %d deferred tracepoint libraries", nr_libs);
+}
+
 static struct lttng_ust_tracepoint_probe *
 tracepoint_add_probe(const char *name, void (*probe)(void), void *data,
 		const char *signature)
@@ -584,6 +955,7 @@ int __tracepoint_probe_register(const char *name, void (*probe)(void),
 	DBG("Registering probe to tracepoint %s", name);
 
 	pthread_mutex_lock(&tracepoint_mutex);
+	lib_register_pending();
 	old = tracepoint_add_probe(name, probe, data, signature);
 	if (IS_ERR(old)) {
 		ret = PTR_ERR(old);
@@ -611,6 +983,7 @@ int __tracepoint_probe_register_queue_release(const char *name,
 	DBG("Registering probe to tracepoint %s. Queuing release.", name);
 
 	pthread_mutex_lock(&tracepoint_mutex);
+	lib_register_pending();
 	old = tracepoint_add_probe(name, probe, data, signature);
 	if (IS_ERR(old)) {
 		ret = PTR_ERR(old);
@@ -710,6 +1083,7 @@ void __tracepoint_probe_prune_release_queue(void)
 
 	/* Wait for grace period between all sync_callsites and free. */
 	synchronize_rcu();
+	free_removed_tracepoints();
 
 	cds_list_for_each_entry_safe(pos, next, &release_probes, u.list) {
 		cds_list_del(&pos->u.list);
@@ -743,6 +1117,7 @@ int tracepoint_probe_register_noupdate(const char *name, void (*probe)(void),
 	int ret = 0;
 
 	pthread_mutex_lock(&tracepoint_mutex);
+	lib_register_pending();
 	old = tracepoint_add_probe(name, probe, data, signature);
 	if (IS_ERR(old)) {
 		ret = PTR_ERR(old);
@@ -791,6 +1166,7 @@ void tracepoint_probe_update_all(void)
 	struct tp_probes *pos, *next;
 
 	pthread_mutex_lock(&tracepoint_mutex);
+	lib_register_pending();
 	if (!need_update) {
 		goto end;
 	}
@@ -801,6 +1177,7 @@ void tracepoint_probe_update_all(void)
 	tracepoint_update_probes();
 	/* Wait for grace period between update_probes and free. */
 	synchronize_rcu();
+	free_removed_tracepoints();
 	cds_list_for_each_entry_safe(pos, next, &release_probes, u.list) {
 		cds_list_del(&pos->u.list);
 		free(pos);
@@ -814,23 +1191,10 @@ void tracepoint_set_new_tracepoint_cb(void (*cb)(struct lttng_ust_tracepoint *))
 	new_tracepoint_cb = cb;
 }
 
-static void new_tracepoints(struct lttng_ust_tracepoint * const *start,
-			    struct lttng_ust_tracepoint * const *end)
-{
-	if (new_tracepoint_cb) {
-		struct lttng_ust_tracepoint * const *t;
-
-		for (t = start; t < end; t++) {
-			if (*t)
-				new_tracepoint_cb(*t);
-		}
-	}
-}
-
 int tracepoint_register_lib(struct lttng_ust_tracepoint * const *tracepoints_start,
 			    int tracepoints_count)
 {
-	struct tracepoint_lib *pl, *iter;
+	struct tracepoint_lib *pl;
 
 	init_tracepoint();
 
@@ -844,22 +1208,16 @@ int tracepoint_register_lib(struct lttng_ust_tracepoint * const *tracepoints_sta
 	CDS_INIT_LIST_HEAD(&pl->callsites);
 
 	pthread_mutex_lock(&tracepoint_mutex);
-	/*
-	 * We sort the libs by struct lib pointer address.
-	 */
-	cds_list_for_each_entry_reverse(iter, &libs, list) {
-		BUG_ON(iter == pl);    /* Should never be in the list twice */
-		if (iter < pl) {
-			/* We belong to the location right after iter. */
-			cds_list_add(&pl->list, &iter->list);
-			goto lib_added;
-		}
+	if (lib_registration_deferred()) {
+		cds_list_add_tail(&pl->list, &pending_libs);
+		pthread_mutex_unlock(&tracepoint_mutex);
+		DBG("deferred registration of a tracepoints section from %p and having %d tracepoints",
+			tracepoints_start, tracepoints_count);
+		return 0;
 	}
-	/* We should be added at the head of the list */
-	cds_list_add(&pl->list, &libs);
-lib_added:
-	new_tracepoints(tracepoints_start, tracepoints_start + tracepoints_count);
-	lib_register_callsites(pl);
+	lib_add(pl);
+	if (callsite_ht)
+		ht_grow(callsite_ht, &callsite_ht_size, nr_callsite_entries);
 	lib_update_tracepoints(pl);
 	pthread_mutex_unlock(&tracepoint_mutex);
 
@@ -896,12 +1254,67 @@ int tracepoint_unregister_lib(struct lttng_ust_tracepoint * const *tracepoints_s
 		DBG("just unregistered a tracepoints section from %p",
 			lib->tracepoints_start);
 		free(lib);
+		goto end;
+	}
+	cds_list_for_each_entry(lib, &pending_libs, list) {
+		if (lib->tracepoints_start != tracepoints_start)
+			continue;
+
+		cds_list_del(&lib->list);
+		free(lib);
 		break;
 	}
+end:
 	pthread_mutex_unlock(&tracepoint_mutex);
 	return 0;
 }
 
+#ifdef LTTNG_UST_HAVE_JUMP_LABEL
+/*
+ * Called after tracepoint_register_lib by modules whose call sites use
+ * jump labels. The entries are sorted in place, and patched according
+ * to the current state of their tracepoint.
+ */
+int tracepoint_register_jump_entries(struct lttng_ust_tracepoint * const *tracepoints_start,
+		struct lttng_ust_tracepoint_jump_entry *start,
+		struct lttng_ust_tracepoint_jump_entry *end)
+{
+	struct lttng_ust_tracepoint_jump_entry *entry;
+	struct tracepoint_lib *lib;
+	int ret = -ENOENT;
+
+	pthread_mutex_lock(&tracepoint_mutex);
+	cds_list_for_each_entry(lib, &libs, list) {
+		if (lib->tracepoints_start != tracepoints_start)
+			continue;
+		qsort(start, end - start, sizeof(*start), jump_entry_cmp);
+		lib->jump_entries_start = start;
+		lib->jump_entries_end = end;
+		jump_label_reset_prot();
+		for (entry = start; entry < end; entry++)
+			jump_label_update_entry(entry,
+				!!CMM_LOAD_SHARED(entry->tracepoint->state));
+		ret = 0;
+		goto end;
+	}
+	/* Patched when the pending library is registered. */
+	cds_list_for_each_entry(lib, &pending_libs, list) {
+		if (lib->tracepoints_start != tracepoints_start)
+			continue;
+		qsort(start, end - start, sizeof(*start), jump_entry_cmp);
+		lib->jump_entries_start = start;
+		lib->jump_entries_end = end;
+		ret = 0;
+		break;
+	}
+end:
+	pthread_mutex_unlock(&tracepoint_mutex);
+	DBG("just registered %ld tracepoint jump labels from %p",
+		(long) (end - start), start);
+	return ret;
+}
+#endif	/* LTTNG_UST_HAVE_JUMP_LABEL */
+
 /*
  * Report in debug message whether the compiler correctly supports weak
  * hidden symbols. This test checks that the address associated with two
@@ -924,6 +1337,22 @@ static void check_weak_hidden(void)
 			"DIFFERENT addresses");
 }
 
+/*
+ * The hash tables are created when the library is loaded, before any
+ * library or probe provider can register.
+ */
+static void __attribute__((constructor)) init_tracepoint_ht(void)
+{
+	tracepoint_ht = cds_lfht_new(TRACEPOINT_TABLE_SIZE,
+			TRACEPOINT_TABLE_SIZE, HT_MAX_SIZE, 0, NULL);
+	tracepoint_ht_size = TRACEPOINT_TABLE_SIZE;
+	callsite_ht = cds_lfht_new(CALLSITE_TABLE_SIZE,
+			CALLSITE_TABLE_SIZE, HT_MAX_SIZE, 0, NULL);
+	callsite_ht_size = CALLSITE_TABLE_SIZE;
+	if (!tracepoint_ht || !callsite_ht)
+		ERR("Unable to create tracepoint hash tables");
+}
+
 void init_tracepoint(void)
 {
 	if (uatomic_xchg(&initialized, 1) == 1)
@@ -31,6 +31,7 @@
 /* Internal helpers */
 #include "backend_internal.h"
 #include "frontend_internal.h"
+#include "string_kernels.h"
 
 /* Ring buffer backend API */
 
@@ -58,6 +59,14 @@ extern void *
 lib_ring_buffer_read_offset_address(struct lttng_ust_lib_ring_buffer_backend *bufb,
 				    size_t offset,
 				    struct lttng_ust_shm_handle *handle);
+extern struct lttng_ust_lib_ring_buffer_packet_index *
+lib_ring_buffer_read_packet_index(struct lttng_ust_lib_ring_buffer_backend *bufb,
+				  struct lttng_ust_shm_handle *handle);
+extern void
+lib_ring_buffer_index_finalize(const struct lttng_ust_lib_ring_buffer_config *config,
+			       struct lttng_ust_lib_ring_buffer_backend *bufb,
+			       unsigned long idx,
+			       struct lttng_ust_shm_handle *handle);
 
 /**
  * lib_ring_buffer_write - write data to a buffer backend
@@ -114,21 +123,11 @@ static inline
 size_t lib_ring_buffer_do_strcpy(const struct lttng_ust_lib_ring_buffer_config *config,
 		char *dest, const char *src, size_t len)
 {
-	size_t count;
-
-	for (count = 0; count < len; count++) {
-		char c;
-
-		/*
-		 * Only read source character once, in case it is
-		 * modified concurrently.
-		 */
-		c = CMM_LOAD_SHARED(src[count]);
-		if (!c)
-			break;
-		lib_ring_buffer_do_copy(config, &dest[count], &c, 1);
-	}
-	return count;
+	/*
+	 * The kernel only reads each source character once, in case it
+	 * is modified concurrently, and stops storing at the terminator.
+	 */
+	return lib_ring_buffer_strcpy_kernel(dest, src, len);
 }
 
 /**
@@ -195,6 +194,90 @@ void lib_ring_buffer_strcpy(const struct lttng_ust_lib_ring_buffer_config *confi
 	ctx->buf_offset += len;
 }
 
+/*
+ * Return the write pointer for the current context offset. The caller
+ * must not write across sub-buffers.
+ */
+static inline
+char *lib_ring_buffer_ctx_write_ptr(const struct lttng_ust_lib_ring_buffer_config *config,
+		struct lttng_ust_lib_ring_buffer_ctx *ctx)
+{
+	struct lttng_ust_lib_ring_buffer_backend *bufb = &ctx->buf->backend;
+	struct channel_backend *chanb = &ctx->chan->backend;
+	struct lttng_ust_shm_handle *handle = ctx->handle;
+	size_t sbidx;
+	size_t offset = ctx->buf_offset;
+	struct lttng_ust_lib_ring_buffer_backend_pages_shmp *rpages;
+	unsigned long sb_bindex, id;
+
+	offset &= chanb->buf_size - 1;
+	sbidx = offset >> chanb->subbuf_size_order;
+	id = shmp_index(handle, bufb->buf_wsb, sbidx)->id;
+	sb_bindex = subbuffer_id_get_index(config, id);
+	rpages = shmp_index(handle, bufb->array, sb_bindex);
+	CHAN_WARN_ON(ctx->chan,
+		     config->mode == RING_BUFFER_OVERWRITE
+		     && subbuffer_id_is_noref(config, id));
+	return shmp_index(handle, shmp(handle, rpages->shmp)->p,
+			offset & (chanb->subbuf_size - 1));
+}
+
+/**
+ * lib_ring_buffer_strcpy_bounded - write string data of unknown length
+ * @config : ring buffer instance configuration
+ * @ctx: ring buffer context. (input arguments only)
+ * @src : source pointer to copy from
+ * @len : space available for the string, including its terminator
+ *
+ * Copies at most @len - 1 bytes of string data from @src, followed by a
+ * terminating '\0' character, at the current context offset. Unlike
+ * lib_ring_buffer_strcpy(), the string is not padded: the context offset
+ * only moves past the terminator. Returns the number of characters
+ * copied, excluding the terminator. A string cut short to fit is
+ * accounted in the buffer records_truncated counter.
+ */
+static inline
+size_t lib_ring_buffer_strcpy_bounded(const struct lttng_ust_lib_ring_buffer_config *config,
+			   struct lttng_ust_lib_ring_buffer_ctx *ctx,
+			   const char *src, size_t len)
+{
+	char *dest;
+	size_t count;
+
+	if (caa_unlikely(!len))
+		return 0;
+	dest = lib_ring_buffer_ctx_write_ptr(config, ctx);
+	count = lib_ring_buffer_do_strcpy(config, dest, src, len - 1);
+	if (caa_unlikely(count == len - 1 && src[count] != '\0'))
+		v_inc(config, &ctx->buf->records_truncated);
+	lib_ring_buffer_do_memset(dest + count, '\0', 1);
+	ctx->buf_offset += count + 1;
+	return count;
+}
+
+/**
+ * lib_ring_buffer_memset - fill the record with a byte value
+ * @config : ring buffer instance configuration
+ * @ctx: ring buffer context. (input arguments only)
+ * @c : the byte to write
+ * @len : number of bytes to write
+ *
+ * Writes @len bytes of value @c at the current context offset. Used to
+ * fill the unused end of a record which cannot be released.
+ */
+static inline
+void lib_ring_buffer_memset(const struct lttng_ust_lib_ring_buffer_config *config,
+			   struct lttng_ust_lib_ring_buffer_ctx *ctx, int c, size_t len)
+{
+	char *dest;
+
+	if (caa_unlikely(!len))
+		return;
+	dest = lib_ring_buffer_ctx_write_ptr(config, ctx);
+	lib_ring_buffer_do_memset(dest, c, len);
+	ctx->buf_offset += len;
+}
+
 /*
  * This accessor counts the number of unread records in a buffer.
  * It only provides a consistent value if no reads not writes are performed
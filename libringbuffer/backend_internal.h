@@ -50,8 +50,8 @@ int channel_backend_init(struct channel_backend *chanb,
 void channel_backend_free(struct channel_backend *chanb,
 			  struct lttng_ust_shm_handle *handle);
 
-void lib_ring_buffer_backend_reset(struct lttng_ust_lib_ring_buffer_backend *bufb,
-				   struct lttng_ust_shm_handle *handle);
+int lib_ring_buffer_backend_reset(struct lttng_ust_lib_ring_buffer_backend *bufb,
+				  struct lttng_ust_shm_handle *handle);
 void channel_backend_reset(struct channel_backend *chanb);
 
 int lib_ring_buffer_backend_init(void);
@@ -93,6 +93,46 @@ extern void _lib_ring_buffer_write(struct lttng_ust_lib_ring_buffer_backend *buf
 #define SB_ID_INDEX_COUNT	(1UL << SB_ID_INDEX_SHIFT)
 #define SB_ID_INDEX_MASK	(SB_ID_NOREF_COUNT - 1)
 
+/*
+ * Sub-buffer pool (producer-consumer mode only). Writer sub-buffer IDs
+ * are indexes in the channel-wide pool array, or RB_POOL_NONE while the
+ * sub-buffer slot holds no pages. The free list head keeps the index of
+ * its first entry in its lowest half word, and a generation count in
+ * its top half word. Limits the pool to 2^16 - 1 sub-buffers on 32-bit.
+ */
+#define RB_POOL_GEN_SHIFT	HALF_ULONG_BITS
+#define RB_POOL_INDEX_MASK	((1UL << RB_POOL_GEN_SHIFT) - 1)
+#define RB_POOL_NONE		RB_POOL_INDEX_MASK
+
+int lib_ring_buffer_pool_fill(const struct lttng_ust_lib_ring_buffer_config *config,
+			      struct lttng_ust_lib_ring_buffer_backend *bufb,
+			      unsigned long idx,
+			      struct lttng_ust_shm_handle *handle);
+void lib_ring_buffer_pool_release(const struct lttng_ust_lib_ring_buffer_config *config,
+				  struct lttng_ust_lib_ring_buffer_backend *bufb,
+				  unsigned long idx,
+				  struct lttng_ust_shm_handle *handle);
+
+/*
+ * Packet index of the sub-buffer backed by @pages, or NULL if the channel
+ * has no packet index.
+ */
+static inline
+struct lttng_ust_lib_ring_buffer_packet_index *
+subbuffer_packet_index(struct lttng_ust_lib_ring_buffer_backend_pages *pages,
+		       struct lttng_ust_shm_handle *handle)
+{
+	struct shm_ref ref;
+
+	if (!pages->index_offset)
+		return NULL;
+	ref.index = pages->p._ref.index;
+	ref.offset = pages->index_offset;
+	return (struct lttng_ust_lib_ring_buffer_packet_index *)
+		_shmp_offset(handle->table, &ref, 0,
+			sizeof(struct lttng_ust_lib_ring_buffer_packet_index));
+}
+
 /*
  * Construct the subbuffer id from offset, index and noref. Use only the index
  * for producer-consumer mode (offset and noref are only used in overwrite
@@ -202,20 +242,22 @@ int subbuffer_id_check_index(const struct lttng_ust_lib_ring_buffer_config *conf
  */
 #ifdef LTTNG_RING_BUFFER_COUNT_EVENTS
 static inline
-void subbuffer_count_record(const struct lttng_ust_lib_ring_buffer_config *config,
+void subbuffer_count_records(const struct lttng_ust_lib_ring_buffer_config *config,
 			    struct lttng_ust_lib_ring_buffer_backend *bufb,
-			    unsigned long idx, struct lttng_ust_shm_handle *handle)
+			    unsigned long idx, unsigned int nr_records,
+			    struct lttng_ust_shm_handle *handle)
 {
 	unsigned long sb_bindex;
 
 	sb_bindex = subbuffer_id_get_index(config, shmp_index(handle, bufb->buf_wsb, idx)->id);
-	v_inc(config, &shmp(handle, shmp_index(handle, bufb->array, sb_bindex)->shmp)->records_commit);
+	v_add(config, nr_records, &shmp(handle, shmp_index(handle, bufb->array, sb_bindex)->shmp)->records_commit);
 }
 #else /* LTTNG_RING_BUFFER_COUNT_EVENTS */
 static inline
-void subbuffer_count_record(const struct lttng_ust_lib_ring_buffer_config *config,
+void subbuffer_count_records(const struct lttng_ust_lib_ring_buffer_config *config,
 			    struct lttng_ust_lib_ring_buffer_backend *bufb,
-			    unsigned long idx, struct lttng_ust_shm_handle *handle)
+			    unsigned long idx, unsigned int nr_records,
+			    struct lttng_ust_shm_handle *handle)
 {
 }
 #endif /* #else LTTNG_RING_BUFFER_COUNT_EVENTS */
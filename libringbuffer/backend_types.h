@@ -24,17 +24,52 @@
  */
 
 #include <limits.h>
+#include <urcu/arch.h>
 #include "shm_internal.h"
 #include "vatomic.h"
 
-#define RB_BACKEND_PAGES_PADDING	16
+/*
+ * Sparse record index of a sub-buffer, for channels created with
+ * LTTNG_UST_CHAN_FLAG_PACKET_INDEX. The sub-buffer is split in
+ * RB_PACKET_INDEX_ENTRIES intervals. The writer committing the record
+ * slot which covers the first byte of an interval samples the slot
+ * offset and the record timestamp in the matching entry of "samples".
+ * Slots do not overlap, so each sample has a single writer. At
+ * delivery, the writer holding the sub-buffer exclusively moves the
+ * samples to "entries", in offset order, and clears them for the next
+ * packet. The index belongs to the backend pages, so it follows the
+ * sub-buffer exchanged with the reader. It is allocated in the shm
+ * object of the sub-buffer data, and located by its offset within that
+ * object.
+ */
+#define RB_PACKET_INDEX_ORDER		6
+#define RB_PACKET_INDEX_ENTRIES		(1U << RB_PACKET_INDEX_ORDER)
+
+struct lttng_ust_lib_ring_buffer_index_entry {
+	uint64_t offset;		/* Slot offset in sub-buffer, 0: none */
+	uint64_t timestamp;		/* Record timestamp */
+};
+
+struct lttng_ust_lib_ring_buffer_packet_index {
+	uint64_t nr_entries;		/* Entries of the delivered packet */
+	struct lttng_ust_lib_ring_buffer_index_entry
+		entries[RB_PACKET_INDEX_ENTRIES];
+	struct lttng_ust_lib_ring_buffer_index_entry
+		samples[RB_PACKET_INDEX_ENTRIES];
+};
+
 struct lttng_ust_lib_ring_buffer_backend_pages {
 	unsigned long mmap_offset;	/* offset of the subbuffer in mmap */
 	union v_atomic records_commit;	/* current records committed count */
 	union v_atomic records_unread;	/* records to read */
 	unsigned long data_size;	/* Amount of data to read from subbuf */
 	DECLARE_SHMP(char, p);		/* Backing memory map */
-	char padding[RB_BACKEND_PAGES_PADDING];
+	unsigned long pool_next;	/* Next free entry in sub-buffer pool */
+	unsigned long index_offset;	/*
+					 * Packet index offset in the shm
+					 * object of p, 0 if disabled. Uses
+					 * the last of the padding.
+					 */
 };
 
 struct lttng_ust_lib_ring_buffer_backend_subbuffer {
@@ -62,12 +97,29 @@ struct lttng_ust_lib_ring_buffer_backend_pages_shmp {
 	DECLARE_SHMP(struct lttng_ust_lib_ring_buffer_backend_pages, shmp);
 };
 
-#define RB_BACKEND_RING_BUFFER_PADDING		64
+/*
+ * Channel-wide pool of sub-buffers shared by all per-cpu buffers
+ * (LTTNG_UST_CHAN_FLAG_SUBBUF_POOL). Lives in the shared memory of the
+ * first stream, next to the pool pages. The free list head packs a
+ * generation count in its upper half-word and the index of the first
+ * free entry in its lower half-word, to protect the lock-free pop
+ * against ABA.
+ */
+#define RB_BACKEND_POOL_PADDING		48
+struct lttng_ust_lib_ring_buffer_pool {
+	unsigned long head;		/* Free list head (generation, index) */
+	long nr_free;			/* Number of free entries */
+	char padding[RB_BACKEND_POOL_PADDING];
+} __attribute__((aligned(CAA_CACHE_LINE_SIZE)));
+
+#define RB_BACKEND_RING_BUFFER_PADDING		48
 struct lttng_ust_lib_ring_buffer_backend {
+	/*
+	 * Fields read by writers for each record, only written at
+	 * buffer creation and sub-buffer switch.
+	 */
 	/* Array of ring_buffer_backend_subbuffer for writer */
 	DECLARE_SHMP(struct lttng_ust_lib_ring_buffer_backend_subbuffer, buf_wsb);
-	/* ring_buffer_backend_subbuffer for reader */
-	struct lttng_ust_lib_ring_buffer_backend_subbuffer buf_rsb;
 	/* Array of lib_ring_buffer_backend_counts for the packet counter */
 	DECLARE_SHMP(struct lttng_ust_lib_ring_buffer_backend_counts, buf_cnt);
 	/*
@@ -79,8 +131,18 @@ struct lttng_ust_lib_ring_buffer_backend {
 
 	DECLARE_SHMP(struct channel, chan);	/* Associated channel */
 	int cpu;			/* This buffer's cpu. -1 if global. */
-	union v_atomic records_read;	/* Number of records read */
 	unsigned int allocated:1;	/* is buffer allocated ? */
+
+	/*
+	 * Fields written by the reader, on their own cache line so
+	 * getting sub-buffers does not invalidate the writer fields.
+	 */
+	/* ring_buffer_backend_subbuffer for reader */
+	struct lttng_ust_lib_ring_buffer_backend_subbuffer
+		__attribute__((aligned(CAA_CACHE_LINE_SIZE))) buf_rsb;
+	union v_atomic records_read;	/* Number of records read */
+	/* Sub-buffer pool, shared by all buffers of the channel */
+	DECLARE_SHMP(struct lttng_ust_lib_ring_buffer_pool, pool);
 	char padding[RB_BACKEND_RING_BUFFER_PADDING];
 };
 
@@ -54,6 +54,12 @@
  * private data area.
  */
 
+/*
+ * Maximum number of streams of a RING_BUFFER_ALLOC_PER_THREAD channel,
+ * i.e. of threads owning a stream at once.
+ */
+#define RING_BUFFER_MAX_THREAD_STREAMS	4096
+
 extern
 struct lttng_ust_shm_handle *channel_create(const struct lttng_ust_lib_ring_buffer_config *config,
 				const char *name,
@@ -65,7 +71,8 @@ struct lttng_ust_shm_handle *channel_create(const struct lttng_ust_lib_ring_buff
 				size_t subbuf_size, size_t num_subbuf,
 				unsigned int switch_timer_interval,
 				unsigned int read_timer_interval,
-				const int *stream_fds, int nr_stream_fds);
+				const int *stream_fds, int nr_stream_fds,
+				uint32_t flags, size_t pool_num_subbuf);
 
 /*
  * channel_destroy finalizes all channel's buffers, waits for readers to
@@ -82,10 +89,11 @@ void channel_destroy(struct channel *chan, struct lttng_ust_shm_handle *handle,
  * Iteration on channel cpumask needs to issue a read barrier to match the write
  * barrier in cpu hotplug. It orders the cpumask read before read of per-cpu
  * buffer data. The per-cpu buffer is never removed by cpu hotplug; teardown is
- * only performed at channel destruction.
+ * only performed at channel destruction. Per-thread channels iterate on
+ * their thread streams.
  */
 #define for_each_channel_cpu(cpu, chan)					\
-	for_each_possible_cpu(cpu)
+	for ((cpu) = 0; (cpu) < (chan)->nr_streams; (cpu)++)
 
 extern struct lttng_ust_lib_ring_buffer *channel_get_ring_buffer(
 				const struct lttng_ust_lib_ring_buffer_config *config,
@@ -117,12 +125,9 @@ extern int lib_ring_buffer_open_read(struct lttng_ust_lib_ring_buffer *buf,
 				     struct lttng_ust_shm_handle *handle);
 extern void lib_ring_buffer_release_read(struct lttng_ust_lib_ring_buffer *buf,
 					 struct lttng_ust_shm_handle *handle);
-
-/*
- * Initialize signals for ring buffer. Should be called early e.g. by
- * main() in the program to affect all threads.
- */
-void lib_ringbuffer_signal_init(void);
+extern int lib_ring_buffer_wait_wakeup(struct lttng_ust_lib_ring_buffer *buf,
+				       struct lttng_ust_shm_handle *handle,
+				       int timeout_ms);
 
 /*
  * Read sequence: snapshot, many get_subbuf/put_subbuf, move_consumer.
@@ -131,6 +136,12 @@ extern int lib_ring_buffer_snapshot(struct lttng_ust_lib_ring_buffer *buf,
 				    unsigned long *consumed,
 				    unsigned long *produced,
 				    struct lttng_ust_shm_handle *handle);
+extern int lib_ring_buffer_snapshot_incremental(struct lttng_ust_lib_ring_buffer *buf,
+				    unsigned long *consumed,
+				    unsigned long *produced,
+				    const unsigned long *prev_produced,
+				    unsigned long *lost,
+				    struct lttng_ust_shm_handle *handle);
 extern void lib_ring_buffer_move_consumer(struct lttng_ust_lib_ring_buffer *buf,
 					  unsigned long consumed_new,
 					  struct lttng_ust_shm_handle *handle);
@@ -238,6 +249,38 @@ unsigned long lib_ring_buffer_get_records_overrun(
 	return v_read(config, &buf->records_overrun);
 }
 
+static inline
+unsigned long lib_ring_buffer_get_reserve_slow(
+				const struct lttng_ust_lib_ring_buffer_config *config,
+				struct lttng_ust_lib_ring_buffer *buf)
+{
+	return v_read(config, &buf->stats.reserve_slow);
+}
+
+static inline
+unsigned long lib_ring_buffer_get_reserve_retry(
+				const struct lttng_ust_lib_ring_buffer_config *config,
+				struct lttng_ust_lib_ring_buffer *buf)
+{
+	return v_read(config, &buf->stats.reserve_retry);
+}
+
+static inline
+unsigned long lib_ring_buffer_get_switch_timer(
+				const struct lttng_ust_lib_ring_buffer_config *config,
+				struct lttng_ust_lib_ring_buffer *buf)
+{
+	return v_read(config, &buf->stats.switch_timer);
+}
+
+static inline
+unsigned long lib_ring_buffer_get_switch_flush(
+				const struct lttng_ust_lib_ring_buffer_config *config,
+				struct lttng_ust_lib_ring_buffer *buf)
+{
+	return v_read(config, &buf->stats.switch_flush);
+}
+
 static inline
 unsigned long lib_ring_buffer_get_records_lost_full(
 				const struct lttng_ust_lib_ring_buffer_config *config,
@@ -262,6 +305,14 @@ unsigned long lib_ring_buffer_get_records_lost_big(
 	return v_read(config, &buf->records_lost_big);
 }
 
+static inline
+unsigned long lib_ring_buffer_get_records_truncated(
+				const struct lttng_ust_lib_ring_buffer_config *config,
+				struct lttng_ust_lib_ring_buffer *buf)
+{
+	return v_read(config, &buf->records_truncated);
+}
+
 static inline
 unsigned long lib_ring_buffer_get_records_read(
 				const struct lttng_ust_lib_ring_buffer_config *config,
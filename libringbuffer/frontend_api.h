@@ -33,6 +33,28 @@
 #include "frontend.h"
 #include <urcu-bp.h>
 #include <urcu/compiler.h>
+#include <lttng/ust-abi.h>
+
+/**
+ * lib_ring_buffer_get_thread_stream - Stream index of the current thread.
+ *
+ * Used by RING_BUFFER_ALLOC_PER_THREAD channels. The thread is bound to
+ * a stream on first use. Threads which found no free stream index use
+ * the processor ID instead (see lib_ring_buffer_get_stream()).
+ */
+static inline
+int lib_ring_buffer_get_thread_stream(void)
+{
+	int stream = URCU_TLS(lib_ring_buffer_thread_stream);
+
+	if (caa_unlikely(stream <= 0)) {
+		if (!stream)
+			stream = lib_ring_buffer_thread_stream_bind();
+		if (stream < 0)
+			return lttng_ust_get_cpu();
+	}
+	return stream - 1;
+}
 
 /**
  * lib_ring_buffer_get_cpu - Precedes ring buffer reserve/commit.
@@ -40,7 +62,8 @@
  * Keeps a ring buffer nesting count as supplementary safety net to
  * ensure tracer client code will never trigger an endless recursion.
  * Returns the processor ID on success, -EPERM on failure (nesting count
- * too high).
+ * too high). For RING_BUFFER_ALLOC_PER_THREAD configurations, returns
+ * the stream index bound to the current thread instead.
  *
  * asm volatile and "memory" clobber prevent the compiler from moving
  * instructions out of the ring buffer nesting count. This is required to ensure
@@ -53,7 +76,10 @@ int lib_ring_buffer_get_cpu(const struct lttng_ust_lib_ring_buffer_config *confi
 {
 	int cpu, nesting;
 
-	cpu = lttng_ust_get_cpu();
+	if (config->alloc == RING_BUFFER_ALLOC_PER_THREAD)
+		cpu = lib_ring_buffer_get_thread_stream();
+	else
+		cpu = lttng_ust_get_cpu();
 	nesting = ++URCU_TLS(lib_ring_buffer_nesting);
 	cmm_barrier();
 
@@ -65,6 +91,25 @@ int lib_ring_buffer_get_cpu(const struct lttng_ust_lib_ring_buffer_config *confi
 		return cpu;
 }
 
+/**
+ * lib_ring_buffer_get_stream - Stream of the channel to write to.
+ * @cpu: value returned by lib_ring_buffer_get_cpu()
+ *
+ * A thread owns its stream of RING_BUFFER_ALLOC_PER_THREAD channels if
+ * the channel has that many streams. Otherwise, as when it found no free
+ * stream index, it writes to a stream chosen by its processor ID, shared
+ * with the owner of that stream.
+ */
+static inline
+int lib_ring_buffer_get_stream(const struct lttng_ust_lib_ring_buffer_config *config,
+			       struct channel *chan, int cpu)
+{
+	if (config->alloc == RING_BUFFER_ALLOC_PER_THREAD
+			&& caa_unlikely(cpu >= chan->nr_streams))
+		return lttng_ust_get_cpu() % chan->nr_streams;
+	return cpu;
+}
+
 /**
  * lib_ring_buffer_put_cpu - Follows ring buffer reserve/commit.
  */
@@ -76,8 +121,8 @@ void lib_ring_buffer_put_cpu(const struct lttng_ust_lib_ring_buffer_config *conf
 }
 
 /*
- * lib_ring_buffer_try_reserve is called by lib_ring_buffer_reserve(). It is not
- * part of the API per se.
+ * lib_ring_buffer_try_reserve is called by lib_ring_buffer_reserve_batch(). It
+ * is not part of the API per se.
  *
  * returns 0 if reserve ok, or 1 if the slow path must be taken.
  */
@@ -85,8 +130,10 @@ static inline
 int lib_ring_buffer_try_reserve(const struct lttng_ust_lib_ring_buffer_config *config,
 				struct lttng_ust_lib_ring_buffer_ctx *ctx,
 				unsigned long *o_begin, unsigned long *o_end,
-				unsigned long *o_old, size_t *before_hdr_pad)
+				unsigned long *o_old, size_t *before_hdr_pad,
+				unsigned int nr_records)
 {
+	unsigned int i;
 	struct channel *chan = ctx->chan;
 	struct lttng_ust_lib_ring_buffer *buf = ctx->buf;
 	*o_begin = v_read(config, &buf->offset);
@@ -109,11 +156,25 @@ int lib_ring_buffer_try_reserve(const struct lttng_ust_lib_ring_buffer_config *c
 	if (caa_unlikely(subbuf_offset(*o_begin, chan) == 0))
 		return 1;
 
-	ctx->slot_size = record_header_size(config, chan, *o_begin,
-					    before_hdr_pad, ctx);
-	ctx->slot_size +=
-		lib_ring_buffer_align(*o_begin + ctx->slot_size,
-				      ctx->largest_align) + ctx->data_size;
+	ctx->slot_size = 0;
+	for (i = 0; i < nr_records; i++) {
+		size_t hdr_pad;
+
+		/*
+		 * Each record of a batch has its own header, aligned
+		 * from the end of the previous record.
+		 */
+		ctx->slot_size += record_header_size(config, chan,
+					*o_begin + ctx->slot_size,
+					&hdr_pad, ctx);
+		if (!i)
+			*before_hdr_pad = hdr_pad;
+		ctx->slot_size +=
+			lib_ring_buffer_align(*o_begin + ctx->slot_size,
+					      ctx->largest_align) + ctx->data_size;
+		ctx->rflags |= RING_BUFFER_RFLAG_BATCH_NEXT;
+	}
+	ctx->rflags &= ~RING_BUFFER_RFLAG_BATCH_NEXT;
 	if (caa_unlikely((subbuf_offset(*o_begin, chan) + ctx->slot_size)
 		     > chan->backend.subbuf_size))
 		return 1;
@@ -135,24 +196,28 @@ int lib_ring_buffer_try_reserve(const struct lttng_ust_lib_ring_buffer_config *c
 }
 
 /**
- * lib_ring_buffer_reserve - Reserve space in a ring buffer.
+ * lib_ring_buffer_reserve_batch - Reserve space for several records at once.
  * @config: ring buffer instance configuration.
  * @ctx: ring buffer context. (input and output) Must be already initialized.
+ * @nr_records: number of records to reserve.
  *
- * Atomic wait-free slot reservation. The reserved space starts at the context
- * "pre_offset". Its length is "slot_size". The associated time-stamp is "tsc".
+ * Reserves room for @nr_records consecutive records with a single offset
+ * update. Each record has its own record header followed by a payload of
+ * ctx->data_size bytes aligned on ctx->largest_align, and all records share
+ * the time-stamp "tsc". The whole batch always fits within a single
+ * sub-buffer, and is committed with lib_ring_buffer_commit_batch().
  *
  * Return :
  *  0 on success.
  * -EAGAIN if channel is disabled.
- * -ENOSPC if event size is too large for packet.
- * -ENOBUFS if there is currently not enough space in buffer for the event.
+ * -ENOSPC if the batch is too large for packet.
+ * -ENOBUFS if there is currently not enough space in buffer for the batch.
  * -EIO if data cannot be written into the buffer for any other reason.
  */
-
 static inline
-int lib_ring_buffer_reserve(const struct lttng_ust_lib_ring_buffer_config *config,
-			    struct lttng_ust_lib_ring_buffer_ctx *ctx)
+int lib_ring_buffer_reserve_batch(const struct lttng_ust_lib_ring_buffer_config *config,
+				  struct lttng_ust_lib_ring_buffer_ctx *ctx,
+				  unsigned int nr_records)
 {
 	struct channel *chan = ctx->chan;
 	struct lttng_ust_shm_handle *handle = ctx->handle;
@@ -163,11 +228,13 @@ int lib_ring_buffer_reserve(const struct lttng_ust_lib_ring_buffer_config *confi
 	if (uatomic_read(&chan->record_disabled))
 		return -EAGAIN;
 
-	if (config->alloc == RING_BUFFER_ALLOC_PER_CPU)
+	if (config->alloc != RING_BUFFER_ALLOC_GLOBAL)
 		buf = shmp(handle, chan->backend.buf[ctx->cpu].shmp);
 	else
 		buf = shmp(handle, chan->backend.buf[0].shmp);
-	if (uatomic_read(&buf->record_disabled))
+	/* A lazily allocated buffer is disabled until its first write. */
+	if (caa_unlikely(uatomic_read(&buf->record_disabled))
+			&& lib_ring_buffer_materialize(buf, handle))
 		return -EAGAIN;
 	ctx->buf = buf;
 
@@ -175,12 +242,15 @@ int lib_ring_buffer_reserve(const struct lttng_ust_lib_ring_buffer_config *confi
 	 * Perform retryable operations.
 	 */
 	if (caa_unlikely(lib_ring_buffer_try_reserve(config, ctx, &o_begin,
-						 &o_end, &o_old, &before_hdr_pad)))
+						 &o_end, &o_old, &before_hdr_pad,
+						 nr_records)))
 		goto slow_path;
 
 	if (caa_unlikely(v_cmpxchg(config, &ctx->buf->offset, o_old, o_end)
-		     != o_old))
+		     != o_old)) {
+		v_inc(config, &ctx->buf->stats.reserve_retry);
 		goto slow_path;
+	}
 
 	/*
 	 * Atomically update last_tsc. This update races against concurrent
@@ -205,7 +275,92 @@ int lib_ring_buffer_reserve(const struct lttng_ust_lib_ring_buffer_config *confi
 	ctx->buf_offset = o_begin + before_hdr_pad;
 	return 0;
 slow_path:
-	return lib_ring_buffer_reserve_slow(ctx);
+	return lib_ring_buffer_reserve_slow(ctx, nr_records);
+}
+
+/**
+ * lib_ring_buffer_reserve - Reserve space in a ring buffer.
+ * @config: ring buffer instance configuration.
+ * @ctx: ring buffer context. (input and output) Must be already initialized.
+ *
+ * Atomic wait-free slot reservation. The reserved space starts at the context
+ * "pre_offset". Its length is "slot_size". The associated time-stamp is "tsc".
+ *
+ * Return :
+ *  0 on success.
+ * -EAGAIN if channel is disabled.
+ * -ENOSPC if event size is too large for packet.
+ * -ENOBUFS if there is currently not enough space in buffer for the event.
+ * -EIO if data cannot be written into the buffer for any other reason.
+ */
+static inline
+int lib_ring_buffer_reserve(const struct lttng_ust_lib_ring_buffer_config *config,
+			    struct lttng_ust_lib_ring_buffer_ctx *ctx)
+{
+	return lib_ring_buffer_reserve_batch(config, ctx, 1);
+}
+
+/**
+ * lib_ring_buffer_shrink_to_packet - Cap a record payload to the current packet.
+ * @config: ring buffer instance configuration.
+ * @ctx: ring buffer context. (input and output) Must be already initialized,
+ *       including ctx->cpu.
+ * @min_data_size: smallest acceptable payload size.
+ *
+ * Lowers ctx->data_size so that the record ends before the end of the
+ * current sub-buffer, without going below @min_data_size. If the payload
+ * cannot shrink enough, the record goes to the next sub-buffer, and the
+ * payload is capped to the size of an empty sub-buffer. The buffer
+ * offset is only read as a hint: a concurrent reservation can still push
+ * the record to the next sub-buffer, which is harmless. Used with
+ * lib_ring_buffer_try_trim_reserve() to reserve an upper bound for
+ * records whose size is only known once written.
+ */
+static inline
+void lib_ring_buffer_shrink_to_packet(const struct lttng_ust_lib_ring_buffer_config *config,
+				      struct lttng_ust_lib_ring_buffer_ctx *ctx,
+				      size_t min_data_size)
+{
+	struct channel *chan = ctx->chan;
+	struct lttng_ust_lib_ring_buffer *buf;
+	unsigned long o_begin, offset;
+	unsigned int rflags = ctx->rflags;
+	size_t hdr_pad, used;
+
+	if (config->alloc != RING_BUFFER_ALLOC_GLOBAL)
+		buf = shmp(ctx->handle, chan->backend.buf[ctx->cpu].shmp);
+	else
+		buf = shmp(ctx->handle, chan->backend.buf[0].shmp);
+	if (caa_unlikely(!buf))
+		return;
+	/* The record header size depends on the buffer and time value. */
+	ctx->buf = buf;
+	ctx->tsc = lib_ring_buffer_clock_read(chan);
+	o_begin = v_read(config, &buf->offset);
+	for (;;) {
+		offset = o_begin;
+		if (subbuf_offset(offset, chan) == 0)
+			offset += config->cb.subbuffer_header_size();
+		offset += record_header_size(config, chan, offset, &hdr_pad, ctx);
+		/* The reservation makes its own header decisions. */
+		ctx->rflags = rflags;
+		offset += lib_ring_buffer_align(offset, ctx->largest_align);
+		used = offset - subbuf_trunc(o_begin, chan);
+		/*
+		 * Keep one byte free so the record does not end on the
+		 * sub-buffer boundary, which would prevent trimming it.
+		 */
+		if (used + ctx->data_size < chan->backend.subbuf_size)
+			return;
+		if (used + min_data_size < chan->backend.subbuf_size) {
+			ctx->data_size = chan->backend.subbuf_size - used - 1;
+			return;
+		}
+		if (subbuf_offset(o_begin, chan) == 0)
+			return;
+		/* Does not fit here: cap to an empty sub-buffer instead. */
+		o_begin = subbuf_align(o_begin, chan);
+	}
 }
 
 /**
@@ -223,26 +378,75 @@ slow_path:
  * disabled, for RING_BUFFER_SYNC_PER_CPU configuration.
  */
 static inline
-void lib_ring_buffer_switch(const struct lttng_ust_lib_ring_buffer_config *config,
-			    struct lttng_ust_lib_ring_buffer *buf, enum switch_mode mode,
-			    struct lttng_ust_shm_handle *handle)
+int lib_ring_buffer_switch(const struct lttng_ust_lib_ring_buffer_config *config,
+			   struct lttng_ust_lib_ring_buffer *buf, enum switch_mode mode,
+			   struct lttng_ust_shm_handle *handle)
 {
-	lib_ring_buffer_switch_slow(buf, mode, handle);
+	return lib_ring_buffer_switch_slow(buf, mode, handle);
 }
 
 /* See ring_buffer_frontend_api.h for lib_ring_buffer_reserve(). */
 
+/*
+ * lib_ring_buffer_index_sample - Sample a record in the packet index.
+ *
+ * Records the slot offset and timestamp of the record in the index of
+ * sub-buffer @idx if its slot covers the first byte of an index
+ * interval. For a batch, the first record of the batch is sampled.
+ */
+static inline
+void lib_ring_buffer_index_sample(const struct lttng_ust_lib_ring_buffer_config *config,
+				  const struct lttng_ust_lib_ring_buffer_ctx *ctx,
+				  unsigned long idx)
+{
+	struct channel *chan = ctx->chan;
+	struct lttng_ust_shm_handle *handle = ctx->handle;
+	struct lttng_ust_lib_ring_buffer_backend *bufb = &ctx->buf->backend;
+	struct lttng_ust_lib_ring_buffer_backend_subbuffer *wsb;
+	struct lttng_ust_lib_ring_buffer_backend_pages_shmp *sbp;
+	struct lttng_ust_lib_ring_buffer_backend_pages *pages;
+	struct lttng_ust_lib_ring_buffer_packet_index *index;
+	struct lttng_ust_lib_ring_buffer_index_entry *sample;
+	unsigned int order;
+	unsigned long pad;
+
+	order = chan->backend.subbuf_size_order - RB_PACKET_INDEX_ORDER;
+	pad = -ctx->pre_offset & ((1UL << order) - 1);
+	if (caa_likely(pad >= ctx->slot_size))
+		return;
+	wsb = shmp_index(handle, bufb->buf_wsb, idx);
+	if (!wsb)
+		return;
+	sbp = shmp_index(handle, bufb->array,
+			subbuffer_id_get_index(config, wsb->id));
+	if (!sbp)
+		return;
+	pages = shmp(handle, sbp->shmp);
+	if (!pages)
+		return;
+	index = subbuffer_packet_index(pages, handle);
+	if (!index)
+		return;
+	sample = &index->samples[subbuf_offset(ctx->pre_offset + pad, chan)
+			>> order];
+	sample->timestamp = ctx->tsc;
+	sample->offset = subbuf_offset(ctx->pre_offset, chan);
+}
+
 /**
- * lib_ring_buffer_commit - Commit an record.
+ * lib_ring_buffer_commit_batch - Commit a batch of records.
  * @config: ring buffer instance configuration.
  * @ctx: ring buffer context. (input arguments only)
+ * @nr_records: number of records reserved by lib_ring_buffer_reserve_batch().
  *
  * Atomic unordered slot commit. Increments the commit count in the
- * specified sub-buffer, and delivers it if necessary.
+ * specified sub-buffer once for the whole batch, and delivers it if
+ * necessary.
  */
 static inline
-void lib_ring_buffer_commit(const struct lttng_ust_lib_ring_buffer_config *config,
-			    const struct lttng_ust_lib_ring_buffer_ctx *ctx)
+void lib_ring_buffer_commit_batch(const struct lttng_ust_lib_ring_buffer_config *config,
+				  const struct lttng_ust_lib_ring_buffer_ctx *ctx,
+				  unsigned int nr_records)
 {
 	struct channel *chan = ctx->chan;
 	struct lttng_ust_shm_handle *handle = ctx->handle;
@@ -252,9 +456,13 @@ void lib_ring_buffer_commit(const struct lttng_ust_lib_ring_buffer_config *confi
 	unsigned long commit_count;
 
 	/*
-	 * Must count record before incrementing the commit count.
+	 * Must count records and sample them in the packet index before
+	 * incrementing the commit count.
 	 */
-	subbuffer_count_record(config, &buf->backend, endidx, handle);
+	subbuffer_count_records(config, &buf->backend, endidx, nr_records,
+			handle);
+	if (caa_unlikely(chan->flags & LTTNG_UST_CHAN_FLAG_PACKET_INDEX))
+		lib_ring_buffer_index_sample(config, ctx, endidx);
 
 	/*
 	 * Order all writes to buffer before the commit count update that will
@@ -294,6 +502,21 @@ void lib_ring_buffer_commit(const struct lttng_ust_lib_ring_buffer_config *confi
 			offset_end, commit_count, handle);
 }
 
+/**
+ * lib_ring_buffer_commit - Commit an record.
+ * @config: ring buffer instance configuration.
+ * @ctx: ring buffer context. (input arguments only)
+ *
+ * Atomic unordered slot commit. Increments the commit count in the
+ * specified sub-buffer, and delivers it if necessary.
+ */
+static inline
+void lib_ring_buffer_commit(const struct lttng_ust_lib_ring_buffer_config *config,
+			    const struct lttng_ust_lib_ring_buffer_ctx *ctx)
+{
+	lib_ring_buffer_commit_batch(config, ctx, 1);
+}
+
 /**
  * lib_ring_buffer_try_discard_reserve - Try discarding a record.
  * @config: ring buffer instance configuration.
@@ -332,6 +555,38 @@ int lib_ring_buffer_try_discard_reserve(const struct lttng_ust_lib_ring_buffer_c
 		return 0;
 }
 
+/**
+ * lib_ring_buffer_try_trim_reserve - Try shrinking a reserved record.
+ * @config: ring buffer instance configuration.
+ * @ctx: ring buffer context. (input and output)
+ *
+ * Releases the reserved space located after ctx->buf_offset, so the
+ * record ends where its writer stopped. Only succeeds if no other record
+ * has been reserved after it, and if the reserved slot does not end on a
+ * sub-buffer boundary (the reservation may then have already ended the
+ * sub-buffer). If trim fails, the whole reserved slot must be written
+ * before the record is committed.
+ *
+ * Returns 0 upon success, -EPERM if the record cannot be trimmed.
+ */
+static inline
+int lib_ring_buffer_try_trim_reserve(const struct lttng_ust_lib_ring_buffer_config *config,
+				     struct lttng_ust_lib_ring_buffer_ctx *ctx)
+{
+	struct lttng_ust_lib_ring_buffer *buf = ctx->buf;
+	unsigned long end_offset = ctx->pre_offset + ctx->slot_size;
+
+	if (ctx->buf_offset == end_offset)
+		return 0;
+	if (caa_unlikely(subbuf_offset(end_offset, ctx->chan) == 0))
+		return -EPERM;
+	if (caa_unlikely(v_cmpxchg(config, &buf->offset, end_offset, ctx->buf_offset)
+		   != end_offset))
+		return -EPERM;
+	ctx->slot_size -= end_offset - ctx->buf_offset;
+	return 0;
+}
+
 static inline
 void channel_record_disable(const struct lttng_ust_lib_ring_buffer_config *config,
 			    struct channel *chan)
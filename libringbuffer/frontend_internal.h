@@ -158,13 +158,18 @@ int last_tsc_overflow(const struct lttng_ust_lib_ring_buffer_config *config,
 #endif
 
 extern
-int lib_ring_buffer_reserve_slow(struct lttng_ust_lib_ring_buffer_ctx *ctx);
+int lib_ring_buffer_reserve_slow(struct lttng_ust_lib_ring_buffer_ctx *ctx,
+				 unsigned int nr_records);
 
 extern
-void lib_ring_buffer_switch_slow(struct lttng_ust_lib_ring_buffer *buf,
+int lib_ring_buffer_switch_slow(struct lttng_ust_lib_ring_buffer *buf,
 				 enum switch_mode mode,
 				 struct lttng_ust_shm_handle *handle);
 
+extern
+int lib_ring_buffer_materialize(struct lttng_ust_lib_ring_buffer *buf,
+				struct lttng_ust_shm_handle *handle);
+
 void lib_ring_buffer_check_deliver_slow(const struct lttng_ust_lib_ring_buffer_config *config,
 				   struct lttng_ust_lib_ring_buffer *buf,
 			           struct channel *chan,
@@ -329,4 +334,11 @@ extern void lib_ring_buffer_free(struct lttng_ust_lib_ring_buffer *buf,
 /* Keep track of trap nesting inside ring buffer code */
 extern DECLARE_URCU_TLS(unsigned int, lib_ring_buffer_nesting);
 
+/* Stream owned by the current thread in per-thread channels (index + 1) */
+extern DECLARE_URCU_TLS(int, lib_ring_buffer_thread_stream);
+
+extern int lib_ring_buffer_thread_stream_bind(void);
+extern void lib_ring_buffer_thread_stream_init(void);
+extern void lib_ring_buffer_thread_stream_exit(void);
+
 #endif /* _LTTNG_RING_BUFFER_FRONTEND_INTERNAL_H */
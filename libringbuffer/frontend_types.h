@@ -29,7 +29,6 @@
  */
 
 #include <string.h>
-#include <time.h>	/* for timer_t */
 
 #include <urcu/list.h>
 #include <urcu/uatomic.h>
@@ -47,8 +46,10 @@
  */
 enum switch_mode { SWITCH_ACTIVE, SWITCH_FLUSH };
 
+struct lib_ring_buffer_timer;
+
 /* channel: collection of per-cpu ring buffers. */
-#define RB_CHANNEL_PADDING		32
+#define RB_CHANNEL_PADDING		24
 struct channel {
 	int record_disabled;
 	unsigned long commit_count_mask;	/*
@@ -59,17 +60,19 @@ struct channel {
 						 */
 
 	unsigned long switch_timer_interval;	/* Buffer flush (us) */
-	timer_t switch_timer;
+	struct lib_ring_buffer_timer *switch_timer;
 	int switch_timer_enabled;
 
 	unsigned long read_timer_interval;	/* Reader wakeup (us) */
-	timer_t read_timer;
+	struct lib_ring_buffer_timer *read_timer;
 	int read_timer_enabled;
 
 	int finalized;				/* Has channel been finalized */
 	size_t priv_data_offset;
 	unsigned int nr_streams;		/* Number of streams */
 	struct lttng_ust_shm_handle *handle;
+	uint32_t flags;				/* enum lttng_ust_chan_flags */
+	uint32_t pool_num_subbuf;		/* Sub-buffer pool size, 0 if none */
 	char padding[RB_CHANNEL_PADDING];
 	/*
 	 * Associated backend contains a variable-length array. Needs to
@@ -93,9 +96,34 @@ struct commit_counters_cold {
 	char padding[RB_COMMIT_COUNT_COLD_PADDING];
 } __attribute__((aligned(CAA_CACHE_LINE_SIZE)));
 
+/*
+ * Reader wakeup state of a buffer, for channels created with
+ * LTTNG_UST_CHAN_FLAG_FUTEX_WAKEUP. Writers only issue a futex wake
+ * when the reader is parked, and deliveries happening while a wakeup
+ * is pending are coalesced.
+ */
+enum rb_wakeup_state {
+	RB_WAKEUP_IDLE = 0,	/* Reader not waiting, nothing delivered */
+	RB_WAKEUP_PENDING = 1,	/* Delivered since the reader last waited */
+	RB_WAKEUP_WAITING = 2,	/* Reader parked on the futex */
+};
+
+/*
+ * Allocation state of a per-cpu buffer of a channel created with
+ * LTTNG_UST_CHAN_FLAG_LAZY_ALLOC, or of a per-thread channel buffer. The
+ * shm of a pending buffer is sized but not allocated, and the buffer is
+ * record-disabled until its first writer materializes it.
+ */
+enum rb_lazy_state {
+	RB_LAZY_ACTIVE = 0,		/* Allocated, in use */
+	RB_LAZY_PENDING = 1,		/* Not written to yet */
+	RB_LAZY_MATERIALIZING = 2,	/* First writer allocating it */
+	RB_LAZY_FAILED = 3,		/* Allocation failed, stays disabled */
+};
+
 /* ring buffer state */
 #define RB_CRASH_DUMP_ABI_LEN		256
-#define RB_RING_BUFFER_PADDING		60
+#define RB_RING_BUFFER_PADDING		44
 
 #define RB_CRASH_DUMP_ABI_MAGIC_LEN	16
 
@@ -117,7 +145,7 @@ struct commit_counters_cold {
 #define RB_CRASH_ENDIAN			0x1234
 
 #define RB_CRASH_DUMP_ABI_MAJOR		0
-#define RB_CRASH_DUMP_ABI_MINOR		0
+#define RB_CRASH_DUMP_ABI_MINOR		1
 
 enum lttng_crash_type {
 	LTTNG_CRASH_TYPE_UST = 0,
@@ -169,51 +197,96 @@ struct lttng_crash_abi {
 	uint64_t subbuf_size;	/* Sub-buffer size */
 	uint64_t num_subbuf;	/* Number of sub-buffers for writer */
 	uint32_t mode;		/* Buffer mode: 0: overwrite, 1: discard */
+
+	/* Since minor 1: timestamps, to end partially written packets. */
+	struct {
+		uint32_t last_tsc;		/* Within the buffer */
+		uint32_t timestamp_begin;	/* Within the packet header */
+		uint32_t timestamp_end;		/* Within the packet header */
+	} __attribute__((packed)) tsc_offset;
+	struct {
+		uint8_t last_tsc;		/* 0: not saved */
+		uint8_t timestamp_begin;
+		uint8_t timestamp_end;
+	} __attribute__((packed)) tsc_length;
+	uint8_t last_tsc_shift;	/* last_tsc holds the timestamp >> shift */
 } __attribute__((packed));
 
+/*
+ * Producer-side statistics, on a cache line of their own so that
+ * readers polling them never bounce the writer-hot cache line. Only
+ * updated on slow paths.
+ */
+struct lttng_ust_lib_ring_buffer_stats {
+	union v_atomic reserve_slow;	/* Reservations through slow path */
+	union v_atomic reserve_retry;	/* Offset cmpxchg retries */
+	union v_atomic switch_timer;	/* Switches forced by switch timer */
+	union v_atomic switch_flush;	/* Switches forced by flush */
+} __attribute__((aligned(CAA_CACHE_LINE_SIZE)));
+
 struct lttng_ust_lib_ring_buffer {
 	/* First 32 bytes are for the buffer crash dump ABI */
 	struct lttng_crash_abi crash_abi;
 
-	/* 32 bytes cache-hot cacheline */
-	union v_atomic __attribute__((aligned(32))) offset;
+	/*
+	 * Writer-hot cache line: updated or read by every reserve and
+	 * commit. Never written by the reader.
+	 */
+	union v_atomic __attribute__((aligned(CAA_CACHE_LINE_SIZE))) offset;
 					/* Current offset in the buffer */
+	union v_atomic last_tsc;	/*
+					 * Last timestamp written in the buffer.
+					 */
 	DECLARE_SHMP(struct commit_counters_hot, commit_hot);
 					/* Commit count per sub-buffer */
-	long consumed;			/*
+	int record_disabled;
+	/* End of writer-hot cache line */
+
+	/*
+	 * Reader-hot cache line: updated by the reader for each
+	 * sub-buffer. Writers only read it on sub-buffer switch and
+	 * delivery.
+	 */
+	long __attribute__((aligned(CAA_CACHE_LINE_SIZE))) consumed;
+					/*
 					 * Current offset in the buffer
 					 * standard atomic access (shared)
 					 */
-	int record_disabled;
-	/* End of cache-hot 32 bytes cacheline */
-
-	union v_atomic last_tsc;	/*
-					 * Last timestamp written in the buffer.
+	long active_readers;		/*
+					 * Active readers count
+					 * standard atomic access (shared)
 					 */
+	int32_t wakeup_state;		/*
+					 * Futex wakeup state
+					 * (enum rb_wakeup_state)
+					 */
+	unsigned long get_subbuf_consumed;	/* Read-side consumed */
+	unsigned long prod_snapshot;	/* Producer count snapshot */
+	unsigned long cons_snapshot;	/* Consumer count snapshot */
+	unsigned int get_subbuf:1;	/* Sub-buffer being held by reader */
+	/* End of reader-hot cache line */
 
-	struct lttng_ust_lib_ring_buffer_backend backend;
+	/* Cold fields, starting on a new cache line. */
+	struct lttng_ust_lib_ring_buffer_backend
+		__attribute__((aligned(CAA_CACHE_LINE_SIZE))) backend;
 					/* Associated backend */
 
 	DECLARE_SHMP(struct commit_counters_cold, commit_cold);
 					/* Commit count per sub-buffer */
-	long active_readers;		/*
-					 * Active readers count
-					 * standard atomic access (shared)
-					 */
 					/* Dropped records */
 	union v_atomic records_lost_full;	/* Buffer full */
 	union v_atomic records_lost_wrap;	/* Nested wrap-around */
 	union v_atomic records_lost_big;	/* Events too big */
 	union v_atomic records_count;	/* Number of records written */
 	union v_atomic records_overrun;	/* Number of overwritten records */
+	union v_atomic records_truncated;	/* Strings cut to fit */
 	//wait_queue_head_t read_wait;	/* reader buffer-level wait queue */
 	int finalized;			/* buffer has been finalized */
-	unsigned long get_subbuf_consumed;	/* Read-side consumed */
-	unsigned long prod_snapshot;	/* Producer count snapshot */
-	unsigned long cons_snapshot;	/* Consumer count snapshot */
-	unsigned int get_subbuf:1;	/* Sub-buffer being held by reader */
 	/* shmp pointer to self */
 	DECLARE_SHMP(struct lttng_ust_lib_ring_buffer, self);
+	int32_t lazy_state;		/* enum rb_lazy_state */
+	int32_t reset_disabled;		/* Disabled by reset, pool exhausted */
+	struct lttng_ust_lib_ring_buffer_stats stats;
 	char padding[RB_RING_BUFFER_PADDING];
 } __attribute__((aligned(CAA_CACHE_LINE_SIZE)));
 
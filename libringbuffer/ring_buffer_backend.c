@@ -25,12 +25,324 @@
 #include <limits.h>
 
 #include <lttng/ringbuffer-config.h>
+#include <lttng/ust-abi.h>
 #include "vatomic.h"
 #include "backend.h"
 #include "frontend.h"
 #include "smp.h"
 #include "shm.h"
 
+/*
+ * Lock-free stack of free pool entries. Pool entries are never unmapped,
+ * so reading the link of an entry concurrently popped by another writer
+ * is harmless: the generation count makes the following cmpxchg fail.
+ */
+static
+unsigned long lib_ring_buffer_pool_pop(struct lttng_ust_lib_ring_buffer_backend *bufb,
+				       struct lttng_ust_shm_handle *handle)
+{
+	struct lttng_ust_lib_ring_buffer_pool *pool;
+	unsigned long head, new_head, idx;
+
+	pool = shmp(handle, bufb->pool);
+	if (!pool)
+		return RB_POOL_NONE;
+	head = uatomic_read(&pool->head);
+	for (;;) {
+		struct lttng_ust_lib_ring_buffer_backend_pages_shmp *sbp;
+		struct lttng_ust_lib_ring_buffer_backend_pages *pages;
+		unsigned long old_head;
+
+		idx = head & RB_POOL_INDEX_MASK;
+		if (idx == RB_POOL_NONE)
+			return RB_POOL_NONE;
+		cmm_smp_read_barrier_depends();
+		sbp = shmp_index(handle, bufb->array, idx);
+		if (!sbp)
+			return RB_POOL_NONE;
+		pages = shmp(handle, sbp->shmp);
+		if (!pages)
+			return RB_POOL_NONE;
+		new_head = ((head >> RB_POOL_GEN_SHIFT) + 1) << RB_POOL_GEN_SHIFT;
+		new_head |= CMM_LOAD_SHARED(pages->pool_next) & RB_POOL_INDEX_MASK;
+		old_head = uatomic_cmpxchg(&pool->head, head, new_head);
+		if (old_head == head)
+			break;
+		head = old_head;
+	}
+	uatomic_dec(&pool->nr_free);
+	return idx;
+}
+
+static
+void lib_ring_buffer_pool_push(struct lttng_ust_lib_ring_buffer_backend *bufb,
+			       unsigned long idx,
+			       struct lttng_ust_shm_handle *handle)
+{
+	struct lttng_ust_lib_ring_buffer_pool *pool;
+	struct lttng_ust_lib_ring_buffer_backend_pages_shmp *sbp;
+	struct lttng_ust_lib_ring_buffer_backend_pages *pages;
+	unsigned long head, new_head, old_head;
+
+	pool = shmp(handle, bufb->pool);
+	if (!pool)
+		return;
+	sbp = shmp_index(handle, bufb->array, idx);
+	if (!sbp)
+		return;
+	pages = shmp(handle, sbp->shmp);
+	if (!pages)
+		return;
+	head = uatomic_read(&pool->head);
+	for (;;) {
+		/* Link is published by the cmpxchg full memory barrier. */
+		CMM_STORE_SHARED(pages->pool_next, head & RB_POOL_INDEX_MASK);
+		new_head = ((head >> RB_POOL_GEN_SHIFT) + 1) << RB_POOL_GEN_SHIFT;
+		new_head |= idx;
+		old_head = uatomic_cmpxchg(&pool->head, head, new_head);
+		if (old_head == head)
+			break;
+		head = old_head;
+	}
+	uatomic_inc(&pool->nr_free);
+}
+
+/**
+ * lib_ring_buffer_pool_fill - give pages to a writer sub-buffer
+ * @config: ring buffer instance configuration
+ * @bufb: buffer backend
+ * @idx: sub-buffer index within the buffer
+ * @handle: shared memory handle
+ *
+ * Called by the writer before it starts writing into sub-buffer @idx,
+ * once it knows the reader is done with it. Takes an entry from the
+ * channel pool if the sub-buffer holds no pages. Returns 0 on success,
+ * -ENOBUFS if the pool is exhausted.
+ */
+int lib_ring_buffer_pool_fill(const struct lttng_ust_lib_ring_buffer_config *config,
+			      struct lttng_ust_lib_ring_buffer_backend *bufb,
+			      unsigned long idx,
+			      struct lttng_ust_shm_handle *handle)
+{
+	struct lttng_ust_lib_ring_buffer_backend_subbuffer *sb;
+	unsigned long id, old_id;
+
+	sb = shmp_index(handle, bufb->buf_wsb, idx);
+	if (!sb)
+		return -ENOBUFS;
+	/*
+	 * Read the consumed position (done by the caller) before the
+	 * sub-buffer ID. Matches the memory barrier implied by the
+	 * uatomic_xchg() in lib_ring_buffer_pool_release().
+	 */
+	cmm_smp_rmb();
+	if (caa_likely(CMM_LOAD_SHARED(sb->id) != RB_POOL_NONE))
+		return 0;
+	id = lib_ring_buffer_pool_pop(bufb, handle);
+	if (id == RB_POOL_NONE)
+		return -ENOBUFS;
+	old_id = uatomic_cmpxchg(&sb->id, RB_POOL_NONE,
+				 subbuffer_id(config, 0, 1, id));
+	if (old_id != RB_POOL_NONE) {
+		/* A nested writer filled the sub-buffer first. */
+		lib_ring_buffer_pool_push(bufb, id, handle);
+	}
+	return 0;
+}
+
+/**
+ * lib_ring_buffer_pool_release - give the pages of a sub-buffer back
+ * @config: ring buffer instance configuration
+ * @bufb: buffer backend
+ * @idx: sub-buffer index within the buffer
+ * @handle: shared memory handle
+ *
+ * Called by the reader once it is done with sub-buffer @idx, before it
+ * moves the consumed position past it.
+ */
+void lib_ring_buffer_pool_release(const struct lttng_ust_lib_ring_buffer_config *config,
+				  struct lttng_ust_lib_ring_buffer_backend *bufb,
+				  unsigned long idx,
+				  struct lttng_ust_shm_handle *handle)
+{
+	struct lttng_ust_lib_ring_buffer_backend_subbuffer *sb;
+	struct lttng_ust_lib_ring_buffer_backend_pages_shmp *sbp;
+	struct lttng_ust_lib_ring_buffer_backend_pages *pages;
+	unsigned long id;
+
+	sb = shmp_index(handle, bufb->buf_wsb, idx);
+	if (!sb)
+		return;
+	id = uatomic_xchg(&sb->id, RB_POOL_NONE);
+	if (id == RB_POOL_NONE)
+		return;
+	id = subbuffer_id_get_index(config, id);
+	sbp = shmp_index(handle, bufb->array, id);
+	if (!sbp)
+		return;
+	pages = shmp(handle, sbp->shmp);
+	if (!pages)
+		return;
+	v_set(config, &pages->records_commit, 0);
+	v_set(config, &pages->records_unread, 0);
+	pages->data_size = 0;
+	lib_ring_buffer_pool_push(bufb, id, handle);
+}
+
+/*
+ * Allocate the packet index of a sub-buffer in the shm object of its
+ * data, which must be set beforehand.
+ */
+static
+int lib_ring_buffer_index_create(struct lttng_ust_lib_ring_buffer_backend_pages *pages,
+				 struct lttng_ust_shm_handle *handle,
+				 struct shm_object *shmobj)
+{
+	struct shm_ref ref;
+
+	align_shm(shmobj, __alignof__(struct lttng_ust_lib_ring_buffer_packet_index));
+	ref = zalloc_shm(shmobj,
+			sizeof(struct lttng_ust_lib_ring_buffer_packet_index));
+	if (caa_unlikely(ref.index < 0 || ref.index != pages->p._ref.index))
+		return -ENOMEM;
+	pages->index_offset = ref.offset;
+	if (caa_unlikely(!subbuffer_packet_index(pages, handle)))
+		return -ENOMEM;
+	return 0;
+}
+
+/*
+ * Allocate the channel sub-buffer pool within the shared memory of the
+ * first buffer. All entries start on the free list.
+ */
+static
+int lib_ring_buffer_pool_create(struct lttng_ust_lib_ring_buffer_backend *bufb,
+				struct channel *chan,
+				struct lttng_ust_shm_handle *handle,
+				struct shm_object *shmobj)
+{
+	const struct lttng_ust_lib_ring_buffer_config *config = &chan->backend.config;
+	unsigned long subbuf_size = chan->backend.subbuf_size;
+	unsigned long num_subbuf_pool = chan->pool_num_subbuf;
+	struct lttng_ust_lib_ring_buffer_pool *pool;
+	unsigned long i, mmap_offset = 0;
+	long page_size;
+
+	page_size = sysconf(_SC_PAGE_SIZE);
+	if (page_size <= 0)
+		return -ENOMEM;
+
+	align_shm(shmobj, __alignof__(struct lttng_ust_lib_ring_buffer_pool));
+	set_shmp(bufb->pool, zalloc_shm(shmobj,
+			sizeof(struct lttng_ust_lib_ring_buffer_pool)));
+	pool = shmp(handle, bufb->pool);
+	if (caa_unlikely(!pool))
+		return -ENOMEM;
+	pool->head = RB_POOL_NONE;
+
+	align_shm(shmobj, __alignof__(struct lttng_ust_lib_ring_buffer_backend_pages_shmp));
+	set_shmp(bufb->array, zalloc_shm(shmobj,
+			sizeof(struct lttng_ust_lib_ring_buffer_backend_pages_shmp) * num_subbuf_pool));
+	if (caa_unlikely(!shmp(handle, bufb->array)))
+		return -ENOMEM;
+
+	align_shm(shmobj, page_size);
+	set_shmp(bufb->memory_map, zalloc_shm(shmobj,
+			subbuf_size * num_subbuf_pool));
+	if (caa_unlikely(!shmp(handle, bufb->memory_map)))
+		return -ENOMEM;
+
+	for (i = 0; i < num_subbuf_pool; i++) {
+		struct lttng_ust_lib_ring_buffer_backend_pages_shmp *sbp;
+		struct lttng_ust_lib_ring_buffer_backend_pages *pages;
+		struct shm_ref ref;
+
+		sbp = shmp_index(handle, bufb->array, i);
+		if (!sbp)
+			return -ENOMEM;
+		align_shm(shmobj, __alignof__(struct lttng_ust_lib_ring_buffer_backend_pages));
+		set_shmp(sbp->shmp, zalloc_shm(shmobj,
+				sizeof(struct lttng_ust_lib_ring_buffer_backend_pages)));
+		pages = shmp(handle, sbp->shmp);
+		if (!pages)
+			return -ENOMEM;
+		ref.index = bufb->memory_map._ref.index;
+		ref.offset = bufb->memory_map._ref.offset + i * subbuf_size;
+		set_shmp(pages->p, ref);
+		if (config->output == RING_BUFFER_MMAP) {
+			pages->mmap_offset = mmap_offset;
+			mmap_offset += subbuf_size;
+		}
+		if ((chan->flags & LTTNG_UST_CHAN_FLAG_PACKET_INDEX)
+				&& lib_ring_buffer_index_create(pages, handle, shmobj))
+			return -ENOMEM;
+	}
+	/* Push in reverse order so entries are handed out in address order. */
+	for (i = num_subbuf_pool; i-- > 0; )
+		lib_ring_buffer_pool_push(bufb, i, handle);
+	return 0;
+}
+
+/*
+ * Buffer backend allocation in sub-buffer pool mode: the buffer only
+ * owns its sub-buffer tables. Its pages array and memory map are the
+ * ones of the channel pool, so sub-buffer IDs are pool indexes.
+ */
+static
+int lib_ring_buffer_backend_allocate_pool(const struct lttng_ust_lib_ring_buffer_config *config,
+					  struct lttng_ust_lib_ring_buffer_backend *bufb,
+					  size_t num_subbuf,
+					  struct lttng_ust_shm_handle *handle,
+					  struct shm_object *shmobj)
+{
+	struct channel *chan;
+	unsigned long i;
+	int ret;
+
+	chan = shmp(handle, bufb->chan);
+	if (!chan)
+		return -EINVAL;
+
+	if (bufb->cpu == 0) {
+		ret = lib_ring_buffer_pool_create(bufb, chan, handle, shmobj);
+		if (ret)
+			return ret;
+	} else {
+		struct lttng_ust_lib_ring_buffer *buf0;
+
+		buf0 = shmp(handle, chan->backend.buf[0].shmp);
+		if (!buf0)
+			return -EINVAL;
+		set_shmp(bufb->pool, buf0->backend.pool._ref);
+		set_shmp(bufb->array, buf0->backend.array._ref);
+		set_shmp(bufb->memory_map, buf0->backend.memory_map._ref);
+	}
+
+	/* Allocate write-side subbuffer table, initially without pages */
+	align_shm(shmobj, __alignof__(struct lttng_ust_lib_ring_buffer_backend_subbuffer));
+	set_shmp(bufb->buf_wsb, zalloc_shm(shmobj,
+				sizeof(struct lttng_ust_lib_ring_buffer_backend_subbuffer)
+				* num_subbuf));
+	if (caa_unlikely(!shmp(handle, bufb->buf_wsb)))
+		return -ENOMEM;
+	for (i = 0; i < num_subbuf; i++)
+		shmp_index(handle, bufb->buf_wsb, i)->id = RB_POOL_NONE;
+	bufb->buf_rsb.id = RB_POOL_NONE;
+
+	/* Allocate subbuffer packet counter table */
+	align_shm(shmobj, __alignof__(struct lttng_ust_lib_ring_buffer_backend_counts));
+	set_shmp(bufb->buf_cnt, zalloc_shm(shmobj,
+				sizeof(struct lttng_ust_lib_ring_buffer_backend_counts)
+				* num_subbuf));
+	if (caa_unlikely(!shmp(handle, bufb->buf_cnt)))
+		return -ENOMEM;
+
+	/* The first sub-buffer is started at buffer creation. */
+	if (lib_ring_buffer_pool_fill(config, bufb, 0, handle))
+		return -ENOMEM;
+	return 0;
+}
+
 /**
  * lib_ring_buffer_backend_allocate - allocate a channel buffer
  * @config: ring buffer instance configuration
@@ -47,15 +359,17 @@ int lib_ring_buffer_backend_allocate(const struct lttng_ust_lib_ring_buffer_conf
 				     struct lttng_ust_shm_handle *handle,
 				     struct shm_object *shmobj)
 {
+	struct channel *chan;
 	struct channel_backend *chanb;
 	unsigned long subbuf_size, mmap_offset = 0;
 	unsigned long num_subbuf_alloc;
 	unsigned long i;
 	long page_size;
 
-	chanb = &shmp(handle, bufb->chan)->backend;
-	if (!chanb)
+	chan = shmp(handle, bufb->chan);
+	if (!chan)
 		return -EINVAL;
+	chanb = &chan->backend;
 
 	subbuf_size = chanb->subbuf_size;
 	num_subbuf_alloc = num_subbuf;
@@ -147,6 +461,9 @@ int lib_ring_buffer_backend_allocate(const struct lttng_ust_lib_ring_buffer_conf
 			pages->mmap_offset = mmap_offset;
 			mmap_offset += subbuf_size;
 		}
+		if ((chan->flags & LTTNG_UST_CHAN_FLAG_PACKET_INDEX)
+				&& lib_ring_buffer_index_create(pages, handle, shmobj))
+			goto free_array;
 	}
 	return 0;
 
@@ -171,19 +488,28 @@ int lib_ring_buffer_backend_create(struct lttng_ust_lib_ring_buffer_backend *buf
 	set_shmp(bufb->chan, handle->chan._ref);
 	bufb->cpu = cpu;
 
+	if (caa_container_of(chanb, struct channel, backend)->pool_num_subbuf)
+		return lib_ring_buffer_backend_allocate_pool(config, bufb,
+						chanb->num_subbuf,
+						handle, shmobj);
 	return lib_ring_buffer_backend_allocate(config, bufb, chanb->buf_size,
 						chanb->num_subbuf,
 						chanb->extra_reader_sb,
 						handle, shmobj);
 }
 
-void lib_ring_buffer_backend_reset(struct lttng_ust_lib_ring_buffer_backend *bufb,
-				   struct lttng_ust_shm_handle *handle)
+/*
+ * Returns 0 on success, -ENOBUFS if the sub-buffer pool has no pages left
+ * for the first sub-buffer.
+ */
+int lib_ring_buffer_backend_reset(struct lttng_ust_lib_ring_buffer_backend *bufb,
+				  struct lttng_ust_shm_handle *handle)
 {
 	struct channel_backend *chanb;
 	const struct lttng_ust_lib_ring_buffer_config *config;
 	unsigned long num_subbuf_alloc;
 	unsigned int i;
+	int ret;
 
 	chanb = &shmp(handle, bufb->chan)->backend;
 	if (!chanb)
@@ -194,6 +520,38 @@ void lib_ring_buffer_backend_reset(struct lttng_ust_lib_ring_buffer_backend *buf
 	if (chanb->extra_reader_sb)
 		num_subbuf_alloc++;
 
+	if (caa_container_of(chanb, struct channel, backend)->pool_num_subbuf) {
+		struct lttng_ust_lib_ring_buffer_backend_pages_shmp *sbp;
+		struct lttng_ust_lib_ring_buffer_backend_pages *pages;
+		unsigned long sb_bindex;
+
+		/*
+		 * Pool entries are shared with the other buffers of the
+		 * channel: give back the ones held by this buffer, except
+		 * for the first sub-buffer, started again by the frontend.
+		 */
+		for (i = 1; i < chanb->num_subbuf; i++)
+			lib_ring_buffer_pool_release(config, bufb, i, handle);
+		bufb->buf_rsb.id = RB_POOL_NONE;
+		v_set(config, &bufb->records_read, 0);
+		ret = lib_ring_buffer_pool_fill(config, bufb, 0, handle);
+		if (ret)
+			return ret;
+		/* The first sub-buffer may keep the pages it held. */
+		sb_bindex = subbuffer_id_get_index(config,
+				shmp_index(handle, bufb->buf_wsb, 0)->id);
+		sbp = shmp_index(handle, bufb->array, sb_bindex);
+		if (!sbp)
+			abort();
+		pages = shmp(handle, sbp->shmp);
+		if (!pages)
+			abort();
+		v_set(config, &pages->records_commit, 0);
+		v_set(config, &pages->records_unread, 0);
+		pages->data_size = 0;
+		return 0;
+	}
+
 	for (i = 0; i < chanb->num_subbuf; i++) {
 		struct lttng_ust_lib_ring_buffer_backend_subbuffer *sb;
 
@@ -226,6 +584,7 @@ void lib_ring_buffer_backend_reset(struct lttng_ust_lib_ring_buffer_backend *buf
 	}
 	/* Don't reset num_pages_per_subbuf, cpu, allocated */
 	v_set(config, &bufb->records_read, 0);
+	return 0;
 }
 
 /*
@@ -272,9 +631,9 @@ int channel_backend_init(struct channel_backend *chanb,
 			 const int *stream_fds)
 {
 	struct channel *chan = caa_container_of(chanb, struct channel, backend);
-	unsigned int i;
+	unsigned int i, shm_flags = 0;
 	int ret;
-	size_t shmsize = 0, num_subbuf_alloc;
+	size_t shmsize = 0, pool_shmsize, num_subbuf_alloc;
 	long page_size;
 
 	if (!name)
@@ -306,6 +665,13 @@ int channel_backend_init(struct channel_backend *chanb,
 	ret = subbuffer_id_check_index(config, num_subbuf);
 	if (ret)
 		return ret;
+	/*
+	 * Each buffer of a pooled channel holds at least the sub-buffer
+	 * it is writing into.
+	 */
+	if (chan->pool_num_subbuf && (chan->pool_num_subbuf < num_possible_cpus()
+			|| chan->pool_num_subbuf >= RB_POOL_NONE))
+		return -EINVAL;
 
 	chanb->buf_size = num_subbuf * subbuf_size;
 	chanb->subbuf_size = subbuf_size;
@@ -324,32 +690,74 @@ int channel_backend_init(struct channel_backend *chanb,
 	shmsize += sizeof(struct lttng_ust_lib_ring_buffer);
 
 	/* Per-cpu buffer size: backend */
-	/* num_subbuf + 1 is the worse case */
-	num_subbuf_alloc = num_subbuf + 1;
-	shmsize += offset_align(shmsize, __alignof__(struct lttng_ust_lib_ring_buffer_backend_pages_shmp));
-	shmsize += sizeof(struct lttng_ust_lib_ring_buffer_backend_pages_shmp) * num_subbuf_alloc;
-	shmsize += offset_align(shmsize, page_size);
-	shmsize += subbuf_size * num_subbuf_alloc;
-	shmsize += offset_align(shmsize, __alignof__(struct lttng_ust_lib_ring_buffer_backend_pages));
-	shmsize += sizeof(struct lttng_ust_lib_ring_buffer_backend_pages) * num_subbuf_alloc;
+	if (!chan->pool_num_subbuf) {
+		/* num_subbuf + 1 is the worse case */
+		num_subbuf_alloc = num_subbuf + 1;
+		shmsize += offset_align(shmsize, __alignof__(struct lttng_ust_lib_ring_buffer_backend_pages_shmp));
+		shmsize += sizeof(struct lttng_ust_lib_ring_buffer_backend_pages_shmp) * num_subbuf_alloc;
+		shmsize += offset_align(shmsize, page_size);
+		shmsize += subbuf_size * num_subbuf_alloc;
+		shmsize += offset_align(shmsize, __alignof__(struct lttng_ust_lib_ring_buffer_backend_pages));
+		shmsize += sizeof(struct lttng_ust_lib_ring_buffer_backend_pages) * num_subbuf_alloc;
+		/* Packet indexes are interleaved with the backend pages. */
+		if (chan->flags & LTTNG_UST_CHAN_FLAG_PACKET_INDEX)
+			shmsize += (__alignof__(struct lttng_ust_lib_ring_buffer_packet_index)
+				+ sizeof(struct lttng_ust_lib_ring_buffer_packet_index))
+				* num_subbuf_alloc;
+	}
 	shmsize += offset_align(shmsize, __alignof__(struct lttng_ust_lib_ring_buffer_backend_subbuffer));
 	shmsize += sizeof(struct lttng_ust_lib_ring_buffer_backend_subbuffer) * num_subbuf;
+	shmsize += offset_align(shmsize, __alignof__(struct lttng_ust_lib_ring_buffer_backend_counts));
+	shmsize += sizeof(struct lttng_ust_lib_ring_buffer_backend_counts) * num_subbuf;
 	/* Per-cpu buffer size: control (after backend) */
 	shmsize += offset_align(shmsize, __alignof__(struct commit_counters_hot));
 	shmsize += sizeof(struct commit_counters_hot) * num_subbuf;
 	shmsize += offset_align(shmsize, __alignof__(struct commit_counters_cold));
 	shmsize += sizeof(struct commit_counters_cold) * num_subbuf;
 
-	if (config->alloc == RING_BUFFER_ALLOC_PER_CPU) {
+	/* First buffer also holds the channel sub-buffer pool. */
+	pool_shmsize = shmsize;
+	if (chan->pool_num_subbuf) {
+		size_t num_subbuf_pool = chan->pool_num_subbuf;
+
+		pool_shmsize += offset_align(pool_shmsize, __alignof__(struct lttng_ust_lib_ring_buffer_pool));
+		pool_shmsize += sizeof(struct lttng_ust_lib_ring_buffer_pool);
+		pool_shmsize += offset_align(pool_shmsize, __alignof__(struct lttng_ust_lib_ring_buffer_backend_pages_shmp));
+		pool_shmsize += sizeof(struct lttng_ust_lib_ring_buffer_backend_pages_shmp) * num_subbuf_pool;
+		pool_shmsize += offset_align(pool_shmsize, page_size);
+		pool_shmsize += subbuf_size * num_subbuf_pool;
+		pool_shmsize += offset_align(pool_shmsize, __alignof__(struct lttng_ust_lib_ring_buffer_backend_pages));
+		pool_shmsize += sizeof(struct lttng_ust_lib_ring_buffer_backend_pages) * num_subbuf_pool;
+		/* Packet indexes are interleaved with the backend pages. */
+		if (chan->flags & LTTNG_UST_CHAN_FLAG_PACKET_INDEX)
+			pool_shmsize += (__alignof__(struct lttng_ust_lib_ring_buffer_packet_index)
+				+ sizeof(struct lttng_ust_lib_ring_buffer_packet_index))
+				* num_subbuf_pool;
+	}
+
+	if (chan->flags & LTTNG_UST_CHAN_FLAG_HUGEPAGES)
+		shm_flags |= SHM_OBJECT_FLAG_HUGEPAGES;
+	if (chan->flags & LTTNG_UST_CHAN_FLAG_NUMA)
+		shm_flags |= SHM_OBJECT_FLAG_NUMA;
+	if ((chan->flags & LTTNG_UST_CHAN_FLAG_LAZY_ALLOC)
+			&& config->alloc != RING_BUFFER_ALLOC_GLOBAL)
+		shm_flags |= SHM_OBJECT_FLAG_LAZY;
+
+	if (config->alloc != RING_BUFFER_ALLOC_GLOBAL) {
 		struct lttng_ust_lib_ring_buffer *buf;
 		/*
-		 * We need to allocate for all possible cpus.
+		 * We need to allocate for all possible cpus, or for all
+		 * the thread streams of per-thread channels.
 		 */
-		for_each_possible_cpu(i) {
+		for_each_channel_cpu(i, chan) {
 			struct shm_object *shmobj;
 
-			shmobj = shm_object_table_alloc(handle->table, shmsize,
-					SHM_OBJECT_SHM, stream_fds[i]);
+			shmobj = shm_object_table_alloc(handle->table,
+					i ? shmsize : pool_shmsize,
+					SHM_OBJECT_SHM, stream_fds[i],
+					config->alloc == RING_BUFFER_ALLOC_PER_CPU ?
+						i : -1,
+					shm_flags);
 			if (!shmobj)
 				goto end;
 			align_shm(shmobj, __alignof__(struct lttng_ust_lib_ring_buffer));
@@ -368,7 +776,8 @@ int channel_backend_init(struct channel_backend *chanb,
 		struct lttng_ust_lib_ring_buffer *buf;
 
 		shmobj = shm_object_table_alloc(handle->table, shmsize,
-					SHM_OBJECT_SHM, stream_fds[0]);
+					SHM_OBJECT_SHM, stream_fds[0],
+					-1, shm_flags);
 		if (!shmobj)
 			goto end;
 		align_shm(shmobj, __alignof__(struct lttng_ust_lib_ring_buffer));
@@ -534,6 +943,95 @@ void *lib_ring_buffer_read_offset_address(struct lttng_ust_lib_ring_buffer_backe
 	return shmp_index(handle, shmp(handle, rpages->shmp)->p, offset & (chanb->subbuf_size - 1));
 }
 
+/**
+ * lib_ring_buffer_read_packet_index - get the index of the sub-buffer being read
+ * @bufb : buffer backend
+ * @handle : shared memory handle
+ *
+ * Return the packet index of the sub-buffer held by the reader, or NULL
+ * if the channel was created without LTTNG_UST_CHAN_FLAG_PACKET_INDEX.
+ * Should be protected by get_subbuf/put_subbuf.
+ */
+struct lttng_ust_lib_ring_buffer_packet_index *
+lib_ring_buffer_read_packet_index(struct lttng_ust_lib_ring_buffer_backend *bufb,
+				  struct lttng_ust_shm_handle *handle)
+{
+	struct lttng_ust_lib_ring_buffer_backend_pages_shmp *rpages;
+	struct lttng_ust_lib_ring_buffer_backend_pages *pages;
+	const struct lttng_ust_lib_ring_buffer_config *config;
+	struct channel *chan;
+
+	chan = shmp(handle, bufb->chan);
+	if (!chan)
+		return NULL;
+	if (!(chan->flags & LTTNG_UST_CHAN_FLAG_PACKET_INDEX))
+		return NULL;
+	config = &chan->backend.config;
+	rpages = shmp_index(handle, bufb->array,
+			subbuffer_id_get_index(config, bufb->buf_rsb.id));
+	if (!rpages)
+		return NULL;
+	pages = shmp(handle, rpages->shmp);
+	if (!pages)
+		return NULL;
+	return subbuffer_packet_index(pages, handle);
+}
+
+/**
+ * lib_ring_buffer_index_finalize - complete the index of a delivered sub-buffer
+ * @config : ring buffer instance configuration
+ * @bufb : buffer backend
+ * @idx : sub-buffer index within the buffer
+ * @handle : shared memory handle
+ *
+ * Called from the client buffer_end callback, while the caller has
+ * exclusive access to sub-buffer @idx: all records are committed, and
+ * neither writers nor the reader can use it yet. Moves the samples of
+ * the packet to the entries read by the consumer, and clears them for
+ * the next packet written in these pages.
+ */
+void lib_ring_buffer_index_finalize(const struct lttng_ust_lib_ring_buffer_config *config,
+				    struct lttng_ust_lib_ring_buffer_backend *bufb,
+				    unsigned long idx,
+				    struct lttng_ust_shm_handle *handle)
+{
+	struct lttng_ust_lib_ring_buffer_backend_subbuffer *wsb;
+	struct lttng_ust_lib_ring_buffer_backend_pages_shmp *sbp;
+	struct lttng_ust_lib_ring_buffer_backend_pages *pages;
+	struct lttng_ust_lib_ring_buffer_packet_index *index;
+	struct channel *chan;
+	unsigned int i, nr_entries = 0;
+
+	chan = shmp(handle, bufb->chan);
+	if (!chan)
+		return;
+	if (!(chan->flags & LTTNG_UST_CHAN_FLAG_PACKET_INDEX))
+		return;
+	wsb = shmp_index(handle, bufb->buf_wsb, idx);
+	if (!wsb)
+		return;
+	sbp = shmp_index(handle, bufb->array,
+			subbuffer_id_get_index(config, wsb->id));
+	if (!sbp)
+		return;
+	pages = shmp(handle, sbp->shmp);
+	if (!pages)
+		return;
+	index = subbuffer_packet_index(pages, handle);
+	if (!index)
+		return;
+	for (i = 0; i < RB_PACKET_INDEX_ENTRIES; i++) {
+		struct lttng_ust_lib_ring_buffer_index_entry *sample;
+
+		sample = &index->samples[i];
+		if (!sample->offset)
+			continue;
+		index->entries[nr_entries++] = *sample;
+		sample->offset = 0;
+	}
+	index->nr_entries = nr_entries;
+}
+
 /**
  * lib_ring_buffer_offset_address - get address of a location within the buffer
  * @bufb : buffer backend
@@ -60,14 +60,17 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <time.h>
+#include <sys/timerfd.h>
 #include <urcu/compiler.h>
 #include <urcu/ref.h>
 #include <urcu/tls-compat.h>
+#include <urcu/futex.h>
 #include <poll.h>
 #include <helper.h>
 
 #include "smp.h"
 #include <lttng/ringbuffer-config.h>
+#include <lttng/ust-abi.h>
 #include "vatomic.h"
 #include "backend.h"
 #include "frontend.h"
@@ -78,9 +81,6 @@
 /* Print DBG() messages about events lost only every 1048576 hits */
 #define DBG_PRINT_NR_LOST	(1UL << 20)
 
-#define LTTNG_UST_RB_SIG_FLUSH		SIGRTMIN
-#define LTTNG_UST_RB_SIG_READ		SIGRTMIN + 1
-#define LTTNG_UST_RB_SIG_TEARDOWN	SIGRTMIN + 2
 #define CLOCKID		CLOCK_MONOTONIC
 #define LTTNG_UST_RING_BUFFER_GET_RETRY		10
 #define LTTNG_UST_RING_BUFFER_RETRY_DELAY_MS	10
@@ -118,6 +118,23 @@ struct switch_offsets {
 
 DEFINE_URCU_TLS(unsigned int, lib_ring_buffer_nesting);
 
+/*
+ * Stream index + 1 owned by the current thread in
+ * RING_BUFFER_ALLOC_PER_THREAD channels. 0 means not bound yet, -1 that
+ * all the streams were owned when the thread tried to bind.
+ */
+DEFINE_URCU_TLS(int, lib_ring_buffer_thread_stream);
+
+/*
+ * Per-thread stream slots, one bit per stream index, set while a live
+ * thread owns the index. The same index is used in all the per-thread
+ * channels. Released on thread exit by the thread_stream_key destructor.
+ */
+static unsigned long thread_stream_map[RING_BUFFER_MAX_THREAD_STREAMS
+		/ CAA_BITS_PER_LONG];
+static pthread_key_t thread_stream_key;
+static int thread_stream_key_created;
+
 /*
  * wakeup_fd_mutex protects wakeup fd use by timer from concurrent
  * close.
@@ -130,22 +147,33 @@ void lib_ring_buffer_print_errors(struct channel *chan,
 				struct lttng_ust_shm_handle *handle);
 
 /*
- * Handle timer teardown race wrt memory free of private data by
- * ring buffer signals are handled by a single thread, which permits
- * a synchronization point between handling of each signal.
- * Protected by the lock within the structure.
+ * Switch and read timers of all channels are serviced by a single
+ * thread, woken up by a timerfd armed for the earliest deadline.
+ * Deadlines are aligned on a multiple of the timer period, so timers
+ * of channels sharing a period (or a multiple of it) expire together
+ * and are serviced within a single wakeup. The lock protects the timer
+ * list and is held while timers are serviced, which synchronizes timer
+ * removal with the service thread.
  */
-struct timer_signal_data {
-	pthread_t tid;	/* thread id managing signals */
+struct lib_ring_buffer_timer {
+	struct cds_list_head node;	/* timer_service.timers */
+	struct channel *chan;
+	void (*cb)(struct channel *chan);
+	uint64_t period;		/* ns */
+	uint64_t deadline;		/* ns, CLOCKID time base */
+};
+
+struct timer_service_data {
+	int timerfd;
 	int setup_done;
-	int qs_done;
+	struct cds_list_head timers;
 	pthread_mutex_t lock;
 };
 
-static struct timer_signal_data timer_signal = {
-	.tid = 0,
+static struct timer_service_data timer_service = {
+	.timerfd = -1,
 	.setup_done = 0,
-	.qs_done = 0,
+	.timers = CDS_LIST_HEAD_INIT(timer_service.timers),
 	.lock = PTHREAD_MUTEX_INITIALIZER,
 };
 
@@ -180,15 +208,39 @@ void lib_ring_buffer_reset(struct lttng_ust_lib_ring_buffer *buf,
 		v_set(config, &shmp_index(handle, buf->commit_cold, i)->cc_sb, 0);
 	}
 	uatomic_set(&buf->consumed, 0);
-	uatomic_set(&buf->record_disabled, 0);
 	v_set(config, &buf->last_tsc, 0);
-	lib_ring_buffer_backend_reset(&buf->backend, handle);
+	/*
+	 * record_disabled also counts lib_ring_buffer_record_disable()
+	 * callers and lazy allocation: only take or drop the count owned
+	 * by reset.
+	 */
+	if (lib_ring_buffer_backend_reset(&buf->backend, handle)) {
+		/*
+		 * The sub-buffer pool has no pages left to restart the
+		 * first sub-buffer: keep writers out of this buffer.
+		 */
+		DBG("ring buffer %s, cpu %d: sub-buffer pool exhausted on reset, "
+			"disabling buffer\n", chan->backend.name,
+			buf->backend.cpu);
+		if (!buf->reset_disabled) {
+			buf->reset_disabled = 1;
+			uatomic_inc(&buf->record_disabled);
+		}
+	} else if (buf->reset_disabled) {
+		buf->reset_disabled = 0;
+		uatomic_dec(&buf->record_disabled);
+	}
 	/* Don't reset number of active readers */
 	v_set(config, &buf->records_lost_full, 0);
 	v_set(config, &buf->records_lost_wrap, 0);
 	v_set(config, &buf->records_lost_big, 0);
 	v_set(config, &buf->records_count, 0);
 	v_set(config, &buf->records_overrun, 0);
+	v_set(config, &buf->records_truncated, 0);
+	v_set(config, &buf->stats.reserve_slow, 0);
+	v_set(config, &buf->stats.reserve_retry, 0);
+	v_set(config, &buf->stats.switch_timer, 0);
+	v_set(config, &buf->stats.switch_flush, 0);
 	buf->finalized = 0;
 }
 
@@ -301,6 +353,34 @@ void init_crash_abi(const struct lttng_ust_lib_ring_buffer_config *config,
 		crash_abi->offset.packet_size = 0;
 		crash_abi->length.packet_size = 0;
 	}
+
+	/* last_tsc is only saved by the timestamp compression scheme. */
+	crash_abi->tsc_offset.last_tsc =
+		(uint32_t) ((char *) &buf->last_tsc - (char *) buf);
+	if (config->tsc_bits == 0 || config->tsc_bits == 64)
+		crash_abi->tsc_length.last_tsc = 0;
+	else
+		crash_abi->tsc_length.last_tsc = sizeof(buf->last_tsc);
+#if (CAA_BITS_PER_LONG == 32)
+	crash_abi->last_tsc_shift = config->tsc_bits;
+#else
+	crash_abi->last_tsc_shift = 0;
+#endif
+	if (config->cb.timestamp_fields) {
+		size_t begin_offset, end_offset, length;
+
+		config->cb.timestamp_fields(config, &begin_offset,
+				&end_offset, &length);
+		crash_abi->tsc_offset.timestamp_begin = begin_offset;
+		crash_abi->tsc_offset.timestamp_end = end_offset;
+		crash_abi->tsc_length.timestamp_begin = length;
+		crash_abi->tsc_length.timestamp_end = length;
+	} else {
+		crash_abi->tsc_offset.timestamp_begin = 0;
+		crash_abi->tsc_offset.timestamp_end = 0;
+		crash_abi->tsc_length.timestamp_begin = 0;
+		crash_abi->tsc_length.timestamp_end = 0;
+	}
 }
 
 /*
@@ -365,6 +445,16 @@ int lib_ring_buffer_create(struct lttng_ust_lib_ring_buffer *buf,
 
 	init_crash_abi(config, &buf->crash_abi, buf, chanb, shmobj, handle);
 
+	/*
+	 * Lazily allocated buffers stay disabled until their first
+	 * writer materializes them (see lib_ring_buffer_materialize()).
+	 */
+	if ((chan->flags & LTTNG_UST_CHAN_FLAG_LAZY_ALLOC)
+			&& config->alloc != RING_BUFFER_ALLOC_GLOBAL) {
+		buf->lazy_state = RB_LAZY_PENDING;
+		uatomic_set(&buf->record_disabled, 1);
+	}
+
 	buf->backend.allocated = 1;
 	return 0;
 
@@ -378,35 +468,34 @@ free_chanbuf:
 }
 
 static
-void lib_ring_buffer_channel_switch_timer(int sig, siginfo_t *si, void *uc)
+void lib_ring_buffer_channel_switch_timer(struct channel *chan)
 {
 	const struct lttng_ust_lib_ring_buffer_config *config;
 	struct lttng_ust_shm_handle *handle;
-	struct channel *chan;
 	int cpu;
 
-	assert(CMM_LOAD_SHARED(timer_signal.tid) == pthread_self());
-
-	chan = si->si_value.sival_ptr;
 	handle = chan->handle;
 	config = &chan->backend.config;
 
 	DBG("Switch timer for channel %p\n", chan);
 
+	if (config->cb.channel_timer)
+		config->cb.channel_timer(chan);
 	/*
 	 * Only flush buffers periodically if readers are active.
 	 */
 	pthread_mutex_lock(&wakeup_fd_mutex);
-	if (config->alloc == RING_BUFFER_ALLOC_PER_CPU) {
-		for_each_possible_cpu(cpu) {
+	if (config->alloc != RING_BUFFER_ALLOC_GLOBAL) {
+		for_each_channel_cpu(cpu, chan) {
 			struct lttng_ust_lib_ring_buffer *buf =
 				shmp(handle, chan->backend.buf[cpu].shmp);
 
 			if (!buf)
 				abort();
-			if (uatomic_read(&buf->active_readers))
-				lib_ring_buffer_switch_slow(buf, SWITCH_ACTIVE,
-					chan->handle);
+			if (uatomic_read(&buf->active_readers)
+					&& lib_ring_buffer_switch_slow(buf,
+						SWITCH_ACTIVE, chan->handle))
+				v_inc(config, &buf->stats.switch_timer);
 		}
 	} else {
 		struct lttng_ust_lib_ring_buffer *buf =
@@ -414,9 +503,10 @@ void lib_ring_buffer_channel_switch_timer(int sig, siginfo_t *si, void *uc)
 
 		if (!buf)
 			abort();
-		if (uatomic_read(&buf->active_readers))
-			lib_ring_buffer_switch_slow(buf, SWITCH_ACTIVE,
-				chan->handle);
+		if (uatomic_read(&buf->active_readers)
+				&& lib_ring_buffer_switch_slow(buf,
+					SWITCH_ACTIVE, chan->handle))
+			v_inc(config, &buf->stats.switch_timer);
 	}
 	pthread_mutex_unlock(&wakeup_fd_mutex);
 	return;
@@ -464,14 +554,41 @@ int lib_ring_buffer_poll_deliver(const struct lttng_ust_lib_ring_buffer_config *
 	return 1;
 }
 
+/*
+ * Post the delivery in shared memory, and only wake up the reader if
+ * it is parked on the futex. No system call is issued while a wakeup
+ * is already pending.
+ */
+static
+void lib_ring_buffer_futex_wakeup(struct lttng_ust_lib_ring_buffer *buf)
+{
+	if (CMM_LOAD_SHARED(buf->wakeup_state) == RB_WAKEUP_PENDING)
+		return;
+	if (uatomic_xchg(&buf->wakeup_state, RB_WAKEUP_PENDING)
+			!= RB_WAKEUP_WAITING)
+		return;
+	if (futex_async(&buf->wakeup_state, FUTEX_WAKE, 1,
+			NULL, NULL, 0) < 0) {
+		PERROR("futex");
+	}
+}
+
 static
 void lib_ring_buffer_wakeup(struct lttng_ust_lib_ring_buffer *buf,
 		struct lttng_ust_shm_handle *handle)
 {
-	int wakeup_fd = shm_get_wakeup_fd(handle, &buf->self._ref);
+	struct channel *chan = shmp(handle, buf->backend.chan);
+	int wakeup_fd;
 	sigset_t sigpipe_set, pending_set, old_set;
 	int ret, sigpipe_was_pending = 0;
 
+	if (!chan)
+		return;
+	if (chan->flags & LTTNG_UST_CHAN_FLAG_FUTEX_WAKEUP) {
+		lib_ring_buffer_futex_wakeup(buf);
+		return;
+	}
+	wakeup_fd = shm_get_wakeup_fd(handle, &buf->self._ref);
 	if (wakeup_fd < 0)
 		return;
 
@@ -529,6 +646,37 @@ void lib_ring_buffer_wakeup(struct lttng_ust_lib_ring_buffer *buf,
 	}
 }
 
+/*
+ * Called by writers finding the buffer record-disabled. If the buffer
+ * is pending lazy allocation, the first writer allocates its shm and
+ * enables it. Only uses atomic operations and system calls, so that
+ * the first writer can be a signal handler. Concurrent writers, and
+ * signal handlers nested over the materializing writer, drop their
+ * record rather than wait. The reader is woken up so that it learns
+ * about the new stream.
+ *
+ * Returns 0 if the buffer can now be written to, -EAGAIN otherwise.
+ */
+int lib_ring_buffer_materialize(struct lttng_ust_lib_ring_buffer *buf,
+		struct lttng_ust_shm_handle *handle)
+{
+	if (CMM_LOAD_SHARED(buf->lazy_state) != RB_LAZY_PENDING)
+		return -EAGAIN;
+	if (uatomic_cmpxchg(&buf->lazy_state, RB_LAZY_PENDING,
+			RB_LAZY_MATERIALIZING) != RB_LAZY_PENDING)
+		return -EAGAIN;
+	if (shm_materialize(handle, &buf->self._ref)) {
+		CMM_STORE_SHARED(buf->lazy_state, RB_LAZY_FAILED);
+		return -EAGAIN;
+	}
+	/* Pages are allocated before the buffer is seen active. */
+	cmm_smp_mb();
+	CMM_STORE_SHARED(buf->lazy_state, RB_LAZY_ACTIVE);
+	uatomic_dec(&buf->record_disabled);
+	lib_ring_buffer_wakeup(buf, handle);
+	return uatomic_read(&buf->record_disabled) ? -EAGAIN : 0;
+}
+
 static
 void lib_ring_buffer_channel_do_read(struct channel *chan)
 {
@@ -543,8 +691,8 @@ void lib_ring_buffer_channel_do_read(struct channel *chan)
 	 * Only flush buffers periodically if readers are active.
 	 */
 	pthread_mutex_lock(&wakeup_fd_mutex);
-	if (config->alloc == RING_BUFFER_ALLOC_PER_CPU) {
-		for_each_possible_cpu(cpu) {
+	if (config->alloc != RING_BUFFER_ALLOC_GLOBAL) {
+		for_each_channel_cpu(cpu, chan) {
 			struct lttng_ust_lib_ring_buffer *buf =
 				shmp(handle, chan->backend.buf[cpu].shmp);
 
@@ -572,206 +720,212 @@ void lib_ring_buffer_channel_do_read(struct channel *chan)
 }
 
 static
-void lib_ring_buffer_channel_read_timer(int sig, siginfo_t *si, void *uc)
+void lib_ring_buffer_channel_read_timer(struct channel *chan)
 {
-	struct channel *chan;
+	const struct lttng_ust_lib_ring_buffer_config *config =
+		&chan->backend.config;
 
-	assert(CMM_LOAD_SHARED(timer_signal.tid) == pthread_self());
-	chan = si->si_value.sival_ptr;
 	DBG("Read timer for channel %p\n", chan);
+	if (config->cb.channel_timer)
+		config->cb.channel_timer(chan);
 	lib_ring_buffer_channel_do_read(chan);
 	return;
 }
 
 static
-void rb_setmask(sigset_t *mask)
+uint64_t timer_service_now(void)
 {
-	int ret;
+	struct timespec ts;
 
-	ret = sigemptyset(mask);
-	if (ret) {
-		PERROR("sigemptyset");
-	}
-	ret = sigaddset(mask, LTTNG_UST_RB_SIG_FLUSH);
-	if (ret) {
-		PERROR("sigaddset");
-	}
-	ret = sigaddset(mask, LTTNG_UST_RB_SIG_READ);
-	if (ret) {
-		PERROR("sigaddset");
+	if (clock_gettime(CLOCKID, &ts))
+		abort();
+	return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/*
+ * Next deadline strictly after "now", aligned on the timer period so
+ * timers with related periods expire at the same time.
+ */
+static
+uint64_t timer_service_next_deadline(uint64_t now, uint64_t period)
+{
+	return (now / period + 1) * period;
+}
+
+/*
+ * Arm the timerfd for the earliest deadline, or disarm it when there
+ * is no timer left. Called with timer_service.lock held.
+ */
+static
+void timer_service_arm(void)
+{
+	struct lib_ring_buffer_timer *timer;
+	struct itimerspec its;
+	uint64_t next = 0;
+
+	cds_list_for_each_entry(timer, &timer_service.timers, node) {
+		if (!next || timer->deadline < next)
+			next = timer->deadline;
 	}
-	ret = sigaddset(mask, LTTNG_UST_RB_SIG_TEARDOWN);
-	if (ret) {
-		PERROR("sigaddset");
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = next / 1000000000ULL;
+	its.it_value.tv_nsec = next % 1000000000ULL;
+	if (timerfd_settime(timer_service.timerfd, TFD_TIMER_ABSTIME,
+			&its, NULL) < 0) {
+		PERROR("timerfd_settime");
 	}
 }
 
 static
-void *sig_thread(void *arg)
+void *timer_service_thread(void *arg)
 {
-	sigset_t mask;
-	siginfo_t info;
-	int signr;
-
-	/* Only self thread will receive signal mask. */
-	rb_setmask(&mask);
-	CMM_STORE_SHARED(timer_signal.tid, pthread_self());
+	uint64_t expirations;
+	ssize_t len;
 
 	for (;;) {
-		signr = sigwaitinfo(&mask, &info);
-		if (signr == -1) {
+		struct lib_ring_buffer_timer *timer;
+		uint64_t now;
+
+		len = read(timer_service.timerfd, &expirations,
+			sizeof(expirations));
+		if (len < 0) {
 			if (errno != EINTR)
-				PERROR("sigwaitinfo");
+				PERROR("read timerfd");
 			continue;
 		}
-		if (signr == LTTNG_UST_RB_SIG_FLUSH) {
-			lib_ring_buffer_channel_switch_timer(info.si_signo,
-					&info, NULL);
-		} else if (signr == LTTNG_UST_RB_SIG_READ) {
-			lib_ring_buffer_channel_read_timer(info.si_signo,
-					&info, NULL);
-		} else if (signr == LTTNG_UST_RB_SIG_TEARDOWN) {
-			cmm_smp_mb();
-			CMM_STORE_SHARED(timer_signal.qs_done, 1);
-			cmm_smp_mb();
-		} else {
-			ERR("Unexptected signal %d\n", info.si_signo);
+		pthread_mutex_lock(&timer_service.lock);
+		now = timer_service_now();
+		cds_list_for_each_entry(timer, &timer_service.timers, node) {
+			if (timer->deadline > now)
+				continue;
+			timer->cb(timer->chan);
+			/* Skip missed periods rather than catching up. */
+			timer->deadline = timer_service_next_deadline(now,
+						timer->period);
 		}
+		timer_service_arm();
+		pthread_mutex_unlock(&timer_service.lock);
 	}
 	return NULL;
 }
 
 /*
- * Ensure only a single thread listens on the timer signal.
+ * Ensure only a single thread services the timers. The thread blocks
+ * all signals: timers do not rely on signals, and the service thread
+ * should not handle the application's. Called with timer_service.lock
+ * held.
  */
 static
-void lib_ring_buffer_setup_timer_thread(void)
+int lib_ring_buffer_setup_timer_thread(void)
 {
+	sigset_t sig_all_blocked, orig_mask;
 	pthread_t thread;
 	int ret;
 
-	pthread_mutex_lock(&timer_signal.lock);
-	if (timer_signal.setup_done)
-		goto end;
+	if (timer_service.setup_done)
+		return 0;
 
-	ret = pthread_create(&thread, NULL, &sig_thread, NULL);
+	timer_service.timerfd = timerfd_create(CLOCKID, TFD_CLOEXEC);
+	if (timer_service.timerfd < 0) {
+		PERROR("timerfd_create");
+		return -1;
+	}
+	sigfillset(&sig_all_blocked);
+	ret = pthread_sigmask(SIG_SETMASK, &sig_all_blocked, &orig_mask);
+	if (ret) {
+		errno = ret;
+		PERROR("pthread_sigmask");
+	}
+	ret = pthread_create(&thread, NULL, &timer_service_thread, NULL);
 	if (ret) {
 		errno = ret;
 		PERROR("pthread_create");
 	}
+	if (pthread_sigmask(SIG_SETMASK, &orig_mask, NULL)) {
+		PERROR("pthread_sigmask");
+	}
+	if (ret) {
+		if (close(timer_service.timerfd))
+			PERROR("close");
+		timer_service.timerfd = -1;
+		return -1;
+	}
 	ret = pthread_detach(thread);
 	if (ret) {
 		errno = ret;
 		PERROR("pthread_detach");
 	}
-	timer_signal.setup_done = 1;
-end:
-	pthread_mutex_unlock(&timer_signal.lock);
+	timer_service.setup_done = 1;
+	return 0;
 }
 
-/*
- * Wait for signal-handling thread quiescent state.
- */
 static
-void lib_ring_buffer_wait_signal_thread_qs(unsigned int signr)
+struct lib_ring_buffer_timer *lib_ring_buffer_timer_add(struct channel *chan,
+		void (*cb)(struct channel *chan),
+		unsigned long interval)
 {
-	sigset_t pending_set;
-	int ret;
+	struct lib_ring_buffer_timer *timer;
 
-	/*
-	 * We need to be the only thread interacting with the thread
-	 * that manages signals for teardown synchronization.
-	 */
-	pthread_mutex_lock(&timer_signal.lock);
-
-	/*
-	 * Ensure we don't have any signal queued for this channel.
-	 */
-	for (;;) {
-		ret = sigemptyset(&pending_set);
-		if (ret == -1) {
-			PERROR("sigemptyset");
-		}
-		ret = sigpending(&pending_set);
-		if (ret == -1) {
-			PERROR("sigpending");
-		}
-		if (!sigismember(&pending_set, signr))
-			break;
-		caa_cpu_relax();
+	timer = zmalloc(sizeof(*timer));
+	if (!timer)
+		return NULL;
+	timer->chan = chan;
+	timer->cb = cb;
+	timer->period = (uint64_t) interval * 1000ULL;
+
+	pthread_mutex_lock(&timer_service.lock);
+	if (lib_ring_buffer_setup_timer_thread()) {
+		pthread_mutex_unlock(&timer_service.lock);
+		free(timer);
+		return NULL;
 	}
+	timer->deadline = timer_service_next_deadline(timer_service_now(),
+				timer->period);
+	cds_list_add(&timer->node, &timer_service.timers);
+	timer_service_arm();
+	pthread_mutex_unlock(&timer_service.lock);
+	return timer;
+}
 
-	/*
-	 * From this point, no new signal handler will be fired that
-	 * would try to access "chan". However, we still need to wait
-	 * for any currently executing handler to complete.
-	 */
-	cmm_smp_mb();
-	CMM_STORE_SHARED(timer_signal.qs_done, 0);
-	cmm_smp_mb();
-
-	/*
-	 * Kill with LTTNG_UST_RB_SIG_TEARDOWN, so signal management
-	 * thread wakes up.
-	 */
-	kill(getpid(), LTTNG_UST_RB_SIG_TEARDOWN);
-
-	while (!CMM_LOAD_SHARED(timer_signal.qs_done))
-		caa_cpu_relax();
-	cmm_smp_mb();
-
-	pthread_mutex_unlock(&timer_signal.lock);
+/*
+ * Once this returns, the timer callback is neither running nor will it
+ * run again.
+ */
+static
+void lib_ring_buffer_timer_remove(struct lib_ring_buffer_timer *timer)
+{
+	pthread_mutex_lock(&timer_service.lock);
+	cds_list_del(&timer->node);
+	timer_service_arm();
+	pthread_mutex_unlock(&timer_service.lock);
+	free(timer);
 }
 
 static
 void lib_ring_buffer_channel_switch_timer_start(struct channel *chan)
 {
-	struct sigevent sev;
-	struct itimerspec its;
-	int ret;
-
 	if (!chan->switch_timer_interval || chan->switch_timer_enabled)
 		return;
 
-	chan->switch_timer_enabled = 1;
-
-	lib_ring_buffer_setup_timer_thread();
-
-	sev.sigev_notify = SIGEV_SIGNAL;
-	sev.sigev_signo = LTTNG_UST_RB_SIG_FLUSH;
-	sev.sigev_value.sival_ptr = chan;
-	ret = timer_create(CLOCKID, &sev, &chan->switch_timer);
-	if (ret == -1) {
-		PERROR("timer_create");
-	}
-
-	its.it_value.tv_sec = chan->switch_timer_interval / 1000000;
-	its.it_value.tv_nsec = (chan->switch_timer_interval % 1000000) * 1000;
-	its.it_interval.tv_sec = its.it_value.tv_sec;
-	its.it_interval.tv_nsec = its.it_value.tv_nsec;
-
-	ret = timer_settime(chan->switch_timer, 0, &its, NULL);
-	if (ret == -1) {
-		PERROR("timer_settime");
+	chan->switch_timer = lib_ring_buffer_timer_add(chan,
+			lib_ring_buffer_channel_switch_timer,
+			chan->switch_timer_interval);
+	if (!chan->switch_timer) {
+		ERR("Cannot start switch timer for channel %p\n", chan);
+		return;
 	}
+	chan->switch_timer_enabled = 1;
 }
 
 static
 void lib_ring_buffer_channel_switch_timer_stop(struct channel *chan)
 {
-	int ret;
-
 	if (!chan->switch_timer_interval || !chan->switch_timer_enabled)
 		return;
 
-	ret = timer_delete(chan->switch_timer);
-	if (ret == -1) {
-		PERROR("timer_delete");
-	}
-
-	lib_ring_buffer_wait_signal_thread_qs(LTTNG_UST_RB_SIG_FLUSH);
+	lib_ring_buffer_timer_remove(chan->switch_timer);
 
-	chan->switch_timer = 0;
+	chan->switch_timer = NULL;
 	chan->switch_timer_enabled = 0;
 }
 
@@ -779,51 +933,31 @@ static
 void lib_ring_buffer_channel_read_timer_start(struct channel *chan)
 {
 	const struct lttng_ust_lib_ring_buffer_config *config = &chan->backend.config;
-	struct sigevent sev;
-	struct itimerspec its;
-	int ret;
 
 	if (config->wakeup != RING_BUFFER_WAKEUP_BY_TIMER
 			|| !chan->read_timer_interval || chan->read_timer_enabled)
 		return;
 
-	chan->read_timer_enabled = 1;
-
-	lib_ring_buffer_setup_timer_thread();
-
-	sev.sigev_notify = SIGEV_SIGNAL;
-	sev.sigev_signo = LTTNG_UST_RB_SIG_READ;
-	sev.sigev_value.sival_ptr = chan;
-	ret = timer_create(CLOCKID, &sev, &chan->read_timer);
-	if (ret == -1) {
-		PERROR("timer_create");
-	}
-
-	its.it_value.tv_sec = chan->read_timer_interval / 1000000;
-	its.it_value.tv_nsec = (chan->read_timer_interval % 1000000) * 1000;
-	its.it_interval.tv_sec = its.it_value.tv_sec;
-	its.it_interval.tv_nsec = its.it_value.tv_nsec;
-
-	ret = timer_settime(chan->read_timer, 0, &its, NULL);
-	if (ret == -1) {
-		PERROR("timer_settime");
+	chan->read_timer = lib_ring_buffer_timer_add(chan,
+			lib_ring_buffer_channel_read_timer,
+			chan->read_timer_interval);
+	if (!chan->read_timer) {
+		ERR("Cannot start read timer for channel %p\n", chan);
+		return;
 	}
+	chan->read_timer_enabled = 1;
 }
 
 static
 void lib_ring_buffer_channel_read_timer_stop(struct channel *chan)
 {
 	const struct lttng_ust_lib_ring_buffer_config *config = &chan->backend.config;
-	int ret;
 
 	if (config->wakeup != RING_BUFFER_WAKEUP_BY_TIMER
 			|| !chan->read_timer_interval || !chan->read_timer_enabled)
 		return;
 
-	ret = timer_delete(chan->read_timer);
-	if (ret == -1) {
-		PERROR("timer_delete");
-	}
+	lib_ring_buffer_timer_remove(chan->read_timer);
 
 	/*
 	 * do one more check to catch data that has been written in the last
@@ -831,9 +965,7 @@ void lib_ring_buffer_channel_read_timer_stop(struct channel *chan)
 	 */
 	lib_ring_buffer_channel_do_read(chan);
 
-	lib_ring_buffer_wait_signal_thread_qs(LTTNG_UST_RB_SIG_READ);
-
-	chan->read_timer = 0;
+	chan->read_timer = NULL;
 	chan->read_timer_enabled = 0;
 }
 
@@ -851,8 +983,8 @@ static void channel_print_errors(struct channel *chan,
 			&chan->backend.config;
 	int cpu;
 
-	if (config->alloc == RING_BUFFER_ALLOC_PER_CPU) {
-		for_each_possible_cpu(cpu) {
+	if (config->alloc != RING_BUFFER_ALLOC_GLOBAL) {
+		for_each_channel_cpu(cpu, chan) {
 			struct lttng_ust_lib_ring_buffer *buf =
 				shmp(handle, chan->backend.buf[cpu].shmp);
 			lib_ring_buffer_print_errors(chan, buf, cpu, handle);
@@ -892,6 +1024,9 @@ static void channel_free(struct channel *chan,
  * @read_timer_interval: Time interval (in us) to wake up pending readers.
  * @stream_fds: array of stream file descriptors.
  * @nr_stream_fds: number of file descriptors in array.
+ * @flags: channel creation flags (enum lttng_ust_chan_flags).
+ * @pool_num_subbuf: number of sub-buffers in the channel-wide pool, used
+ *                   with LTTNG_UST_CHAN_FLAG_SUBBUF_POOL.
  *
  * Holds cpu hotplug.
  * Returns NULL on failure.
@@ -905,7 +1040,8 @@ struct lttng_ust_shm_handle *channel_create(const struct lttng_ust_lib_ring_buff
 		   void *buf_addr, size_t subbuf_size,
 		   size_t num_subbuf, unsigned int switch_timer_interval,
 		   unsigned int read_timer_interval,
-		   const int *stream_fds, int nr_stream_fds)
+		   const int *stream_fds, int nr_stream_fds,
+		   uint32_t flags, size_t pool_num_subbuf)
 {
 	int ret;
 	size_t shmsize, chansize;
@@ -914,10 +1050,21 @@ struct lttng_ust_shm_handle *channel_create(const struct lttng_ust_lib_ring_buff
 	struct shm_object *shmobj;
 	unsigned int nr_streams;
 
-	if (config->alloc == RING_BUFFER_ALLOC_PER_CPU)
+	switch (config->alloc) {
+	case RING_BUFFER_ALLOC_PER_CPU:
 		nr_streams = num_possible_cpus();
-	else
+		break;
+	case RING_BUFFER_ALLOC_PER_THREAD:
+		/* The consumer chooses the number of thread streams. */
+		if (nr_stream_fds < 1
+				|| nr_stream_fds > RING_BUFFER_MAX_THREAD_STREAMS)
+			return NULL;
+		nr_streams = nr_stream_fds;
+		break;
+	default:
 		nr_streams = 1;
+		break;
+	}
 
 	if (nr_stream_fds != nr_streams)
 		return NULL;
@@ -931,7 +1078,7 @@ struct lttng_ust_shm_handle *channel_create(const struct lttng_ust_lib_ring_buff
 		return NULL;
 
 	/* Allocate table for channel + per-cpu buffers */
-	handle->table = shm_object_table_create(1 + num_possible_cpus());
+	handle->table = shm_object_table_create(1 + nr_streams);
 	if (!handle->table)
 		goto error_table_alloc;
 
@@ -946,7 +1093,7 @@ struct lttng_ust_shm_handle *channel_create(const struct lttng_ust_lib_ring_buff
 
 	/* Allocate normal memory for channel (not shared) */
 	shmobj = shm_object_table_alloc(handle->table, shmsize, SHM_OBJECT_MEM,
-			-1);
+			-1, -1, 0);
 	if (!shmobj)
 		goto error_append;
 	/* struct channel is at object 0, offset 0 (hardcoded) */
@@ -957,6 +1104,25 @@ struct lttng_ust_shm_handle *channel_create(const struct lttng_ust_lib_ring_buff
 	if (!chan)
 		goto error_append;
 	chan->nr_streams = nr_streams;
+	/*
+	 * The sub-buffer pool is only implemented for per-cpu buffers in
+	 * discard mode: overwrite mode already exchanges sub-buffers with
+	 * the reader. Pool memory is allocated up front, so it supersedes
+	 * lazy allocation.
+	 */
+	if ((flags & LTTNG_UST_CHAN_FLAG_SUBBUF_POOL)
+			&& (config->alloc != RING_BUFFER_ALLOC_PER_CPU
+				|| config->mode != RING_BUFFER_DISCARD
+				|| !pool_num_subbuf))
+		flags &= ~LTTNG_UST_CHAN_FLAG_SUBBUF_POOL;
+	if (flags & LTTNG_UST_CHAN_FLAG_SUBBUF_POOL) {
+		flags &= ~LTTNG_UST_CHAN_FLAG_LAZY_ALLOC;
+		chan->pool_num_subbuf = pool_num_subbuf;
+	}
+	/* Thread streams only get memory once a thread owns them. */
+	if (config->alloc == RING_BUFFER_ALLOC_PER_THREAD)
+		flags |= LTTNG_UST_CHAN_FLAG_LAZY_ALLOC;
+	chan->flags = flags;
 
 	/* space for private data */
 	if (priv_data_size) {
@@ -1005,13 +1171,21 @@ struct lttng_ust_shm_handle *channel_handle_create(void *data,
 {
 	struct lttng_ust_shm_handle *handle;
 	struct shm_object *object;
+	unsigned int nr_streams = num_possible_cpus();
+
+	/* Per-thread channels may have more streams than cpus. */
+	if (memory_map_size >= sizeof(struct channel)
+			&& ((struct channel *) data)->nr_streams > nr_streams
+			&& ((struct channel *) data)->nr_streams
+				<= RING_BUFFER_MAX_THREAD_STREAMS)
+		nr_streams = ((struct channel *) data)->nr_streams;
 
 	handle = zmalloc(sizeof(struct lttng_ust_shm_handle));
 	if (!handle)
 		return NULL;
 
 	/* Allocate table for channel + per-cpu buffers */
-	handle->table = shm_object_table_create(1 + num_possible_cpus());
+	handle->table = shm_object_table_create(1 + nr_streams);
 	if (!handle->table)
 		goto error_table_alloc;
 	/* Add channel object */
@@ -1036,11 +1210,19 @@ int channel_handle_add_stream(struct lttng_ust_shm_handle *handle,
 		uint64_t memory_map_size)
 {
 	struct shm_object *object;
+	struct channel *chan;
+	unsigned int shm_flags = 0;
+
+	chan = shmp(handle, handle->chan);
+	if (!chan)
+		return -EINVAL;
+	if (chan->flags & LTTNG_UST_CHAN_FLAG_HUGEPAGES)
+		shm_flags |= SHM_OBJECT_FLAG_HUGEPAGES;
 
 	/* Add stream object */
 	object = shm_object_table_append_shm(handle->table,
 			shm_fd, wakeup_fd, stream_nr,
-			memory_map_size);
+			memory_map_size, shm_flags);
 	if (!object)
 		return -EINVAL;
 	return 0;
@@ -1052,6 +1234,19 @@ unsigned int channel_handle_get_nr_streams(struct lttng_ust_shm_handle *handle)
 	return handle->table->allocated_len - 1;
 }
 
+unsigned int channel_handle_get_nr_hugepage_streams(struct lttng_ust_shm_handle *handle)
+{
+	unsigned int i, nr = 0;
+
+	assert(handle->table);
+	/* Object 0 is the channel, streams follow. */
+	for (i = 1; i < handle->table->allocated_len; i++) {
+		if (handle->table->objects[i].hugepages)
+			nr++;
+	}
+	return nr;
+}
+
 static
 void channel_release(struct channel *chan, struct lttng_ust_shm_handle *handle)
 {
@@ -1104,7 +1299,7 @@ struct lttng_ust_lib_ring_buffer *channel_get_ring_buffer(
 	if (config->alloc == RING_BUFFER_ALLOC_GLOBAL) {
 		cpu = 0;
 	} else {
-		if (cpu >= num_possible_cpus())
+		if (cpu >= chan->nr_streams)
 			return NULL;
 	}
 	ref = &chan->backend.buf[cpu].shmp._ref;
@@ -1146,7 +1341,7 @@ int ring_buffer_stream_close_wait_fd(const struct lttng_ust_lib_ring_buffer_conf
 	if (config->alloc == RING_BUFFER_ALLOC_GLOBAL) {
 		cpu = 0;
 	} else {
-		if (cpu >= num_possible_cpus())
+		if (cpu >= chan->nr_streams)
 			return -EINVAL;
 	}
 	ref = &chan->backend.buf[cpu].shmp._ref;
@@ -1164,7 +1359,7 @@ int ring_buffer_stream_close_wakeup_fd(const struct lttng_ust_lib_ring_buffer_co
 	if (config->alloc == RING_BUFFER_ALLOC_GLOBAL) {
 		cpu = 0;
 	} else {
-		if (cpu >= num_possible_cpus())
+		if (cpu >= chan->nr_streams)
 			return -EINVAL;
 	}
 	ref = &chan->backend.buf[cpu].shmp._ref;
@@ -1193,6 +1388,66 @@ void lib_ring_buffer_release_read(struct lttng_ust_lib_ring_buffer *buf,
 	uatomic_dec(&buf->active_readers);
 }
 
+/**
+ * lib_ring_buffer_wait_wakeup - wait for a sub-buffer delivery
+ * @buf: ring buffer
+ * @handle: shared memory handle
+ * @timeout_ms: timeout in milliseconds, -1 to wait forever
+ *
+ * Only for channels created with LTTNG_UST_CHAN_FLAG_FUTEX_WAKEUP.
+ * Returns immediately if a sub-buffer was delivered since the last
+ * call. Like with the wakeup pipe, the reader should consume all
+ * available sub-buffers after each return, before waiting again.
+ *
+ * Returns 0 on wakeup, -ETIMEDOUT on timeout, or another negative
+ * error value.
+ */
+int lib_ring_buffer_wait_wakeup(struct lttng_ust_lib_ring_buffer *buf,
+				struct lttng_ust_shm_handle *handle,
+				int timeout_ms)
+{
+	struct channel *chan = shmp(handle, buf->backend.chan);
+	struct timespec timeout, *ptimeout = NULL;
+	int ret = 0;
+
+	if (!chan)
+		return -EPERM;
+	if (!(chan->flags & LTTNG_UST_CHAN_FLAG_FUTEX_WAKEUP))
+		return -EINVAL;
+	if (timeout_ms >= 0) {
+		timeout.tv_sec = timeout_ms / 1000;
+		timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+		ptimeout = &timeout;
+	}
+	if (uatomic_cmpxchg(&buf->wakeup_state, RB_WAKEUP_IDLE,
+			RB_WAKEUP_WAITING) == RB_WAKEUP_PENDING)
+		goto end;
+
+	while (futex_async(&buf->wakeup_state, FUTEX_WAIT,
+			RB_WAKEUP_WAITING, ptimeout, NULL, 0)) {
+		switch (errno) {
+		case EWOULDBLOCK:
+			/* Value already changed. */
+			goto end;
+		case EINTR:
+			/* Retry if interrupted by signal. */
+			break;
+		case ETIMEDOUT:
+			ret = -ETIMEDOUT;
+			goto end;
+		default:
+			ret = -errno;
+			goto end;
+		}
+	}
+end:
+	/* Consume the pending wakeup, or stop waiting. */
+	if (uatomic_xchg(&buf->wakeup_state, RB_WAKEUP_IDLE)
+			== RB_WAKEUP_PENDING)
+		ret = 0;
+	return ret;
+}
+
 /**
  * lib_ring_buffer_snapshot - save subbuffer position snapshot (for read)
  * @buf: ring buffer
@@ -1252,6 +1507,58 @@ nodata:
 		return -EAGAIN;
 }
 
+/**
+ * lib_ring_buffer_snapshot_incremental - snapshot only the new sub-buffers
+ * @buf: ring buffer
+ * @consumed: position where to start reading (output)
+ * @produced: position where to stop reading (output)
+ * @prev_produced: produced position of the previous incremental snapshot
+ *                 of this buffer, or NULL for the first one.
+ * @lost: number of sub-buffers overwritten since @prev_produced, before
+ *        they could be part of a snapshot (output)
+ *
+ * Like lib_ring_buffer_snapshot(), but the range starts where the
+ * previous incremental snapshot ended, so sub-buffers already exported
+ * are skipped. If the writer has lapped the previous position (overwrite
+ * mode), the range starts at the oldest sub-buffer still in the buffer
+ * and the overwritten sub-buffers are accounted in @lost. Sub-buffers can
+ * still be overwritten while the range is read: lib_ring_buffer_get_subbuf()
+ * then fails for them.
+ *
+ * Returns -ENODATA if buffer is finalized, -EAGAIN if no sub-buffer was
+ * completed since the previous snapshot, or 0 on success.
+ */
+int lib_ring_buffer_snapshot_incremental(struct lttng_ust_lib_ring_buffer *buf,
+			     unsigned long *consumed, unsigned long *produced,
+			     const unsigned long *prev_produced,
+			     unsigned long *lost,
+			     struct lttng_ust_shm_handle *handle)
+{
+	struct channel *chan = shmp(handle, buf->backend.chan);
+	unsigned long consumed_cur, produced_cur;
+	int ret;
+
+	ret = lib_ring_buffer_snapshot(buf, &consumed_cur, &produced_cur,
+			handle);
+	if (ret)
+		return ret;
+	*lost = 0;
+	if (prev_produced) {
+		if ((long) (*prev_produced - consumed_cur) >= 0) {
+			/* Positions are free-running: compare the difference. */
+			consumed_cur = *prev_produced;
+			if (consumed_cur == produced_cur)
+				return -EAGAIN;
+		} else {
+			*lost = (consumed_cur - *prev_produced)
+				>> chan->backend.subbuf_size_order;
+		}
+	}
+	*consumed = consumed_cur;
+	*produced = produced_cur;
+	return 0;
+}
+
 /**
  * lib_ring_buffer_move_consumer - move consumed counter forward
  * @buf: ring buffer
@@ -1273,6 +1580,22 @@ void lib_ring_buffer_move_consumer(struct lttng_ust_lib_ring_buffer *buf,
 	 * the writer in flight recorder mode.
 	 */
 	consumed = uatomic_read(&buf->consumed);
+	if (chan->pool_num_subbuf) {
+		unsigned long start = subbuf_trunc(consumed, chan), cons;
+
+		/*
+		 * Give the pages of the sub-buffers we are done with back
+		 * to the channel pool before the writer may reuse them.
+		 * Only the reader moves the consumed position in
+		 * producer-consumer mode.
+		 */
+		for (cons = start;
+		     (long) (cons - consumed_new) < 0
+		     && cons - start < chan->backend.buf_size;
+		     cons += chan->backend.subbuf_size)
+			lib_ring_buffer_pool_release(&chan->backend.config,
+					bufb, subbuf_index(cons, chan), handle);
+	}
 	while ((long) consumed - (long) consumed_new < 0)
 		consumed = uatomic_cmpxchg(&buf->consumed, consumed,
 					   consumed_new);
@@ -1589,6 +1912,11 @@ void lib_ring_buffer_print_errors(struct channel *chan,
 				v_read(config, &buf->records_lost_full),
 				v_read(config, &buf->records_lost_wrap),
 				v_read(config, &buf->records_lost_big));
+		if (v_read(config, &buf->records_truncated))
+			DBG("ring buffer %s, cpu %d: %lu records with strings "
+				"truncated or padded to fit\n",
+				chan->backend.name, cpu,
+				v_read(config, &buf->records_truncated));
 	}
 	lib_ring_buffer_print_buffer_errors(buf, chan, priv, cpu, handle);
 }
@@ -1804,6 +2132,14 @@ int lib_ring_buffer_try_switch_slow(enum switch_mode mode,
 				 * and we are full : don't switch.
 				 */
 				return -1;
+			} else if (caa_unlikely(chan->pool_num_subbuf
+					&& lib_ring_buffer_pool_fill(config,
+						&buf->backend, sb_index, handle))) {
+				/*
+				 * No pages left in the channel sub-buffer
+				 * pool to write the header : don't switch.
+				 */
+				return -1;
 			} else {
 				/*
 				 * Next subbuffer not being written to, and we
@@ -1841,9 +2177,11 @@ int lib_ring_buffer_try_switch_slow(enum switch_mode mode,
  * Note, however, that as a v_cmpxchg is used for some atomic
  * operations, this function must be called from the CPU which owns the buffer
  * for a ACTIVE flush.
+ *
+ * Returns 1 if a switch was performed, 0 if none was needed.
  */
-void lib_ring_buffer_switch_slow(struct lttng_ust_lib_ring_buffer *buf, enum switch_mode mode,
-				 struct lttng_ust_shm_handle *handle)
+int lib_ring_buffer_switch_slow(struct lttng_ust_lib_ring_buffer *buf, enum switch_mode mode,
+				struct lttng_ust_shm_handle *handle)
 {
 	struct channel *chan = shmp(handle, buf->backend.chan);
 	const struct lttng_ust_lib_ring_buffer_config *config = &chan->backend.config;
@@ -1851,17 +2189,24 @@ void lib_ring_buffer_switch_slow(struct lttng_ust_lib_ring_buffer *buf, enum swi
 	unsigned long oldidx;
 	uint64_t tsc;
 
+	/* Never touch the pages of a buffer not materialized yet. */
+	if (CMM_LOAD_SHARED(buf->lazy_state) != RB_LAZY_ACTIVE)
+		return 0;
+
 	offsets.size = 0;
 
 	/*
 	 * Perform retryable operations.
 	 */
-	do {
+	for (;;) {
 		if (lib_ring_buffer_try_switch_slow(mode, buf, chan, &offsets,
 						    &tsc, handle))
-			return;	/* Switch not needed */
-	} while (v_cmpxchg(config, &buf->offset, offsets.old, offsets.end)
-		 != offsets.old);
+			return 0;	/* Switch not needed */
+		if (caa_likely(v_cmpxchg(config, &buf->offset, offsets.old,
+				offsets.end) == offsets.old))
+			break;
+		v_inc(config, &buf->stats.reserve_retry);
+	}
 
 	/*
 	 * Atomically update last_tsc. This update races against concurrent
@@ -1891,6 +2236,36 @@ void lib_ring_buffer_switch_slow(struct lttng_ust_lib_ring_buffer *buf, enum swi
 	 * Switch old subbuffer.
 	 */
 	lib_ring_buffer_switch_old_end(buf, chan, &offsets, tsc, handle);
+	return 1;
+}
+
+/*
+ * Size of a batch of nr_records records starting at offset "begin", each
+ * with its own record header. Sets the padding before the first header.
+ */
+static
+size_t lib_ring_buffer_batch_size(const struct lttng_ust_lib_ring_buffer_config *config,
+				  struct channel *chan, unsigned long begin,
+				  size_t *pre_header_padding,
+				  struct lttng_ust_lib_ring_buffer_ctx *ctx,
+				  unsigned int nr_records)
+{
+	size_t size = 0;
+	unsigned int i;
+
+	for (i = 0; i < nr_records; i++) {
+		size_t padding;
+
+		size += config->cb.record_header_size(config, chan,
+						begin + size, &padding, ctx);
+		if (!i)
+			*pre_header_padding = padding;
+		size += lib_ring_buffer_align(begin + size, ctx->largest_align)
+			+ ctx->data_size;
+		ctx->rflags |= RING_BUFFER_RFLAG_BATCH_NEXT;
+	}
+	ctx->rflags &= ~RING_BUFFER_RFLAG_BATCH_NEXT;
+	return size;
 }
 
 /*
@@ -1904,7 +2279,8 @@ static
 int lib_ring_buffer_try_reserve_slow(struct lttng_ust_lib_ring_buffer *buf,
 				     struct channel *chan,
 				     struct switch_offsets *offsets,
-				     struct lttng_ust_lib_ring_buffer_ctx *ctx)
+				     struct lttng_ust_lib_ring_buffer_ctx *ctx,
+				     unsigned int nr_records)
 {
 	const struct lttng_ust_lib_ring_buffer_config *config = &chan->backend.config;
 	struct lttng_ust_shm_handle *handle = ctx->handle;
@@ -1928,14 +2304,10 @@ retry:
 	if (caa_unlikely(subbuf_offset(offsets->begin, ctx->chan) == 0)) {
 		offsets->switch_new_start = 1;		/* For offsets->begin */
 	} else {
-		offsets->size = config->cb.record_header_size(config, chan,
+		offsets->size = lib_ring_buffer_batch_size(config, chan,
 						offsets->begin,
 						&offsets->pre_header_padding,
-						ctx);
-		offsets->size +=
-			lib_ring_buffer_align(offsets->begin + offsets->size,
-					      ctx->largest_align)
-			+ ctx->data_size;
+						ctx, nr_records);
 		if (caa_unlikely(subbuf_offset(offsets->begin, chan) +
 			     offsets->size > chan->backend.subbuf_size)) {
 			offsets->switch_old_end = 1;	/* For offsets->old */
@@ -1994,13 +2366,31 @@ retry:
 				 * and we are full : record is lost.
 				 */
 				nr_lost = v_read(config, &buf->records_lost_full);
-				v_inc(config, &buf->records_lost_full);
+				v_add(config, nr_records, &buf->records_lost_full);
 				if ((nr_lost & (DBG_PRINT_NR_LOST - 1)) == 0) {
 					DBG("%lu or more records lost in (%s:%d) (buffer full)\n",
 						nr_lost + 1, chan->backend.name,
 						buf->backend.cpu);
 				}
 				return -ENOBUFS;
+			} else if (caa_unlikely(chan->pool_num_subbuf
+					&& lib_ring_buffer_pool_fill(config,
+						&buf->backend, sb_index, handle))) {
+				unsigned long nr_lost;
+
+				/*
+				 * The reader is done with the next subbuffer,
+				 * but the channel sub-buffer pool has no
+				 * pages left to back it : record is lost.
+				 */
+				nr_lost = v_read(config, &buf->records_lost_full);
+				v_add(config, nr_records, &buf->records_lost_full);
+				if ((nr_lost & (DBG_PRINT_NR_LOST - 1)) == 0) {
+					DBG("%lu or more records lost in (%s:%d) (sub-buffer pool empty)\n",
+						nr_lost + 1, chan->backend.name,
+						buf->backend.cpu);
+				}
+				return -ENOBUFS;
 			} else {
 				/*
 				 * Next subbuffer not being written to, and we
@@ -2020,7 +2410,7 @@ retry:
 			 * many nested writes over a reserve/commit pair.
 			 */
 			nr_lost = v_read(config, &buf->records_lost_wrap);
-			v_inc(config, &buf->records_lost_wrap);
+			v_add(config, nr_records, &buf->records_lost_wrap);
 			if ((nr_lost & (DBG_PRINT_NR_LOST - 1)) == 0) {
 				DBG("%lu or more records lost in (%s:%d) (wrap-around)\n",
 					nr_lost + 1, chan->backend.name,
@@ -2028,15 +2418,10 @@ retry:
 			}
 			return -EIO;
 		}
-		offsets->size =
-			config->cb.record_header_size(config, chan,
+		offsets->size = lib_ring_buffer_batch_size(config, chan,
 						offsets->begin,
 						&offsets->pre_header_padding,
-						ctx);
-		offsets->size +=
-			lib_ring_buffer_align(offsets->begin + offsets->size,
-					      ctx->largest_align)
-			+ ctx->data_size;
+						ctx, nr_records);
 		if (caa_unlikely(subbuf_offset(offsets->begin, chan)
 			     + offsets->size > chan->backend.subbuf_size)) {
 			unsigned long nr_lost;
@@ -2046,7 +2431,7 @@ retry:
 			 * complete the sub-buffer switch.
 			 */
 			nr_lost = v_read(config, &buf->records_lost_big);
-			v_inc(config, &buf->records_lost_big);
+			v_add(config, nr_records, &buf->records_lost_big);
 			if ((nr_lost & (DBG_PRINT_NR_LOST - 1)) == 0) {
 				DBG("%lu or more records lost in (%s:%d) record size "
 					" of %zu bytes is too large for buffer\n",
@@ -2081,12 +2466,14 @@ retry:
 /**
  * lib_ring_buffer_reserve_slow - Atomic slot reservation in a buffer.
  * @ctx: ring buffer context.
+ * @nr_records: number of records reserved together in the slot.
  *
  * Return : -NOBUFS if not enough space, -ENOSPC if event size too large,
  * -EIO for other errors, else returns 0.
  * It will take care of sub-buffer switching.
  */
-int lib_ring_buffer_reserve_slow(struct lttng_ust_lib_ring_buffer_ctx *ctx)
+int lib_ring_buffer_reserve_slow(struct lttng_ust_lib_ring_buffer_ctx *ctx,
+				 unsigned int nr_records)
 {
 	struct channel *chan = ctx->chan;
 	struct lttng_ust_shm_handle *handle = ctx->handle;
@@ -2095,22 +2482,25 @@ int lib_ring_buffer_reserve_slow(struct lttng_ust_lib_ring_buffer_ctx *ctx)
 	struct switch_offsets offsets;
 	int ret;
 
-	if (config->alloc == RING_BUFFER_ALLOC_PER_CPU)
+	if (config->alloc != RING_BUFFER_ALLOC_GLOBAL)
 		buf = shmp(handle, chan->backend.buf[ctx->cpu].shmp);
 	else
 		buf = shmp(handle, chan->backend.buf[0].shmp);
 	ctx->buf = buf;
+	v_inc(config, &buf->stats.reserve_slow);
 
 	offsets.size = 0;
 
-	do {
+	for (;;) {
 		ret = lib_ring_buffer_try_reserve_slow(buf, chan, &offsets,
-						       ctx);
+						       ctx, nr_records);
 		if (caa_unlikely(ret))
 			return ret;
-	} while (caa_unlikely(v_cmpxchg(config, &buf->offset, offsets.old,
-				    offsets.end)
-			  != offsets.old));
+		if (caa_likely(v_cmpxchg(config, &buf->offset, offsets.old,
+				offsets.end) == offsets.old))
+			break;
+		v_inc(config, &buf->stats.reserve_retry);
+	}
 
 	/*
 	 * Atomically update last_tsc. This update races against concurrent
@@ -2300,27 +2690,95 @@ void lib_ring_buffer_check_deliver_slow(const struct lttng_ust_lib_ring_buffer_c
 	}
 }
 
+/**
+ * lib_ring_buffer_thread_stream_bind - bind current thread to a stream
+ *
+ * Called on the first reserve of a thread into a
+ * RING_BUFFER_ALLOC_PER_THREAD channel. The thread takes the lowest
+ * stream index not owned by another live thread, and writes to that
+ * stream of each per-thread channel until it exits. Only uses atomic
+ * operations and TLS stores: async-signal-safe.
+ *
+ * Returns the stream index + 1, or -1 if all the indexes are owned.
+ */
+int lib_ring_buffer_thread_stream_bind(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < RING_BUFFER_MAX_THREAD_STREAMS / CAA_BITS_PER_LONG; i++) {
+		unsigned long old, prev, bit;
+
+		old = CMM_LOAD_SHARED(thread_stream_map[i]);
+		while (~old) {
+			bit = ~old & (old + 1);	/* Lowest clear bit */
+			prev = uatomic_cmpxchg(&thread_stream_map[i], old,
+					old | bit);
+			if (prev == old) {
+				int stream = i * CAA_BITS_PER_LONG
+					+ __builtin_ctzl(bit) + 1;
+
+				URCU_TLS(lib_ring_buffer_thread_stream) = stream;
+				if (thread_stream_key_created)
+					(void) pthread_setspecific(thread_stream_key,
+						(void *) (long) stream);
+				return stream;
+			}
+			old = prev;
+		}
+	}
+	URCU_TLS(lib_ring_buffer_thread_stream) = -1;
+	return -1;
+}
+
+/* Give the stream index back when its thread exits. */
+static
+void thread_stream_release(void *arg)
+{
+	long stream = (long) arg - 1;
+
+	URCU_TLS(lib_ring_buffer_thread_stream) = 0;
+	uatomic_and(&thread_stream_map[stream / CAA_BITS_PER_LONG],
+		~(1UL << (stream % CAA_BITS_PER_LONG)));
+}
+
 /*
- * Force a read (imply TLS fixup for dlopen) of TLS variables.
+ * Also called in the child after fork, where only the calling thread
+ * remains: all the stream indexes are free again.
  */
-void lttng_fixup_ringbuffer_tls(void)
+void lib_ring_buffer_thread_stream_init(void)
 {
-	asm volatile ("" : : "m" (URCU_TLS(lib_ring_buffer_nesting)));
+	int ret;
+
+	memset(thread_stream_map, 0, sizeof(thread_stream_map));
+	URCU_TLS(lib_ring_buffer_thread_stream) = 0;
+	ret = pthread_key_create(&thread_stream_key, thread_stream_release);
+	if (ret) {
+		errno = ret;
+		PERROR("pthread_key_create");
+		return;
+	}
+	thread_stream_key_created = 1;
 }
 
-void lib_ringbuffer_signal_init(void)
+void lib_ring_buffer_thread_stream_exit(void)
 {
-	sigset_t mask;
 	int ret;
 
-	/*
-	 * Block signal for entire process, so only our thread processes
-	 * it.
-	 */
-	rb_setmask(&mask);
-	ret = pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	if (!thread_stream_key_created)
+		return;
+	thread_stream_key_created = 0;
+	ret = pthread_key_delete(thread_stream_key);
 	if (ret) {
 		errno = ret;
-		PERROR("pthread_sigmask");
+		PERROR("pthread_key_delete");
 	}
 }
+
+/*
+ * Force a read (imply TLS fixup for dlopen) of TLS variables.
+ */
+void lttng_fixup_ringbuffer_tls(void)
+{
+	asm volatile ("" : : "m" (URCU_TLS(lib_ring_buffer_nesting)));
+	asm volatile ("" : : "m" (URCU_TLS(lib_ring_buffer_thread_stream)));
+}
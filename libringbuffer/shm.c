@@ -19,12 +19,14 @@
  */
 
 #define _LGPL_SOURCE
+#include <config.h>
 #include "shm.h"
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>	/* For mode constants */
+#include <sys/vfs.h>	/* For fstatfs */
 #include <fcntl.h>	/* For O_* constants */
 #include <assert.h>
 #include <stdio.h>
@@ -32,7 +34,36 @@
 #include <dirent.h>
 #include <lttng/align.h>
 #include <limits.h>
+#include <string.h>
 #include <helper.h>
+#include <urcu/arch.h>
+
+#ifdef HAVE_LIBNUMA
+#include <numa.h>
+#include <numaif.h>
+
+/* Support up to 1024 NUMA nodes. */
+#define LTTNG_UST_NUMA_NODEMASK_LONGS	(1024 / CAA_BITS_PER_LONG)
+#endif
+
+#ifndef HUGETLBFS_MAGIC
+#define HUGETLBFS_MAGIC		0x958458f6
+#endif
+
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE		14
+#endif
+
+#ifndef MADV_NOHUGEPAGE
+#define MADV_NOHUGEPAGE		15
+#endif
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE	23
+#endif
+
+#define SHM_THP_SIZE_PATH	"/sys/kernel/mm/transparent_hugepage/hpage_pmd_size"
+#define SHM_SMAPS_PATH		"/proc/self/smaps"
 
 /*
  * Ensure we have the required amount of space available by writing 0
@@ -72,6 +103,137 @@ error:
 	return ret;
 }
 
+/*
+ * Returns the huge page size of the file system backing fd if it is a
+ * hugetlbfs, else 0.
+ */
+static
+size_t hugetlbfs_page_size(int fd)
+{
+	struct statfs fs;
+
+	if (fstatfs(fd, &fs) < 0)
+		return 0;
+	if ((uint32_t) fs.f_type != HUGETLBFS_MAGIC)
+		return 0;
+	return fs.f_bsize;
+}
+
+/*
+ * Returns the transparent huge page (PMD) size, or 0 if the kernel does
+ * not support transparent huge pages.
+ */
+static
+size_t thp_page_size(void)
+{
+	unsigned long size;
+	FILE *file;
+
+	file = fopen(SHM_THP_SIZE_PATH, "r");
+	if (!file)
+		return 0;
+	if (fscanf(file, "%lu", &size) != 1)
+		size = 0;
+	fclose(file);
+	return size;
+}
+
+/*
+ * Returns 1 if some of the mapping starting at memory_map is actually
+ * mapped with huge pages, else 0. madvise(MADV_HUGEPAGE) succeeds even
+ * when shmem transparent huge pages are disabled, so the page tables
+ * reported by smaps are the only reliable source.
+ */
+static
+int mapping_has_huge_pages(char *memory_map)
+{
+	char line[PATH_MAX];
+	unsigned long start, end, kb;
+	int in_mapping = 0, ret = 0;
+	FILE *file;
+
+	file = fopen(SHM_SMAPS_PATH, "r");
+	if (!file)
+		return 0;
+	while (fgets(line, sizeof(line), file)) {
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+			if (in_mapping)
+				break;
+			in_mapping = (start == (unsigned long) memory_map);
+			continue;
+		}
+		if (!in_mapping)
+			continue;
+		if ((sscanf(line, "ShmemPmdMapped: %lu kB", &kb) == 1
+				|| sscanf(line, "FilePmdMapped: %lu kB", &kb) == 1
+				|| sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+				&& kb) {
+			ret = 1;
+			break;
+		}
+	}
+	fclose(file);
+	return ret;
+}
+
+/*
+ * Request transparent huge pages for a shm mapping, and populate it
+ * through the mapping so the pages are allocated huge. Returns 0 on
+ * success, 1 if the kernel does not support it (the caller should fall
+ * back on zero_file()), or a negative error value if populating the
+ * mapping failed (e.g. out of shm space).
+ */
+static
+int populate_thp(char *memory_map, size_t len)
+{
+	if (madvise(memory_map, len, MADV_HUGEPAGE) < 0) {
+		DBG("madvise MADV_HUGEPAGE unsupported, using small pages");
+		return 1;
+	}
+	/*
+	 * MADV_POPULATE_WRITE reports a failure instead of raising SIGBUS
+	 * when going beyond the available shm space.
+	 */
+	if (madvise(memory_map, len, MADV_POPULATE_WRITE) < 0) {
+		if (errno == EINVAL) {
+			DBG("madvise MADV_POPULATE_WRITE unsupported, using small pages");
+			(void) madvise(memory_map, len, MADV_NOHUGEPAGE);
+			return 1;
+		}
+		return -errno;
+	}
+	return 0;
+}
+
+/*
+ * Prefer allocating the shm pages on the NUMA node of the CPU owning
+ * the stream. The policy is attached to the shared memory object, so
+ * it applies to every later allocation of its pages, whichever process
+ * touches them first. A preferred (rather than strict) policy lets the
+ * kernel fall back on other nodes when the local one is exhausted.
+ * Best effort: failure leaves the default policy in place.
+ */
+static
+void set_numa_policy(char *memory_map, size_t len, int cpu)
+{
+#ifdef HAVE_LIBNUMA
+	unsigned long nodemask[LTTNG_UST_NUMA_NODEMASK_LONGS] = { 0 };
+	int node;
+
+	if (cpu < 0 || numa_available() < 0)
+		return;
+	node = numa_node_of_cpu(cpu);
+	if (node < 0 || node >= LTTNG_UST_NUMA_NODEMASK_LONGS * CAA_BITS_PER_LONG)
+		return;
+	nodemask[node / CAA_BITS_PER_LONG] |= 1UL << (node % CAA_BITS_PER_LONG);
+	if (mbind(memory_map, len, MPOL_PREFERRED, nodemask,
+			LTTNG_UST_NUMA_NODEMASK_LONGS * CAA_BITS_PER_LONG,
+			MPOL_MF_MOVE) < 0)
+		DBG("mbind of stream for cpu %d on node %d failed: %s",
+			cpu, node, strerror(errno));
+#endif /* HAVE_LIBNUMA */
+}
+
 struct shm_object_table *shm_object_table_create(size_t max_nb_obj)
 {
 	struct shm_object_table *table;
@@ -87,11 +249,13 @@ struct shm_object_table *shm_object_table_create(size_t max_nb_obj)
 static
 struct shm_object *_shm_object_table_alloc_shm(struct shm_object_table *table,
 					   size_t memory_map_size,
-					   int stream_fd)
+					   int stream_fd, int cpu,
+					   unsigned int flags)
 {
-	int shmfd, waitfd[2], ret, i;
+	int shmfd, waitfd[2], ret, i, hugetlb = 0;
 	struct shm_object *obj;
 	char *memory_map;
+	size_t huge_page_size;
 
 	if (stream_fd < 0)
 		return NULL;
@@ -123,10 +287,15 @@ struct shm_object *_shm_object_table_alloc_shm(struct shm_object_table *table,
 	/* create shm */
 
 	shmfd = stream_fd;
-	ret = zero_file(shmfd, memory_map_size);
-	if (ret) {
-		PERROR("zero_file");
-		goto error_zero_file;
+	if (flags & SHM_OBJECT_FLAG_HUGEPAGES) {
+		huge_page_size = hugetlbfs_page_size(shmfd);
+		if (huge_page_size)
+			hugetlb = 1;
+		else
+			huge_page_size = thp_page_size();
+		if (huge_page_size)
+			memory_map_size = ALIGN(memory_map_size,
+					huge_page_size);
 	}
 	ret = ftruncate(shmfd, memory_map_size);
 	if (ret) {
@@ -143,6 +312,60 @@ struct shm_object *_shm_object_table_alloc_shm(struct shm_object_table *table,
 		PERROR("mmap");
 		goto error_mmap;
 	}
+	/*
+	 * The memory policy needs to be set before the shm pages are
+	 * allocated by populating the file below.
+	 */
+	if (flags & SHM_OBJECT_FLAG_NUMA)
+		set_numa_policy(memory_map, memory_map_size, cpu);
+
+	/*
+	 * Lazy objects are populated by shm_materialize(), which relies
+	 * on fallocate(). File systems without fallocate() support would
+	 * only allocate pages on first touch, where a failure raises
+	 * SIGBUS: populate those objects right away instead.
+	 */
+	obj->lazy = 0;
+	if ((flags & SHM_OBJECT_FLAG_LAZY) && !hugetlb) {
+		do {
+			ret = fallocate(shmfd, 0, 0, 1);
+		} while (ret < 0 && errno == EINTR);
+		if (!ret) {
+			obj->lazy = 1;
+		} else if (errno != EOPNOTSUPP && errno != ENOSYS) {
+			PERROR("fallocate");
+			goto error_populate;
+		}
+	}
+	/*
+	 * hugetlbfs does not support write(): huge pages are reserved by
+	 * mmap instead. Transparent huge pages are populated through the
+	 * mapping.
+	 */
+	obj->hugepages = 0;
+	if (hugetlb) {
+		obj->hugepages = 1;
+	} else if (!obj->lazy) {
+		ret = 1;
+		if (flags & SHM_OBJECT_FLAG_HUGEPAGES) {
+			ret = populate_thp(memory_map, memory_map_size);
+			if (ret < 0) {
+				errno = -ret;
+				PERROR("madvise");
+				goto error_populate;
+			}
+			if (!ret)
+				obj->hugepages =
+					mapping_has_huge_pages(memory_map);
+		}
+		if (ret > 0) {
+			ret = zero_file(shmfd, memory_map_size);
+			if (ret) {
+				PERROR("zero_file");
+				goto error_populate;
+			}
+		}
+	}
 	obj->type = SHM_OBJECT_SHM;
 	obj->memory_map = memory_map;
 	obj->memory_map_size = memory_map_size;
@@ -151,9 +374,14 @@ struct shm_object *_shm_object_table_alloc_shm(struct shm_object_table *table,
 
 	return obj;
 
+error_populate:
+	ret = munmap(memory_map, memory_map_size);
+	if (ret) {
+		PERROR("munmap");
+		assert(0);
+	}
 error_mmap:
 error_ftruncate:
-error_zero_file:
 error_fcntl:
 	for (i = 0; i < 2; i++) {
 		ret = close(waitfd[i]);
@@ -232,12 +460,13 @@ alloc_error:
 struct shm_object *shm_object_table_alloc(struct shm_object_table *table,
 			size_t memory_map_size,
 			enum shm_object_type type,
-			int stream_fd)
+			int stream_fd, int cpu,
+			unsigned int flags)
 {
 	switch (type) {
 	case SHM_OBJECT_SHM:
 		return _shm_object_table_alloc_shm(table, memory_map_size,
-				stream_fd);
+				stream_fd, cpu, flags);
 	case SHM_OBJECT_MEM:
 		return _shm_object_table_alloc_mem(table, memory_map_size);
 	default:
@@ -248,7 +477,7 @@ struct shm_object *shm_object_table_alloc(struct shm_object_table *table,
 
 struct shm_object *shm_object_table_append_shm(struct shm_object_table *table,
 			int shm_fd, int wakeup_fd, uint32_t stream_nr,
-			size_t memory_map_size)
+			size_t memory_map_size, unsigned int flags)
 {
 	struct shm_object *obj;
 	char *memory_map;
@@ -287,6 +516,19 @@ struct shm_object *shm_object_table_append_shm(struct shm_object_table *table,
 		PERROR("mmap");
 		goto error_mmap;
 	}
+	obj->hugepages = 0;
+	if (flags & SHM_OBJECT_FLAG_HUGEPAGES) {
+		/*
+		 * The consumer populated the shm. hugetlbfs mappings are
+		 * always huge, otherwise only advise, so the huge pages
+		 * already in the page cache get mapped huge when touched.
+		 */
+		if (hugetlbfs_page_size(shm_fd))
+			obj->hugepages = 1;
+		else
+			(void) madvise(memory_map, memory_map_size,
+					MADV_HUGEPAGE);
+	}
 	obj->type = SHM_OBJECT_SHM;
 	obj->memory_map = memory_map;
 	obj->memory_map_size = memory_map_size;
@@ -428,3 +670,33 @@ void align_shm(struct shm_object *obj, size_t align)
 	size_t offset_len = offset_align(obj->allocated_len, align);
 	obj->allocated_len += offset_len;
 }
+
+/*
+ * Allocate the pages backing a shm object created with
+ * SHM_OBJECT_FLAG_LAZY, so that writing to it cannot trigger SIGBUS.
+ * Only issues fallocate(), thus can be called from a signal handler.
+ * Objects on file systems without fallocate() support were populated
+ * at creation.
+ * Returns 0 on success, a negative error value (e.g. -ENOSPC) on error.
+ */
+int shm_materialize(struct lttng_ust_shm_handle *handle, struct shm_ref *ref)
+{
+	struct shm_object_table *table = handle->table;
+	struct shm_object *obj;
+	size_t index;
+	int ret, saved_errno = errno;
+
+	index = (size_t) ref->index;
+	if (caa_unlikely(index >= table->allocated_len))
+		return -EPERM;
+	obj = &table->objects[index];
+	if (obj->type != SHM_OBJECT_SHM || !obj->lazy)
+		return 0;
+	do {
+		ret = fallocate(obj->shm_fd, 0, 0, obj->memory_map_size);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		ret = -errno;
+	errno = saved_errno;
+	return ret;
+}
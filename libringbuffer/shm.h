@@ -36,6 +36,7 @@ int channel_handle_add_stream(struct lttng_ust_shm_handle *handle,
 		int shm_fd, int wakeup_fd, uint32_t stream_nr,
 		uint64_t memory_map_size);
 unsigned int channel_handle_get_nr_streams(struct lttng_ust_shm_handle *handle);
+unsigned int channel_handle_get_nr_hugepage_streams(struct lttng_ust_shm_handle *handle);
 extern
 void channel_destroy(struct channel *chan, struct lttng_ust_shm_handle *handle,
 		int consumer);
@@ -89,10 +90,12 @@ struct shm_object_table *shm_object_table_create(size_t max_nb_obj);
 struct shm_object *shm_object_table_alloc(struct shm_object_table *table,
 			size_t memory_map_size,
 			enum shm_object_type type,
-			const int stream_fd);
+			const int stream_fd,
+			int cpu,
+			unsigned int flags);
 struct shm_object *shm_object_table_append_shm(struct shm_object_table *table,
 			int shm_fd, int wakeup_fd, uint32_t stream_nr,
-			size_t memory_map_size);
+			size_t memory_map_size, unsigned int flags);
 /* mem ownership is passed to shm_object_table_append_mem(). */
 struct shm_object *shm_object_table_append_mem(struct shm_object_table *table,
 			void *mem, size_t memory_map_size, int wakeup_fd);
@@ -107,6 +110,7 @@ void shm_object_table_destroy(struct shm_object_table *table);
  */
 struct shm_ref zalloc_shm(struct shm_object *obj, size_t len);
 void align_shm(struct shm_object *obj, size_t align);
+int shm_materialize(struct lttng_ust_shm_handle *handle, struct shm_ref *ref);
 
 static inline
 int shm_get_wait_fd(struct lttng_ust_shm_handle *handle, struct shm_ref *ref)
@@ -32,6 +32,12 @@ enum shm_object_type {
 	SHM_OBJECT_MEM,
 };
 
+enum shm_object_flags {
+	SHM_OBJECT_FLAG_HUGEPAGES = (1U << 0),	/* Use huge pages if available */
+	SHM_OBJECT_FLAG_NUMA = (1U << 1),	/* Allocate on the cpu's NUMA node */
+	SHM_OBJECT_FLAG_LAZY = (1U << 2),	/* Defer allocation to first use */
+};
+
 struct shm_object {
 	enum shm_object_type type;
 	size_t index;	/* within the object table */
@@ -41,6 +47,8 @@ struct shm_object {
 	size_t memory_map_size;
 	uint64_t allocated_len;
 	int shm_fd_ownership;
+	int hugepages;	/* mapping backed by huge pages */
+	int lazy;	/* pages allocated by shm_materialize() */
 };
 
 struct shm_object_table {
@@ -0,0 +1,253 @@
+/*
+ * libringbuffer/string_kernels.c
+ *
+ * String length and copy kernels used for string fields.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#define _LGPL_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <urcu/compiler.h>
+#include <urcu/system.h>
+
+#include "string_kernels.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define STRING_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+typedef size_t (*strnlen_fct)(const char *src, size_t len);
+typedef size_t (*strcpy_fct)(char *dest, const char *src, size_t len);
+
+static
+size_t strnlen_scalar(const char *src, size_t len)
+{
+	size_t count;
+
+	for (count = 0; count < len; count++) {
+		if (!CMM_LOAD_SHARED(src[count]))
+			break;
+	}
+	return count;
+}
+
+static
+size_t strcpy_scalar(char *dest, const char *src, size_t len)
+{
+	size_t count;
+
+	for (count = 0; count < len; count++) {
+		char c;
+
+		/*
+		 * Only read source character once, in case it is
+		 * modified concurrently.
+		 */
+		c = CMM_LOAD_SHARED(src[count]);
+		if (!c)
+			break;
+		dest[count] = c;
+	}
+	return count;
+}
+
+#ifdef STRING_KERNELS_X86
+
+/*
+ * Scalar head: advance until @src + count is aligned on @align bytes.
+ * Returns 1 if the terminator was found (or @len reached), in which
+ * case *count holds the final length.
+ */
+static inline
+int strcpy_head(char *dest, const char *src, size_t len, size_t *count,
+		uintptr_t align)
+{
+	size_t i = 0;
+
+	while ((uintptr_t) (src + i) & (align - 1)) {
+		char c;
+
+		if (i == len)
+			goto end;
+		c = CMM_LOAD_SHARED(src[i]);
+		if (!c)
+			goto end;
+		if (dest)
+			dest[i] = c;
+		i++;
+	}
+	*count = i;
+	return 0;
+end:
+	*count = i;
+	return 1;
+}
+
+static
+size_t strnlen_sse2(const char *src, size_t len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t count;
+
+	if (strcpy_head(NULL, src, len, &count, 16))
+		return count;
+	for (; len - count >= 16; count += 16) {
+		__m128i v = _mm_load_si128((const __m128i *) (src + count));
+		unsigned int mask;
+
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+		if (mask)
+			return count + __builtin_ctz(mask);
+	}
+	return count + strnlen_scalar(src + count, len - count);
+}
+
+static
+size_t strcpy_sse2(char *dest, const char *src, size_t len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t count;
+
+	if (strcpy_head(dest, src, len, &count, 16))
+		return count;
+	for (; len - count >= 16; count += 16) {
+		__m128i v = _mm_load_si128((const __m128i *) (src + count));
+		unsigned int mask;
+
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+		if (mask) {
+			char tail[16] __attribute__((aligned(16)));
+
+			/*
+			 * Only store the bytes preceding the terminator:
+			 * the bytes following it in @src are not part of
+			 * the string.
+			 */
+			_mm_store_si128((__m128i *) tail, v);
+			mask = __builtin_ctz(mask);
+			memcpy(dest + count, tail, mask);
+			return count + mask;
+		}
+		_mm_storeu_si128((__m128i *) (dest + count), v);
+	}
+	return count + strcpy_scalar(dest + count, src + count, len - count);
+}
+
+static __attribute__((target("avx2")))
+size_t strnlen_avx2(const char *src, size_t len)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	size_t count;
+
+	if (strcpy_head(NULL, src, len, &count, 32))
+		return count;
+	for (; len - count >= 32; count += 32) {
+		__m256i v = _mm256_load_si256((const __m256i *) (src + count));
+		unsigned int mask;
+
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+		if (mask)
+			return count + __builtin_ctz(mask);
+	}
+	return count + strnlen_sse2(src + count, len - count);
+}
+
+static __attribute__((target("avx2")))
+size_t strcpy_avx2(char *dest, const char *src, size_t len)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	size_t count;
+
+	if (strcpy_head(dest, src, len, &count, 32))
+		return count;
+	for (; len - count >= 32; count += 32) {
+		__m256i v = _mm256_load_si256((const __m256i *) (src + count));
+		unsigned int mask;
+
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+		if (mask) {
+			char tail[32] __attribute__((aligned(32)));
+
+			_mm256_store_si256((__m256i *) tail, v);
+			mask = __builtin_ctz(mask);
+			memcpy(dest + count, tail, mask);
+			return count + mask;
+		}
+		_mm256_storeu_si256((__m256i *) (dest + count), v);
+	}
+	return count + strcpy_sse2(dest + count, src + count, len - count);
+}
+
+#endif /* STRING_KERNELS_X86 */
+
+static size_t strnlen_resolve(const char *src, size_t len);
+static size_t strcpy_resolve(char *dest, const char *src, size_t len);
+
+static strnlen_fct strnlen_impl = strnlen_resolve;
+static strcpy_fct strcpy_impl = strcpy_resolve;
+
+/*
+ * Select the kernels for the running CPU. Racing callers compute the
+ * same result, so publishing it with a plain store is fine. This is
+ * reachable from signal handlers (tracepoints), hence no lock.
+ */
+static
+void string_kernels_select(void)
+{
+	strnlen_fct len_fct = strnlen_scalar;
+	strcpy_fct cpy_fct = strcpy_scalar;
+
+#ifdef STRING_KERNELS_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		len_fct = strnlen_avx2;
+		cpy_fct = strcpy_avx2;
+	} else {
+		/* SSE2 is part of the x86-64 baseline. */
+		len_fct = strnlen_sse2;
+		cpy_fct = strcpy_sse2;
+	}
+#endif
+	CMM_STORE_SHARED(strnlen_impl, len_fct);
+	CMM_STORE_SHARED(strcpy_impl, cpy_fct);
+}
+
+static
+size_t strnlen_resolve(const char *src, size_t len)
+{
+	string_kernels_select();
+	return CMM_LOAD_SHARED(strnlen_impl)(src, len);
+}
+
+static
+size_t strcpy_resolve(char *dest, const char *src, size_t len)
+{
+	string_kernels_select();
+	return CMM_LOAD_SHARED(strcpy_impl)(dest, src, len);
+}
+
+size_t lib_ring_buffer_strnlen(const char *src, size_t len)
+{
+	return CMM_LOAD_SHARED(strnlen_impl)(src, len);
+}
+
+size_t lib_ring_buffer_strcpy_kernel(char *dest, const char *src, size_t len)
+{
+	return CMM_LOAD_SHARED(strcpy_impl)(dest, src, len);
+}
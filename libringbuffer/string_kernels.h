@@ -0,0 +1,54 @@
+#ifndef _LIBRINGBUFFER_STRING_KERNELS_H
+#define _LIBRINGBUFFER_STRING_KERNELS_H
+
+/*
+ * libringbuffer/string_kernels.h
+ *
+ * String length and copy kernels used for string fields.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stddef.h>
+
+/*
+ * The kernels below are selected once, on first use, according to the
+ * instruction set extensions available on the running CPU (AVX2, SSE2,
+ * or a portable byte-at-a-time fallback).
+ *
+ * Source loads are always naturally aligned to the vector width, so
+ * they never cross a page boundary past the terminating NULL
+ * character. Each source byte is loaded exactly once: the copy kernel
+ * stores the very register it scanned for the terminator, so a string
+ * modified concurrently can never produce a copy that disagrees with
+ * the length it reports.
+ */
+
+/*
+ * Return the number of non-NULL characters at the start of @src,
+ * looking at no more than @len bytes.
+ */
+extern size_t lib_ring_buffer_strnlen(const char *src, size_t len);
+
+/*
+ * Copy up to @len string bytes from @src to @dest. Stop whenever a NULL
+ * terminating character is found in @src. Returns the number of bytes
+ * copied. Does *not* terminate @dest with NULL terminating character.
+ * Bytes of @dest past the returned count are left untouched.
+ */
+extern size_t lib_ring_buffer_strcpy_kernel(char *dest, const char *src,
+		size_t len);
+
+#endif /* _LIBRINGBUFFER_STRING_KERNELS_H */
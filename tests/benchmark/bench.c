@@ -35,6 +35,7 @@
 
 static int nr_cpus;
 static unsigned long nr_events;
+static int tp_only;	/* Measure the tracepoint alone */
 
 void do_stuff(void)
 {
@@ -43,11 +44,14 @@ void do_stuff(void)
 
 	v = 1;
 
+	if (tp_only)
+		goto tp;
 	file = fopen("/dev/null", "a");
 	fprintf(file, "%d", v);
 	fclose(file);
 	time(NULL);
 
+tp:
 #ifdef TRACING
 	tracepoint(ust_tests_benchmark, tpbench, v);
 #endif
@@ -66,7 +70,7 @@ void *function(void *arg)
 }
 
 void usage(char **argv) {
-	printf("Usage: %s nr_cpus nr_events\n", argv[0]);
+	printf("Usage: %s nr_cpus nr_events [tp_only]\n", argv[0]);
 }
 
 
@@ -86,6 +90,9 @@ int main(int argc, char **argv)
 	nr_events = atol(argv[2]);
 	printf("using %ld events per cpu\n", nr_events);
 
+	if (argc > 3)
+		tp_only = atoi(argv[3]);
+
 	pthread_t thread[nr_cpus];
 	for (i = 0; i < nr_cpus; i++) {
 		if (pthread_create(&thread[i], NULL, function, NULL)) {
@@ -0,0 +1,120 @@
+/*
+ * startup.c
+ *
+ * LTTng Userspace Tracer (UST) - tracepoint library registration
+ * benchmark: registers the tracepoint sections of many libraries, as
+ * done by their constructors when they are loaded, then connects a
+ * probe as done by the first enabled event.
+ *
+ * Run with LTTNG_UST_DEFER_TRACEPOINT_REGISTRATION=1 to measure the
+ * deferred registration.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <lttng/tracepoint-types.h>
+
+#define TP_SIGNATURE	"int, v"
+
+/* Exported by liblttng-ust-tracepoint, called by tracepoint.h. */
+extern int tracepoint_register_lib(struct lttng_ust_tracepoint * const *tracepoints_start,
+		int tracepoints_count);
+extern int tracepoint_unregister_lib(struct lttng_ust_tracepoint * const *tracepoints_start);
+extern int __tracepoint_probe_register(const char *name, void (*func)(void),
+		void *data, const char *signature);
+extern int __tracepoint_probe_unregister(const char *name, void (*func)(void),
+		void *data);
+
+static void probe(void)
+{
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void usage(char **argv) {
+	printf("Usage: %s nr_libs nr_tracepoints\n", argv[0]);
+}
+
+int main(int argc, char **argv)
+{
+	struct lttng_ust_tracepoint *tracepoints, **ptrs;
+	int nr_libs, nr_tp, i;
+	double t0, t1, t2;
+
+	if (argc < 3) {
+		usage(argv);
+		exit(1);
+	}
+	nr_libs = atoi(argv[1]);
+	nr_tp = atoi(argv[2]);
+	if (nr_libs <= 0 || nr_tp <= 0) {
+		usage(argv);
+		exit(1);
+	}
+	printf("using %d libraries of %d tracepoints\n", nr_libs, nr_tp);
+
+	tracepoints = calloc(nr_libs * nr_tp, sizeof(*tracepoints));
+	ptrs = calloc(nr_libs * nr_tp, sizeof(*ptrs));
+	if (!tracepoints || !ptrs) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < nr_libs * nr_tp; i++) {
+		char *name;
+
+		if (asprintf(&name, "bench_startup_lib%d:event%d",
+				i / nr_tp, i % nr_tp) < 0) {
+			perror("asprintf");
+			exit(1);
+		}
+		tracepoints[i].name = name;
+		tracepoints[i].signature = TP_SIGNATURE;
+		ptrs[i] = &tracepoints[i];
+	}
+
+	t0 = now();
+	for (i = 0; i < nr_libs; i++)
+		tracepoint_register_lib(&ptrs[i * nr_tp], nr_tp);
+	t1 = now();
+	if (__tracepoint_probe_register("bench_startup_lib0:event0",
+			probe, NULL, TP_SIGNATURE)) {
+		fprintf(stderr, "probe register failed\n");
+		exit(1);
+	}
+	t2 = now();
+	if (!tracepoints[0].state) {
+		fprintf(stderr, "tracepoint not enabled\n");
+		exit(1);
+	}
+
+	printf("library registration: %.6fs\n", t1 - t0);
+	printf("first probe connection: %.6fs\n", t2 - t1);
+	printf("total: %.6fs\n", t2 - t0);
+
+	__tracepoint_probe_unregister("bench_startup_lib0:event0", probe, NULL);
+	for (i = 0; i < nr_libs; i++)
+		tracepoint_unregister_lib(&ptrs[i * nr_tp]);
+	return 0;
+}
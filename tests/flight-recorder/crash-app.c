@@ -0,0 +1,36 @@
+/*
+ * crash-app.c
+ *
+ * Traced application of the flight recorder test: records events, then
+ * crashes without letting liblttng-ust flush its buffers.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; version 2.1 of
+ * the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdlib.h>
+
+#define TRACEPOINT_DEFINE
+#include "ust_tests_fr.h"
+
+int main(int argc, char **argv)
+{
+	int i, nr_events = 1000;
+
+	if (argc > 1)
+		nr_events = atoi(argv[1]);
+	for (i = 0; i < nr_events; i++)
+		tracepoint(ust_tests_fr, crash, i, "flight-recorder-payload");
+	abort();
+}
@@ -0,0 +1,99 @@
+/*
+ * prog.c
+ *
+ * Unit test of per-event rate limiting: burst, suppression summaries
+ * and limit changes.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; version 2.1 of
+ * the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <string.h>
+
+#include <lttng/ust-events.h>
+#include "tap.h"
+
+#define NUM_TESTS	7
+#define NUM_EVENTS	10
+
+static const struct lttng_event_desc desc = {
+	.name = "rate_limit:test",
+};
+
+/*
+ * Each CPU has its own token bucket: stay on one CPU so that all the
+ * events use the same bucket.
+ */
+static
+void pin_to_current_cpu(void)
+{
+	cpu_set_t mask;
+	int cpu;
+
+	cpu = sched_getcpu();
+	if (cpu < 0)
+		return;
+	CPU_ZERO(&mask);
+	CPU_SET(cpu, &mask);
+	(void) sched_setaffinity(0, sizeof(mask), &mask);
+}
+
+static
+int record_events(struct lttng_event *event)
+{
+	int i, recorded = 0;
+
+	for (i = 0; i < NUM_EVENTS; i++)
+		recorded += lttng_event_rate_limit(event);
+	return recorded;
+}
+
+int main()
+{
+	struct lttng_ust_rate_limit limit = { .rate = 1, .burst = 3 };
+	struct lttng_event event;
+
+	plan_tests(NUM_TESTS);
+	pin_to_current_cpu();
+
+	memset(&event, 0, sizeof(event));
+	event.desc = &desc;
+	lttng_event_sync_rate_limit(&event, &limit);
+	ok(event.rate_limit != NULL, "Rate limit attached to event");
+	ok(record_events(&event) == 3,
+		"Only the burst is recorded out of %d events", NUM_EVENTS);
+	ok(lttng_event_flush_rate_limit(&event) == NUM_EVENTS - 3,
+		"Flush reports the trailing suppressed events");
+	ok(lttng_event_flush_rate_limit(&event) == 0,
+		"Suppressed events are reported once");
+
+	/* Changing the limit starts from a full bucket. */
+	limit.burst = 5;
+	lttng_event_sync_rate_limit(&event, &limit);
+	lttng_rate_limit_prune_release_queue();
+	ok(record_events(&event) == 5,
+		"New burst applies after the limit is changed");
+
+	limit.rate = 0;
+	lttng_event_sync_rate_limit(&event, &limit);
+	lttng_rate_limit_prune_release_queue();
+	ok(event.rate_limit == NULL, "Rate limit removed from event");
+	ok(record_events(&event) == NUM_EVENTS,
+		"All events recorded without rate limit");
+
+	lttng_event_free_rate_limit(&event);
+	return exit_status();
+}
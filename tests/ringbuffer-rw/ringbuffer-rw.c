@@ -0,0 +1,267 @@
+/*
+ * ringbuffer-rw.c
+ *
+ * Concurrent ring buffer writers and reader benchmark. The reader checks
+ * the packets it reads back against the records written.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; version 2.1 of
+ * the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <lttng/ust-ctl.h>
+
+#define SUBBUF_SIZE		(64UL * 1024)
+#define NUM_SUBBUF		8
+#define DEFAULT_NR_WRITERS	2
+#define DEFAULT_RECORD_SIZE	64
+#define DEFAULT_DURATION	5
+
+#define METADATA_MAGIC		0x75D11D57
+#define NR_RECORD_BYTES		26
+
+/* Same layout as in lttng-ring-buffer-metadata-client.h. */
+struct metadata_packet_header {
+	uint32_t magic;
+	uint8_t  uuid[16];
+	uint32_t checksum;
+	uint32_t content_size;		/* in bits */
+	uint32_t packet_size;		/* in bits */
+	uint8_t  compression_scheme;
+	uint8_t  encryption_scheme;
+	uint8_t  checksum_scheme;
+	uint8_t  major;
+	uint8_t  minor;
+	uint8_t  header_end[0];
+};
+
+#define METADATA_HEADER_LEN	offsetof(struct metadata_packet_header, header_end)
+
+static struct ustctl_consumer_channel *chan;
+static struct ustctl_consumer_stream *stream;
+static size_t record_size = DEFAULT_RECORD_SIZE;
+static unsigned int nr_writers = DEFAULT_NR_WRITERS;
+static volatile int test_stop, reader_stop;
+
+struct writer_data {
+	pthread_t thread;
+	char record_byte;
+	unsigned long long nr_records;
+};
+
+struct reader_data {
+	unsigned long long nr_subbuf;
+	unsigned long long payload_len;
+	int error;
+};
+
+static
+int create_stream_fd(void)
+{
+	char name[64];
+	int fd;
+
+	snprintf(name, sizeof(name), "/ust-rb-rw-bench-%d", (int) getpid());
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		perror("shm_open");
+		return -1;
+	}
+	if (shm_unlink(name))
+		perror("shm_unlink");
+	return fd;
+}
+
+static
+void *writer_thread(void *arg)
+{
+	struct writer_data *data = arg;
+	char *record;
+
+	record = malloc(record_size);
+	if (!record)
+		abort();
+	memset(record, data->record_byte, record_size);
+	while (!test_stop) {
+		if (ustctl_write_metadata_to_channel(chan, record,
+				record_size))
+			break;
+		data->nr_records++;
+	}
+	free(record);
+	return NULL;
+}
+
+/*
+ * Check the packet header of the sub-buffer being read, and that its
+ * payload is only made of bytes written by the writers.
+ */
+static
+int check_subbuf(struct reader_data *data)
+{
+	const struct metadata_packet_header *header;
+	unsigned long off, len, i;
+	char *base, c;
+
+	base = ustctl_get_mmap_base(stream);
+	if (!base || ustctl_get_mmap_read_offset(stream, &off)
+			|| ustctl_get_subbuf_size(stream, &len))
+		return -1;
+	if (len < METADATA_HEADER_LEN)
+		return -1;
+	header = (const struct metadata_packet_header *) (base + off);
+	if (header->magic != METADATA_MAGIC
+			|| header->content_size != len * CHAR_BIT)
+		return -1;
+	for (i = METADATA_HEADER_LEN; i < len; i++) {
+		c = base[off + i];
+		if (c < 'a' || c >= 'a' + NR_RECORD_BYTES
+				|| c - 'a' >= nr_writers)
+			return -1;
+	}
+	data->payload_len += len - METADATA_HEADER_LEN;
+	return 0;
+}
+
+static
+void *reader_thread(void *arg)
+{
+	struct reader_data *data = arg;
+	int stop;
+
+	for (;;) {
+		/* Read before polling: the last flush precedes the stop. */
+		stop = reader_stop;
+		if (ustctl_get_next_subbuf(stream)) {
+			if (stop)
+				break;
+			/* Nothing delivered yet: spin like a busy consumer. */
+			continue;
+		}
+		data->nr_subbuf++;
+		if (!data->error && check_subbuf(data)) {
+			fprintf(stderr, "Corrupted packet %llu\n",
+				data->nr_subbuf);
+			data->error = 1;
+		}
+		if (ustctl_put_next_subbuf(stream))
+			abort();
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct ustctl_consumer_channel_attr attr;
+	struct writer_data *writers;
+	struct reader_data reader_data = { 0 };
+	unsigned long long nr_records = 0;
+	unsigned int duration = DEFAULT_DURATION;
+	pthread_t reader;
+	int stream_fd, ret = EXIT_FAILURE;
+	unsigned int i;
+
+	if (argc > 1)
+		nr_writers = strtoul(argv[1], NULL, 0);
+	if (argc > 2)
+		record_size = strtoul(argv[2], NULL, 0);
+	if (argc > 3)
+		duration = strtoul(argv[3], NULL, 0);
+	if (!nr_writers || !record_size || record_size > SUBBUF_SIZE / 2) {
+		fprintf(stderr, "Invalid arguments\n");
+		goto end;
+	}
+
+	stream_fd = create_stream_fd();
+	if (stream_fd < 0)
+		goto end;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = LTTNG_UST_CHAN_METADATA;
+	attr.subbuf_size = SUBBUF_SIZE;
+	attr.num_subbuf = NUM_SUBBUF;
+	attr.overwrite = 0;
+	attr.output = LTTNG_UST_MMAP;
+	chan = ustctl_create_channel(&attr, &stream_fd, 1);
+	if (!chan) {
+		fprintf(stderr, "Error creating channel\n");
+		goto end_close;
+	}
+	stream = ustctl_create_stream(chan, 0);
+	if (!stream) {
+		fprintf(stderr, "Error creating stream\n");
+		goto end_destroy_chan;
+	}
+	writers = calloc(nr_writers, sizeof(*writers));
+	if (!writers)
+		goto end_destroy_stream;
+
+	if (pthread_create(&reader, NULL, reader_thread, &reader_data))
+		abort();
+	for (i = 0; i < nr_writers; i++) {
+		writers[i].record_byte = 'a' + i % NR_RECORD_BYTES;
+		if (pthread_create(&writers[i].thread, NULL, writer_thread,
+				&writers[i]))
+			abort();
+	}
+	sleep(duration);
+	test_stop = 1;
+	for (i = 0; i < nr_writers; i++) {
+		if (pthread_join(writers[i].thread, NULL))
+			abort();
+		nr_records += writers[i].nr_records;
+	}
+	/*
+	 * Stop the reader last, so writers never wait on a full buffer. It
+	 * drains the packet flushed here before exiting.
+	 */
+	ustctl_flush_buffer(stream, 1);
+	reader_stop = 1;
+	if (pthread_join(reader, NULL))
+		abort();
+
+	printf("writers: %u, record size: %zu bytes, duration: %u s\n",
+		nr_writers, record_size, duration);
+	printf("records written: %llu (%.0f records/s)\n",
+		nr_records, (double) nr_records / duration);
+	printf("sub-buffers read: %llu\n", reader_data.nr_subbuf);
+	if (reader_data.error)
+		goto end_free;
+	if (reader_data.payload_len != nr_records * record_size) {
+		fprintf(stderr, "Read %llu bytes of records, %llu written\n",
+			reader_data.payload_len, nr_records * record_size);
+		goto end_free;
+	}
+	ret = EXIT_SUCCESS;
+
+end_free:
+	free(writers);
+end_destroy_stream:
+	ustctl_destroy_stream(stream);
+end_destroy_chan:
+	ustctl_destroy_channel(chan);
+end_close:
+	close(stream_fd);
+end:
+	return ret;
+}
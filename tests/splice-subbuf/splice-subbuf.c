@@ -0,0 +1,290 @@
+/*
+ * splice-subbuf.c
+ *
+ * Benchmark sub-buffer export from consumer: write() from the stream
+ * mapping compared to ustctl_splice_subbuf(). The spliced data is first
+ * checked against the content of the mapping.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; version 2.1 of
+ * the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <lttng/ust-ctl.h>
+
+#define DEFAULT_SUBBUF_SIZE	(1UL << 20)
+#define DEFAULT_ITERATIONS	1000
+
+enum export_method {
+	EXPORT_WRITE,
+	EXPORT_SPLICE,
+};
+
+static
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static
+int create_stream_fd(void)
+{
+	char name[64];
+	int fd;
+
+	snprintf(name, sizeof(name), "/ust-splice-bench-%d", (int) getpid());
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		perror("shm_open");
+		return -1;
+	}
+	if (shm_unlink(name))
+		perror("shm_unlink");
+	return fd;
+}
+
+static
+int export_write(struct ustctl_consumer_stream *stream, int out_fd)
+{
+	unsigned long off, len;
+	char *base;
+	ssize_t ret;
+
+	base = ustctl_get_mmap_base(stream);
+	if (!base)
+		return -EINVAL;
+	if (ustctl_get_mmap_read_offset(stream, &off))
+		return -EINVAL;
+	if (ustctl_get_padded_subbuf_size(stream, &len))
+		return -EINVAL;
+	while (len > 0) {
+		ret = write(out_fd, base + off, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		off += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * Splice one packet to a temporary file, and compare the file content
+ * with the sub-buffer read from the stream mapping.
+ */
+static
+int verify(struct ustctl_consumer_channel *chan,
+		struct ustctl_consumer_stream *stream,
+		char *packet, size_t packet_len)
+{
+	unsigned long off, len;
+	char *base, *data = NULL;
+	FILE *file;
+	size_t i;
+	ssize_t ret;
+	int fd, err = -1;
+
+	for (i = 0; i < packet_len; i++)
+		packet[i] = 'a' + i % 26;
+	ret = ustctl_write_one_packet_to_channel(chan, packet, packet_len);
+	if (ret < 0) {
+		fprintf(stderr, "Error writing packet: %zd\n", ret);
+		return -1;
+	}
+	ustctl_flush_buffer(stream, 1);
+	if (ustctl_get_next_subbuf(stream)) {
+		fprintf(stderr, "No sub-buffer to verify\n");
+		return -1;
+	}
+	base = ustctl_get_mmap_base(stream);
+	if (!base || ustctl_get_mmap_read_offset(stream, &off)
+			|| ustctl_get_padded_subbuf_size(stream, &len))
+		goto end_put;
+	file = tmpfile();
+	if (!file) {
+		perror("tmpfile");
+		goto end_put;
+	}
+	fd = fileno(file);
+	ret = ustctl_splice_subbuf(stream, fd);
+	if (ret != (ssize_t) len) {
+		fprintf(stderr, "Spliced %zd bytes, expected %lu\n", ret, len);
+		goto end_close;
+	}
+	data = malloc(len);
+	if (!data)
+		goto end_close;
+	if (pread(fd, data, len, 0) != (ssize_t) len) {
+		perror("pread");
+		goto end_close;
+	}
+	if (memcmp(data, base + off, len)) {
+		fprintf(stderr, "Spliced data differs from the mapping\n");
+		goto end_close;
+	}
+	if (!memmem(data, len, packet, packet_len)) {
+		fprintf(stderr, "Spliced data misses the packet payload\n");
+		goto end_close;
+	}
+	err = 0;
+
+end_close:
+	free(data);
+	fclose(file);
+end_put:
+	if (ustctl_put_next_subbuf(stream))
+		err = -1;
+	/* Drain the packets flushed after the verified one. */
+	while (ustctl_get_next_subbuf(stream) == 0) {
+		if (ustctl_put_next_subbuf(stream))
+			err = -1;
+	}
+	return err;
+}
+
+static
+int run(struct ustctl_consumer_channel *chan,
+		struct ustctl_consumer_stream *stream,
+		enum export_method method, int out_fd,
+		const char *packet, size_t packet_len,
+		unsigned long iterations)
+{
+	uint64_t total_ns = 0, total_bytes = 0;
+	unsigned long i;
+
+	for (i = 0; i < iterations; i++) {
+		unsigned long len;
+		uint64_t start;
+		ssize_t ret;
+
+		ret = ustctl_write_one_packet_to_channel(chan, packet,
+				packet_len);
+		if (ret < 0) {
+			fprintf(stderr, "Error writing packet: %zd\n", ret);
+			return -1;
+		}
+		ustctl_flush_buffer(stream, 1);
+		while (ustctl_get_next_subbuf(stream) == 0) {
+			if (ustctl_get_padded_subbuf_size(stream, &len))
+				return -1;
+			start = now_ns();
+			if (method == EXPORT_SPLICE)
+				ret = ustctl_splice_subbuf(stream, out_fd);
+			else
+				ret = export_write(stream, out_fd);
+			total_ns += now_ns() - start;
+			if (ret < 0) {
+				fprintf(stderr, "Error exporting packet: %s\n",
+					strerror((int) -ret));
+				return -1;
+			}
+			total_bytes += len;
+			if (ustctl_put_next_subbuf(stream))
+				return -1;
+		}
+	}
+	printf("%-6s: %" PRIu64 " bytes in %" PRIu64 " ns (%.1f MB/s)\n",
+		method == EXPORT_SPLICE ? "splice" : "write",
+		total_bytes, total_ns,
+		total_ns ? (double) total_bytes * 1000.0 / total_ns : 0.0);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct ustctl_consumer_channel_attr attr;
+	struct ustctl_consumer_channel *chan;
+	struct ustctl_consumer_stream *stream;
+	const char *output = "/dev/null";
+	unsigned long subbuf_size = DEFAULT_SUBBUF_SIZE;
+	unsigned long iterations = DEFAULT_ITERATIONS;
+	int stream_fd, out_fd, ret = EXIT_FAILURE;
+	char *packet;
+
+	if (argc > 1)
+		output = argv[1];
+	if (argc > 2)
+		subbuf_size = strtoul(argv[2], NULL, 0);
+	if (argc > 3)
+		iterations = strtoul(argv[3], NULL, 0);
+
+	out_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (out_fd < 0) {
+		perror("open");
+		goto end;
+	}
+	stream_fd = create_stream_fd();
+	if (stream_fd < 0)
+		goto end_close_out;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = LTTNG_UST_CHAN_METADATA;
+	attr.subbuf_size = subbuf_size;
+	attr.num_subbuf = 2;
+	attr.overwrite = 0;
+	attr.output = LTTNG_UST_MMAP;
+	chan = ustctl_create_channel(&attr, &stream_fd, 1);
+	if (!chan) {
+		fprintf(stderr, "Error creating channel\n");
+		goto end_close_stream_fd;
+	}
+	stream = ustctl_create_stream(chan, 0);
+	if (!stream) {
+		fprintf(stderr, "Error creating stream\n");
+		goto end_destroy_chan;
+	}
+	packet = malloc(subbuf_size);
+	if (!packet)
+		goto end_destroy_stream;
+
+	/* The payload leaves room for the metadata packet header. */
+	if (verify(chan, stream, packet, subbuf_size / 2))
+		goto end_free;
+	memset(packet, 'x', subbuf_size);
+
+	if (run(chan, stream, EXPORT_WRITE, out_fd, packet, subbuf_size,
+			iterations))
+		goto end_free;
+	if (run(chan, stream, EXPORT_SPLICE, out_fd, packet, subbuf_size,
+			iterations))
+		goto end_free;
+	ret = EXIT_SUCCESS;
+
+end_free:
+	free(packet);
+end_destroy_stream:
+	ustctl_destroy_stream(stream);
+end_destroy_chan:
+	ustctl_destroy_channel(chan);
+end_close_stream_fd:
+	close(stream_fd);
+end_close_out:
+	close(out_fd);
+end:
+	return ret;
+}
@@ -0,0 +1,592 @@
+/*
+ * lttng-ust-recover.c
+ *
+ * Rebuild a CTF trace from the stream files of an LTTng UST flight
+ * recorder (LTTNG_UST_FLIGHT_RECORDER_PATH), after the traced process
+ * has exited or crashed.
+ *
+ * The ring buffer of each stream starts with its crash ABI record
+ * (libringbuffer/frontend_types.h), which gives the location of the
+ * producer position, the commit counters and the sub-buffer table
+ * within the file. Sub-buffers are copied as CTF packets, oldest first.
+ * A sub-buffer which was being written at the time of the crash is
+ * truncated to its contiguously committed bytes. Its end timestamp is
+ * set to the begin timestamp of the following packet, or to the last
+ * timestamp saved by the producer for the newest packet.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* Must match libringbuffer/frontend_types.h. */
+#define RB_CRASH_DUMP_ABI_MAGIC_LEN	16
+#define RB_CRASH_ENDIAN			0x1234
+#define RB_CRASH_DUMP_ABI_MAJOR		0
+#define RB_CRASH_DUMP_ABI_MINOR		1	/* Minimum: timestamps */
+#define RB_MODE_OVERWRITE		0
+
+static const uint8_t crash_magic[RB_CRASH_DUMP_ABI_MAGIC_LEN] = {
+	0x17, 0x7B, 0xF1, 0x77, 0xBF, 0x17, 0x7B, 0xF1,
+	0x77, 0xBF, 0x17, 0x7B, 0xF1, 0x77, 0xBF, 0x17,
+};
+
+struct crash_abi {
+	uint8_t magic[RB_CRASH_DUMP_ABI_MAGIC_LEN];
+	uint64_t mmap_length;
+	uint16_t endian;
+	uint16_t major;
+	uint16_t minor;
+	uint8_t word_size;
+	uint8_t layout_type;
+
+	struct {
+		uint32_t prod_offset;
+		uint32_t consumed_offset;
+		uint32_t commit_hot_array;
+		uint32_t commit_hot_seq;
+		uint32_t buf_wsb_array;
+		uint32_t buf_wsb_id;
+		uint32_t sb_array;
+		uint32_t sb_array_shmp_offset;
+		uint32_t sb_backend_p_offset;
+		uint32_t content_size;
+		uint32_t packet_size;
+	} __attribute__((packed)) offset;
+	struct {
+		uint8_t prod_offset;
+		uint8_t consumed_offset;
+		uint8_t commit_hot_seq;
+		uint8_t buf_wsb_id;
+		uint8_t sb_array_shmp_offset;
+		uint8_t sb_backend_p_offset;
+		uint8_t content_size;
+		uint8_t packet_size;
+	} __attribute__((packed)) length;
+	struct {
+		uint32_t commit_hot_array;
+		uint32_t buf_wsb_array;
+		uint32_t sb_array;
+	} __attribute__((packed)) stride;
+
+	uint64_t buf_size;
+	uint64_t subbuf_size;
+	uint64_t num_subbuf;
+	uint32_t mode;
+
+	struct {
+		uint32_t last_tsc;
+		uint32_t timestamp_begin;
+		uint32_t timestamp_end;
+	} __attribute__((packed)) tsc_offset;
+	struct {
+		uint8_t last_tsc;
+		uint8_t timestamp_begin;
+		uint8_t timestamp_end;
+	} __attribute__((packed)) tsc_length;
+	uint8_t last_tsc_shift;
+} __attribute__((packed));
+
+struct stream {
+	const char *name;
+	const char *map;
+	size_t len;
+	struct crash_abi abi;
+	uint64_t word_mask;		/* Mask of a word of the traced process */
+	unsigned int subbuf_order;
+	unsigned int num_subbuf_order;
+};
+
+static
+int get_count_order(uint64_t v)
+{
+	int order = 0;
+
+	if (!v || (v & (v - 1)))
+		return -1;
+	while (v >>= 1)
+		order++;
+	return order;
+}
+
+/* Read an unsigned integer of @len bytes at @offset of the stream file. */
+static
+int read_field(const struct stream *s, uint64_t offset, unsigned int len,
+		uint64_t *value)
+{
+	if (offset > s->len || len > s->len - offset)
+		return -1;
+	switch (len) {
+	case 1:
+	{
+		uint8_t v;
+
+		memcpy(&v, s->map + offset, sizeof(v));
+		*value = v;
+		break;
+	}
+	case 2:
+	{
+		uint16_t v;
+
+		memcpy(&v, s->map + offset, sizeof(v));
+		*value = v;
+		break;
+	}
+	case 4:
+	{
+		uint32_t v;
+
+		memcpy(&v, s->map + offset, sizeof(v));
+		*value = v;
+		break;
+	}
+	case 8:
+	{
+		uint64_t v;
+
+		memcpy(&v, s->map + offset, sizeof(v));
+		*value = v;
+		break;
+	}
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+static
+uint64_t read_packet_field(const char *packet, uint64_t offset)
+{
+	uint64_t v;
+
+	memcpy(&v, packet + offset, sizeof(v));
+	return v;
+}
+
+static
+void write_field(char *packet, uint64_t offset, unsigned int len,
+		uint64_t value)
+{
+	switch (len) {
+	case 4:
+	{
+		uint32_t v = value;
+
+		memcpy(packet + offset, &v, sizeof(v));
+		break;
+	}
+	case 8:
+		memcpy(packet + offset, &value, sizeof(value));
+		break;
+	default:
+		break;
+	}
+}
+
+static
+int write_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t ret;
+
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static
+int check_abi(struct stream *s)
+{
+	const struct crash_abi *abi = &s->abi;
+	int order;
+
+	if (s->len < sizeof(*abi))
+		return -1;
+	memcpy(&s->abi, s->map, sizeof(s->abi));
+	if (memcmp(abi->magic, crash_magic, sizeof(crash_magic)))
+		return -1;
+	if (abi->endian != RB_CRASH_ENDIAN) {
+		fprintf(stderr, "%s: byte order differs from this host\n",
+			s->name);
+		return -1;
+	}
+	if (abi->major != RB_CRASH_DUMP_ABI_MAJOR
+			|| abi->minor < RB_CRASH_DUMP_ABI_MINOR) {
+		fprintf(stderr, "%s: unsupported crash ABI %u.%u\n",
+			s->name, abi->major, abi->minor);
+		return -1;
+	}
+	if (abi->word_size != 4 && abi->word_size != 8) {
+		fprintf(stderr, "%s: unsupported word size %u\n",
+			s->name, abi->word_size);
+		return -1;
+	}
+	s->word_mask = abi->word_size == 8 ? UINT64_MAX : UINT32_MAX;
+	order = get_count_order(abi->subbuf_size);
+	if (order < 0)
+		goto invalid;
+	s->subbuf_order = order;
+	order = get_count_order(abi->num_subbuf);
+	if (order < 0)
+		goto invalid;
+	s->num_subbuf_order = order;
+	if (abi->buf_size != abi->subbuf_size * abi->num_subbuf)
+		goto invalid;
+	if (abi->length.content_size != 8 || abi->length.packet_size != 8)
+		goto invalid;
+	if (abi->tsc_length.timestamp_begin != 8
+			|| abi->tsc_length.timestamp_end != 8)
+		goto invalid;
+	if (abi->tsc_length.last_tsc != 0 && abi->tsc_length.last_tsc != 4
+			&& abi->tsc_length.last_tsc != 8)
+		goto invalid;
+	if (abi->last_tsc_shift >= 64)
+		goto invalid;
+	return 0;
+
+invalid:
+	fprintf(stderr, "%s: invalid buffer geometry\n", s->name);
+	return -1;
+}
+
+/*
+ * Locate the data of the sub-buffer at position @pos, and compute how
+ * many of its bytes are committed. Returns 1 if the sub-buffer is
+ * complete, 0 if it is partially committed, -1 if it holds nothing
+ * usable for this position.
+ */
+static
+int subbuf_locate(const struct stream *s, uint64_t pos,
+		uint64_t *data, uint64_t *committed)
+{
+	const struct crash_abi *abi = &s->abi;
+	uint64_t idx, seq, id, sb_index, pages, base;
+
+	idx = (pos & (abi->buf_size - 1)) >> s->subbuf_order;
+
+	if (read_field(s, abi->offset.commit_hot_array
+			+ idx * abi->stride.commit_hot_array
+			+ abi->offset.commit_hot_seq,
+			abi->length.commit_hot_seq, &seq))
+		return -1;
+	/* Commit count this sub-buffer had when it was last delivered. */
+	base = (pos & ~(abi->buf_size - 1)) >> s->num_subbuf_order;
+	*committed = (seq - base) & (s->word_mask >> s->num_subbuf_order);
+	if (!*committed || *committed > abi->subbuf_size)
+		return -1;
+
+	if (read_field(s, abi->offset.buf_wsb_array
+			+ idx * abi->stride.buf_wsb_array
+			+ abi->offset.buf_wsb_id,
+			abi->length.buf_wsb_id, &id))
+		return -1;
+	if (abi->mode == RB_MODE_OVERWRITE)
+		sb_index = id & ((1ULL << (abi->word_size * 4)) - 1);
+	else
+		sb_index = id;
+	/* Overwrite mode has one extra sub-buffer for the reader. */
+	if (sb_index > abi->num_subbuf)
+		return -1;
+	if (read_field(s, abi->offset.sb_array
+			+ sb_index * abi->stride.sb_array
+			+ abi->offset.sb_array_shmp_offset,
+			abi->length.sb_array_shmp_offset, &pages))
+		return -1;
+	if (read_field(s, pages + abi->offset.sb_backend_p_offset,
+			abi->length.sb_backend_p_offset, data))
+		return -1;
+	if (*data > s->len || abi->subbuf_size > s->len - *data)
+		return -1;
+	return *committed == abi->subbuf_size;
+}
+
+/*
+ * End timestamp of the partially written packet at position @pos,
+ * which begins at @begin. A packet which is not the newest ends where
+ * the following one begins. The newest one ends at the last timestamp
+ * saved by the producer. Only the high bits of that timestamp may have
+ * been saved: take the latest timestamp they allow.
+ */
+static
+uint64_t partial_packet_end(const struct stream *s, uint64_t pos,
+		uint64_t prod, uint64_t begin)
+{
+	const struct crash_abi *abi = &s->abi;
+	uint64_t next, data, committed, last;
+
+	next = pos + abi->subbuf_size;
+	if (next < prod && subbuf_locate(s, next, &data, &committed) >= 0
+			&& !read_field(s, data + abi->tsc_offset.timestamp_begin,
+				8, &last)
+			&& last >= begin)
+		return last;
+	if (!abi->tsc_length.last_tsc
+			|| read_field(s, abi->tsc_offset.last_tsc,
+				abi->tsc_length.last_tsc, &last))
+		return begin;
+	if (abi->last_tsc_shift)
+		last = (last << abi->last_tsc_shift)
+			| ((1ULL << abi->last_tsc_shift) - 1);
+	return last > begin ? last : begin;
+}
+
+static
+int recover_stream(struct stream *s, int out_fd)
+{
+	const struct crash_abi *abi = &s->abi;
+	uint64_t prod, consumed, pos, start;
+	unsigned int nr_full = 0, nr_partial = 0;
+	char *packet;
+	int ret = 0;
+
+	if (read_field(s, abi->offset.prod_offset, abi->length.prod_offset,
+			&prod)
+			|| read_field(s, abi->offset.consumed_offset,
+				abi->length.consumed_offset, &consumed))
+		return -1;
+	packet = malloc(abi->subbuf_size);
+	if (!packet)
+		return -1;
+
+	/* At most num_subbuf sub-buffers are kept, up to the producer. */
+	start = 0;
+	if (prod > abi->buf_size)
+		start = ((prod - 1) & ~(abi->subbuf_size - 1))
+			- (abi->buf_size - abi->subbuf_size);
+	if (consumed > start)
+		start = consumed & ~(abi->subbuf_size - 1);
+
+	for (pos = start; pos < prod; pos += abi->subbuf_size) {
+		uint64_t data, committed, packet_size;
+		int full;
+
+		full = subbuf_locate(s, pos, &data, &committed);
+		if (full < 0)
+			continue;
+		memcpy(packet, s->map + data, abi->subbuf_size);
+		if (full) {
+			if (read_field(s, data + abi->offset.packet_size, 8,
+					&packet_size))
+				continue;
+			packet_size >>= 3;
+			if (!packet_size || packet_size > abi->subbuf_size)
+				packet_size = abi->subbuf_size;
+			nr_full++;
+		} else {
+			/*
+			 * Packet being written: its header still holds
+			 * placeholder sizes and a zero end timestamp.
+			 * Keep the committed bytes, and end the packet
+			 * after its last event.
+			 */
+			packet_size = committed;
+			write_field(packet, abi->offset.content_size, 8,
+				committed << 3);
+			write_field(packet, abi->offset.packet_size, 8,
+				committed << 3);
+			write_field(packet, abi->tsc_offset.timestamp_end, 8,
+				partial_packet_end(s, pos, prod,
+					read_packet_field(packet,
+						abi->tsc_offset.timestamp_begin)));
+			nr_partial++;
+		}
+		if (write_all(out_fd, packet, packet_size)) {
+			ret = -1;
+			break;
+		}
+	}
+	free(packet);
+	if (!ret)
+		printf("%s: %u complete and %u partial packets\n", s->name,
+			nr_full, nr_partial);
+	return ret;
+}
+
+static
+int open_output(const char *out_dir, const char *name)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	if (snprintf(path, sizeof(path), "%s/%s", out_dir, name)
+			>= (int) sizeof(path)) {
+		fprintf(stderr, "%s/%s: path too long\n", out_dir, name);
+		return -1;
+	}
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		perror(path);
+	return fd;
+}
+
+/*
+ * Returns 1 if the file is not a stream file, 0 on success, -1 on
+ * error.
+ */
+static
+int recover_file(int dir_fd, const char *name, const char *out_dir)
+{
+	struct stream s;
+	struct stat st;
+	void *map;
+	int fd, out_fd, ret;
+
+	fd = openat(dir_fd, name, O_RDONLY);
+	if (fd < 0) {
+		perror(name);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || !st.st_size) {
+		close(fd);
+		return 1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(name);
+		return -1;
+	}
+	memset(&s, 0, sizeof(s));
+	s.name = name;
+	s.map = map;
+	s.len = st.st_size;
+	if (check_abi(&s)) {
+		ret = 1;
+		goto end;
+	}
+	out_fd = open_output(out_dir, name);
+	if (out_fd < 0) {
+		ret = -1;
+		goto end;
+	}
+	ret = recover_stream(&s, out_fd);
+	if (close(out_fd) < 0)
+		ret = -1;
+end:
+	munmap(map, st.st_size);
+	return ret;
+}
+
+static
+int copy_metadata(int dir_fd, const char *out_dir)
+{
+	char buf[4096];
+	int fd, out_fd, ret = 0;
+
+	fd = openat(dir_fd, "metadata", O_RDONLY);
+	if (fd < 0) {
+		perror("metadata");
+		return -1;
+	}
+	out_fd = open_output(out_dir, "metadata");
+	if (out_fd < 0) {
+		close(fd);
+		return -1;
+	}
+	for (;;) {
+		ssize_t len;
+
+		len = read(fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -1;
+			break;
+		}
+		if (!len)
+			break;
+		if (write_all(out_fd, buf, len)) {
+			ret = -1;
+			break;
+		}
+	}
+	if (ret)
+		perror("metadata");
+	close(fd);
+	if (close(out_fd) < 0)
+		ret = -1;
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *in_dir, *out_dir;
+	struct dirent *entry;
+	DIR *dir;
+	int nr_streams = 0, ret = EXIT_SUCCESS;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s RECORD_DIR OUTPUT_DIR\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	in_dir = argv[1];
+	out_dir = argv[2];
+
+	dir = opendir(in_dir);
+	if (!dir) {
+		perror(in_dir);
+		return EXIT_FAILURE;
+	}
+	if (mkdir(out_dir, 0755) < 0 && errno != EEXIST) {
+		perror(out_dir);
+		closedir(dir);
+		return EXIT_FAILURE;
+	}
+	if (copy_metadata(dirfd(dir), out_dir))
+		ret = EXIT_FAILURE;
+	while ((entry = readdir(dir))) {
+		if (entry->d_name[0] == '.'
+				|| !strcmp(entry->d_name, "metadata"))
+			continue;
+		switch (recover_file(dirfd(dir), entry->d_name, out_dir)) {
+		case 0:
+			nr_streams++;
+			break;
+		case 1:
+			fprintf(stderr, "%s: not a stream file, skipped\n",
+				entry->d_name);
+			break;
+		default:
+			ret = EXIT_FAILURE;
+			break;
+		}
+	}
+	closedir(dir);
+	if (!nr_streams) {
+		fprintf(stderr, "%s: no stream file found\n", in_dir);
+		ret = EXIT_FAILURE;
+	}
+	return ret;
+}